@@ -1,9 +1,74 @@
 #ifndef __USER_API_H__
 #define __USER_API_H__
 
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
+/* option names, values follow linux so IPPROTO_TCP/SOL_SOCKET callers port as is */
+#define USER_TCP_NODELAY            1
+#define USER_TCP_CORK               3
+#define USER_TCP_KEEPIDLE           4       // seconds idle before the first probe
+#define USER_TCP_KEEPINTVL          5       // seconds between probes
+#define USER_TCP_KEEPCNT            6       // unanswered probes before the stream is dropped
+#define USER_TCP_INFO               11
+#define USER_TCP_QUICKACK           12
+#define USER_TCP_CONGESTION         13
+#define USER_TCP_FASTOPEN           23
+#define USER_TCP_NOTSENT_LOWAT      25
+
+/* SOL_SOCKET */
+#define USER_SO_KEEPALIVE           9
+#define USER_SO_MAX_PACING_RATE     47      // bytes per second, 0 or ~0 removes the cap
+
+/* stack specific, outside the linux range */
+#define USER_TCP_DELACK_MS          0x100   // delayed ack timeout, 0 acks every segment
+#define USER_TCP_DELACK_SEGS        0x101   // full segments covered by one ack
+#define USER_TCP_IDLE_KILL          0x102   // 0 keeps a stream idle past USER_TCP_TIMEOUT, default 1
+
+#define USER_TCP_CA_NAME_MAX        16
+
+/* pages behind the memory pools, set before user_tcp_setup. USER_MEM_PAGES=4k|2m|1g does the same */
+#define USER_MEM_4K                 0
+#define USER_MEM_2M                 1
+#define USER_MEM_1G                 2
+
+struct user_tcp_info
+{
+    uint8_t  state;
+    uint8_t  ca_algo;
+    uint8_t  bbr_mode;
+    uint8_t  ecn;               // ECN negotiated
+
+    uint32_t rto;               // ms
+    uint32_t rtt;               // smoothed, ms
+    uint32_t rttvar;
+    uint32_t snd_mss;
+    uint32_t snd_cwnd;          // bytes
+    uint32_t snd_ssthresh;
+    uint32_t snd_wnd;           // peer window
+    uint32_t rcv_wnd;
+    uint32_t rcv_space;         // receive buffer size, autotuned
+    uint32_t unacked;
+    uint32_t notsent;           // bytes in the send buffer not sent yet
+    uint32_t snd_space;         // send buffer size, autotuned
+    uint32_t retrans;
+    uint32_t sacked;            // bytes the peer holds above snd_una
+    uint32_t dsacks;
+    uint32_t spurious;          // window reductions undone, F-RTO / Eifel
+
+    uint64_t delivered;         // bytes
+    uint64_t delivery_rate;     // bytes per second
+    uint64_t pacing_rate;       // bytes per second, 0 if not paced
+    uint64_t max_pacing_rate;   // 0 if not capped
+    uint64_t bbr_bw;            // bytes per second
+    uint32_t bbr_min_rtt;       // us
+    uint32_t bbr_pacing_gain;   // << 8
+    uint32_t bbr_cwnd_gain;     // << 8
+    uint32_t dctcp_alpha;       // 1024 is all bytes marked
+    uint32_t mem;               // bytes the connection holds, stream and buffers
+};
+
 int user_socket(int domain, int type, int protocol);
 int user_bind(int sockid, const struct sockaddr *addr, socklen_t addrlen);
 int user_listen(int sockid, int backlog);
@@ -11,7 +76,13 @@ int user_accept(int sockid, struct sockaddr *addr, socklen_t *addrlen);
 ssize_t user_recv(int sockid, char *buf, size_t len, int flags);
 ssize_t user_send(int sockid, const char *buf, size_t len);
 int user_close(int sockid);
+int user_setsockopt(int sockid, int level, int optname, const void *optval, socklen_t optlen);
+int user_getsockopt(int sockid, int level, int optname, void *optval, socklen_t *optlen);
 void user_tcp_setup(void);
+int  user_tcp_mempages(int pages);
+int  user_tcp_memlimits(uint64_t low, uint64_t pressure, uint64_t high);   // bytes, like tcp_mem
+int  user_tcp_bufidle(int seconds);      // idle streams release empty buffers after it, 0 never
+void user_tcp_memstat(void);
 
 int socket(int domain, int type, int protocol);
 int bind(int sockid, const struct sockaddr *addr, socklen_t addrlen);
@@ -19,5 +90,7 @@ int listen(int sockid, int backlog);
 int accept(int sockid, struct sockaddr *addr, socklen_t *addrlen);
 ssize_t recv(int sockid, void *buf, size_t len, int flags);
 ssize_t send(int sockid, const void *buf, size_t len, int flags);
+int setsockopt(int sockid, int level, int optname, const void *optval, socklen_t optlen);
+int getsockopt(int sockid, int level, int optname, void *optval, socklen_t *optlen);
 
 #endif
\ No newline at end of file
@@ -23,26 +23,48 @@ enum rb_caller
 #define MIN(a, b) ((a)<(b)?(a):(b))
 
 /*----------------------------------------------------------------------------*/
+/*
+ * send and receive buffers are chains of fixed size segments from a pool
+ * of their manager. data is appended and consumed where it lies, nothing
+ * is moved, and a buffer grows by linking segments up to its size. the
+ * segments consumed go back to the pool right away.
+ *
+ * a receive buffer keeps its segments in a ring of slots by position
+ * instead, one per USER_BUF_SEG_SIZE sequence numbers. out-of-order data
+ * only gets the segments it lies in and finds them without a walk, the
+ * slots in between stay empty until the gap fills.
+ */
+#define USER_BUF_SEG_SHIFT     11
+#define USER_BUF_SEG_SIZE      (1U << USER_BUF_SEG_SHIFT)
+
+typedef struct _user_buf_seg
+{
+    struct _user_buf_seg *next;
+    u_char data[USER_BUF_SEG_SIZE];
+} user_buf_seg;
+
 typedef struct _user_sb_manager
 {
-    size_t chunk_size;
+    size_t chunk_size;          // size of a new buffer
+    size_t max_size;            // autotuning limit
     uint32_t cur_num;
     uint32_t cnum;
-    struct _user_mempool *mp;
-    struct _user_sb_queue *freeq;
-
+    struct _user_mempool *seg_mp;
 } user_sb_manager;
 
 typedef struct _user_send_buffer
 {
-    unsigned char *data;
-    unsigned char *head;
-
+    user_buf_seg *head;         // head_seq is at head_off in it
+    user_buf_seg *tail;         // filled up to tail_off
+    user_buf_seg *hint;         // last looked up by SBCopy, hint_off from the start of head
     uint32_t head_off;
     uint32_t tail_off;
+    uint32_t hint_off;
+    uint32_t nsegs;
+
     uint32_t len;
     uint64_t cum_len;
-    uint32_t size;
+    uint32_t size;              // most bytes it takes
 
     uint32_t head_seq;
     uint32_t init_seq;
@@ -55,15 +77,6 @@ typedef int32_t signed_index_type;
 #endif
 
 
-typedef struct _user_sb_queue
-{
-    index_type _capacity;
-    volatile index_type _head;
-    volatile index_type _tail;
-
-    user_send_buffer *volatile *_q;
-} user_sb_queue;
-
 #define NextIndex(sq, i)    (i != sq->_capacity ? i + 1: 0)
 #define PrevIndex(sq, i)    (i != 0 ? i - 1: sq->_capacity)
 #define MemoryBarrier(buf, idx)    __asm__ volatile("" : : "m" (buf), "m" (idx))
@@ -81,48 +94,76 @@ typedef struct _user_rb_frag_queue
 
 
 /** ring buffer **/
+/*
+ * the received ranges of a buffer, disjoint and never adjacent. they are
+ * kept in a red-black tree by sequence number, where a new segment finds
+ * the range before it in O(log n), and linked in sequence order for the
+ * readers that walk them (sack, pruning). a buffer keeps at most
+ * frag_max ranges and the manager frag_total_max: a segment that needs
+ * one more drops the highest ranges to make room if it lies below them,
+ * else it is dropped itself. in-order data is always taken.
+ */
 typedef struct _user_fragment_ctx
 {
     uint32_t seq;
     uint32_t len:      31,
              is_calloc: 1;
-    struct _user_fragment_ctx *next;
+    struct _user_fragment_ctx *next;    // next higher range
+    RB_ENTRY(_user_fragment_ctx) link;
 } user_fragment_ctx;
 
+RB_HEAD(_user_frag_tree, _user_fragment_ctx);
+
 typedef struct _user_ring_buffer
 {
-    u_char *data;
-    u_char *head;
-
-    uint32_t head_offset;
-    uint32_t tail_offset;
+    user_buf_seg **segs;        // by position from seg_seq on, NULL where nothing arrived
+    uint32_t seg_seq;           // sequence number of data[0] of the first slot
+    uint32_t seg_first;         // the first slot
+    uint32_t seg_slots;         // a power of two, 0 until the first put
+    uint32_t nsegs;
 
     int merged_len;
     uint64_t cum_len;
     int last_len;
-    int size;
+    int size;                   // most bytes it takes, in order or not
     uint32_t head_seq;
     uint32_t init_seq;
-    user_fragment_ctx *fctx;
+    user_fragment_ctx *fctx;    // lowest range, the in-order data if it starts at head_seq
+    struct _user_frag_tree frags;
+    uint32_t nfrags;
 } user_ring_buffer;
 
 typedef struct _user_rb_manager
 {
-    size_t chunk_size;
+    size_t chunk_size;          // size of a new buffer
+    size_t max_size;            // autotuning limit
     uint32_t cur_num;
     uint32_t cnum;
-    user_mempool *mp;
+    user_mempool *seg_mp;
     user_mempool *frag_mp;
     user_rb_frag_queue *free_fragq;
     user_rb_frag_queue *free_fragq_int;
+    uint32_t frag_max;          // ranges of one buffer, lowered under memory pressure
+    uint32_t frag_total_max;
+    uint32_t frag_cnt;          // ranges held by all buffers
+    uint64_t frag_dropped;      // out-of-order bytes dropped for the limits
 } user_rb_manager;
 
+/*
+ * a growing queue that is full links a ring of twice the size and the
+ * producer goes on there, the consumer follows once the old ring is
+ * drained. the queue itself is the first ring.
+ */
 typedef struct _user_stream_queue
 {
     index_type _capacity;
     volatile index_type _head;
     volatile index_type _tail;
     struct _user_tcp_stream *volatile *_q;
+    struct _user_stream_queue *volatile _next;
+    struct _user_stream_queue *_prod;
+    struct _user_stream_queue *volatile _cons;
+    int _grow;
 } user_stream_queue;
 
 typedef struct _user_stream_queue_int
@@ -134,9 +175,11 @@ typedef struct _user_stream_queue_int
     int count;
 } user_stream_queue_int;
 
-user_sb_manager *user_sbmanager_create(size_t chunk_size, uint32_t cnum);
-user_rb_manager *RBManagerCreate(size_t chunk_size, uint32_t cnum);
+user_sb_manager *user_sbmanager_create(size_t chunk_size, size_t max_size, uint32_t cnum);
+user_rb_manager *RBManagerCreate(size_t chunk_size, size_t max_size, uint32_t cnum,
+                                 uint32_t frag_max, uint32_t frag_total_max);
 user_stream_queue *CreateStreamQueue(int capacity);
+user_stream_queue *CreateGrowingStreamQueue(int capacity);
 
 
 user_stream_queue_int *CreateInternalStreamQueue(int size);
@@ -146,24 +189,26 @@ user_send_buffer *SBInit(user_sb_manager *sbm, uint32_t init_seq);
 
 void   SBFree(   user_sb_manager *sbm, user_send_buffer *buf);
 size_t SBPut(    user_sb_manager *sbm, user_send_buffer *buf, const void *data, size_t len);
-int    SBEnqueue(user_sb_queue *sq,    user_send_buffer *buf);
 size_t SBRemove( user_sb_manager *sbm, user_send_buffer *buf, size_t len);
+int    SBResize( user_sb_manager *sbm, user_send_buffer *buf, uint32_t size);
+int    SBRelease(user_sb_manager *sbm, user_send_buffer *buf);
+void   SBCopy(   user_send_buffer *buf, uint32_t seq, void *dst, uint32_t len);
 size_t RBRemove( user_rb_manager *rbm, user_ring_buffer *buf, size_t len, int option);
 int    RBPut(    user_rb_manager *rbm, user_ring_buffer *buf, void *data, uint32_t len, uint32_t cur_seq);
 void  RBFree(    user_rb_manager *rbm, user_ring_buffer *buf);
+int   RBResize(  user_rb_manager *rbm, user_ring_buffer *buf, uint32_t size);
+uint32_t RBPruneOfo(user_rb_manager *rbm, user_ring_buffer *buf);
+int   RBRelease( user_rb_manager *rbm, user_ring_buffer *buf);
+size_t RBCopy(   user_ring_buffer *buf, void *dst, size_t len);
 
 int StreamInternalEnqueue(user_stream_queue_int *sq, struct _user_tcp_stream *stream);
 
 struct _user_tcp_stream *StreamInternalDequeue(user_stream_queue_int *sq);
 
 
-/*** ******************************** sb queue ******************************** ***/
-user_sb_queue *CreateSBQueue(int capacity);
-
 int StreamQueueIsEmpty(user_stream_queue *sq);
 
 
-user_send_buffer *SBDequeue(user_sb_queue *sq);
 user_ring_buffer *RBInit(user_rb_manager *rbm, uint32_t init_seq);
 
 
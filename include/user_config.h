@@ -5,11 +5,17 @@
 #define USER_SELF_IP_HEX    0x6B00A8C0 //0x8301A8C0 //
 #define USER_SELF_MAC        "00:0c:29:58:6f:f4"
 
-#define USER_MAX_CONCURRENCY        1024
+#define USER_MAX_CONCURRENCY        1024            // initial size, pools, queues and the socket map grow
+#define USER_MAX_SOCKETS            (16 * 1024 * 1024)
 #define USER_SNDBUF_SIZE            8192
+#define USER_SNDBUF_MAX             (1024 * 1024)   // autotuning limit
 #define USER_RCVBUF_SIZE            8192
+#define USER_RCVBUF_MAX             (1024 * 1024)   // autotuning limit
 #define USER_MAX_NUM_BUFFERS        1024
+#define USER_RCVBUF_FRAGS           64              // out-of-order ranges a receive buffer holds
+#define USER_RCVBUF_FRAGS_TOTAL     (USER_MAX_NUM_BUFFERS * 16)
 #define USER_BACKLOG_SIZE            1024
+#define USER_MAX_TIMEWAIT           (USER_MAX_CONCURRENCY * 64)    // compact TIME_WAIT records
 
 #define USER_ENABLE_MULTI_NIC        0
 #define USER_ENABLE_BLOCKING        1
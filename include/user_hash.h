@@ -58,6 +58,7 @@ void *StreamHTRemove(user_hashtable *ht, void *it);
 
 unsigned int HashFlow(const void *f);
 int EqualFlow(const void *f1, const void *f2);
+unsigned int HashTuple(uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport);
 unsigned int HashListener(const void *l);
 int EqualListener(const void *l1, const void *l2);
 user_hashtable *CreateHashtable(unsigned int (*hashfn)(const void *), // key function
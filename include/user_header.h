@@ -22,6 +22,11 @@
 #define PROTO_ICMP    1
 #define PROTO_IGMP    2
 
+/* ECN codepoint in the low bits of iphdr->tos, RFC 3168 */
+#define IP_ECN_MASK     0x03
+#define IP_ECN_ECT0     0x02
+#define IP_ECN_CE       0x03
+
 struct ethhdr
 {
     unsigned char h_dest[ETH_ALEN];
@@ -1,31 +1,144 @@
 #ifndef __USER_MEMPOOL_H__
 #define __USER_MEMPOOL_H__
 
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/* page size behind a pool, MEM_DEFAULT takes the runtime setting of user_mempool_set_backing */
 enum
 {
-    MEM_NORMAL,
-    MEM_HUGEPAGE
+    MEM_DEFAULT = -1,
+    MEM_NORMAL,                 // 4K
+    MEM_HUGEPAGE,               // 2M
+    MEM_HUGEPAGE_1G,
+    MEM_TYPES
 };
 
+/*
+ * every slab prefers the numa node its pool was created for: the node set
+ * with user_mempool_set_node in the creating thread, else the node of the
+ * cpu it runs on. 1G pages are carved into slabs and kept, pieces that
+ * come back are reused by later slabs of any pool on the node.
+ */
+#define USER_MEM_MAX_NODES      8
+
+typedef struct _user_mem_stat
+{
+    uint64_t bytes[MEM_TYPES];  // mapped, by page size
+    uint64_t maps[MEM_TYPES];
+    uint64_t fallbacks;         // huge pages asked for, smaller ones used
+    uint64_t node_bytes[USER_MEM_MAX_NODES];
+} user_mem_stat;
+
+/*
+ * magazines (Bonwick, Adams: "Magazines and Vmem", 2001). every thread
+ * keeps a loaded and a previous magazine per pool and allocates and frees
+ * from them without any lock. full and empty magazines are exchanged with
+ * the depot of the pool, two lock-free stacks. only when the depot has
+ * none the chunk free list itself is used, under a spinlock. destroying a
+ * pool drains every magazine, also those cached by other threads, which
+ * drop their cache of it when they exit.
+ */
+#define USER_MAG_ROUNDS         32      // most objects a magazine holds
+#define USER_MEMPOOL_MAX        64      // pools with magazines, later ones use the free list only
+#define USER_MAG_BLOCK_SHIFT    8       // magazines are added in blocks of 256 as the pool grows
+#define USER_MAG_BLOCKS         4096
+
+/*
+ * slabs. a pool is a list of slabs, each a naturally aligned block of at
+ * least one huge page with its header in front and its own free list.
+ * the pool starts with the slabs for total_size and adds one whenever it
+ * runs out, so the size given at creation is no longer a limit. a slab
+ * whose chunks all came back is unmapped again while the pool has more
+ * than USER_MEMPOOL_HIWAT slabs worth of free chunks, the slabs of the
+ * initial size always stay. a pool whose initial size is below a huge page
+ * gets slabs of that size in normal pages instead, down to one page.
+ */
+#define USER_SLAB_MIN_SIZE      (2 * 1024 * 1024)
+#define USER_SLAB_PAGE_SIZE     4096
+#define USER_SLAB_MIN_CHUNKS    8
+#define USER_MEMPOOL_HIWAT      2
+
+/*
+ * object caching. a pool created with a constructor runs it on every chunk
+ * when its slab is mapped and the destructor when the slab goes, objects
+ * keep their constructed state through free and alloc. the free list link
+ * lives in the first sizeof(user_mem_chunk) bytes of a free chunk, state
+ * the constructor sets up has to lie past it.
+ */
+typedef int  (*user_mem_ctor)(void *obj, void *arg);
+typedef void (*user_mem_dtor)(void *obj, void *arg);
+
 typedef struct _user_mem_chunk
 {
     int mc_free_chunks;
     struct _user_mem_chunk *next;
 } user_mem_chunk;
 
+typedef struct _user_mem_slab
+{
+    struct _user_mem_slab *next;    // slabs with free chunks
+    struct _user_mem_slab *prev;
+    user_mem_chunk *freeptr;
+    int free_chunks;
+    int on_partial;
+    int type;                       // pages it was mapped from, may be smaller than the pool's
+    int node;
+    u_char *startptr;               // first chunk, after this header
+} user_mem_slab;
+
+typedef struct _user_magazine
+{
+    uint32_t next;              // depot link, index + 1
+    uint32_t rounds;
+    uint32_t idx;
+    void *obj[USER_MAG_ROUNDS];
+} user_magazine;
+
 typedef struct _user_mempool
 {
-    u_char *mp_startptr;
-    user_mem_chunk *mp_freeptr;
-    int mp_free_chunks;
+    user_mem_slab *mp_partial;  // slabs with free chunks, allocation takes the first
+    size_t mp_slab_size;        // power of two, slabs are aligned to it
+    int mp_slab_chunks;
+    int mp_nslabs;
+    int mp_min_slabs;
+    int mp_free_chunks;         // on the slab free lists, magazines hold more
     int mp_total_chunks;
     int mp_chunk_size;
-    int mp_type;
+    int mp_type;                // MEM_NORMAL, MEM_HUGEPAGE or MEM_HUGEPAGE_1G
+    int mp_node;                // preferred numa node, -1 for none
+    user_mem_ctor mp_ctor;
+    user_mem_dtor mp_dtor;
+    void *mp_cache_arg;
+
+    int mp_id;                  // slot in the per-thread caches, -1 without magazines
+    uint32_t mp_mag_rounds;
+    uint32_t mp_nmags;
+    user_magazine *mp_mag_blk[USER_MAG_BLOCKS];
+    uint64_t mp_depot_full;     // stack heads: aba tag << 32 | index + 1
+    uint64_t mp_depot_empty;
+    int mp_depot_rounds;        // objects in the full magazines of the depot
+    pthread_spinlock_t mp_lock; // the slabs and their free lists
+    pthread_mutex_t mp_grow_lock;   // adding a slab and its magazines
 } user_mempool;
 
-user_mempool *user_mempool_create(int chunk_size, size_t total_size, int is_hugepage);
+user_mempool *user_mempool_create(int chunk_size, size_t total_size, int mem_type);
+user_mempool *user_mempool_create_cache(int chunk_size, size_t total_size, int mem_type,
+                                        user_mem_ctor ctor, user_mem_dtor dtor, void *arg);
 void          user_mempool_destory(user_mempool *mp);
 void *        user_mempool_alloc(  user_mempool *mp);
 void          user_mempool_free(   user_mempool *mp, void *p);
+int           user_mempool_getfree_chunks(user_mempool *mp);
+int           user_mempool_used_chunks(user_mempool *mp);
+
+int   user_mempool_set_backing(int mem_type);
+int   user_mempool_get_backing(void);
+void  user_mempool_set_node(int node);
+int   user_mem_cpu_node(int cpu);
+void *user_mem_map(  size_t size, int *mem_type, int node);
+void  user_mem_unmap(void *p, size_t size, int mem_type, int node);
+void  user_mempool_stats(user_mem_stat *st);
+void  user_mempool_dump(void);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,32 @@
+#ifndef __USER_SLAB_H__
+#define __USER_SLAB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * size-class allocator for the small heap objects of the stack. every
+ * class is a user_mempool, objects come from its slabs (the page size of
+ * user_mempool_set_backing) through the per-thread magazines. like kmem_free
+ * the caller passes the size it allocated, which keeps the fragmentation
+ * counts exact. sizes above USER_SLAB_MAX_SIZE go to malloc.
+ */
+#define USER_SLAB_NCLASS        16
+#define USER_SLAB_MAX_SIZE      4096
+
+typedef struct _user_slab_stat
+{
+    uint32_t size;              // of the class
+    uint32_t slabs;
+    uint64_t total;             // chunks in the slabs
+    uint64_t used;              // handed out or cached by threads
+    uint64_t req_bytes;         // asked for by the objects in use
+} user_slab_stat;
+
+void *user_slab_alloc(size_t size);
+void *user_slab_zalloc(size_t size);
+void  user_slab_free(void *p, size_t size);
+int   user_slab_stats(user_slab_stat *st, int n);
+void  user_slab_dump(void);
+
+#endif
@@ -40,9 +40,12 @@ enum user_socket_opts
     USER_TCP_ADDR_BIND = 0x02,
 };
 
-user_socket_map *user_allocate_socket(int socktype, int need_lock);
-void             user_free_socket(int sockid, int need_lock);
+struct _user_tcp_manager;
+
+user_socket_map *user_allocate_socket(int socktype);
+void             user_free_socket(int sockid);
 user_socket_map *user_get_socket(int sockid);
+int              user_socket_map_grow(struct _user_tcp_manager *tcp);
 
 
 /*
@@ -74,6 +77,7 @@ struct _user_socket_table
     int cur_idx;
     struct _user_socket **sockfds;
     unsigned char *open_fds;
+    int mem_type;               // pages behind sockfds
     pthread_spinlock_t lock;
 };
 
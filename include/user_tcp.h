@@ -7,6 +7,18 @@
 #include "user_addr.h"
 #include "user_config.h"
 #include "user_epoll_inner.h"
+#include "user_tcp_cc.h"
+#include "user_tcp_sack.h"
+#include "user_tcp_rack.h"
+#include "user_tcp_syncookie.h"
+#include "user_tcp_reqsk.h"
+#include "user_tcp_timewait.h"
+#include "user_tcp_fastopen.h"
+#include "user_tcp_pacing.h"
+#include "user_tcp_keepalive.h"
+#include "user_tcp_mem.h"
+
+#include <stddef.h>
 
 #define ETH_NUM        4
 
@@ -33,6 +45,8 @@ typedef enum _user_tcp_state
 #define USER_TCPHDR_URG        0x20
 #define USER_TCPHDR_ECE        0x40
 #define USER_TCPHDR_CWR        0x80
+/* internal only, never put on the wire: ack to solicit a window update */
+#define USER_TCPHDR_WACK       0x100
 
 #define USER_TCPOPT_MSS_LEN                4
 #define USER_TCPOPT_WSCALE_LEN            3
@@ -48,9 +62,36 @@ typedef enum _user_tcp_state
 
 #define USER_SEND_BUFFER_SIZE        8192
 #define USER_RECV_BUFFER_SIZE        8192
-#define USER_TCP_TIMEWAIT            0
+#define USER_TCP_TIMEWAIT            (60 * HZ)   // 2MSL
 #define USER_TCP_TIMEOUT                30
 
+/* delayed acks: every TCP_DELACK_SEGS full segments or after TCP_DELACK_MS */
+#define TCP_DELACK_MS               40
+#define TCP_DELACK_SEGS             2
+#define TCP_MAX_QUICKACKS           16
+
+#define TCP_DEFAULT_CC                USER_TCP_CC_RENO
+#define TCP_PACING_HORIZON_US        1000
+#define TCP_FLUSH_PACED                (-4)
+
+/* a partial tail segment of a corked stream waits at most TCP_CORK_MS, on the cork list */
+#define TCP_CORK_MS                 200
+#define TCP_FLUSH_HELD              (-5)
+
+#define TCP_SACK_ENABLE             1
+/* time based loss detection for sack streams, 0 falls back to the DupThresh rule */
+#define TCP_RACK_ENABLE             1
+
+/* 0: no ECN, 1: request on active and accept on passive opens, 2: accept only */
+#define TCP_ECN_MODE                2
+
+/* snd->ecn_flags */
+#define TCP_ECN_OK                  0x01    // negotiated on the handshake
+#define TCP_ECN_QUEUE_CWR           0x02    // set CWR on the next data segment
+#define TCP_ECN_DEMAND_CWR          0x04    // echo ECE until the peer sends CWR
+#define TCP_ECN_CE_STATE            0x08    // last data segment was CE marked (DCTCP)
+#define TCP_ECN_IN_CWR              0x10    // window already reduced up to ecn_high_seq
+
 #define TCP_MAX_RTX                    16
 #define TCP_MAX_SYN_RETRY            7
 #define TCP_MAX_BACKOFF                7
@@ -72,6 +113,8 @@ typedef enum _user_tcp_state
 
 #define TCP_INITIAL_RTO        (MSEC_TO_USEC(500) / TIME_TICK)
 
+#define USER_CACHE_LINE        64
+
 #if USER_ENABLE_BLOCKING
 
 #define SBUF_LOCK_INIT(lock, errmsg, action);        \
@@ -107,7 +150,8 @@ enum tcp_option
     TCP_OPT_WSCALE = 3,
     TCP_OPT_SACK_PERMIT = 4,
     TCP_OPT_SACK = 5,
-    TCP_OPT_TIMESTAMP = 8
+    TCP_OPT_TIMESTAMP = 8,
+    TCP_OPT_FASTOPEN = 34
 };
 
 enum tcp_close_reason
@@ -157,79 +201,155 @@ typedef struct _user_rtm_stat
 } user_rtm_stat; //__attribute__((packed)) 
 
 
+/*
+ * per connection state. the stream and its two halves are one chunk of
+ * the flow pool, user_tcp_conn, each starting on a cache line. the pool
+ * constructs the locks and condvars once per chunk, a new stream only
+ * clears what lies in front of them. in every
+ * struct the fields a segment in either direction touches come first and
+ * the links, locks and rarely used settings after them, the asserts below
+ * keep the hot part within USER_TCP_*_HOT_LINES.
+ */
 typedef struct _user_tcp_recv
 {
+    struct _user_ring_buffer *recvbuf;
     uint32_t rcv_wnd;
-    uint32_t irs;
+    uint32_t rcv_adv;           // right edge of the last advertised window
     uint32_t snd_wl1;
     uint32_t snd_wl2;
-
-    uint8_t dup_acks;
     uint32_t last_ack_seq;
+    uint8_t dup_acks;
 
     uint32_t ts_recent;
     uint32_t ts_lastack_rcvd;
     uint32_t ts_last_ts_upd;
-    uint32_t ts_tw_expire;
+    uint32_t ts_last_seg;       // any segment, the keepalive idle time counts from it
+    uint32_t ts_last_data;
 
     uint32_t srtt;
+    uint32_t rttvar;
     uint32_t mdev;
     uint32_t mdev_max;
-    uint32_t rttvar;
     uint32_t rtt_seq;
 
-    struct _user_ring_buffer *recvbuf;
+    uint16_t delack_ms;         // 0 acks every segment at once
+    uint8_t delack_segs;
+    uint8_t quickack;           // segments still acked at once
+    uint8_t on_delack_list;
+    uint32_t delack_bytes;      // in-order bytes not acked yet
+    uint32_t ts_delack;
+    uint32_t sack_recent;       // last out-of-order segment, its block is reported first
+
+    /* cold */
+    uint32_t irs;
+    uint32_t ts_tw_expire;
+    uint32_t dsack_start;
+    uint32_t dsack_end;
+    uint8_t dsack_pending;
+
+    /* receive buffer autotuning, dynamic right-sizing */
+    uint32_t rcv_rtt;           // from timestamp echoes, in ticks
+    uint32_t rcvq_space;        // most the app consumed in one rtt
+    uint32_t rcvq_seq;          // recvbuf head_seq when the measurement started
+    uint32_t rcvq_ts;
+
+    uint32_t ts_idle;           // queued on the idle buffer list
+    uint8_t on_idle_list;
 
     TAILQ_ENTRY(_user_tcp_stream) he_link;
+    TAILQ_ENTRY(_user_tcp_stream) delack_link;
+    TAILQ_ENTRY(_user_tcp_stream) idle_link;
 
 #if USER_ENABLE_BLOCKING
     TAILQ_ENTRY(_user_tcp_stream) rcv_br_link;
-    pthread_cond_t read_cond;
+#endif
+
+    /* set up once by user_tcp_conn_ctor, from here on nothing is reset for a new stream */
+#if USER_ENABLE_BLOCKING
     pthread_mutex_t read_lock;
+    pthread_cond_t read_cond;
 #else
     pthread_spinlock_t read_lock;
 #endif
 
-} user_tcp_recv;
+} __attribute__((aligned(USER_CACHE_LINE))) user_tcp_recv;
 
 typedef struct _user_tcp_send
 {
-    uint16_t ip_id;
-    uint16_t mss;
-    uint16_t eff_mss;
-
-    uint8_t wscale_mine;
-    uint8_t wscale_peer;
-    int8_t nif_out;
-
+    struct _user_send_buffer *sndbuf;
     unsigned char *d_haddr;
+
     uint32_t snd_una;
     uint32_t snd_wnd;
-
     uint32_t peer_wnd;
-    uint32_t iss;
-    uint32_t fss;
-
-    uint8_t nrtx;
-    uint8_t max_nrtx;
-    uint32_t rto;
-    uint32_t ts_rto;
-
     uint32_t cwnd;
     uint32_t ssthresh;
+    uint32_t rto;
+    uint32_t ts_rto;
     uint32_t ts_lastack_sent;
+    uint32_t fss;
 
+    uint16_t ip_id;
+    uint16_t mss;
+    uint16_t eff_mss;
+    uint8_t wscale_mine;
+    uint8_t wscale_peer;
+    int8_t nif_out;
+    uint8_t nrtx;
+    uint8_t loss_timer;
+    uint8_t cc_algo;
+    uint8_t ecn_flags;
+
+    uint8_t nodelay: 1,         // no nagle
+            cork: 1,
+            more: 1,            // MSG_MORE on the last send
+            write_wait: 1;      // the app found the stream not writable
     uint8_t is_wack: 1,
             ack_cnt: 6;
-
     uint8_t on_control_list;
-    uint8_t on_send_list;
+    uint8_t on_send_list;       // also set while waiting on the pace wheel
     uint8_t on_ack_list;
+    uint8_t on_pace_wheel;
+    uint8_t on_cork_list;       // the corked tail waits there, off the send list
     uint8_t on_sendq;
     uint8_t on_ackq;
+
+    uint64_t pacing_rate;
+    uint64_t ts_pace_us;
+
+    /* touched per ack, larger than a line each */
+    user_tcp_txq txq;
+    user_tcp_rate *rate;        // bbr only
+    user_tcp_sackboard sack;
+    user_tcp_rack rack;
+    user_tcp_prr prr;
+    user_tcp_undo undo;
+    user_tcp_dctcp dctcp;
+
+    /* cold */
+    uint32_t iss;
+    uint8_t max_nrtx;
+    uint32_t ecn_high_seq;
+    uint64_t max_pacing_rate;   // cap set by the app, 0 is none
+    uint32_t ts_cork;           // when the corked tail was first held, 0 if not held
+    uint32_t ts_cork_due;       // when it goes out anyway, the cork list is sorted by it
+    uint32_t notsent_lowat;     // writable only below this many unsent bytes, 0 is off
+    uint16_t pace_slot;
+
+    uint16_t keep_idle;         // keepalive, seconds
+    uint16_t keep_intvl;
+    uint8_t keep_cnt;
+    uint8_t ka_probes;          // sent and unanswered
+    uint8_t keepalive: 1,       // the app sets these two, the stack thread never writes their byte
+            no_idle_kill: 1;    // not closed after USER_TCP_TIMEOUT idle
+    uint8_t on_ka_wheel;
+    uint16_t ka_slot;
+    uint8_t cc_change;          // cc_next set by setsockopt, for the stack thread
+    uint8_t cc_next;
+
     uint8_t on_closeq;
     uint8_t on_resetq;
-
+    uint8_t on_optq;
     uint8_t on_closeq_int: 1,
             on_resetq_int: 1,
             is_fin_sent: 1,
@@ -238,63 +358,86 @@ typedef struct _user_tcp_send
     TAILQ_ENTRY(_user_tcp_stream) control_link;
     TAILQ_ENTRY(_user_tcp_stream) send_link;
     TAILQ_ENTRY(_user_tcp_stream) ack_link;
+    TAILQ_ENTRY(_user_tcp_stream) pace_link;
+    TAILQ_ENTRY(_user_tcp_stream) cork_link;
     TAILQ_ENTRY(_user_tcp_stream) timer_link;
     TAILQ_ENTRY(_user_tcp_stream) timeout_link;
-
-    struct _user_send_buffer *sndbuf;
+    TAILQ_ENTRY(_user_tcp_stream) ka_link;
 
 #if USER_ENABLE_BLOCKING
     TAILQ_ENTRY(_user_tcp_stream) snd_br_link;
-    pthread_cond_t write_cond;
+#endif
+
+    /* constructed, as in user_tcp_recv */
+#if USER_ENABLE_BLOCKING
     pthread_mutex_t write_lock;
+    pthread_cond_t write_cond;
 #else
     pthread_spinlock_t write_lock;
 #endif
-} user_tcp_send; //__attribute__((packed))
+} __attribute__((aligned(USER_CACHE_LINE))) user_tcp_send;
 
 typedef struct _user_tcp_stream
 {
-#if USER_ENABLE_SOCKET_C10M
-    struct _user_socket *s;
-#endif
-    struct _user_socket_map *socket;
-    uint32_t id: 24,
-            stream_type: 8;
+    user_tcp_recv *rcv;
+    user_tcp_send *snd;
+
+    uint32_t snd_nxt;
+    uint32_t rcv_nxt;
 
     uint32_t saddr;
     uint32_t daddr;
-
     uint16_t sport;
     uint16_t dport;
 
     uint8_t state;
-    uint8_t close_reason;
-    uint8_t on_hash_table;
-    uint8_t on_timewait_list;
-
-    uint8_t ht_idx;
-    uint8_t closed;
-    uint8_t is_bound_addr;
     uint8_t need_wnd_adv;
-
-    int16_t on_rto_idx;
     uint16_t on_timeout_list: 1,
             on_rcv_br_list: 1,
             on_snd_br_list: 1,
             saw_timestamp: 1,
             sack_permit: 1,
             control_list_waiting: 1,
-            have_reset: 1;
-
+            have_reset: 1,
+            wscale_ok: 1,
+            fastopen: 1;        // accepted from a fast open SYN, in the listener's fastopen_pending
+    uint32_t id: 24,
+            stream_type: 8;
     uint32_t last_active_ts;
+    int16_t on_rto_idx;
 
-    user_tcp_recv *rcv;
-    user_tcp_send *snd;
+    /* cold */
+    uint8_t close_reason;
+    uint8_t on_hash_table;
+    uint8_t on_timewait_list;
+    uint8_t ht_idx;
+    uint8_t closed;
+    uint8_t is_bound_addr;
 
-    uint32_t snd_nxt;
-    uint32_t rcv_nxt;
+#if USER_ENABLE_SOCKET_C10M
+    struct _user_socket *s;
+#endif
+    struct _user_socket_map *socket;
 
-} user_tcp_stream;
+} __attribute__((aligned(USER_CACHE_LINE))) user_tcp_stream;
+
+typedef struct _user_tcp_conn
+{
+    user_tcp_stream stream;
+    user_tcp_recv rcv;
+    user_tcp_send snd;
+} user_tcp_conn;
+
+#define USER_TCP_STREAM_HOT_LINES   1
+#define USER_TCP_RECV_HOT_LINES     2
+#define USER_TCP_SEND_HOT_LINES     2
+
+_Static_assert(offsetof(user_tcp_stream, close_reason) <= USER_TCP_STREAM_HOT_LINES * USER_CACHE_LINE,
+               "hot fields of user_tcp_stream spill over");
+_Static_assert(offsetof(user_tcp_recv, irs) <= USER_TCP_RECV_HOT_LINES * USER_CACHE_LINE,
+               "hot fields of user_tcp_recv spill over");
+_Static_assert(offsetof(user_tcp_send, txq) <= USER_TCP_SEND_HOT_LINES * USER_CACHE_LINE,
+               "hot fields of user_tcp_send spill over");
 
 typedef struct _user_sender
 {
@@ -306,6 +449,8 @@ typedef struct _user_sender
     int control_list_cnt;
     int send_list_cnt;
     int ack_list_cnt;
+
+    user_tcp_pacer pacer;       // send list streams not due yet
 } user_sender; //__attribute__((packed)) 
 
 typedef struct _user_thread_context
@@ -327,9 +472,7 @@ typedef struct _user_thread_context
 typedef struct _user_tcp_manager
 {
 
-    struct _user_mempool *flow;
-    struct _user_mempool *rcv;
-    struct _user_mempool *snd;
+    struct _user_mempool *flow;         // user_tcp_conn
     struct _user_mempool *mv;
 
     struct _user_sb_manager *rbm_snd;
@@ -342,7 +485,8 @@ typedef struct _user_tcp_manager
 #endif
 
     uint32_t s_index;
-    struct _user_socket_map *smap;
+    struct _user_socket_map **smap;     // blocks of USER_MAX_CONCURRENCY, see USER_SMAP
+    int smap_cnt;                       // ids below are valid
     TAILQ_HEAD(, _user_socket_map) free_smap;
 
     struct _user_addr_pool *ap;
@@ -370,6 +514,7 @@ typedef struct _user_tcp_manager
     struct _user_stream_queue_int *resetq_int;
 
     struct _user_stream_queue *destroyq;
+    struct _user_stream_queue *optq;        // timer and cc options changed by setsockopt
 
     struct _user_sender *g_sender;
     struct _user_sender *n_sender[ETH_NUM];
@@ -377,10 +522,16 @@ typedef struct _user_tcp_manager
     struct _user_rto_hashstore *rto_store;
     TAILQ_HEAD(timewait_head, _user_tcp_stream) timewait_list;
     TAILQ_HEAD(timeout_head, _user_tcp_stream) timeout_list;
+    TAILQ_HEAD(delack_head, _user_tcp_stream) delack_list;
+    TAILQ_HEAD(cork_head, _user_tcp_stream) cork_list;
 
     int rto_list_cnt;
     int timewait_list_cnt;
     int timeout_list_cnt;
+    int delack_list_cnt;
+    int cork_list_cnt;
+
+    struct _user_tcp_kawheel *ka_wheel;
 
 #if USER_ENABLE_BLOCKING
     TAILQ_HEAD(rcv_br_head, _user_tcp_stream) rcv_br_list;
@@ -392,8 +543,28 @@ typedef struct _user_tcp_manager
     uint32_t cur_ts;
     int wakeup_flag;
     int is_sleeping;
+
+    uint32_t syncookie_secret[2];
+
+    struct _user_tcp_reqsk **reqsk_table;
+    struct _user_mempool *reqsk_pool;
+    TAILQ_HEAD(reqsk_head, _user_tcp_reqsk) reqsk_list;
+    uint32_t reqsk_cnt;
+
+    struct _user_tcp_tw **tw_table;
+    struct _user_mempool *tw_pool;
+    TAILQ_HEAD(tw_head, _user_tcp_tw) tw_list;
+    uint32_t tw_cnt;
+    uint32_t tw_overflow;       // streams closed without TIME_WAIT, table full
+
+    uint32_t fastopen_secret[4];
+    user_tcp_tfo_cache fastopen_cache[USER_TFO_CACHE_SIZE];
+
+    user_tcp_memctl mem;
 } user_tcp_manager; //__attribute__((packed)) 
 
+#define USER_SMAP(tcp, id)      (&(tcp)->smap[(id) / USER_MAX_CONCURRENCY][(id) % USER_MAX_CONCURRENCY])
+
 #include <arpa/inet.h>
 
 typedef struct _user_tcp_listener
@@ -404,6 +575,25 @@ typedef struct _user_tcp_listener
 #endif
     struct _user_socket_map *socket;
     int backlog;
+    uint8_t cc_algo;
+    uint8_t delack_segs;
+    uint16_t delack_ms;
+    uint8_t nodelay;
+    uint32_t notsent_lowat;
+    uint64_t max_pacing_rate;
+    uint8_t keepalive;
+    uint8_t no_idle_kill;
+    uint8_t keep_cnt;
+    uint16_t keep_idle;         // 0 leaves the default
+    uint16_t keep_intvl;
+
+    uint32_t syn_backlog;       // request socks before syn cookies take over
+    uint32_t syn_cnt;
+    uint32_t ts_synq_overflow;  // cookies are only checked shortly after one
+    uint32_t syncookies_sent;
+    uint32_t syncookies_ok;
+    uint32_t fastopen_qlen;     // pending fast open streams allowed, 0 disables
+    uint32_t fastopen_pending;
     struct _user_stream_queue *acceptq;
     pthread_mutex_t accept_lock;
     pthread_cond_t accept_cond;
@@ -412,7 +602,7 @@ typedef struct _user_tcp_listener
 
 uint8_t *EthernetOutput(user_tcp_manager *tcp, uint16_t h_proto,
                         int nif, unsigned char *dst_haddr, uint16_t iplen);
-uint8_t *IPOutput(user_tcp_manager *tcp, user_tcp_stream *stream, uint16_t tcplen);
+uint8_t *IPOutput(user_tcp_manager *tcp, user_tcp_stream *stream, uint16_t tcplen, uint8_t tos);
 
 user_tcp_stream *CreateTcpStream(user_tcp_manager *tcp, struct _user_socket_map *socket, int type,
                                  uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport);
@@ -424,6 +614,7 @@ void user_tcp_addto_controllist(user_tcp_manager *tcp, user_tcp_stream *cur_stre
 void user_tcp_remove_controllist(user_tcp_manager *tcp, user_tcp_stream *cur_stream);
 void user_tcp_remove_sendlist(user_tcp_manager *tcp, user_tcp_stream *cur_stream);
 void user_tcp_remove_acklist(user_tcp_manager *tcp, user_tcp_stream *cur_stream);
+int  user_tcp_sndbuf_writable(user_tcp_stream *cur_stream);
 
 void user_tcp_write_chunks(uint32_t cur_ts);
 int  user_tcp_handle_apicall(uint32_t cur_ts);
@@ -0,0 +1,187 @@
+#ifndef __USER_TCP_CC_H__
+#define __USER_TCP_CC_H__
+
+#include <stdint.h>
+#include <time.h>
+
+enum user_tcp_cc_algo
+{
+    USER_TCP_CC_RENO = 0,
+    USER_TCP_CC_BBR = 1,
+    USER_TCP_CC_DCTCP = 2,
+};
+
+/*
+ * per-segment transmit record, kept in send order for the bytes in flight.
+ * rack times losses from xmit_us. while bbr runs, the connection delivery
+ * state at the moment the segment left is kept beside it in a
+ * user_tcp_txrate, so the ack of the segment can produce a rate sample.
+ */
+#define USER_TXSEG_APP_LIMITED    0x01
+#define USER_TXSEG_RETRANS        0x02
+#define USER_TXSEG_SACKED         0x04    // delivered, seen by rack
+#define USER_TXSEG_LOST           0x08    // marked lost by rack, cleared when resent
+
+typedef struct _user_tcp_txseg
+{
+    uint32_t seq;
+    uint32_t end_seq;
+    uint64_t xmit_us;
+    uint8_t flags;
+} user_tcp_txseg;
+
+typedef struct _user_tcp_txrate
+{
+    uint64_t first_tx_us;
+    uint64_t delivered_us;
+    uint64_t delivered;
+} user_tcp_txrate;
+
+/*
+ * the transmit records of a stream, a ring that doubles with the flight
+ * from USER_TCP_TXQ_MIN up to USER_TCP_TXQ_MAX records and is kept until
+ * the stream goes idle. the cap covers a megabyte in flight in 256 byte
+ * segments, a segment sent beyond it extends the last record.
+ */
+#define USER_TCP_TXQ_MIN          16
+#define USER_TCP_TXQ_MAX          4096
+
+typedef struct _user_tcp_txq
+{
+    user_tcp_txseg *seg;
+    user_tcp_txrate *rate;      // parallel to seg while the stream has rate state
+    uint32_t head;
+    uint32_t cnt;
+    uint32_t size;              // power of two, 0 until the first send
+    uint32_t high_seq;          // end of the highest segment sent
+} user_tcp_txq;
+
+#define TXSEG_AT(txq, i)     (&(txq)->seg[((txq)->head + (i)) & ((txq)->size - 1)])
+#define TXRATE_AT(txq, i)    (&(txq)->rate[((txq)->head + (i)) & ((txq)->size - 1)])
+
+typedef struct _user_tcp_rate_sample
+{
+    uint64_t prior_delivered;
+    uint64_t prior_us;
+    int64_t interval_us;
+    int64_t rtt_us;
+    uint32_t delivered;
+    uint32_t acked;
+    uint32_t prior_in_flight;
+    uint8_t is_app_limited;
+    uint8_t is_retrans;
+} user_tcp_rate_sample;
+
+/* windowed min/max filter, Kathleen Nichols' algorithm */
+typedef struct _user_minmax_sample
+{
+    uint64_t t;
+    uint64_t v;
+} user_minmax_sample;
+
+typedef struct _user_minmax
+{
+    user_minmax_sample s[3];
+} user_minmax;
+
+enum user_bbr_mode
+{
+    USER_BBR_STARTUP = 0,
+    USER_BBR_DRAIN = 1,
+    USER_BBR_PROBE_BW = 2,
+    USER_BBR_PROBE_RTT = 3,
+};
+
+typedef struct _user_tcp_bbr
+{
+    uint8_t mode;
+    uint8_t cycle_idx;
+    uint8_t full_bw_cnt;
+    uint8_t full_bw_reached: 1,
+            round_start: 1,
+            idle_restart: 1,
+            packet_conservation: 1,
+            probe_rtt_round_done: 1;
+
+    uint32_t round_cnt;
+    uint64_t next_rtt_delivered;
+
+    user_minmax bw;
+    uint64_t full_bw;
+
+    uint32_t min_rtt_us;
+    uint64_t min_rtt_stamp_us;
+    uint64_t probe_rtt_done_us;
+    uint64_t cycle_stamp_us;
+
+    uint32_t pacing_gain;
+    uint32_t cwnd_gain;
+    uint32_t prior_cwnd;
+} user_tcp_bbr;
+
+/*
+ * delivery rate sampling and the bbr model, allocated by user_tcp_cc_init
+ * only while bbr runs on the stream.
+ */
+typedef struct _user_tcp_rate
+{
+    uint64_t delivered;
+    uint64_t delivered_us;
+    uint64_t first_tx_us;
+    uint64_t app_limited;
+    uint64_t rate_bps;
+
+    user_tcp_bbr bbr;
+} user_tcp_rate;
+
+#define USER_TCP_BBR_ACTIVE(snd)    ((snd)->rate != NULL)
+
+/* DCTCP, alpha is the moving fraction of CE marked bytes scaled to 1024 */
+#define USER_DCTCP_MAX_ALPHA      1024
+#define USER_DCTCP_SHIFT_G        4
+
+typedef struct _user_tcp_dctcp
+{
+    uint32_t alpha;
+    uint32_t acked_bytes_ecn;
+    uint32_t acked_bytes_total;
+    uint32_t next_seq;
+} user_tcp_dctcp;
+
+struct _user_tcp_stream;
+
+static inline uint64_t user_tcp_clock_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int  user_tcp_cc_by_name(const char *name);
+const char *user_tcp_cc_name(int algo);
+
+void user_tcp_cc_init(struct _user_tcp_stream *cur_stream, int algo);
+int  user_tcp_txq_trim(struct _user_tcp_stream *cur_stream);
+void user_tcp_cc_destroy(struct _user_tcp_stream *cur_stream);
+void user_tcp_cc_on_ack(struct _user_tcp_stream *cur_stream, const user_tcp_rate_sample *rs, uint32_t acked);
+void user_tcp_cc_on_fast_retransmit(struct _user_tcp_stream *cur_stream);
+void user_tcp_cc_on_dupack(struct _user_tcp_stream *cur_stream);
+void user_tcp_cc_on_recovered(struct _user_tcp_stream *cur_stream);
+void user_tcp_cc_on_rto(struct _user_tcp_stream *cur_stream);
+void user_tcp_cc_on_probe_loss(struct _user_tcp_stream *cur_stream);
+void user_tcp_cc_undo(struct _user_tcp_stream *cur_stream, uint32_t cwnd, uint32_t ssthresh);
+void user_tcp_cc_on_ecn(struct _user_tcp_stream *cur_stream, uint32_t ack_seq, uint32_t acked, int ece);
+
+void user_tcp_rate_on_send(struct _user_tcp_stream *cur_stream, uint32_t seq, uint32_t len, uint64_t now_us);
+void user_tcp_rate_on_ack(struct _user_tcp_stream *cur_stream, uint32_t ack_seq, uint64_t now_us,
+                          user_tcp_rate_sample *rs);
+void user_tcp_rate_check_app_limited(struct _user_tcp_stream *cur_stream);
+
+void     user_bbr_init(struct _user_tcp_stream *cur_stream);
+void     user_bbr_main(struct _user_tcp_stream *cur_stream, const user_tcp_rate_sample *rs, uint32_t acked);
+void     user_bbr_on_loss(struct _user_tcp_stream *cur_stream);
+void     user_bbr_on_rto(struct _user_tcp_stream *cur_stream);
+void     user_bbr_on_tx_start(struct _user_tcp_stream *cur_stream);
+uint64_t user_bbr_bw(struct _user_tcp_stream *cur_stream);
+
+#endif
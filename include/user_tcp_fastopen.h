@@ -0,0 +1,32 @@
+#ifndef __USER_TCP_FASTOPEN_H__
+#define __USER_TCP_FASTOPEN_H__
+
+#include <stdint.h>
+
+/* TCP Fast Open, RFC 7413 */
+#define USER_TFO_COOKIE_LEN         8       // the cookies we hand out
+#define USER_TFO_COOKIE_MAX         16
+#define USER_TCPOPT_FASTOPEN_LEN    (2 + USER_TFO_COOKIE_LEN)
+#define USER_TFO_CACHE_SIZE         256     // client cookies, direct mapped by server address
+
+typedef struct _user_tcp_tfo_cache
+{
+    uint32_t daddr;
+    uint8_t len;
+    uint8_t cookie[USER_TFO_COOKIE_MAX];
+} user_tcp_tfo_cache;
+
+struct _user_tcp_manager;
+struct _user_tcp_stream;
+struct tcphdr;
+
+void user_tcp_fastopen_init(struct _user_tcp_manager *tcp);
+int  user_tcp_parse_fastopen(const struct tcphdr *tcph, uint8_t *cookie);
+void user_tcp_fastopen_cookie(struct _user_tcp_manager *tcp, uint32_t daddr, uint8_t *cookie);
+int  user_tcp_fastopen_check(struct _user_tcp_manager *tcp, uint32_t daddr, const uint8_t *cookie, int len);
+void user_tcp_fastopen_release(struct _user_tcp_manager *tcp, struct _user_tcp_stream *cur_stream);
+
+int  user_tcp_fastopen_cache_get(struct _user_tcp_manager *tcp, uint32_t daddr, uint8_t *cookie);
+void user_tcp_fastopen_cache_put(struct _user_tcp_manager *tcp, uint32_t daddr, const uint8_t *cookie, int len);
+
+#endif
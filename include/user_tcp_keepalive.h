@@ -0,0 +1,41 @@
+#ifndef __USER_TCP_KEEPALIVE_H__
+#define __USER_TCP_KEEPALIVE_H__
+
+#include "user_queue.h"
+
+#include <stdint.h>
+
+/* defaults as in linux, seconds */
+#define TCP_KEEPIDLE_DEFAULT        7200
+#define TCP_KEEPINTVL_DEFAULT       75
+#define TCP_KEEPCNT_DEFAULT         9
+#define TCP_KEEPALIVE_MAX           32767
+
+/*
+ * keepalive timer wheel, one second slots. a stream sits in the slot of
+ * the time it has to be looked at again, incoming segments do not touch
+ * it: when the slot comes up the idle time is checked against the last
+ * segment and the stream either probes or moves on to its new deadline.
+ * deadlines past the wheel wait in the farthest slot.
+ */
+#define USER_KA_SLOT_MS             1000
+#define USER_KA_SLOTS               8192    // a bit over two hours
+
+typedef struct _user_tcp_kawheel
+{
+    TAILQ_HEAD(ka_slot, _user_tcp_stream) slot[USER_KA_SLOTS];
+    uint32_t cur_ts;            // start of the slot at idx
+    uint32_t idx;
+    uint32_t cnt;
+} user_tcp_kawheel;
+
+struct _user_tcp_manager;
+struct _user_tcp_stream;
+
+int  user_tcp_keepalive_init(struct _user_tcp_manager *tcp);
+void user_tcp_keepalive_arm(struct _user_tcp_manager *tcp, struct _user_tcp_stream *cur_stream, uint32_t cur_ts);
+void user_tcp_keepalive_disarm(struct _user_tcp_manager *tcp, struct _user_tcp_stream *cur_stream);
+void user_tcp_keepalive_apply(struct _user_tcp_manager *tcp, struct _user_tcp_stream *cur_stream, uint32_t cur_ts);
+void user_tcp_keepalive_timer(struct _user_tcp_manager *tcp, uint32_t cur_ts, int thresh);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef __USER_TCP_MEM_H__
+#define __USER_TCP_MEM_H__
+
+#include "user_queue.h"
+
+#include <stdint.h>
+
+/*
+ * memory pressure, like tcp_mem. the bytes the flows and their buffers
+ * take from the pools are compared with three limits: above pressure the
+ * stack is under pressure until it falls below low again, above high it
+ * is critical until it falls below pressure.
+ *
+ * pressure: advertised windows stop opening beyond what was promised and
+ *           shrink towards a few segments, buffers no longer grow and
+ *           keep fewer out-of-order ranges, new connections are answered
+ *           with syn cookies only.
+ * critical: additionally out-of-order data is pruned and not accepted,
+ *           SYNs are dropped.
+ */
+enum
+{
+    USER_TCP_MEM_NORMAL,
+    USER_TCP_MEM_PRESSURE,
+    USER_TCP_MEM_CRITICAL
+};
+
+#define USER_TCP_MEM_PERCENT        50      // of physical memory, the default high limit
+#define USER_TCP_MEM_PRESSURE_WND   4       // segments a window shrinks to under pressure
+#define USER_TCP_MEM_CRITICAL_WND   1
+#define USER_TCP_MEM_PRESSURE_FRAGS 4       // out-of-order ranges a receive buffer keeps under pressure
+
+/*
+ * idle buffers. established streams wait on a list in the order they were
+ * last looked at, once a stream heard nothing for buf_idle its empty send
+ * and receive buffers give their segments back to the pools. the headers
+ * stay with their sequence numbers, the next write or segment links
+ * segments again. 0 keeps the buffers.
+ */
+#define USER_TCP_BUF_IDLE           10      // seconds
+
+typedef struct _user_tcp_memctl
+{
+    uint64_t limit[3];          // low, pressure, high in bytes
+    uint64_t used;
+    uint64_t cc_bytes;          // transmit rings and rate state, from the shared size classes
+    uint32_t ts_update;
+    uint8_t state;
+
+    uint32_t pressure_cnt;      // times pressure was entered
+    uint32_t critical_cnt;
+    uint64_t ofo_pruned;        // bytes of out-of-order data dropped
+    uint32_t syn_cookied;       // SYNs answered with a cookie because of pressure
+    uint32_t syn_dropped;
+
+    TAILQ_HEAD(idle_head, _user_tcp_stream) idle_list;
+    uint32_t idle_cnt;
+    uint32_t buf_idle;          // ticks, 0 keeps idle buffers
+    uint64_t buf_released;      // buffers whose segments went back to the pool
+} user_tcp_memctl;
+
+struct _user_tcp_manager;
+struct _user_tcp_stream;
+
+void     user_tcp_mem_init(struct _user_tcp_manager *tcp);
+int      user_tcp_mem_set_limits(struct _user_tcp_manager *tcp, uint64_t low, uint64_t pressure, uint64_t high);
+void     user_tcp_mem_update(struct _user_tcp_manager *tcp, uint32_t cur_ts);
+uint32_t user_tcp_mem_rcv_wnd(struct _user_tcp_manager *tcp, struct _user_tcp_stream *cur_stream);
+void     user_tcp_mem_prune_ofo(struct _user_tcp_manager *tcp, struct _user_tcp_stream *cur_stream);
+void     user_tcp_mem_idle_arm(struct _user_tcp_manager *tcp, struct _user_tcp_stream *cur_stream, uint32_t cur_ts);
+void     user_tcp_mem_idle_disarm(struct _user_tcp_manager *tcp, struct _user_tcp_stream *cur_stream);
+void     user_tcp_mem_idle_timer(struct _user_tcp_manager *tcp, uint32_t cur_ts, int thresh);
+uint32_t user_tcp_mem_stream_bytes(struct _user_tcp_stream *cur_stream);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef __USER_TCP_PACING_H__
+#define __USER_TCP_PACING_H__
+
+#include "user_queue.h"
+#include "user_tcp_cc.h"
+
+#include <stdint.h>
+
+/* 0 paces only bbr, 1 also paces reno and dctcp from cwnd / srtt */
+#define TCP_PACING_ENABLE           1
+#define TCP_PACING_SS_RATIO         200     // percent of cwnd / srtt in slow start
+#define TCP_PACING_CA_RATIO         120     // and in congestion avoidance
+
+/*
+ * streams that may not send before a time in the future wait on a timer
+ * wheel of their sender instead of the send list. a slot covers
+ * USER_PACE_SLOT_US, later times than the wheel spans wait in the farthest
+ * slot and are parked again when it comes up.
+ */
+#define USER_PACE_SLOT_US           64
+#define USER_PACE_SLOTS             1024    // about 65 ms ahead
+
+typedef struct _user_tcp_pacer
+{
+    TAILQ_HEAD(pace_slot, _user_tcp_stream) slot[USER_PACE_SLOTS];
+    uint64_t cur_us;            // start of the slot at idx
+    uint32_t idx;
+    uint32_t cnt;
+} user_tcp_pacer;
+
+struct _user_sender;
+struct _user_tcp_stream;
+
+void user_tcp_pacer_init(user_tcp_pacer *pacer);
+void user_tcp_pace_park(struct _user_sender *sender, struct _user_tcp_stream *cur_stream, uint64_t now_us);
+void user_tcp_pace_unpark(struct _user_sender *sender, struct _user_tcp_stream *cur_stream);
+int  user_tcp_pace_run(struct _user_sender *sender, uint64_t now_us);
+void user_tcp_pacing_update(struct _user_tcp_stream *cur_stream, const user_tcp_rate_sample *rs);
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef __USER_TCP_RACK_H__
+#define __USER_TCP_RACK_H__
+
+#include <stdint.h>
+
+/* the one retransmission timer slot of a stream, and what it is armed for */
+enum user_tcp_loss_timer
+{
+    USER_TCP_TIMER_RTO = 0,
+    USER_TCP_TIMER_TLP = 1,     // tail loss probe
+    USER_TCP_TIMER_REO = 2,     // rack reordering window
+};
+
+#define USER_RACK_REO_PERSIST       16
+#define USER_TLP_WC_DELACK_MS       200
+
+/* RACK-TLP, RFC 8985 */
+typedef struct _user_tcp_rack
+{
+    uint64_t xmit_us;           // send time of the most recently sent delivered segment
+    uint32_t end_seq;
+    uint32_t fack;              // highest end_seq delivered
+    uint32_t rtt_us;
+    uint32_t min_rtt_us;
+
+    uint64_t reo_deadline_us;   // 0 if no segment waits for the reordering window
+    uint32_t dsack_round;
+    uint8_t reo_wnd_steps;      // reo_wnd is (1 + steps) * min_rtt / 4
+    uint8_t reo_wnd_persist;
+    uint8_t reordering_seen: 1,
+            dsack_round_valid: 1,
+            tlp_out: 1,
+            tlp_retrans: 1;
+    uint32_t tlp_high_seq;      // snd_nxt after the probe
+} user_tcp_rack;
+
+/* proportional rate reduction, RFC 6937 */
+typedef struct _user_tcp_prr
+{
+    uint32_t recover_fs;
+    uint32_t delivered;
+    uint32_t out;
+    uint32_t quota;             // bytes the flush path may still send for this ack
+} user_tcp_prr;
+
+/*
+ * spurious retransmission detection, Eifel (RFC 3522) with timestamps and
+ * F-RTO (RFC 5682) without. the window before the reduction is kept until
+ * the retransmission is known to be needed or not.
+ */
+typedef struct _user_tcp_undo
+{
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t high_seq;          // snd_nxt when the retransmission started
+    uint32_t retrans_ts;        // tsval of the first retransmission, 0 before it goes out
+    uint32_t spurious;          // reductions undone
+    uint8_t marker: 1,          // a reduction can still be undone
+            frto: 2;            // F-RTO step, 0 when not running
+} user_tcp_undo;
+
+struct _user_tcp_stream;
+struct _user_tcp_manager;
+
+void user_tcp_rack_on_ack(struct _user_tcp_stream *cur_stream, uint32_t ack_seq, uint64_t now_us, int dsack);
+int  user_tcp_rack_detect_loss(struct _user_tcp_stream *cur_stream, uint32_t ack_seq, uint64_t now_us,
+                               uint32_t *lost_seq);
+void user_tcp_rack_retransmit(struct _user_tcp_manager *tcp, struct _user_tcp_stream *cur_stream,
+                              uint32_t ack_seq, uint32_t lost_seq);
+void user_tcp_tlp_on_ack(struct _user_tcp_stream *cur_stream, uint32_t ack_seq, int dsack);
+
+void user_tcp_enter_recovery(struct _user_tcp_manager *tcp, struct _user_tcp_stream *cur_stream, uint32_t ack_seq);
+void user_tcp_undo_on_ack(struct _user_tcp_manager *tcp, struct _user_tcp_stream *cur_stream, uint32_t ack_seq);
+void user_tcp_exit_recovery(struct _user_tcp_stream *cur_stream);
+void user_tcp_prr_on_ack(struct _user_tcp_stream *cur_stream, uint32_t delivered);
+
+void user_tcp_recovery_arm_timer(struct _user_tcp_manager *tcp, struct _user_tcp_stream *cur_stream, uint32_t cur_ts);
+void user_tcp_recovery_on_send(struct _user_tcp_manager *tcp, struct _user_tcp_stream *cur_stream,
+                               uint32_t cur_ts, uint32_t len);
+int  user_tcp_recovery_on_timer(struct _user_tcp_manager *tcp, struct _user_tcp_stream *cur_stream, uint32_t cur_ts);
+void user_tcp_recovery_on_rto(struct _user_tcp_stream *cur_stream);
+
+#endif
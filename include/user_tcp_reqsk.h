@@ -0,0 +1,53 @@
+#ifndef __USER_TCP_REQSK_H__
+#define __USER_TCP_REQSK_H__
+
+#include "user_queue.h"
+#include "user_tcp_syncookie.h"
+
+#include <stdint.h>
+
+#define USER_REQSK_BINS        4096    // power of two
+
+/*
+ * a connection in SYN_RCVD before its final ack. only the tuple, the
+ * sequence numbers, the SYN options and the syn-ack timer, a full stream
+ * with its buffers is built when the handshake completes.
+ */
+typedef struct _user_tcp_reqsk
+{
+    uint32_t saddr;             // local side, like the stream
+    uint32_t daddr;
+    uint16_t sport;
+    uint16_t dport;
+
+    uint32_t iss;
+    uint32_t irs;
+    uint32_t ts_rto;
+
+    user_tcp_synopt opt;        // what the peer offered
+    uint16_t peer_wnd;
+    uint8_t nrtx;
+    uint8_t tfo_req: 1;         // answer with a fast open cookie
+
+    struct _user_tcp_reqsk *hash_next;
+    TAILQ_ENTRY(_user_tcp_reqsk) timer_link;
+} user_tcp_reqsk;
+
+struct _user_tcp_manager;
+struct iphdr;
+struct tcphdr;
+
+int  user_tcp_reqsk_init(struct _user_tcp_manager *tcp);
+user_tcp_reqsk *user_tcp_reqsk_lookup(struct _user_tcp_manager *tcp, const struct iphdr *iph,
+                                      const struct tcphdr *tcph);
+user_tcp_reqsk *user_tcp_reqsk_create(struct _user_tcp_manager *tcp, uint32_t cur_ts, const struct iphdr *iph,
+                                      const struct tcphdr *tcph, const user_tcp_synopt *opt);
+void user_tcp_reqsk_destroy(struct _user_tcp_manager *tcp, user_tcp_reqsk *rsk);
+int  user_tcp_reqsk_synack(struct _user_tcp_manager *tcp, user_tcp_reqsk *rsk, uint32_t cur_ts);
+void user_tcp_reqsk_timer(struct _user_tcp_manager *tcp, uint32_t cur_ts, int thresh);
+
+int  user_tcp_synack_alone(struct _user_tcp_manager *tcp, uint32_t saddr, uint16_t sport,
+                           uint32_t daddr, uint16_t dport, uint32_t seq, uint32_t ack_seq,
+                           uint32_t tsval, const user_tcp_synopt *opt, const uint8_t *tfo_cookie);
+
+#endif
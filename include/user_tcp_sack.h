@@ -0,0 +1,45 @@
+#ifndef __USER_TCP_SACK_H__
+#define __USER_TCP_SACK_H__
+
+#include <stdint.h>
+
+/* at most 4 blocks in an option, 3 when it shares the header with timestamps */
+#define USER_TCP_MAX_SACK_BLOCKS    4
+#define USER_TCP_SACK_BLOCKS_TS     3
+#define USER_TCP_SACK_SCOREBOARD    16
+
+typedef struct _user_tcp_sack_block
+{
+    uint32_t start;
+    uint32_t end;
+} user_tcp_sack_block;
+
+/*
+ * sender scoreboard, sorted and non overlapping ranges above snd_una
+ * that the peer reported as received.
+ */
+typedef struct _user_tcp_sackboard
+{
+    user_tcp_sack_block blk[USER_TCP_SACK_SCOREBOARD];
+    uint8_t cnt;
+    uint8_t in_recovery;
+
+    uint32_t sacked_bytes;
+    uint32_t recover;       // snd_nxt when the recovery started
+    uint32_t dsack_cnt;     // duplicate segments reported by the peer
+} user_tcp_sackboard;
+
+struct _user_tcp_stream;
+
+int      user_tcp_sack_parse(uint8_t *tcpopt, int len, user_tcp_sack_block *blocks, int max);
+void     user_tcp_sack_update(struct _user_tcp_stream *cur_stream, uint32_t ack_seq,
+                              user_tcp_sack_block *blocks, int nblocks);
+int      user_tcp_sack_lost(struct _user_tcp_stream *cur_stream);
+uint32_t user_tcp_sack_next_seq(struct _user_tcp_stream *cur_stream, uint32_t seq, uint32_t *hole_end);
+uint32_t user_tcp_sack_pipe(struct _user_tcp_stream *cur_stream, uint32_t seq);
+void     user_tcp_sack_on_rto(struct _user_tcp_stream *cur_stream);
+
+int      user_tcp_sack_generate(struct _user_tcp_stream *cur_stream, user_tcp_sack_block *blocks, int max);
+void     user_tcp_sack_dsack(struct _user_tcp_stream *cur_stream, uint32_t start, uint32_t end);
+
+#endif
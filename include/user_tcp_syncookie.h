@@ -0,0 +1,41 @@
+#ifndef __USER_TCP_SYNCOOKIE_H__
+#define __USER_TCP_SYNCOOKIE_H__
+
+#include <stdint.h>
+
+/* the options of a SYN, all a connection keeps of its handshake */
+typedef struct _user_tcp_synopt
+{
+    uint16_t mss;
+    uint8_t wscale;
+    uint8_t wscale_ok: 1,
+            sack_ok: 1,
+            ts_ok: 1,
+            ecn_ok: 1;          // ECE|CWR on the SYN and we want ECN
+    uint32_t tsval;
+} user_tcp_synopt;
+
+/*
+ * the iss of a cookie syn-ack: 5 bits period counter, 3 bits mss index,
+ * 24 bits keyed hash of the tuple, the counter and the peer isn. with
+ * timestamps the peer's wscale and the sack bit ride in the low bits of
+ * our tsval.
+ */
+#define USER_SYNCOOKIE_PERIOD_MS      64000
+#define USER_SYNCOOKIE_MAX_AGE        2       // periods a cookie stays valid
+#define USER_SYNCOOKIE_TS_BITS        6
+#define USER_SYNCOOKIE_TS_NO_WSCALE   0x0f
+#define USER_SYNCOOKIE_TS_SACK        0x10
+
+struct _user_tcp_manager;
+struct iphdr;
+struct tcphdr;
+
+void user_tcp_syncookie_init(struct _user_tcp_manager *tcp);
+void user_tcp_parse_synopt(const struct tcphdr *tcph, user_tcp_synopt *opt);
+int  user_tcp_syncookie_synack(struct _user_tcp_manager *tcp, uint32_t cur_ts,
+                               const struct iphdr *iph, const struct tcphdr *tcph);
+int  user_tcp_syncookie_check(struct _user_tcp_manager *tcp, uint32_t cur_ts,
+                              const struct iphdr *iph, const struct tcphdr *tcph, user_tcp_synopt *opt);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef __USER_TCP_TIMEWAIT_H__
+#define __USER_TCP_TIMEWAIT_H__
+
+#include "user_queue.h"
+
+#include <stdint.h>
+
+#define USER_TW_BINS               16384   // power of two
+#define USER_TW_REUSE_MS           1000    // idle time before an outbound connect may reuse the tuple
+
+/*
+ * what is left of a connection in TIME_WAIT once its final ack is out:
+ * enough to ack a retransmitted FIN and to judge a new SYN on the tuple.
+ */
+typedef struct _user_tcp_tw
+{
+    uint32_t saddr;             // local side, like the stream
+    uint32_t daddr;
+    uint16_t sport;
+    uint16_t dport;
+
+    uint32_t snd_nxt;
+    uint32_t rcv_nxt;
+    uint32_t ts_recent;
+    uint32_t ts_recent_upd;
+    uint32_t ts_expire;
+
+    uint16_t rcv_wnd;           // as advertised, scaled
+    uint8_t saw_timestamp;
+
+    struct _user_tcp_tw *hash_next;
+    TAILQ_ENTRY(_user_tcp_tw) timer_link;
+} user_tcp_tw;
+
+struct _user_tcp_manager;
+struct _user_tcp_stream;
+struct iphdr;
+struct tcphdr;
+
+int  user_tcp_tw_init(struct _user_tcp_manager *tcp);
+user_tcp_tw *user_tcp_tw_lookup(struct _user_tcp_manager *tcp, uint32_t saddr, uint16_t sport,
+                                uint32_t daddr, uint16_t dport);
+user_tcp_tw *user_tcp_tw_create(struct _user_tcp_manager *tcp, struct _user_tcp_stream *cur_stream);
+void user_tcp_tw_destroy(struct _user_tcp_manager *tcp, user_tcp_tw *tw);
+int  user_tcp_tw_process(struct _user_tcp_manager *tcp, uint32_t cur_ts, user_tcp_tw *tw,
+                         const struct iphdr *iph, const struct tcphdr *tcph, uint32_t seq);
+int  user_tcp_tw_reuse(struct _user_tcp_manager *tcp, uint32_t cur_ts, uint32_t saddr, uint16_t sport,
+                       uint32_t daddr, uint16_t dport, uint32_t *iss);
+void user_tcp_tw_timer(struct _user_tcp_manager *tcp, uint32_t cur_ts, int thresh);
+
+#endif
@@ -5,6 +5,8 @@
 #include "user_api.h"
 #include "user_epoll.h"
 #include "user_socket.h"
+#include "user_mempool.h"
+#include "user_slab.h"
 
 #include <errno.h>
 #include <stdio.h>
@@ -25,7 +27,7 @@ static int user_peek_for_user(user_tcp_stream *cur_stream, char *buf, int len)
         errno = EAGAIN;
         return -1;
     }
-    memcpy(buf, rcv->recvbuf->head, copylen);
+    RBCopy(rcv->recvbuf, buf, copylen);
 
     return copylen;
 }
@@ -53,13 +55,11 @@ static int user_copy_to_user(user_tcp_stream *cur_stream, char *buf, int len)
     //rcv --> data increase
     //uint32_t prev_rcv_wnd = rcv->rcv_wnd;
 
-    memcpy(buf, rcv->recvbuf->head, copylen);
+    RBCopy(rcv->recvbuf, buf, copylen);
 
     RBRemove(tcp->rbm_rcv, rcv->recvbuf, copylen, AT_APP);
     rcv->rcv_wnd = rcv->recvbuf->size - rcv->recvbuf->merged_len;
 
-    //printf("size:%d, merged_len:%d offset %d, %s\n",rcv->recvbuf->size, rcv->recvbuf->merged_len,
-    //	rcv->recvbuf->head_offset, rcv->recvbuf->data);
 
     if (cur_stream->need_wnd_adv)
     {
@@ -90,6 +90,7 @@ static int user_copy_from_user(user_tcp_stream *cur_stream, const char *buf, int
     int sndlen = MIN((int) snd->snd_wnd, len);
     if (sndlen <= 0)
     {
+        snd->write_wait = 1;
         errno = EAGAIN;
         return -1;
     }
@@ -105,17 +106,21 @@ static int user_copy_from_user(user_tcp_stream *cur_stream, const char *buf, int
         }
     }
 
+    /* short when segments run out, the caller sends the rest later */
     int ret = SBPut(tcp->rbm_snd, snd->sndbuf, buf, sndlen);
-    assert(ret == sndlen);
     if (ret <= 0)
     {
         user_trace_api("SBPut failed. reason: %d (sndlen: %u, len: %u\n",
                        ret, sndlen, snd->sndbuf->len);
-        errno = EAGAIN;
+        errno = ret < 0 ? ENOMEM : EAGAIN;
         return -1;
     }
 
     snd->snd_wnd = snd->sndbuf->size - snd->sndbuf->len;
+    if (!user_tcp_sndbuf_writable(cur_stream))
+    {
+        snd->write_wait = 1;
+    }
     if (snd->snd_wnd <= 0)
     {
         user_trace_api("%u Sending buffer became full!! snd_wnd: %u\n",
@@ -131,7 +136,7 @@ static int user_close_stream_socket(int sockid)
     if (!tcp)
         return -1;
 
-    user_tcp_stream *cur_stream = tcp->smap[sockid].stream;
+    user_tcp_stream *cur_stream = USER_SMAP(tcp, sockid)->stream;
     if (!cur_stream)
     {
         user_trace_api("Socket %d: stream does not exist.\n", sockid);
@@ -196,7 +201,7 @@ static int user_close_listening_socket(int sockid)
     user_tcp_manager *tcp = user_get_tcp_manager();
     if (!tcp) return -1;
 
-    struct _user_tcp_listener *listener = tcp->smap[sockid].listener;
+    struct _user_tcp_listener *listener = USER_SMAP(tcp, sockid)->listener;
     if (!listener)
     {
         errno = EINVAL;
@@ -217,7 +222,7 @@ static int user_close_listening_socket(int sockid)
     pthread_mutex_destroy(&listener->accept_lock);
 
     free(listener);
-    tcp->smap[sockid].listener = NULL;
+    USER_SMAP(tcp, sockid)->listener = NULL;
 
     return 0;
 }
@@ -240,7 +245,7 @@ int user_socket(int domain, int type, int protocol)
         return -1;
     }
 
-    user_socket_map *socket = user_allocate_socket(type, 0);
+    user_socket_map *socket = user_allocate_socket(type);
     if (!socket)
     {
         errno = ENFILE;
@@ -254,21 +259,21 @@ int user_bind(int sockid, const struct sockaddr *addr, socklen_t addrlen)
     user_tcp_manager *tcp = user_get_tcp_manager();
     if (!tcp) return -1;
 
-    if (sockid < 0 || sockid >= USER_MAX_CONCURRENCY)
+    if (sockid < 0 || sockid >= tcp->smap_cnt)
     {
         errno = EBADF;
         return -1;
     }
 
-    if (tcp->smap[sockid].socktype == USER_TCP_SOCK_UNUSED)
+    if (USER_SMAP(tcp, sockid)->socktype == USER_TCP_SOCK_UNUSED)
     {
         user_trace_api("Invalid socket id: %d\n", sockid);
         errno = EBADF;
         return -1;
     }
 
-    if (tcp->smap[sockid].socktype != USER_TCP_SOCK_STREAM &&
-        tcp->smap[sockid].socktype != USER_TCP_SOCK_LISTENER)
+    if (USER_SMAP(tcp, sockid)->socktype != USER_TCP_SOCK_STREAM &&
+        USER_SMAP(tcp, sockid)->socktype != USER_TCP_SOCK_LISTENER)
     {
         user_trace_api("Not a stream socket id: %d\n", sockid);
         errno = ENOTSOCK;
@@ -282,7 +287,7 @@ int user_bind(int sockid, const struct sockaddr *addr, socklen_t addrlen)
         return -1;
     }
 
-    if (tcp->smap[sockid].opts & USER_TCP_ADDR_BIND)
+    if (USER_SMAP(tcp, sockid)->opts & USER_TCP_ADDR_BIND)
     {
         user_trace_api("Socket %d: adress already bind for this socket.\n", sockid);
         errno = EINVAL;
@@ -297,8 +302,8 @@ int user_bind(int sockid, const struct sockaddr *addr, socklen_t addrlen)
     }
 
     struct sockaddr_in *addr_in = (struct sockaddr_in *) addr;
-    tcp->smap[sockid].s_addr = *addr_in;
-    tcp->smap[sockid].opts |= USER_TCP_ADDR_BIND;
+    USER_SMAP(tcp, sockid)->s_addr = *addr_in;
+    USER_SMAP(tcp, sockid)->opts |= USER_TCP_ADDR_BIND;
 
     return 0;
 }
@@ -308,29 +313,29 @@ int user_listen(int sockid, int backlog)
     user_tcp_manager *tcp = user_get_tcp_manager();
     if (!tcp) return -1;
 
-    if (sockid < 0 || sockid >= USER_MAX_CONCURRENCY)
+    if (sockid < 0 || sockid >= tcp->smap_cnt)
     {
         errno = EBADF;
         return -1;
     }
-    if (tcp->smap[sockid].socktype == USER_TCP_SOCK_UNUSED)
+    if (USER_SMAP(tcp, sockid)->socktype == USER_TCP_SOCK_UNUSED)
     {
         user_trace_api("Socket %d: invalid argument!\n", sockid);
         errno = EBADF;
         return -1;
     }
-    if (tcp->smap[sockid].socktype == USER_TCP_SOCK_STREAM)
+    if (USER_SMAP(tcp, sockid)->socktype == USER_TCP_SOCK_STREAM)
     {
-        tcp->smap[sockid].socktype = USER_TCP_SOCK_LISTENER;
+        USER_SMAP(tcp, sockid)->socktype = USER_TCP_SOCK_LISTENER;
     }
-    if (tcp->smap[sockid].socktype != USER_TCP_SOCK_LISTENER)
+    if (USER_SMAP(tcp, sockid)->socktype != USER_TCP_SOCK_LISTENER)
     {
         user_trace_api("Not a listening socket. id: %d\n", sockid);
         errno = ENOTSOCK;
         return -1;
     }
 
-    if (ListenerHTSearch(tcp->listeners, &tcp->smap[sockid].s_addr.sin_port))
+    if (ListenerHTSearch(tcp->listeners, &USER_SMAP(tcp, sockid)->s_addr.sin_port))
     {
         errno = EADDRINUSE;
         return -1;
@@ -344,7 +349,11 @@ int user_listen(int sockid, int backlog)
 
     listener->sockid = sockid;
     listener->backlog = backlog;
-    listener->socket = &tcp->smap[sockid];
+    listener->cc_algo = TCP_DEFAULT_CC;
+    listener->delack_ms = TCP_DELACK_MS;
+    listener->delack_segs = TCP_DELACK_SEGS;
+    listener->syn_backlog = backlog > 0 ? backlog : USER_BACKLOG_SIZE;
+    listener->socket = USER_SMAP(tcp, sockid);
 
     if (pthread_cond_init(&listener->accept_cond, NULL))
     {
@@ -368,7 +377,7 @@ int user_listen(int sockid, int backlog)
         return -1;
     }
 
-    tcp->smap[sockid].listener = listener;
+    USER_SMAP(tcp, sockid)->listener = listener;
     ListenerHTInsert(tcp->listeners, listener);
     return 0;
 }
@@ -378,19 +387,19 @@ int user_accept(int sockid, struct sockaddr *addr, socklen_t *addrlen)
     user_tcp_manager *tcp = user_get_tcp_manager();
     if (!tcp) return -1;
 
-    if (sockid < 0 || sockid >= USER_MAX_CONCURRENCY)
+    if (sockid < 0 || sockid >= tcp->smap_cnt)
     {
         errno = EBADF;
         return -1;
     }
 
-    if (tcp->smap[sockid].socktype != USER_TCP_SOCK_LISTENER)
+    if (USER_SMAP(tcp, sockid)->socktype != USER_TCP_SOCK_LISTENER)
     {
         errno = EINVAL;
         return -1;
     }
 
-    user_tcp_listener *listener = tcp->smap[sockid].listener;
+    user_tcp_listener *listener = USER_SMAP(tcp, sockid)->listener;
     user_tcp_stream *accepted = StreamDequeue(listener->acceptq);
     if (!accepted)
     {
@@ -421,7 +430,7 @@ int user_accept(int sockid, struct sockaddr *addr, socklen_t *addrlen)
     user_socket_map *socket = NULL;
     if (!accepted->socket)
     {
-        socket = user_allocate_socket(USER_TCP_SOCK_STREAM, 0);
+        socket = user_allocate_socket(USER_TCP_SOCK_STREAM);
         if (!socket)
         {
             user_trace_api("Failed to create new socket!\n");
@@ -462,13 +471,13 @@ ssize_t user_recv(int sockid, char *buf, size_t len, int flags)
     user_tcp_manager *tcp = user_get_tcp_manager();
     if (!tcp) return -1;
 
-    if (sockid < 0 || sockid >= USER_MAX_CONCURRENCY)
+    if (sockid < 0 || sockid >= tcp->smap_cnt)
     {
         errno = EBADF;
         return -1;
     }
 
-    user_socket_map *socket = &tcp->smap[sockid];
+    user_socket_map *socket = USER_SMAP(tcp, sockid);
     if (socket->socktype == USER_TCP_SOCK_UNUSED)
     {
         errno = EINVAL;
@@ -481,10 +490,11 @@ ssize_t user_recv(int sockid, char *buf, size_t len, int flags)
         return -1;
     }
 
-    /* stream should be in ESTABLISHED, FIN_WAIT_1, FIN_WAIT_2, CLOSE_WAIT */
+    /* stream should be in ESTABLISHED, FIN_WAIT_1, FIN_WAIT_2, CLOSE_WAIT, or SYN_RCVD after fast open */
     user_tcp_stream *cur_stream = socket->stream;
     if (!cur_stream ||
         !(cur_stream->state == USER_TCP_ESTABLISHED ||
+          cur_stream->state == USER_TCP_SYN_RCVD ||
           cur_stream->state == USER_TCP_CLOSE_WAIT ||
           cur_stream->state == USER_TCP_FIN_WAIT_1 ||
           cur_stream->state == USER_TCP_FIN_WAIT_2))
@@ -518,7 +528,8 @@ ssize_t user_recv(int sockid, char *buf, size_t len, int flags)
     if (!(socket->opts & USER_TCP_NONBLOCK))
     {
         while (!rcv->recvbuf || rcv->recvbuf->merged_len == 0) {
-            if (!cur_stream || cur_stream->state != USER_TCP_ESTABLISHED)
+            if (!cur_stream || (cur_stream->state != USER_TCP_ESTABLISHED &&
+                                cur_stream->state != USER_TCP_SYN_RCVD))
             {
                 pthread_mutex_unlock(&rcv->read_lock);
 
@@ -603,13 +614,13 @@ ssize_t user_send(int sockid, const char *buf, size_t len)
     user_tcp_manager *tcp = user_get_tcp_manager();
     if (!tcp) return -1;
 
-    if (sockid < 0 || sockid >= USER_MAX_CONCURRENCY)
+    if (sockid < 0 || sockid >= tcp->smap_cnt)
     {
         errno = EBADF;
         return -1;
     }
 
-    user_socket_map *socket = &tcp->smap[sockid];
+    user_socket_map *socket = USER_SMAP(tcp, sockid);
     if (socket->socktype == USER_TCP_SOCK_UNUSED)
     {
         errno = EINVAL;
@@ -620,10 +631,11 @@ ssize_t user_send(int sockid, const char *buf, size_t len)
         errno = ENOTSOCK;
         return -1;
     }
-    /* stream should be in ESTABLISHED, FIN_WAIT_1, FIN_WAIT_2, CLOSE_WAIT */
+    /* stream should be in ESTABLISHED or CLOSE_WAIT, SYN_RCVD after fast open queues until established */
     user_tcp_stream *cur_stream = socket->stream;
     if (!cur_stream ||
         !(cur_stream->state == USER_TCP_ESTABLISHED ||
+            cur_stream->state == USER_TCP_SYN_RCVD ||
             cur_stream->state == USER_TCP_CLOSE_WAIT))
     {
         errno = ENOTCONN;
@@ -645,19 +657,22 @@ ssize_t user_send(int sockid, const char *buf, size_t len)
     user_tcp_send *snd = cur_stream->snd;
 
     pthread_mutex_lock(&snd->write_lock);
+    snd->more = 0;
 
 #if USER_ENABLE_BLOCKING
     if (!(socket->opts & USER_TCP_NONBLOCK))
     {
-        while (snd->snd_wnd <= 0)
+        while (!user_tcp_sndbuf_writable(cur_stream))
         {
-            if (!cur_stream || cur_stream->state != USER_TCP_ESTABLISHED)
+            if (!cur_stream || (cur_stream->state != USER_TCP_ESTABLISHED &&
+                                cur_stream->state != USER_TCP_SYN_RCVD))
             {
                 pthread_mutex_unlock(&snd->write_lock);
                 errno = EINTR;
                 return -1;
             }
 
+            snd->write_wait = 1;
             pthread_cond_wait(&snd->write_cond, &snd->write_lock);
         }
     }
@@ -680,7 +695,7 @@ ssize_t user_send(int sockid, const char *buf, size_t len)
         errno = EAGAIN;
     }
 
-    if (snd->snd_wnd > 0)
+    if (user_tcp_sndbuf_writable(cur_stream))
     {
         if ((socket->epoll & USER_EPOLLOUT) && !(socket->epoll & USER_EPOLLET))
         {
@@ -708,13 +723,13 @@ int user_close(int sockid)
     user_tcp_manager *tcp = user_get_tcp_manager();
     if (!tcp) return -1;
 
-    if (sockid < 0 || sockid >= USER_MAX_CONCURRENCY)
+    if (sockid < 0 || sockid >= tcp->smap_cnt)
     {
         errno = EBADF;
         return -1;
     }
 
-    user_socket_map *socket = &tcp->smap[sockid];
+    user_socket_map *socket = USER_SMAP(tcp, sockid);
     if (socket->socktype == USER_TCP_SOCK_UNUSED)
     {
         errno = EINVAL;
@@ -723,7 +738,7 @@ int user_close(int sockid)
     user_trace_api("Socket %d: mtcp_close called.\n", sockid);
 
     int ret = -1;
-    switch (tcp->smap[sockid].socktype)
+    switch (USER_SMAP(tcp, sockid)->socktype)
     {
         case USER_TCP_SOCK_STREAM:
         {
@@ -748,10 +763,650 @@ int user_close(int sockid)
         }
     }
 
-    user_free_socket(sockid, 0);
+    user_free_socket(sockid);
     return ret;
 }
 
+static int user_tcp_ca_by_optval(const void *optval, socklen_t optlen)
+{
+    char name[USER_TCP_CA_NAME_MAX] = {0};
+
+    if (optval == NULL || optlen == 0)
+        return -1;
+
+    memcpy(name, optval, MIN(optlen, sizeof(name) - 1));
+    return user_tcp_cc_by_name(name);
+}
+
+static int user_int_optval(const void *optval, socklen_t optlen, int *val)
+{
+    if (optval == NULL || optlen < sizeof(int))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memcpy(val, optval, sizeof(int));
+    return 0;
+}
+
+/* hand data held back by nagle or a cork to the stack */
+static void user_tcp_push_pending(user_tcp_stream *cur_stream)
+{
+    user_tcp_manager *tcp = user_get_tcp_manager();
+    user_tcp_send *snd = cur_stream->snd;
+
+    if (!tcp || !snd->sndbuf || snd->sndbuf->len == 0)
+        return;
+
+    if (!(snd->on_sendq || snd->on_send_list))
+    {
+        snd->on_sendq = 1;
+        StreamEnqueue(tcp->sendq, cur_stream);
+        tcp->wakeup_flag = 1;
+    }
+}
+
+static int user_copy_optval(void *optval, socklen_t *optlen, const void *val, socklen_t len)
+{
+    if (optval == NULL || optlen == NULL)
+    {
+        errno = EFAULT;
+        return -1;
+    }
+
+    len = MIN(*optlen, len);
+    memcpy(optval, val, len);
+    *optlen = len;
+
+    return 0;
+}
+
+static void user_tcp_fill_info(user_tcp_stream *cur_stream, struct user_tcp_info *info)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_recv *rcv = cur_stream->rcv;
+    user_tcp_rate *rate = snd->rate;
+
+    memset(info, 0, sizeof(struct user_tcp_info));
+
+    info->state = cur_stream->state;
+    info->ca_algo = snd->cc_algo;
+    info->ecn = (snd->ecn_flags & TCP_ECN_OK) ? 1 : 0;
+
+    info->rto = snd->rto;
+    info->rtt = rcv->srtt >> 3;
+    info->rttvar = rcv->rttvar;
+    info->snd_mss = snd->mss;
+    info->snd_cwnd = snd->cwnd;
+    info->snd_ssthresh = snd->ssthresh;
+    info->snd_wnd = snd->peer_wnd;
+    info->rcv_wnd = rcv->rcv_wnd;
+    info->rcv_space = rcv->recvbuf ? rcv->recvbuf->size : 0;
+    info->unacked = cur_stream->snd_nxt - snd->snd_una;
+    if (snd->sndbuf)
+    {
+        info->notsent = snd->sndbuf->head_seq + snd->sndbuf->len - cur_stream->snd_nxt;
+        info->snd_space = snd->sndbuf->size;
+    }
+    info->retrans = snd->nrtx;
+    info->sacked = snd->sack.sacked_bytes;
+    info->dsacks = snd->sack.dsack_cnt;
+    info->spurious = snd->undo.spurious;
+    info->mem = user_tcp_mem_stream_bytes(cur_stream);
+
+    info->pacing_rate = snd->pacing_rate;
+    info->max_pacing_rate = snd->max_pacing_rate;
+
+    /* delivery rates are only sampled for bbr */
+    if (rate)
+    {
+        info->delivered = rate->delivered;
+        info->delivery_rate = rate->rate_bps;
+        info->bbr_mode = rate->bbr.mode;
+        info->bbr_bw = rate->bbr.bw.s[0].v;
+        info->bbr_min_rtt = rate->bbr.min_rtt_us;
+        info->bbr_pacing_gain = rate->bbr.pacing_gain;
+        info->bbr_cwnd_gain = rate->bbr.cwnd_gain;
+    }
+    else if (snd->cc_algo == USER_TCP_CC_DCTCP)
+    {
+        info->dctcp_alpha = snd->dctcp.alpha;
+    }
+}
+
+/* keepalive, the idle kill and the congestion control are state of the stack thread, it applies them */
+static void user_tcp_opts_changed(user_tcp_stream *cur_stream)
+{
+    user_tcp_manager *tcp = user_get_tcp_manager();
+
+    if (!tcp || cur_stream->snd->on_optq)
+        return;
+
+    cur_stream->snd->on_optq = 1;
+    StreamEnqueue(tcp->optq, cur_stream);
+    tcp->wakeup_flag = 1;
+}
+
+/* SOL_SOCKET options, a listener passes its values on to accepted streams */
+static int user_sock_setsockopt(int socktype, user_tcp_stream *cur_stream, user_tcp_listener *listener,
+                                int optname, const void *optval, socklen_t optlen)
+{
+    switch (optname)
+    {
+        case USER_SO_KEEPALIVE:
+        {
+            int val = 0;
+            if (user_int_optval(optval, optlen, &val) < 0)
+                return -1;
+
+            if (socktype == USER_TCP_SOCK_LISTENER)
+            {
+                listener->keepalive = val ? 1 : 0;
+                return 0;
+            }
+
+            cur_stream->snd->keepalive = val ? 1 : 0;
+            user_tcp_opts_changed(cur_stream);
+            return 0;
+        }
+        case USER_SO_MAX_PACING_RATE:
+        {
+            uint64_t rate;
+            uint32_t rate32;
+
+            if (optval == NULL || optlen < sizeof(uint32_t))
+            {
+                errno = EINVAL;
+                return -1;
+            }
+
+            if (optlen >= sizeof(uint64_t))
+            {
+                memcpy(&rate, optval, sizeof(uint64_t));
+            }
+            else
+            {
+                memcpy(&rate32, optval, sizeof(uint32_t));
+                rate = (rate32 == UINT32_MAX) ? UINT64_MAX : rate32;
+            }
+            if (rate == UINT64_MAX)
+                rate = 0;
+
+            if (socktype == USER_TCP_SOCK_LISTENER)
+            {
+                listener->max_pacing_rate = rate;
+                return 0;
+            }
+
+            pthread_mutex_lock(&cur_stream->snd->write_lock);
+            cur_stream->snd->max_pacing_rate = rate;
+            if (cur_stream->state >= USER_TCP_ESTABLISHED)
+            {
+                user_tcp_pacing_update(cur_stream, NULL);
+            }
+            pthread_mutex_unlock(&cur_stream->snd->write_lock);
+            return 0;
+        }
+        default:
+        {
+            errno = ENOPROTOOPT;
+            return -1;
+        }
+    }
+}
+
+static int user_sock_getsockopt(int socktype, user_tcp_stream *cur_stream, user_tcp_listener *listener,
+                                int optname, void *optval, socklen_t *optlen)
+{
+    switch (optname)
+    {
+        case USER_SO_KEEPALIVE:
+        {
+            int val = (socktype == USER_TCP_SOCK_LISTENER) ?
+                      listener->keepalive : cur_stream->snd->keepalive;
+            return user_copy_optval(optval, optlen, &val, sizeof(val));
+        }
+        case USER_SO_MAX_PACING_RATE:
+        {
+            uint64_t rate = (socktype == USER_TCP_SOCK_LISTENER) ?
+                            listener->max_pacing_rate : cur_stream->snd->max_pacing_rate;
+            uint32_t rate32;
+
+            if (optlen != NULL && *optlen >= sizeof(uint64_t))
+            {
+                if (rate == 0) rate = UINT64_MAX;
+                return user_copy_optval(optval, optlen, &rate, sizeof(rate));
+            }
+
+            rate32 = (rate == 0 || rate > UINT32_MAX) ? UINT32_MAX : (uint32_t) rate;
+            return user_copy_optval(optval, optlen, &rate32, sizeof(rate32));
+        }
+        default:
+        {
+            errno = ENOPROTOOPT;
+            return -1;
+        }
+    }
+}
+
+static int user_tcp_setsockopt(int socktype, user_tcp_stream *cur_stream, user_tcp_listener *listener,
+                               int level, int optname, const void *optval, socklen_t optlen)
+{
+    if (level != IPPROTO_TCP && level != SOL_SOCKET)
+    {
+        errno = ENOPROTOOPT;
+        return -1;
+    }
+
+    if ((socktype == USER_TCP_SOCK_STREAM && !cur_stream) ||
+        (socktype == USER_TCP_SOCK_LISTENER && !listener) ||
+        (socktype != USER_TCP_SOCK_STREAM && socktype != USER_TCP_SOCK_LISTENER))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (level == SOL_SOCKET)
+    {
+        return user_sock_setsockopt(socktype, cur_stream, listener, optname, optval, optlen);
+    }
+
+    switch (optname)
+    {
+        case USER_TCP_CONGESTION:
+        {
+            int algo = user_tcp_ca_by_optval(optval, optlen);
+            if (algo < 0)
+            {
+                errno = ENOENT;
+                return -1;
+            }
+
+            if (socktype == USER_TCP_SOCK_LISTENER)
+            {
+                listener->cc_algo = algo;
+                return 0;
+            }
+
+            pthread_mutex_lock(&cur_stream->snd->write_lock);
+            if (cur_stream->state >= USER_TCP_ESTABLISHED)
+            {
+                cur_stream->snd->cc_next = algo;
+                cur_stream->snd->cc_change = 1;
+                user_tcp_opts_changed(cur_stream);
+            }
+            else
+            {
+                cur_stream->snd->cc_algo = algo;
+            }
+            pthread_mutex_unlock(&cur_stream->snd->write_lock);
+            return 0;
+        }
+        case USER_TCP_NODELAY:
+        case USER_TCP_CORK:
+        {
+            int val = 0;
+            if (user_int_optval(optval, optlen, &val) < 0)
+                return -1;
+
+            if (socktype == USER_TCP_SOCK_LISTENER)
+            {
+                if (optname == USER_TCP_CORK)
+                {
+                    errno = ENOTCONN;
+                    return -1;
+                }
+                listener->nodelay = val ? 1 : 0;
+                return 0;
+            }
+
+            user_tcp_send *snd = cur_stream->snd;
+            pthread_mutex_lock(&snd->write_lock);
+            if (optname == USER_TCP_NODELAY)
+            {
+                snd->nodelay = val ? 1 : 0;
+            }
+            else
+            {
+                snd->cork = val ? 1 : 0;
+                snd->ts_cork = 0;
+            }
+            pthread_mutex_unlock(&snd->write_lock);
+
+            /* turning on nodelay or uncorking sends what is pending */
+            if ((optname == USER_TCP_NODELAY) == (val != 0))
+            {
+                user_tcp_push_pending(cur_stream);
+            }
+            return 0;
+        }
+        case USER_TCP_NOTSENT_LOWAT:
+        {
+            int val = 0;
+            if (user_int_optval(optval, optlen, &val) < 0)
+                return -1;
+
+            if (val < 0)
+            {
+                errno = EINVAL;
+                return -1;
+            }
+
+            if (socktype == USER_TCP_SOCK_LISTENER)
+            {
+                listener->notsent_lowat = val;
+                return 0;
+            }
+
+            pthread_mutex_lock(&cur_stream->snd->write_lock);
+            cur_stream->snd->notsent_lowat = val;
+            pthread_mutex_unlock(&cur_stream->snd->write_lock);
+            return 0;
+        }
+        case USER_TCP_FASTOPEN:
+        {
+            int val = 0;
+            if (user_int_optval(optval, optlen, &val) < 0)
+                return -1;
+
+            if (val < 0)
+            {
+                errno = EINVAL;
+                return -1;
+            }
+
+            if (socktype != USER_TCP_SOCK_LISTENER)
+            {
+                errno = EOPNOTSUPP;
+                return -1;
+            }
+            listener->fastopen_qlen = val;
+            return 0;
+        }
+        case USER_TCP_KEEPIDLE:
+        case USER_TCP_KEEPINTVL:
+        case USER_TCP_KEEPCNT:
+        {
+            int val = 0;
+            if (user_int_optval(optval, optlen, &val) < 0)
+                return -1;
+
+            if (val < 1 || val > TCP_KEEPALIVE_MAX ||
+                (optname == USER_TCP_KEEPCNT && val > INT8_MAX))
+            {
+                errno = EINVAL;
+                return -1;
+            }
+
+            if (socktype == USER_TCP_SOCK_LISTENER)
+            {
+                if (optname == USER_TCP_KEEPIDLE)
+                    listener->keep_idle = val;
+                else if (optname == USER_TCP_KEEPINTVL)
+                    listener->keep_intvl = val;
+                else
+                    listener->keep_cnt = val;
+                return 0;
+            }
+
+            if (optname == USER_TCP_KEEPIDLE)
+                cur_stream->snd->keep_idle = val;
+            else if (optname == USER_TCP_KEEPINTVL)
+                cur_stream->snd->keep_intvl = val;
+            else
+                cur_stream->snd->keep_cnt = val;
+
+            if (cur_stream->snd->keepalive)
+            {
+                user_tcp_opts_changed(cur_stream);
+            }
+            return 0;
+        }
+        case USER_TCP_IDLE_KILL:
+        {
+            int val = 0;
+            if (user_int_optval(optval, optlen, &val) < 0)
+                return -1;
+
+            if (socktype == USER_TCP_SOCK_LISTENER)
+            {
+                listener->no_idle_kill = val ? 0 : 1;
+                return 0;
+            }
+
+            cur_stream->snd->no_idle_kill = val ? 0 : 1;
+            user_tcp_opts_changed(cur_stream);
+            return 0;
+        }
+        case USER_TCP_QUICKACK:
+        {
+            int val = 0;
+            if (user_int_optval(optval, optlen, &val) < 0)
+                return -1;
+
+            if (socktype != USER_TCP_SOCK_STREAM)
+            {
+                errno = ENOTCONN;
+                return -1;
+            }
+            cur_stream->rcv->quickack = val ? TCP_MAX_QUICKACKS : 0;
+            return 0;
+        }
+        case USER_TCP_DELACK_MS:
+        case USER_TCP_DELACK_SEGS:
+        {
+            int val = 0;
+            if (user_int_optval(optval, optlen, &val) < 0)
+                return -1;
+
+            if (val < 0 || val > UINT16_MAX ||
+                (optname == USER_TCP_DELACK_SEGS && (val == 0 || val > UINT8_MAX)))
+            {
+                errno = EINVAL;
+                return -1;
+            }
+
+            if (optname == USER_TCP_DELACK_MS)
+            {
+                if (socktype == USER_TCP_SOCK_LISTENER)
+                    listener->delack_ms = val;
+                else
+                    cur_stream->rcv->delack_ms = val;
+            }
+            else
+            {
+                if (socktype == USER_TCP_SOCK_LISTENER)
+                    listener->delack_segs = val;
+                else
+                    cur_stream->rcv->delack_segs = val;
+            }
+            return 0;
+        }
+        default:
+        {
+            errno = ENOPROTOOPT;
+            return -1;
+        }
+    }
+}
+
+static int user_tcp_getsockopt(int socktype, user_tcp_stream *cur_stream, user_tcp_listener *listener,
+                               int level, int optname, void *optval, socklen_t *optlen)
+{
+    if (level != IPPROTO_TCP && level != SOL_SOCKET)
+    {
+        errno = ENOPROTOOPT;
+        return -1;
+    }
+
+    if ((socktype == USER_TCP_SOCK_STREAM && !cur_stream) ||
+        (socktype == USER_TCP_SOCK_LISTENER && !listener) ||
+        (socktype != USER_TCP_SOCK_STREAM && socktype != USER_TCP_SOCK_LISTENER))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (level == SOL_SOCKET)
+    {
+        return user_sock_getsockopt(socktype, cur_stream, listener, optname, optval, optlen);
+    }
+
+    switch (optname)
+    {
+        case USER_TCP_CONGESTION:
+        {
+            int algo = (socktype == USER_TCP_SOCK_LISTENER) ?
+                       listener->cc_algo : cur_stream->snd->cc_algo;
+            const char *name;
+
+            /* a switch not yet made by the stack thread reads as made */
+            if (socktype == USER_TCP_SOCK_STREAM && cur_stream->snd->cc_change)
+            {
+                algo = cur_stream->snd->cc_next;
+            }
+            name = user_tcp_cc_name(algo);
+            return user_copy_optval(optval, optlen, name, strlen(name) + 1);
+        }
+        case USER_TCP_INFO:
+        {
+            struct user_tcp_info info;
+            if (socktype != USER_TCP_SOCK_STREAM)
+            {
+                errno = ENOTCONN;
+                return -1;
+            }
+            user_tcp_fill_info(cur_stream, &info);
+            return user_copy_optval(optval, optlen, &info, sizeof(info));
+        }
+        case USER_TCP_NODELAY:
+        {
+            int val = (socktype == USER_TCP_SOCK_LISTENER) ?
+                      listener->nodelay : cur_stream->snd->nodelay;
+            return user_copy_optval(optval, optlen, &val, sizeof(val));
+        }
+        case USER_TCP_CORK:
+        {
+            int val = 0;
+            if (socktype == USER_TCP_SOCK_STREAM)
+            {
+                val = cur_stream->snd->cork;
+            }
+            return user_copy_optval(optval, optlen, &val, sizeof(val));
+        }
+        case USER_TCP_NOTSENT_LOWAT:
+        {
+            int val = (socktype == USER_TCP_SOCK_LISTENER) ?
+                      listener->notsent_lowat : cur_stream->snd->notsent_lowat;
+            return user_copy_optval(optval, optlen, &val, sizeof(val));
+        }
+        case USER_TCP_FASTOPEN:
+        {
+            int val = (socktype == USER_TCP_SOCK_LISTENER) ? listener->fastopen_qlen : 0;
+            return user_copy_optval(optval, optlen, &val, sizeof(val));
+        }
+        case USER_TCP_KEEPIDLE:
+        case USER_TCP_KEEPINTVL:
+        case USER_TCP_KEEPCNT:
+        {
+            int val = 0;
+            if (socktype == USER_TCP_SOCK_LISTENER)
+            {
+                val = (optname == USER_TCP_KEEPIDLE) ? listener->keep_idle :
+                      (optname == USER_TCP_KEEPINTVL) ? listener->keep_intvl : listener->keep_cnt;
+                if (val == 0)
+                {
+                    val = (optname == USER_TCP_KEEPIDLE) ? TCP_KEEPIDLE_DEFAULT :
+                          (optname == USER_TCP_KEEPINTVL) ? TCP_KEEPINTVL_DEFAULT : TCP_KEEPCNT_DEFAULT;
+                }
+            }
+            else
+            {
+                val = (optname == USER_TCP_KEEPIDLE) ? cur_stream->snd->keep_idle :
+                      (optname == USER_TCP_KEEPINTVL) ? cur_stream->snd->keep_intvl : cur_stream->snd->keep_cnt;
+            }
+            return user_copy_optval(optval, optlen, &val, sizeof(val));
+        }
+        case USER_TCP_IDLE_KILL:
+        {
+            int val = (socktype == USER_TCP_SOCK_LISTENER) ?
+                      !listener->no_idle_kill : !cur_stream->snd->no_idle_kill;
+            return user_copy_optval(optval, optlen, &val, sizeof(val));
+        }
+        case USER_TCP_QUICKACK:
+        {
+            int val = 0;
+            if (socktype == USER_TCP_SOCK_STREAM)
+            {
+                val = cur_stream->rcv->quickack > 0;
+            }
+            return user_copy_optval(optval, optlen, &val, sizeof(val));
+        }
+        case USER_TCP_DELACK_MS:
+        {
+            int val = (socktype == USER_TCP_SOCK_LISTENER) ?
+                      listener->delack_ms : cur_stream->rcv->delack_ms;
+            return user_copy_optval(optval, optlen, &val, sizeof(val));
+        }
+        case USER_TCP_DELACK_SEGS:
+        {
+            int val = (socktype == USER_TCP_SOCK_LISTENER) ?
+                      listener->delack_segs : cur_stream->rcv->delack_segs;
+            return user_copy_optval(optval, optlen, &val, sizeof(val));
+        }
+        default:
+        {
+            errno = ENOPROTOOPT;
+            return -1;
+        }
+    }
+}
+
+int user_setsockopt(int sockid, int level, int optname, const void *optval, socklen_t optlen)
+{
+    user_tcp_manager *tcp = user_get_tcp_manager();
+    if (!tcp) return -1;
+
+    if (sockid < 0 || sockid >= tcp->smap_cnt)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    user_socket_map *socket = USER_SMAP(tcp, sockid);
+    if (socket->socktype == USER_TCP_SOCK_UNUSED)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    return user_tcp_setsockopt(socket->socktype, socket->stream, socket->listener,
+                               level, optname, optval, optlen);
+}
+
+int user_getsockopt(int sockid, int level, int optname, void *optval, socklen_t *optlen)
+{
+    user_tcp_manager *tcp = user_get_tcp_manager();
+    if (!tcp) return -1;
+
+    if (sockid < 0 || sockid >= tcp->smap_cnt)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    user_socket_map *socket = USER_SMAP(tcp, sockid);
+    if (socket->socktype == USER_TCP_SOCK_UNUSED)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    return user_tcp_getsockopt(socket->socktype, socket->stream, socket->listener,
+                               level, optname, optval, optlen);
+}
+
 #if 0
 int user_connect(int sockid, const struct sockaddr *addr, socklen_t addrlen)
 {
@@ -762,19 +1417,19 @@ int user_connect(int sockid, const struct sockaddr *addr, socklen_t addrlen)
         return -1;
     }
 
-    if (sockid < 0 || sockid >= USER_MAX_CONCURRENCY)
+    if (sockid < 0 || sockid >= tcp->smap_cnt)
     {
         errno = EBADF;
         return -1;
     }
 
-    if (tcp->smap[sockid].socktype != USER_TCP_SOCK_UNUSED)
+    if (USER_SMAP(tcp, sockid)->socktype != USER_TCP_SOCK_UNUSED)
     {
         errno = EINVAL;
         return -1;
     }
 
-    if (tcp->smap[sockid].socktype != USER_TCP_SOCK_STREAM)
+    if (USER_SMAP(tcp, sockid)->socktype != USER_TCP_SOCK_STREAM)
     {
         errno = ENOTSOCK;
         return -1;
@@ -794,7 +1449,7 @@ int user_connect(int sockid, const struct sockaddr *addr, socklen_t addrlen)
         return -1;
     }
 
-    user_socket_map *socket = &tcp->smap[sockid];
+    user_socket_map *socket = USER_SMAP(tcp, sockid);
     if (socket->stream)
     {
         printf("Socket %d: stream already exist!\n", sockid);
@@ -978,6 +1633,10 @@ int listen(int sockid, int backlog)
 
     listener->sockid = sockid;
     listener->backlog = backlog;
+    listener->cc_algo = TCP_DEFAULT_CC;
+    listener->delack_ms = TCP_DELACK_MS;
+    listener->delack_segs = TCP_DELACK_SEGS;
+    listener->syn_backlog = backlog > 0 ? backlog : USER_BACKLOG_SIZE;
     listener->s = s;
 
     if (pthread_cond_init(&listener->accept_cond, NULL))
@@ -1136,10 +1795,11 @@ ssize_t recv(int sockid, void *buf, size_t len, int flags)
         return -1;
     }
 
-    /* stream should be in ESTABLISHED, FIN_WAIT_1, FIN_WAIT_2, CLOSE_WAIT */
+    /* stream should be in ESTABLISHED, FIN_WAIT_1, FIN_WAIT_2, CLOSE_WAIT, or SYN_RCVD after fast open */
     user_tcp_stream *cur_stream = s->stream;
     if (!cur_stream ||
         !(cur_stream->state == USER_TCP_ESTABLISHED ||
+            cur_stream->state == USER_TCP_SYN_RCVD ||
             cur_stream->state == USER_TCP_CLOSE_WAIT ||
             cur_stream->state == USER_TCP_FIN_WAIT_1 ||
             cur_stream->state == USER_TCP_FIN_WAIT_2))
@@ -1175,7 +1835,8 @@ ssize_t recv(int sockid, void *buf, size_t len, int flags)
 
         while (!rcv->recvbuf || rcv->recvbuf->merged_len == 0)
         {
-            if (!cur_stream || cur_stream->state != USER_TCP_ESTABLISHED)
+            if (!cur_stream || (cur_stream->state != USER_TCP_ESTABLISHED &&
+                                cur_stream->state != USER_TCP_SYN_RCVD))
             {
                 pthread_mutex_unlock(&rcv->read_lock);
 
@@ -1264,10 +1925,11 @@ ssize_t send(int sockid, const void *buf, size_t len, int flags)
         errno = ENOTSOCK;
         return -1;
     }
-    /* stream should be in ESTABLISHED, FIN_WAIT_1, FIN_WAIT_2, CLOSE_WAIT */
+    /* stream should be in ESTABLISHED or CLOSE_WAIT, SYN_RCVD after fast open queues until established */
     user_tcp_stream *cur_stream = s->stream;
     if (!cur_stream ||
         !(cur_stream->state == USER_TCP_ESTABLISHED ||
+            cur_stream->state == USER_TCP_SYN_RCVD ||
             cur_stream->state == USER_TCP_CLOSE_WAIT))
     {
         errno = ENOTCONN;
@@ -1290,19 +1952,22 @@ ssize_t send(int sockid, const void *buf, size_t len, int flags)
     user_tcp_send *snd = cur_stream->snd;
 
     pthread_mutex_lock(&snd->write_lock);
+    snd->more = (flags & MSG_MORE) ? 1 : 0;
 
 #if USER_ENABLE_BLOCKING
     if (!(s->opts & USER_TCP_NONBLOCK))
     {
-        while (snd->snd_wnd <= 0)
+        while (!user_tcp_sndbuf_writable(cur_stream))
         {
-            if (!cur_stream || cur_stream->state != USER_TCP_ESTABLISHED)
+            if (!cur_stream || (cur_stream->state != USER_TCP_ESTABLISHED &&
+                                cur_stream->state != USER_TCP_SYN_RCVD))
             {
                 pthread_mutex_unlock(&snd->write_lock);
                 errno = EINTR;
                 return -1;
             }
 
+            snd->write_wait = 1;
             pthread_cond_wait(&snd->write_cond, &snd->write_lock);
         }
     }
@@ -1361,7 +2026,7 @@ int close(int sockid)
         return -1;
     }
 
-    //user_socket_map *socket = &tcp->smap[sockid];
+    //user_socket_map *socket = USER_SMAP(tcp, sockid);
     if (!tcp->fdtable) return -1;
 
     struct _user_socket *s = tcp->fdtable->sockfds[sockid];
@@ -1402,4 +2067,108 @@ int close(int sockid)
     return ret;
 }
 
-#endif
\ No newline at end of file
+int setsockopt(int sockid, int level, int optname, const void *optval, socklen_t optlen)
+{
+    user_tcp_manager *tcp = user_get_tcp_manager();
+    if (!tcp) return -1;
+
+    if (sockid < 0 || !tcp->fdtable)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    struct _user_socket *s = tcp->fdtable->sockfds[sockid];
+    if (s == NULL || s->socktype == USER_TCP_SOCK_UNUSED)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    return user_tcp_setsockopt(s->socktype, s->stream, s->listener,
+                               level, optname, optval, optlen);
+}
+
+int getsockopt(int sockid, int level, int optname, void *optval, socklen_t *optlen)
+{
+    user_tcp_manager *tcp = user_get_tcp_manager();
+    if (!tcp) return -1;
+
+    if (sockid < 0 || !tcp->fdtable)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    struct _user_socket *s = tcp->fdtable->sockfds[sockid];
+    if (s == NULL || s->socktype == USER_TCP_SOCK_UNUSED)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    return user_tcp_getsockopt(s->socktype, s->stream, s->listener,
+                               level, optname, optval, optlen);
+}
+
+#endif
+
+/* USER_MEM_* match the MEM_* backings of user_mempool */
+int user_tcp_mempages(int pages)
+{
+    if (user_mempool_set_backing(pages) < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int user_tcp_memlimits(uint64_t low, uint64_t pressure, uint64_t high)
+{
+    user_tcp_manager *tcp = user_get_tcp_manager();
+
+    if (!tcp || user_tcp_mem_set_limits(tcp, low, pressure, high) < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int user_tcp_bufidle(int seconds)
+{
+    user_tcp_manager *tcp = user_get_tcp_manager();
+
+    if (!tcp || seconds < 0 || seconds > TCP_KEEPALIVE_MAX)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    tcp->mem.buf_idle = seconds * HZ;
+    return 0;
+}
+
+void user_tcp_memstat(void)
+{
+    user_tcp_manager *tcp = user_get_tcp_manager();
+
+    user_mempool_dump();
+    user_slab_dump();
+
+    if (tcp)
+    {
+        printf("tcp memory: %lu of %lu/%lu/%lu bytes, state %d\n",
+               (unsigned long) tcp->mem.used, (unsigned long) tcp->mem.limit[0],
+               (unsigned long) tcp->mem.limit[1], (unsigned long) tcp->mem.limit[2], tcp->mem.state);
+        printf("pressure %u, critical %u, ofo pruned %lu bytes, syn cookied %u, syn dropped %u\n",
+               tcp->mem.pressure_cnt, tcp->mem.critical_cnt, (unsigned long) tcp->mem.ofo_pruned,
+               tcp->mem.syn_cookied, tcp->mem.syn_dropped);
+        printf("%u flows, %lu bytes each, buffers released %lu\n",
+               tcp->flow_cnt, (unsigned long) (tcp->flow_cnt ? tcp->mem.used / tcp->flow_cnt : 0),
+               (unsigned long) tcp->mem.buf_released);
+        printf("out-of-order ranges %u of %u, %lu bytes dropped for the limits\n",
+               tcp->rbm_rcv->frag_cnt, tcp->rbm_rcv->frag_total_max,
+               (unsigned long) tcp->rbm_rcv->frag_dropped);
+    }
+}
@@ -2,6 +2,7 @@
 #include "user_tcp.h"
 #include "user_nic.h"
 #include "user_arp.h"
+#include "user_slab.h"
 
 #include <pthread.h>
 
@@ -144,7 +145,7 @@ int user_arp_process_reply(struct arphdr *arph)
         if (ent->ip == arph->sip)
         {
             TAILQ_REMOVE(&global_arp_manager.list, ent, arp_link);
-            free(ent);
+            user_slab_free(ent, sizeof(user_arp_queue_entry));
             break;
         }
     }
@@ -264,7 +265,12 @@ void user_arp_request(user_tcp_manager *tcp, uint32_t ip, int nif, uint32_t cur_
         }
     }
 
-    ent = (user_arp_queue_entry *) calloc(1, sizeof(user_arp_queue_entry));
+    ent = (user_arp_queue_entry *) user_slab_zalloc(sizeof(user_arp_queue_entry));
+    if (!ent)
+    {
+        pthread_mutex_unlock(&global_arp_manager.lock);
+        return;
+    }
     ent->ip = ip;
     ent->nif_out = nif;
     ent->ts_out = cur_ts;
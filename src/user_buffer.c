@@ -1,8 +1,203 @@
 #include "user_buffer.h"
+#include "user_slab.h"
 
-user_sb_manager *user_sbmanager_create(size_t chunk_size, uint32_t cnum)
+/*----------------------------------------------------------------------------*/
+/* segment chains of the send side */
+
+static int BufSegAppend(user_mempool *mp, user_buf_seg **head, user_buf_seg **tail, uint32_t *nsegs)
+{
+    user_buf_seg *seg = user_mempool_alloc(mp);
+
+    if (!seg)
+        return -1;
+
+    seg->next = NULL;
+    if (*tail)
+        (*tail)->next = seg;
+    else
+        *head = seg;
+    *tail = seg;
+    (*nsegs)++;
+
+    return 0;
+}
+
+static void BufSegFreeAll(user_mempool *mp, user_buf_seg *seg)
+{
+    user_buf_seg *next;
+
+    for (; seg != NULL; seg = next)
+    {
+        next = seg->next;
+        user_mempool_free(mp, seg);
+    }
+}
+
+/*
+ * the segment holding byte off, counted from the start of the chain, and
+ * off within it. the hint is the segment last looked up, so a walk
+ * over the chain only happens when going back.
+ */
+static user_buf_seg *BufSegFind(user_buf_seg *head, user_buf_seg **hint, uint32_t *hint_off, uint32_t *off)
+{
+    user_buf_seg *seg = head;
+    uint32_t start = 0;
+
+    if (*hint && *hint_off <= *off)
+    {
+        seg = *hint;
+        start = *hint_off;
+    }
+
+    while (*off - start >= USER_BUF_SEG_SIZE)
+    {
+        seg = seg->next;
+        start += USER_BUF_SEG_SIZE;
+    }
+
+    *hint = seg;
+    *hint_off = start;
+    *off -= start;
+
+    return seg;
+}
+
+/* drops the segments before byte off of the chain, returns off in the new head */
+static uint32_t BufSegConsume(user_mempool *mp, user_buf_seg **head, uint32_t *nsegs,
+                              user_buf_seg **hint, uint32_t *hint_off, uint32_t off)
+{
+    user_buf_seg *seg;
+    uint32_t dropped = 0;
+
+    while (off >= USER_BUF_SEG_SIZE && (*head)->next)
+    {
+        seg = *head;
+        *head = seg->next;
+        user_mempool_free(mp, seg);
+        (*nsegs)--;
+        off -= USER_BUF_SEG_SIZE;
+        dropped += USER_BUF_SEG_SIZE;
+    }
+
+    if (*hint_off < dropped)
+    {
+        *hint = NULL;
+        *hint_off = 0;
+    }
+    else
+    {
+        *hint_off -= dropped;
+    }
+
+    return off;
+}
+
+/*----------------------------------------------------------------------------*/
+/* receive segments, by position from seg_seq on */
+
+#define RB_SEG_SLOT(buff, k)    ((buff)->segs[((buff)->seg_first + (k)) & ((buff)->seg_slots - 1)])
+
+/* at least need slots, the ring is unrolled from seg_first into the new one */
+static int RBSegGrow(user_ring_buffer *buff, uint32_t need)
+{
+    user_buf_seg **segs;
+    uint32_t slots = buff->seg_slots ? buff->seg_slots : 4;
+    uint32_t k;
+
+    while (slots < need)
+    {
+        slots <<= 1;
+    }
+
+    segs = user_slab_zalloc(slots * sizeof(user_buf_seg *));
+    if (!segs)
+        return -1;
+
+    for (k = 0; k < buff->seg_slots; k++)
+    {
+        segs[k] = RB_SEG_SLOT(buff, k);
+    }
+    if (buff->segs)
+        user_slab_free(buff->segs, buff->seg_slots * sizeof(user_buf_seg *));
+
+    buff->segs = segs;
+    buff->seg_first = 0;
+    buff->seg_slots = slots;
+
+    return 0;
+}
+
+/*
+ * the segment seq lies in, allocated if nothing arrived there yet. the
+ * slots are anchored at head_seq whenever the buffer holds no segment.
+ */
+static user_buf_seg *RBSegGet(user_mempool *mp, user_ring_buffer *buff, uint32_t seq)
+{
+    user_buf_seg **slot;
+    uint32_t k;
+
+    if (buff->nsegs == 0)
+    {
+        buff->seg_seq = buff->head_seq;
+        buff->seg_first = 0;
+    }
+
+    k = (seq - buff->seg_seq) >> USER_BUF_SEG_SHIFT;
+    if (k >= buff->seg_slots && RBSegGrow(buff, k + 1) < 0)
+        return NULL;
+
+    slot = &RB_SEG_SLOT(buff, k);
+    if (!*slot)
+    {
+        *slot = user_mempool_alloc(mp);
+        if (!*slot)
+            return NULL;
+        buff->nsegs++;
+    }
+
+    return *slot;
+}
+
+/* frees the segments from end_seq on, nothing there is kept any more */
+static void RBSegTrim(user_mempool *mp, user_ring_buffer *buff, uint32_t end_seq)
+{
+    user_buf_seg **slot;
+    uint32_t k;
+
+    k = (end_seq - buff->seg_seq + USER_BUF_SEG_SIZE - 1) >> USER_BUF_SEG_SHIFT;
+    for (; k < buff->seg_slots && buff->nsegs > 0; k++)
+    {
+        slot = &RB_SEG_SLOT(buff, k);
+        if (*slot)
+        {
+            user_mempool_free(mp, *slot);
+            *slot = NULL;
+            buff->nsegs--;
+        }
+    }
+}
+
+/* frees the segments and the slots, returns the bytes they took */
+static int RBSegFreeAll(user_mempool *mp, user_ring_buffer *buff)
+{
+    int bytes = buff->nsegs * sizeof(user_buf_seg) + buff->seg_slots * sizeof(user_buf_seg *);
+
+    if (buff->segs)
+    {
+        RBSegTrim(mp, buff, buff->seg_seq);
+        user_slab_free(buff->segs, buff->seg_slots * sizeof(user_buf_seg *));
+    }
+    buff->segs = NULL;
+    buff->seg_slots = 0;
+
+    return bytes;
+}
+
+/*----------------------------------------------------------------------------*/
+user_sb_manager *user_sbmanager_create(size_t chunk_size, size_t max_size, uint32_t cnum)
 {
     user_sb_manager *sbm = (user_sb_manager *) calloc(1, sizeof(user_sb_manager));
+
     if (!sbm)
     {
         printf("SBManagerCreate() failed. %s\n", strerror(errno));
@@ -10,20 +205,17 @@ user_sb_manager *user_sbmanager_create(size_t chunk_size, uint32_t cnum)
     }
 
     sbm->chunk_size = chunk_size;
+    sbm->max_size = max_size;
     sbm->cnum = cnum;
-    sbm->mp = (struct _user_mempool *) user_mempool_create(chunk_size, (uint64_t) chunk_size * cnum, 0);
-    if (!sbm->mp)
-    {
-        printf("Failed to create mem pool for sb.\n");
-        free(sbm);
-        return NULL;
-    }
 
-    sbm->freeq = CreateSBQueue(cnum);
-    if (!sbm->freeq)
+    /* enough for every buffer at its initial size, the pool grows past it */
+    sbm->seg_mp = user_mempool_create(sizeof(user_buf_seg),
+                                      (uint64_t) sizeof(user_buf_seg) *
+                                      ((chunk_size + USER_BUF_SEG_SIZE - 1) / USER_BUF_SEG_SIZE) * cnum,
+                                      MEM_DEFAULT);
+    if (!sbm->seg_mp)
     {
-        printf("Failed to create free buffer queue.\n");
-        user_mempool_destory(sbm->mp);
+        printf("Failed to create segment pool for sb.\n");
         free(sbm);
         return NULL;
     }
@@ -35,33 +227,16 @@ user_send_buffer *SBInit(user_sb_manager *sbm, uint32_t init_seq)
 {
     user_send_buffer *buf;
 
-    /* first try dequeue from free buffer queue */
-    buf = SBDequeue(sbm->freeq);
+    buf = (user_send_buffer *) user_slab_zalloc(sizeof(user_send_buffer));
     if (!buf)
     {
-        buf = (user_send_buffer *) malloc(sizeof(user_send_buffer));
-        if (!buf)
-        {
-            perror("malloc() for buf");
-            return NULL;
-        }
-        buf->data = user_mempool_alloc(sbm->mp);
-        if (!buf->data)
-        {
-            printf("Failed to fetch memory chunk for data.\n");
-            free(buf);
-            return NULL;
-        }
-        sbm->cur_num++;
+        perror("user_slab_zalloc() for buf");
+        return NULL;
     }
 
-    buf->head = buf->data;
-
-    buf->head_off = buf->tail_off = 0;
-    buf->len = buf->cum_len = 0;
     buf->size = sbm->chunk_size;
-
     buf->init_seq = buf->head_seq = init_seq;
+    sbm->cur_num++;
 
     return buf;
 }
@@ -71,12 +246,46 @@ void SBFree(user_sb_manager *sbm, user_send_buffer *buf)
     if (!buf)
         return;
 
-    SBEnqueue(sbm->freeq, buf);
+    BufSegFreeAll(sbm->seg_mp, buf->head);
+    sbm->cur_num--;
+    user_slab_free(buf, sizeof(user_send_buffer));
 }
 
+/* segments are linked as data comes, growing only raises the limit. returns the new size or 0 */
+int SBResize(user_sb_manager *sbm, user_send_buffer *buf, uint32_t size)
+{
+    if (buf->size >= size)
+        return 0;
+
+    buf->size = MIN(size, sbm->max_size);
+    return buf->size;
+}
+
+/*
+ * an empty buffer keeps its last segment for the next write, an idle
+ * stream gives that back too. returns the bytes released.
+ */
+int SBRelease(user_sb_manager *sbm, user_send_buffer *buf)
+{
+    int bytes;
+
+    if (!buf->head || buf->len > 0)
+        return 0;
+
+    bytes = buf->nsegs * sizeof(user_buf_seg);
+    BufSegFreeAll(sbm->seg_mp, buf->head);
+
+    buf->head = buf->tail = buf->hint = NULL;
+    buf->head_off = buf->tail_off = buf->hint_off = 0;
+    buf->nsegs = 0;
+
+    return bytes;
+}
+
+/* appends what fits below size, as far as segments are to be had */
 size_t SBPut(user_sb_manager *sbm, user_send_buffer *buf, const void *data, size_t len)
 {
-    size_t to_put;
+    size_t to_put, put = 0, n;
 
     if (len <= 0)
         return 0;
@@ -88,25 +297,24 @@ size_t SBPut(user_sb_manager *sbm, user_send_buffer *buf, const void *data, size
         return -2;
     }
 
-    if (buf->tail_off + to_put < buf->size)
+    while (put < to_put)
     {
-        /* if the data fit into the buffer, copy it */
-        memcpy(buf->data + buf->tail_off, data, to_put);
-        buf->tail_off += to_put;
-    }
-    else
-    {
-        /* if buffer overflows, move the existing payload and merge */
-        memmove(buf->data, buf->head, buf->len);
-        buf->head = buf->data;
-        buf->head_off = 0;
-        memcpy(buf->head + buf->len, data, to_put);
-        buf->tail_off = buf->len + to_put;
+        if (!buf->tail || buf->tail_off == USER_BUF_SEG_SIZE)
+        {
+            if (BufSegAppend(sbm->seg_mp, &buf->head, &buf->tail, &buf->nsegs) < 0)
+                break;
+            buf->tail_off = 0;
+        }
+
+        n = MIN(to_put - put, (size_t) (USER_BUF_SEG_SIZE - buf->tail_off));
+        memcpy(buf->tail->data + buf->tail_off, (const u_char *) data + put, n);
+        buf->tail_off += n;
+        put += n;
     }
-    buf->len += to_put;
-    buf->cum_len += to_put;
+    buf->len += put;
+    buf->cum_len += put;
 
-    return to_put;
+    return put;
 }
 
 size_t SBRemove(user_sb_manager *sbm, user_send_buffer *buf, size_t len)
@@ -122,92 +330,38 @@ size_t SBRemove(user_sb_manager *sbm, user_send_buffer *buf, size_t len)
         return -2;
     }
 
-    buf->head_off += to_remove;
-    buf->head = buf->data + buf->head_off;
     buf->head_seq += to_remove;
     buf->len -= to_remove;
+    buf->head_off = BufSegConsume(sbm->seg_mp, &buf->head, &buf->nsegs,
+                                  &buf->hint, &buf->hint_off, buf->head_off + to_remove);
 
-    /* if buffer is empty, move the head to 0 */
-    if (buf->len == 0 && buf->head_off > 0)
+    /* if buffer is empty, start over at the front of the segment left */
+    if (buf->len == 0)
     {
-        buf->head = buf->data;
         buf->head_off = buf->tail_off = 0;
+        buf->hint = NULL;
+        buf->hint_off = 0;
     }
 
     return to_remove;
 }
 
-/*** ******************************** sb queue ******************************** ***/
-user_sb_queue *CreateSBQueue(int capacity)
-{
-    user_sb_queue *sq;
-
-    sq = (user_sb_queue *) calloc(1, sizeof(user_sb_queue));
-    if (!sq)
-        return NULL;
-
-    sq->_q = (user_send_buffer **)
-            calloc(capacity + 1, sizeof(user_send_buffer * ));
-    if (!sq->_q)
-    {
-        free(sq);
-        return NULL;
-    }
-
-    sq->_capacity = capacity;
-    sq->_head = sq->_tail = 0;
-
-    return sq;
-}
-
-void DestroySBQueue(user_sb_queue *sq)
+/* copies len bytes from seq on, they have to be in the buffer. called with write_lock held */
+void SBCopy(user_send_buffer *buf, uint32_t seq, void *dst, uint32_t len)
 {
-    if (!sq)
-        return;
+    uint32_t off = buf->head_off + (seq - buf->head_seq);
+    user_buf_seg *seg = BufSegFind(buf->head, &buf->hint, &buf->hint_off, &off);
+    uint32_t n;
 
-    if (sq->_q)
+    while (len > 0)
     {
-        free((void *) sq->_q);
-        sq->_q = NULL;
+        n = MIN(len, USER_BUF_SEG_SIZE - off);
+        memcpy(dst, seg->data + off, n);
+        dst = (u_char *) dst + n;
+        len -= n;
+        seg = seg->next;
+        off = 0;
     }
-
-    free(sq);
-}
-
-int SBEnqueue(user_sb_queue *sq, user_send_buffer *buf)
-{
-    index_type h = sq->_head;
-    index_type t = sq->_tail;
-    index_type nt = NextIndex(sq, t);
-
-    if (nt != h)
-    {
-        sq->_q[t] = buf;
-        MemoryBarrier(sq->_q[t], sq->_tail);
-        sq->_tail = nt;
-        return 0;
-    }
-
-    printf("Exceed capacity of buf queue!\n");
-    return -1;
-}
-
-user_send_buffer *SBDequeue(user_sb_queue *sq)
-{
-    index_type h = sq->_head;
-    index_type t = sq->_tail;
-
-    if (h != t)
-    {
-        user_send_buffer *buf = sq->_q[h];
-        MemoryBarrier(sq->_q[h], sq->_head);
-        sq->_head = NextIndex(sq, h);
-        assert(buf);
-
-        return buf;
-    }
-
-    return NULL;
 }
 
 user_rb_frag_queue *CreateRBFragQueue(int capacity)
@@ -287,34 +441,30 @@ struct _user_fragment_ctx * RBFragDequeue(user_rb_frag_queue *rb_fragq)
 
 void RBPrintInfo(user_ring_buffer *buff)
 {
-    printf("buff_data %p, buff_size %d, buff_mlen %d, "
-           "buff_clen %lu, buff_head %p (%d), buff_tail (%d)\n",
-           buff->data, buff->size, buff->merged_len, buff->cum_len,
-           buff->head, buff->head_offset, buff->tail_offset);
-}
-
-void RBPrintStr(user_ring_buffer *buff)
-{
-    RBPrintInfo(buff);
-    printf("%s\n", buff->head);
+    printf("buff_size %d, buff_mlen %d, buff_llen %d, "
+           "buff_clen %lu, buff_segs %u (%u) of %u slots\n",
+           buff->size, buff->merged_len, buff->last_len, buff->cum_len,
+           buff->nsegs, buff->head_seq - buff->seg_seq, buff->seg_slots);
 }
 
 void RBPrintHex(user_ring_buffer *buff)
 {
+    uint32_t off = buff->head_seq - buff->seg_seq;
     int i;
 
     RBPrintInfo(buff);
 
-    for (i = 0; i < buff->merged_len; i++)
+    for (i = 0; i < buff->merged_len; i++, off++)
     {
         if (i != 0 && i % 16 == 0)
             printf("\n");
-        printf("%0x ", *((unsigned char *) buff->head + i));
+        printf("%0x ", RB_SEG_SLOT(buff, off >> USER_BUF_SEG_SHIFT)->data[off & (USER_BUF_SEG_SIZE - 1)]);
     }
     printf("\n");
 }
 
-user_rb_manager * RBManagerCreate(size_t chunk_size, uint32_t cnum)
+user_rb_manager * RBManagerCreate(size_t chunk_size, size_t max_size, uint32_t cnum,
+                                  uint32_t frag_max, uint32_t frag_total_max)
 {
     user_rb_manager *rbm = (user_rb_manager *) calloc(1, sizeof(user_rb_manager));
 
@@ -325,21 +475,29 @@ user_rb_manager * RBManagerCreate(size_t chunk_size, uint32_t cnum)
     }
 
     rbm->chunk_size = chunk_size;
+    rbm->max_size = max_size;
     rbm->cnum = cnum;
-    rbm->mp = (user_mempool *) user_mempool_create(chunk_size, (uint64_t) chunk_size * cnum, 0);
-    if (!rbm->mp)
+    rbm->frag_max = frag_max;
+    rbm->frag_total_max = frag_total_max;
+
+    /* as for the send side, every flow at its initial size and room to grow */
+    rbm->seg_mp = user_mempool_create(sizeof(user_buf_seg),
+                                      (uint64_t) sizeof(user_buf_seg) *
+                                      ((chunk_size + USER_BUF_SEG_SIZE - 1) / USER_BUF_SEG_SIZE) * cnum,
+                                      MEM_DEFAULT);
+    if (!rbm->seg_mp)
     {
-        printf("Failed to allocate mp pool.\n");
+        printf("Failed to allocate segment pool.\n");
         free(rbm);
         return NULL;
     }
 
     rbm->frag_mp = (user_mempool *) user_mempool_create(sizeof(user_fragment_ctx),
-                                                        sizeof(user_fragment_ctx) * cnum, 0);
+                                                        sizeof(user_fragment_ctx) * cnum, MEM_DEFAULT);
     if (!rbm->frag_mp)
     {
         printf("Failed to allocate frag_mp pool.\n");
-        user_mempool_destory(rbm->mp);
+        user_mempool_destory(rbm->seg_mp);
         free(rbm);
         return NULL;
     }
@@ -348,7 +506,7 @@ user_rb_manager * RBManagerCreate(size_t chunk_size, uint32_t cnum)
     if (!rbm->free_fragq)
     {
         printf("Failed to create free fragment queue.\n");
-        user_mempool_destory(rbm->mp);
+        user_mempool_destory(rbm->seg_mp);
         user_mempool_destory(rbm->frag_mp);
         free(rbm);
         return NULL;
@@ -357,7 +515,7 @@ user_rb_manager * RBManagerCreate(size_t chunk_size, uint32_t cnum)
     if (!rbm->free_fragq_int)
     {
         printf("Failed to create internal free fragment queue.\n");
-        user_mempool_destory(rbm->mp);
+        user_mempool_destory(rbm->seg_mp);
         user_mempool_destory(rbm->frag_mp);
         DestroyRBFragQueue(rbm->free_fragq);
         free(rbm);
@@ -367,10 +525,21 @@ user_rb_manager * RBManagerCreate(size_t chunk_size, uint32_t cnum)
     return rbm;
 }
 
+static inline int FragCmp(const user_fragment_ctx *a, const user_fragment_ctx *b)
+{
+    /* the ranges of a buffer lie within its size, far less than half the sequence space */
+    int32_t diff = (int32_t) (a->seq - b->seq);
+
+    return diff < 0 ? -1 : diff > 0;
+}
+
+RB_GENERATE_STATIC(_user_frag_tree, _user_fragment_ctx, link, FragCmp)
+
 static inline void FreeFragmentContextSingle(user_rb_manager *rbm, user_fragment_ctx *frag)
 {
+    __atomic_fetch_sub(&rbm->frag_cnt, 1, __ATOMIC_RELAXED);
     if (frag->is_calloc)
-        free(frag);
+        user_slab_free(frag, sizeof(user_fragment_ctx));
     else
         user_mempool_free(rbm->frag_mp, frag);
 }
@@ -394,6 +563,7 @@ void FreeFragmentContext(user_rb_manager *rbm, user_fragment_ctx *fctx)
 static user_fragment_ctx *AllocateFragmentContext(user_rb_manager *rbm)
 {
     user_fragment_ctx *frag;
+    int is_calloc = 0;
 
     frag = RBFragDequeue(rbm->free_fragq);
     if (!frag)
@@ -405,24 +575,36 @@ static user_fragment_ctx *AllocateFragmentContext(user_rb_manager *rbm)
             frag = user_mempool_alloc(rbm->frag_mp);
             if (!frag)
             {
-                printf("fragments depleted, fall back to calloc\n");
-                frag = calloc(1, sizeof(user_fragment_ctx));
+                printf("fragments depleted, fall back to the slab allocator\n");
+                frag = user_slab_alloc(sizeof(user_fragment_ctx));
                 if (frag == NULL)
                 {
-                    printf("calloc failed\n");
+                    printf("user_slab_alloc failed\n");
                     exit(-1);
                 }
-                frag->is_calloc = 1; /* mark it as allocated by calloc */
+                is_calloc = 1; /* mark it as allocated by user_slab_alloc */
             }
         }
+        else
+        {
+            is_calloc = frag->is_calloc;
+        }
     }
+    else
+    {
+        is_calloc = frag->is_calloc;
+    }
+
+    /* the flag outlives the memset, FreeFragmentContextSingle returns the frag where it came from */
     memset(frag, 0, sizeof(*frag));
+    frag->is_calloc = is_calloc;
+    __atomic_fetch_add(&rbm->frag_cnt, 1, __ATOMIC_RELAXED);
     return frag;
 }
 
 user_ring_buffer * RBInit(user_rb_manager *rbm, uint32_t init_seq)
 {
-    user_ring_buffer *buff = (user_ring_buffer *) calloc(1, sizeof(user_ring_buffer));
+    user_ring_buffer *buff = (user_ring_buffer *) user_slab_zalloc(sizeof(user_ring_buffer));
 
     if (buff == NULL)
     {
@@ -430,17 +612,8 @@ user_ring_buffer * RBInit(user_rb_manager *rbm, uint32_t init_seq)
         return NULL;
     }
 
-    buff->data = user_mempool_alloc(rbm->mp);
-    if (!buff->data)
-    {
-        perror("rb_init MPAllocateChunk");
-        free(buff);
-        return NULL;
-    }
-
-    //memset(buff->data, 0, rbm->chunk_size);
+    /* segments are linked by RBPut as data arrives */
     buff->size = rbm->chunk_size;
-    buff->head = buff->data;
     buff->head_seq = init_seq;
     buff->init_seq = init_seq;
     rbm->cur_num++;
@@ -454,16 +627,39 @@ void RBFree(user_rb_manager *rbm, user_ring_buffer *buff)
     {
         FreeFragmentContext(rbm, buff->fctx);
         buff->fctx = NULL;
+        RB_INIT(&buff->frags);
+        buff->nfrags = 0;
     }
 
-    if (buff->data)
-    {
-        user_mempool_free(rbm->mp, buff->data);
-    }
+    RBSegFreeAll(rbm->seg_mp, buff);
 
     rbm->cur_num--;
 
-    free(buff);
+    user_slab_free(buff, sizeof(user_ring_buffer));
+}
+
+/* as SBRelease, the buffer must hold no data in or out of order */
+int RBRelease(user_rb_manager *rbm, user_ring_buffer *buff)
+{
+    int bytes;
+
+    if (!buff->segs || buff->merged_len > 0 || buff->fctx)
+        return 0;
+
+    bytes = RBSegFreeAll(rbm->seg_mp, buff);
+    buff->last_len = 0;
+
+    return bytes;
+}
+
+/* only raises the limit, returns the new size or 0 */
+int RBResize(user_rb_manager *rbm, user_ring_buffer *buff, uint32_t size)
+{
+    if ((uint32_t) buff->size >= size)
+        return 0;
+
+    buff->size = MIN(size, rbm->max_size);
+    return buff->size;
 }
 
 #define MAXSEQ               ((uint32_t)(0xFFFFFFFF))
@@ -488,37 +684,37 @@ static inline uint32_t GetMaxSeq(uint32_t a, uint32_t b)
     return ((a - b) <= MAXSEQ / 2) ? a : b;
 }
 
-/*----------------------------------------------------------------------------*/
-static inline int CanMerge(const user_fragment_ctx *a, const user_fragment_ctx *b)
+/* unlinks and frees the highest range, and the segments only it was using */
+static uint32_t RBDropLast(user_rb_manager *rbm, user_ring_buffer *buff)
 {
-    uint32_t a_end = a->seq + a->len + 1;
-    uint32_t b_end = b->seq + b->len + 1;
+    user_fragment_ctx *last = RB_MAX(_user_frag_tree, &buff->frags);
+    user_fragment_ctx *prev = RB_PREV(_user_frag_tree, &buff->frags, last);
+    uint32_t len = last->len;
 
-    if (GetMinSeq(a_end, b->seq) == a_end ||
-        GetMinSeq(b_end, a->seq) == b_end)
-        return 0;
-    return (1);
-}
+    RB_REMOVE(_user_frag_tree, &buff->frags, last);
+    if (prev)
+        prev->next = NULL;
+    else
+        buff->fctx = NULL;
+    buff->nfrags--;
+    FreeFragmentContextSingle(rbm, last);
 
-static inline void MergeFragments(user_fragment_ctx *a, user_fragment_ctx *b)
-{
-    /* merge a into b */
-    uint32_t min_seq, max_seq;
+    buff->last_len = prev ? (int) (prev->seq + prev->len - buff->head_seq) : buff->merged_len;
+    RBSegTrim(rbm->seg_mp, buff, buff->head_seq + buff->last_len);
+    rbm->frag_dropped += len;
 
-    min_seq = GetMinSeq(a->seq, b->seq);
-    max_seq = GetMaxSeq(a->seq + a->len, b->seq + b->len);
-    b->seq = min_seq;
-    b->len = max_seq - min_seq;
+    return len;
 }
 
 int RBPut(user_rb_manager *rbm, user_ring_buffer *buff,
           void *data, uint32_t len, uint32_t cur_seq)
 {
     int putx, end_off;
-    user_fragment_ctx *new_ctx;
-    user_fragment_ctx *iter;
-    user_fragment_ctx *prev, *pprev;
-    int merged = 0;
+    user_fragment_ctx key;
+    user_fragment_ctx *frag, *prev, *next;
+    user_buf_seg *seg;
+    uint32_t end_seq = cur_seq + len;
+    uint32_t seq, off, put, n;
 
     if (len <= 0)
         return 0;
@@ -534,87 +730,93 @@ int RBPut(user_rb_manager *rbm, user_ring_buffer *buff,
         return -2;
     }
 
-    // if buffer is at tail, move the data to the first of head
-    if ((uint32_t) buff->size <= (buff->head_offset + (uint32_t) end_off))
-    {
-        memmove(buff->data, buff->head, buff->last_len);
-        buff->tail_offset -= buff->head_offset;
-        buff->head_offset = 0;
-        buff->head = buff->data;
-    }
-
-    //copy data to buffer
-    memcpy(buff->head + putx, data, len);
+    // the range starting at or before the data, and the one after it
+    key.seq = cur_seq;
+    frag = RB_NFIND(_user_frag_tree, &buff->frags, &key);
+    if (frag && frag->seq == cur_seq)
+        prev = frag;
+    else if (frag)
+        prev = RB_PREV(_user_frag_tree, &buff->frags, frag);
+    else
+        prev = RB_MAX(_user_frag_tree, &buff->frags);
+    next = prev ? prev->next : buff->fctx;
 
-    if (buff->tail_offset < buff->head_offset + end_off)
-        buff->tail_offset = buff->head_offset + end_off;
-    buff->last_len = buff->tail_offset - buff->head_offset;
+    if (prev && GetMaxSeq(prev->seq + prev->len, cur_seq) == prev->seq + prev->len)
+        frag = prev;
+    else if (next && GetMinSeq(next->seq, end_seq) == next->seq)
+        frag = next;
+    else
+        frag = NULL;
 
-    // create fragmentation context blocks
-    new_ctx = AllocateFragmentContext(rbm);
-    if (!new_ctx)
+    // a range of its own, within the limits
+    while (!frag && cur_seq != buff->head_seq &&
+           (buff->nfrags >= rbm->frag_max || rbm->frag_cnt >= rbm->frag_total_max))
     {
-        perror("allocating new_ctx failed");
-        return 0;
+        if (!next)
+        {
+            rbm->frag_dropped += len;
+            return -4;
+        }
+        if (RB_MAX(_user_frag_tree, &buff->frags) == next)
+            next = NULL;
+        RBDropLast(rbm, buff);
     }
-    new_ctx->seq = cur_seq;
-    new_ctx->len = len;
-    new_ctx->next = NULL;
 
-    // traverse the fragment list, and merge the new fragment if possible
-    for (iter = buff->fctx, prev = NULL, pprev = NULL;
-         iter != NULL;
-         pprev = prev, prev = iter, iter = iter->next)
+    // copy data to the segments it lies in, only those are linked
+    for (put = 0; put < len; put += n)
     {
+        seq = cur_seq + put;
+        seg = RBSegGet(rbm->seg_mp, buff, seq);
+        if (!seg)
+            return -1;
+
+        off = (seq - buff->seg_seq) & (USER_BUF_SEG_SIZE - 1);
+        n = MIN(len - put, USER_BUF_SEG_SIZE - off);
+        memcpy(seg->data + off, (u_char *) data + put, n);
+    }
 
-        if (CanMerge(new_ctx, iter))
-        {
-            /* merge the first fragment into the second fragment */
-            MergeFragments(new_ctx, iter);
+    if (buff->last_len < end_off)
+        buff->last_len = end_off;
 
-            /* remove the first fragment */
-            if (prev == new_ctx)
-            {
-                if (pprev)
-                    pprev->next = iter;
-                else
-                    buff->fctx = iter;
-                prev = pprev;
-            }
-            FreeFragmentContextSingle(rbm, new_ctx);
-            new_ctx = iter;
-            merged = 1;
-        }
-        else if (merged ||
-                   GetMaxSeq(cur_seq + len, iter->seq) == iter->seq)
+    if (!frag)
+    {
+        frag = AllocateFragmentContext(rbm);
+        if (!frag)
         {
-            /* merged at some point, but no more mergeable
-               then stop it now */
-            break;
+            perror("allocating new_ctx failed");
+            return 0;
         }
+        frag->seq = cur_seq;
+        frag->len = len;
+        frag->next = next;
+        if (prev)
+            prev->next = frag;
+        else
+            buff->fctx = frag;
+        RB_INSERT(_user_frag_tree, &buff->frags, frag);
+        buff->nfrags++;
     }
+    else if (frag == next && frag->seq != cur_seq)
+    {
+        /* grows downwards, it stays between the same neighbours in the tree */
+        frag->len += frag->seq - cur_seq;
+        frag->seq = cur_seq;
+    }
+
+    if (GetMaxSeq(frag->seq + frag->len, end_seq) == end_seq)
+        frag->len = end_seq - frag->seq;
 
-    if (!merged)
+    // swallow the ranges the grown one reaches now
+    while ((next = frag->next) != NULL &&
+           GetMinSeq(next->seq, frag->seq + frag->len) == next->seq)
     {
-        if (buff->fctx == NULL)
-        {
-            buff->fctx = new_ctx;
-        }
-        else if (GetMinSeq(cur_seq, buff->fctx->seq) == cur_seq)
-        {
-            /* if the new packet's seqnum is before the existing fragments */
-            new_ctx->next = buff->fctx;
-            buff->fctx = new_ctx;
-        }
-        else
-        {
-            /* if the seqnum is in-between the fragments or
-               at the last */
-            assert(GetMinSeq(cur_seq, prev->seq + prev->len) ==
-                   prev->seq + prev->len);
-            prev->next = new_ctx;
-            new_ctx->next = iter;
-        }
+        if (GetMaxSeq(frag->seq + frag->len, next->seq + next->len) != frag->seq + frag->len)
+            frag->len = next->seq + next->len - frag->seq;
+
+        frag->next = next->next;
+        RB_REMOVE(_user_frag_tree, &buff->frags, next);
+        buff->nfrags--;
+        FreeFragmentContextSingle(rbm, next);
     }
 
     if (buff->head_seq == buff->fctx->seq)
@@ -626,39 +828,98 @@ int RBPut(user_rb_manager *rbm, user_ring_buffer *buff,
     return len;
 }
 
+/* drops the fragments past the in-order part and returns their bytes, the space is reused */
+uint32_t RBPruneOfo(user_rb_manager *rbm, user_ring_buffer *buff)
+{
+    user_fragment_ctx *keep = NULL;
+    user_fragment_ctx *frag = buff->fctx;
+    user_fragment_ctx *iter;
+    uint32_t pruned = 0;
+
+    if (frag && frag->seq == buff->head_seq)
+    {
+        keep = frag;
+        frag = frag->next;
+        keep->next = NULL;
+    }
+
+    for (iter = frag; iter != NULL; iter = iter->next)
+    {
+        pruned += iter->len;
+    }
+    if (frag)
+    {
+        FreeFragmentContext(rbm, frag);
+    }
+
+    buff->fctx = keep;
+    RB_INIT(&buff->frags);
+    buff->nfrags = 0;
+    if (keep)
+    {
+        RB_INSERT(_user_frag_tree, &buff->frags, keep);
+        buff->nfrags = 1;
+    }
+    buff->last_len = buff->merged_len;
+    RBSegTrim(rbm->seg_mp, buff, buff->head_seq + buff->merged_len);
+
+    return pruned;
+}
+
 /*----------------------------------------------------------------------------*/
 size_t RBRemove(user_rb_manager *rbm, user_ring_buffer *buff, size_t len, int option)
 {
     /* this function should be called only in application thread */
+    user_buf_seg **slot;
 
     if (buff->merged_len < (int) len)
         len = buff->merged_len;
 
     if (len == 0)
         return 0;
-#if 0
-    buff->head_offset += len;
-#else
-    buff->head_offset = len;
-#endif
-    buff->head = buff->data + buff->head_offset;
     buff->head_seq += len;
 
     buff->merged_len -= len;
     buff->last_len -= len;
 
+    if (buff->last_len == 0)
+    {
+        /* nothing further in the buffer, one segment is kept to take data from its front */
+        RBSegTrim(rbm->seg_mp, buff, buff->seg_seq + 1);
+        buff->seg_seq = buff->head_seq;
+    }
+    else
+    {
+        while (buff->nsegs > 0 &&
+               (int32_t) (buff->seg_seq + USER_BUF_SEG_SIZE - buff->head_seq) <= 0)
+        {
+            slot = &RB_SEG_SLOT(buff, 0);
+            if (*slot)
+            {
+                user_mempool_free(rbm->seg_mp, *slot);
+                *slot = NULL;
+                buff->nsegs--;
+            }
+            buff->seg_first = (buff->seg_first + 1) & (buff->seg_slots - 1);
+            buff->seg_seq += USER_BUF_SEG_SIZE;
+        }
+    }
+
     // modify fragementation chunks
     if (len == buff->fctx->len)
     {
         user_fragment_ctx *remove = buff->fctx;
         buff->fctx = buff->fctx->next;
-        if (option == AT_APP)
+        RB_REMOVE(_user_frag_tree, &buff->frags, remove);
+        buff->nfrags--;
+        if (RBFragEnqueue(option == AT_APP ? rbm->free_fragq : rbm->free_fragq_int, remove) == 0)
         {
-            RBFragEnqueue(rbm->free_fragq, remove);
+            __atomic_fetch_sub(&rbm->frag_cnt, 1, __ATOMIC_RELAXED);
         }
-        else if (option == AT_MTCP)
+        else
         {
-            RBFragEnqueue(rbm->free_fragq_int, remove);
+            /* queue full, the pool takes frees from any thread */
+            FreeFragmentContextSingle(rbm, remove);
         }
     }
     else if (len < buff->fctx->len)
@@ -674,6 +935,29 @@ size_t RBRemove(user_rb_manager *rbm, user_ring_buffer *buff, size_t len, int op
     return len;
 }
 
+/* copies up to len in-order bytes from head_seq on, called with read_lock held */
+size_t RBCopy(user_ring_buffer *buff, void *dst, size_t len)
+{
+    uint32_t off, k;
+    size_t copied = 0, n;
+
+    len = MIN(len, (size_t) buff->merged_len);
+    if (len == 0)
+        return 0;
+
+    /* the in-order data has all its segments, one slot after the other */
+    off = buff->head_seq - buff->seg_seq;
+    k = off >> USER_BUF_SEG_SHIFT;
+    off &= USER_BUF_SEG_SIZE - 1;
+    for (; copied < len; k++, off = 0)
+    {
+        n = MIN(len - copied, (size_t) (USER_BUF_SEG_SIZE - off));
+        memcpy((u_char *) dst + copied, RB_SEG_SLOT(buff, k)->data + off, n);
+        copied += n;
+    }
+
+    return copied;
+}
 
 user_stream_queue_int *CreateInternalStreamQueue(int size)
 {
@@ -717,10 +1001,27 @@ int StreamInternalEnqueue(user_stream_queue_int *sq, struct _user_tcp_stream *st
 {
     if (sq->count >= sq->size)
     {
-        /* queue is full */
-        printf("[WARNING] Queue overflow. Set larger queue size! "
-               "count: %d, size: %d\n", sq->count, sq->size);
-        return -1;
+        /* queue is full, only the stack thread uses it so it simply doubles */
+        struct _user_tcp_stream **array;
+        int i;
+
+        array = (struct _user_tcp_stream **) calloc(sq->size * 2, sizeof(struct _user_tcp_stream *));
+        if (!array)
+        {
+            printf("[WARNING] Queue overflow. Set larger queue size! "
+                   "count: %d, size: %d\n", sq->count, sq->size);
+            return -1;
+        }
+
+        for (i = 0; i < sq->count; i++)
+        {
+            array[i] = sq->array[(sq->first + i) % sq->size];
+        }
+        free(sq->array);
+        sq->array = array;
+        sq->first = 0;
+        sq->last = sq->count;
+        sq->size *= 2;
     }
 
     sq->array[sq->last++] = stream;
@@ -757,11 +1058,12 @@ struct _user_tcp_stream *StreamInternalDequeue(user_stream_queue_int *sq)
 
 int StreamQueueIsEmpty(user_stream_queue *sq)
 {
-    return (sq->_head == sq->_tail);
-}
+    user_stream_queue *r = sq->_cons;
 
+    return (r->_head == r->_tail && r->_next == NULL);
+}
 
-user_stream_queue *CreateStreamQueue(int capacity)
+static user_stream_queue *StreamQueueRingCreate(int capacity)
 {
     user_stream_queue *sq;
 
@@ -778,15 +1080,45 @@ user_stream_queue *CreateStreamQueue(int capacity)
 
     sq->_capacity = capacity;
     sq->_head = sq->_tail = 0;
+    sq->_prod = sq->_cons = sq;
 
     return sq;
 }
 
+user_stream_queue *CreateStreamQueue(int capacity)
+{
+    return StreamQueueRingCreate(capacity);
+}
+
+/* for the queues of the stack, any stream may sit in them once so they grow with the streams */
+user_stream_queue *CreateGrowingStreamQueue(int capacity)
+{
+    user_stream_queue *sq = StreamQueueRingCreate(capacity);
+
+    if (sq)
+    {
+        sq->_grow = 1;
+    }
+    return sq;
+}
+
 void DestroyStreamQueue(user_stream_queue *sq)
 {
+    user_stream_queue *r, *next;
+
     if (!sq)
         return;
 
+    for (r = sq->_cons; r != NULL; r = next)
+    {
+        next = r->_next;
+        if (r != sq)
+        {
+            free((void *) r->_q);
+            free(r);
+        }
+    }
+
     if (sq->_q)
     {
         free((void *) sq->_q);
@@ -796,17 +1128,37 @@ void DestroyStreamQueue(user_stream_queue *sq)
     free(sq);
 }
 
-int StreamEnqueue(user_stream_queue *sq, struct _user_tcp_stream *stream)
+static int StreamRingEnqueue(user_stream_queue *r, struct _user_tcp_stream *stream)
 {
-    index_type h = sq->_head;
-    index_type t = sq->_tail;
-    index_type nt = NextIndex(sq, t);
+    index_type h = r->_head;
+    index_type t = r->_tail;
+    index_type nt = NextIndex(r, t);
 
     if (nt != h)
     {
-        sq->_q[t] = stream;
-        MemoryBarrier(sq->_q[t], sq->_tail);
-        sq->_tail = nt;
+        r->_q[t] = stream;
+        MemoryBarrier(r->_q[t], r->_tail);
+        r->_tail = nt;
+        return 0;
+    }
+
+    return -1;
+}
+
+int StreamEnqueue(user_stream_queue *sq, struct _user_tcp_stream *stream)
+{
+    user_stream_queue *r = sq->_prod;
+    user_stream_queue *n;
+
+    if (StreamRingEnqueue(r, stream) == 0)
+        return 0;
+
+    if (sq->_grow && (n = StreamQueueRingCreate(r->_capacity * 2)) != NULL)
+    {
+        StreamRingEnqueue(n, stream);
+        /* the entries of the new ring before the link, the consumer reads them after it */
+        __atomic_store_n(&r->_next, n, __ATOMIC_RELEASE);
+        sq->_prod = n;
         return 0;
     }
 
@@ -814,19 +1166,47 @@ int StreamEnqueue(user_stream_queue *sq, struct _user_tcp_stream *stream)
     return -1;
 }
 
-struct _user_tcp_stream *StreamDequeue(user_stream_queue *sq)
+static struct _user_tcp_stream *StreamRingDequeue(user_stream_queue *r)
 {
-    index_type h = sq->_head;
-    index_type t = sq->_tail;
+    index_type h = r->_head;
+    index_type t = r->_tail;
 
     if (h != t)
     {
-        struct _user_tcp_stream *stream = sq->_q[h];
-        MemoryBarrier(sq->_q[h], sq->_head);
-        sq->_head = NextIndex(sq, h);
+        struct _user_tcp_stream *stream = r->_q[h];
+        MemoryBarrier(r->_q[h], r->_head);
+        r->_head = NextIndex(r, h);
         assert(stream);
         return stream;
     }
 
     return NULL;
+}
+
+struct _user_tcp_stream *StreamDequeue(user_stream_queue *sq)
+{
+    user_stream_queue *r = sq->_cons;
+    user_stream_queue *n;
+    struct _user_tcp_stream *stream;
+
+    while ((stream = StreamRingDequeue(r)) == NULL)
+    {
+        n = __atomic_load_n(&r->_next, __ATOMIC_ACQUIRE);
+        if (n == NULL)
+            return NULL;
+
+        /* the producer left this ring before linking the next, what it put there is visible now */
+        if ((stream = StreamRingDequeue(r)) != NULL)
+            return stream;
+
+        sq->_cons = n;
+        if (r != sq)
+        {
+            free((void *) r->_q);
+            free(r);
+        }
+        r = n;
+    }
+
+    return stream;
 }
\ No newline at end of file
@@ -86,7 +86,7 @@ int user_close_epoll_socket(int epid)
     if (!tcp)
         return -1;
 
-    user_epoll *ep = tcp->smap[epid].ep;
+    user_epoll *ep = USER_SMAP(tcp, epid)->ep;
     if (!ep)
     {
         errno = EINVAL;
@@ -99,7 +99,7 @@ int user_close_epoll_socket(int epid)
 
     pthread_mutex_lock(&ep->epoll_lock);
     tcp->ep = NULL;
-    tcp->smap[epid].ep = NULL;
+    USER_SMAP(tcp, epid)->ep = NULL;
     pthread_cond_signal(&ep->epoll_cond);
     pthread_mutex_unlock(&ep->epoll_lock);
 
@@ -245,7 +245,7 @@ int user_raise_pending_stream_events(user_epoll *ep, user_socket_map *socket)
     if (socket->epoll & USER_EPOLLOUT)
     {
         user_tcp_send *snd = stream->snd;
-        if (!snd->sndbuf || (snd->sndbuf && snd->sndbuf->len < snd->snd_wnd))
+        if (!snd->sndbuf || user_tcp_sndbuf_writable(stream))
         {
             if (!(socket->events & USER_EPOLLOUT))
             {
@@ -268,7 +268,7 @@ int user_epoll_create(int size)
         return -1;
     }
 
-    user_socket_map *epsocket = user_allocate_socket(USER_TCP_SOCK_EPOLL, 0);
+    user_socket_map *epsocket = user_allocate_socket(USER_TCP_SOCK_EPOLL);
     if (!epsocket)
     {
         errno = ENFILE;
@@ -278,13 +278,13 @@ int user_epoll_create(int size)
     user_epoll *ep = (user_epoll *) calloc(1, sizeof(user_epoll));
     if (!ep)
     {
-        user_free_socket(epsocket->id, 0);
+        user_free_socket(epsocket->id);
         return -1;
     }
     ep->usr_queue = user_create_event_queue(size);
     if (!ep->usr_queue)
     {
-        user_free_socket(epsocket->id, 0);
+        user_free_socket(epsocket->id);
         free(ep);
         return -1;
     }
@@ -293,7 +293,7 @@ int user_epoll_create(int size)
     if (!ep->usr_shadow_queue)
     {
         user_destory_event_queue(ep->usr_queue);
-        user_free_socket(epsocket->id, 0);
+        user_free_socket(epsocket->id);
         free(ep);
         return -1;
     }
@@ -303,7 +303,7 @@ int user_epoll_create(int size)
     {
         user_destory_event_queue(ep->usr_shadow_queue);
         user_destory_event_queue(ep->usr_queue);
-        user_free_socket(epsocket->id, 0);
+        user_free_socket(epsocket->id);
         free(ep);
         return -1;
     }
@@ -318,7 +318,7 @@ int user_epoll_create(int size)
         user_destory_event_queue(ep->queue);
         user_destory_event_queue(ep->usr_shadow_queue);
         user_destory_event_queue(ep->usr_queue);
-        user_free_socket(epsocket->id, 0);
+        user_free_socket(epsocket->id);
         free(ep);
         return -1;
     }
@@ -328,7 +328,7 @@ int user_epoll_create(int size)
         user_destory_event_queue(ep->queue);
         user_destory_event_queue(ep->usr_shadow_queue);
         user_destory_event_queue(ep->usr_queue);
-        user_free_socket(epsocket->id, 0);
+        user_free_socket(epsocket->id);
         free(ep);
         return -1;
     }
@@ -342,31 +342,31 @@ int user_epoll_ctl(int epid, int op, int sockid, user_epoll_event *event)
     if (tcp == NULL)
         return -1;
 
-    if (epid < 0 || epid >= USER_MAX_CONCURRENCY)
+    if (epid < 0 || epid >= tcp->smap_cnt)
     {
         errno = EBADF;
         return -1;
     }
 
-    if (sockid < 0 || sockid >= USER_MAX_CONCURRENCY)
+    if (sockid < 0 || sockid >= tcp->smap_cnt)
     {
         errno = EBADF;
         return -1;
     }
 
-    if (tcp->smap[epid].socktype == USER_TCP_SOCK_UNUSED)
+    if (USER_SMAP(tcp, epid)->socktype == USER_TCP_SOCK_UNUSED)
     {
         errno = EBADF;
         return -1;
     }
 
-    if (tcp->smap[epid].socktype != USER_TCP_SOCK_EPOLL)
+    if (USER_SMAP(tcp, epid)->socktype != USER_TCP_SOCK_EPOLL)
     {
         errno = EINVAL;
         return -1;
     }
 
-    user_epoll *ep = tcp->smap[epid].ep;
+    user_epoll *ep = USER_SMAP(tcp, epid)->ep;
     if (!ep || (!event && op != USER_EPOLL_CTL_DEL))
     {
         errno = EINVAL;
@@ -374,7 +374,7 @@ int user_epoll_ctl(int epid, int op, int sockid, user_epoll_event *event)
     }
 
     uint32_t events;
-    user_socket_map *socket = &tcp->smap[sockid];
+    user_socket_map *socket = USER_SMAP(tcp, sockid);
     if (op == USER_EPOLL_CTL_ADD)
     {
         if (socket->epoll)
@@ -444,25 +444,25 @@ int user_epoll_wait(int epid, user_epoll_event *events, int maxevents, int timeo
     if (!tcp)
         return -1;
 
-    if (epid < 0 || epid >= USER_MAX_CONCURRENCY)
+    if (epid < 0 || epid >= tcp->smap_cnt)
     {
         user_trace_epoll("Epoll id %d out of range.\n", epid);
         errno = EBADF;
         return -1;
     }
-    if (tcp->smap[epid].socktype == USER_TCP_SOCK_UNUSED)
+    if (USER_SMAP(tcp, epid)->socktype == USER_TCP_SOCK_UNUSED)
     {
         errno = EBADF;
         return -1;
     }
 
-    if (tcp->smap[epid].socktype != USER_TCP_SOCK_EPOLL)
+    if (USER_SMAP(tcp, epid)->socktype != USER_TCP_SOCK_EPOLL)
     {
         errno = EINVAL;
         return -1;
     }
 
-    user_epoll *ep = tcp->smap[epid].ep;
+    user_epoll *ep = USER_SMAP(tcp, epid)->ep;
     if (!ep || !events || maxevents <= 0)
     {
         errno = EINVAL;
@@ -546,7 +546,7 @@ int user_epoll_wait(int epid, user_epoll_event *events, int maxevents, int timeo
         int num_events = eq->num_events;
         for (i = 0; i < num_events && cnt < maxevents; i++)
         {
-            user_socket_map *event_socket = &tcp->smap[eq->events[eq->start].sockid];
+            user_socket_map *event_socket = USER_SMAP(tcp, eq->events[eq->start].sockid);
             validity = 1;
             if (event_socket->socktype == USER_TCP_SOCK_UNUSED)
                 validity = 0;
@@ -586,7 +586,7 @@ int user_epoll_wait(int epid, user_epoll_event *events, int maxevents, int timeo
         num_events = eq->num_events;
         for (i = 0; i < num_events && cnt < maxevents; i++)
         {
-            user_socket_map *event_socket = &tcp->smap[eq->events[eq->start].sockid];
+            user_socket_map *event_socket = USER_SMAP(tcp, eq->events[eq->start].sockid);
             validity = 1;
             if (event_socket->socktype == USER_TCP_SOCK_UNUSED)
                 validity = 0;
@@ -2,6 +2,7 @@
 #include "user_queue.h"
 #include "user_epoll_inner.h"
 #include "user_config.h"
+#include "user_slab.h"
 
 #if USER_ENABLE_EPOLL_RB
 
@@ -45,7 +46,7 @@ int epoll_create(int size)
     struct eventpoll *ep = (struct eventpoll *)calloc(1, sizeof(struct eventpoll));
     if (!ep)
     {
-        user_free_socket(epsocket->id, 0);
+        user_free_socket(epsocket->id);
         return -1;
     }
 
@@ -66,7 +67,7 @@ int epoll_create(int size)
     if (pthread_mutex_init(&ep->mtx, NULL))
     {
         free(ep);
-        user_free_socket(epsocket->id, 0);
+        user_free_socket(epsocket->id);
         return -2;
     }
 
@@ -74,7 +75,7 @@ int epoll_create(int size)
     {
         pthread_mutex_destroy(&ep->mtx);
         free(ep);
-        user_free_socket(epsocket->id, 0);
+        user_free_socket(epsocket->id);
         return -2;
     }
 
@@ -83,7 +84,7 @@ int epoll_create(int size)
         pthread_mutex_destroy(&ep->cdmtx);
         pthread_mutex_destroy(&ep->mtx);
         free(ep);
-        user_free_socket(epsocket->id, 0);
+        user_free_socket(epsocket->id);
         return -2;
     }
 
@@ -94,7 +95,7 @@ int epoll_create(int size)
         pthread_mutex_destroy(&ep->mtx);
         free(ep);
 
-        user_free_socket(epsocket->id, 0);
+        user_free_socket(epsocket->id);
         return -2;
     }
 
@@ -181,7 +182,7 @@ int epoll_ctl(int epid, int op, int sockid, struct epoll_event *event)
         /**
          * a、创建一个 epitem 对象，该对象就是红黑树的一个节点。
         */
-        epi = (struct epitem *)calloc(1, sizeof(struct epitem));
+        epi = (struct epitem *)user_slab_zalloc(sizeof(struct epitem));
         if (!epi)
         {
             pthread_mutex_unlock(&ep->mtx);
@@ -240,7 +241,7 @@ int epoll_ctl(int epid, int op, int sockid, struct epoll_event *event)
         }
 
         ep->rbcnt--;
-        free(epi);
+        user_slab_free(epi, sizeof(struct epitem));
 
         pthread_mutex_unlock(&ep->mtx);
     }
@@ -289,7 +290,7 @@ int epoll_wait(int epid, struct epoll_event *events, int maxevents, int timeout)
     if (!tcp)
         return -1;
 
-    //user_socket_map *epsocket = &tcp->smap[epid];
+    //user_socket_map *epsocket = USER_SMAP(tcp, epid);
     struct _user_socket *epsocket = tcp->fdtable->sockfds[epid];
     if (epsocket == NULL)
         return -1;
@@ -540,7 +541,7 @@ static int epoll_destroy(struct eventpoll *ep)
             break;
 
         epi = RB_REMOVE(_epoll_rb_socket, &ep->rbr, epi);
-        free(epi);
+        user_slab_free(epi, sizeof(struct epitem));
     }
     pthread_mutex_unlock(&ep->mtx);
 
@@ -9,6 +9,8 @@ extern user_tcp_manager *user_get_tcp_manager(void);
 extern void CheckRtmTimeout(user_tcp_manager *tcp, uint32_t cur_ts, int thresh);
 extern void CheckTimewaitExpire(user_tcp_manager *tcp, uint32_t cur_ts, int thresh);
 extern void CheckConnectionTimeout(user_tcp_manager *tcp, uint32_t cur_ts, int thresh);
+extern void CheckDelayedAck(user_tcp_manager *tcp, uint32_t cur_ts, int thresh);
+extern void CheckCorkTimeout(user_tcp_manager *tcp, uint32_t cur_ts, int thresh);
 
 unsigned short in_cksum(unsigned short *addr, int len)
 {
@@ -88,11 +90,35 @@ static void *user_tcp_run(void *arg)
         gettimeofday(&cur_ts, NULL);
         uint32_t ts = TIMEVAL_TO_TS(&cur_ts);
 
+        user_tcp_mem_update(tcp, ts);
+
+        if (tcp->reqsk_cnt > 0)
+        {
+            user_tcp_reqsk_timer(tcp, ts, USER_MAX_CONCURRENCY);
+        }
+        if (tcp->tw_cnt > 0)
+        {
+            user_tcp_tw_timer(tcp, ts, USER_MAX_CONCURRENCY);
+        }
+        if (tcp->ka_wheel->cnt > 0)
+        {
+            user_tcp_keepalive_timer(tcp, ts, USER_MAX_CONCURRENCY);
+        }
+        if (tcp->mem.idle_cnt > 0)
+        {
+            user_tcp_mem_idle_timer(tcp, ts, USER_MAX_CONCURRENCY);
+        }
+
         if (tcp->flow_cnt > 0)
         {
             CheckRtmTimeout(tcp, ts, USER_MAX_CONCURRENCY);
             CheckTimewaitExpire(tcp, ts, USER_MAX_CONCURRENCY);
             CheckConnectionTimeout(tcp, ts, USER_MAX_CONCURRENCY);
+            CheckDelayedAck(tcp, ts, USER_MAX_CONCURRENCY);
+            if (tcp->cork_list_cnt > 0)
+            {
+                CheckCorkTimeout(tcp, ts, USER_MAX_CONCURRENCY);
+            }
 
             user_tcp_handle_apicall(ts);
         }
@@ -122,6 +148,17 @@ void user_tcp_setup(void)
     assert(tctx != NULL);
     printf("user_stack start\n");
 
+    const char *pages = getenv("USER_MEM_PAGES");
+    if (pages)
+    {
+        if (strcasecmp(pages, "1g") == 0)
+            user_mempool_set_backing(MEM_HUGEPAGE_1G);
+        else if (strcasecmp(pages, "2m") == 0)
+            user_mempool_set_backing(MEM_HUGEPAGE);
+        else if (strcasecmp(pages, "4k") == 0)
+            user_mempool_set_backing(MEM_NORMAL);
+    }
+
     //int ret = USER_NIC_INIT(tctx, "netmap:eth0");
     int ret = user_nic_init(tctx, "netmap:eth1");
     if (ret != 0)
@@ -20,6 +20,26 @@ unsigned int HashFlow(const void *f)
     return hash & (NUM_BINS_FLOWS - 1);
 }
 
+/* the flow hash over a bare tuple, unmasked, for tables without a stream */
+unsigned int HashTuple(uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport)
+{
+    uint32_t key[3] = {saddr, ((uint32_t) sport << 16) | dport, daddr};
+    unsigned char *k = (unsigned char *) key;
+    unsigned int hash, i;
+
+    for (hash = i = 0; i < sizeof(key); i++)
+    {
+        hash += k[i];
+        hash += (hash << 10);
+        hash ^= (hash >> 6);
+    }
+    hash += (hash << 3);
+    hash ^= (hash >> 11);
+    hash += (hash << 15);
+
+    return hash;
+}
+
 int EqualFlow(const void *f1, const void *f2)
 {
     user_tcp_stream *flow1 = (user_tcp_stream *) f1;
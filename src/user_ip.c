@@ -114,7 +114,7 @@ uint8_t *IPOutputStandalone(user_tcp_manager *tcp, uint8_t protocol,
     return (uint8_t * )(iph + 1);
 }
 
-uint8_t *IPOutput(user_tcp_manager *tcp, user_tcp_stream *stream, uint16_t tcplen)
+uint8_t *IPOutput(user_tcp_manager *tcp, user_tcp_stream *stream, uint16_t tcplen, uint8_t tos)
 {
     struct iphdr *iph;
     int nif = 0;
@@ -142,7 +142,7 @@ uint8_t *IPOutput(user_tcp_manager *tcp, user_tcp_stream *stream, uint16_t tcple
 
     iph->ihl = IP_HEADER_LEN >> 2;
     iph->version = 4;
-    iph->tos = 0;
+    iph->tos = tos;
     iph->tot_len = htons(IP_HEADER_LEN + tcplen);
     iph->id = htons(stream->snd->ip_id++);
     iph->flag_off = htons(0x4000);
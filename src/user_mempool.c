@@ -4,15 +4,700 @@
 #include <stdint.h>
 #include <assert.h>
 #include <unistd.h>
+#include <dirent.h>
 #include <sys/mman.h>
-
-//sudo apt-get install libhugetlbfs-dev
-#include <hugetlbfs.h>
+#include <sys/syscall.h>
 
 #include "user_mempool.h"
 
-user_mempool *user_mempool_create(int chunk_size, size_t total_size, int is_hugepage)
+typedef struct _user_mag_cache
+{
+    user_mempool *mp;
+    user_magazine *loaded;
+    user_magazine *prev;
+} user_mag_cache;
+
+static int user_mempool_nid;
+static user_mempool *user_mempool_live[USER_MEMPOOL_MAX];   // by mp_id, cleared when the pool is destroyed
+static __thread user_mag_cache *user_mag_tls[USER_MEMPOOL_MAX];
+static pthread_key_t user_mag_key;
+static pthread_once_t user_mag_once = PTHREAD_ONCE_INIT;
+
+#define USER_SLAB_HDR_SIZE      ((sizeof(user_mem_slab) + 63) & ~(size_t) 63)
+#define USER_MAG_BLOCK          (1 << USER_MAG_BLOCK_SHIFT)
+
+static inline user_magazine *user_mag_at(user_mempool *mp, uint32_t idx)
+{
+    return &mp->mp_mag_blk[idx >> USER_MAG_BLOCK_SHIFT][idx & (USER_MAG_BLOCK - 1)];
+}
+
+static void user_depot_push(user_mempool *mp, uint64_t *head, user_magazine *mag);
+static void user_mag_drain(user_mempool *mp, user_magazine *mag);
+
+/*
+ * at least n more magazines, new blocks go empty onto the depot. blocks stay
+ * until the pool is destroyed. called at creation or under mp_grow_lock,
+ * never under mp_lock.
+ */
+static void user_mag_grow(user_mempool *mp, uint32_t n)
+{
+    uint32_t want = mp->mp_nmags + n;
+    user_magazine *blk;
+    uint32_t b, i;
+
+    while (mp->mp_nmags < want)
+    {
+        b = mp->mp_nmags >> USER_MAG_BLOCK_SHIFT;
+        if (b >= USER_MAG_BLOCKS)
+            return;
+
+        blk = calloc(USER_MAG_BLOCK, sizeof(user_magazine));
+        if (blk == NULL)
+            return;
+
+        for (i = 0; i < USER_MAG_BLOCK; i++)
+        {
+            blk[i].idx = mp->mp_nmags + i;
+        }
+        mp->mp_mag_blk[b] = blk;
+        mp->mp_nmags += USER_MAG_BLOCK;
+
+        for (i = 0; i < USER_MAG_BLOCK; i++)
+        {
+            user_depot_push(mp, &mp->mp_depot_empty, &blk[i]);
+        }
+    }
+}
+
+static void user_mag_init(user_mempool *mp)
+{
+    /* small pools would end up in the caches of one thread */
+    mp->mp_id = -1;
+    mp->mp_mag_rounds = mp->mp_total_chunks / 64;
+    if (mp->mp_mag_rounds > USER_MAG_ROUNDS)
+        mp->mp_mag_rounds = USER_MAG_ROUNDS;
+    if (mp->mp_mag_rounds < 2)
+        return;
+
+    mp->mp_id = __atomic_fetch_add(&user_mempool_nid, 1, __ATOMIC_RELAXED);
+    if (mp->mp_id >= USER_MEMPOOL_MAX)
+    {
+        mp->mp_id = -1;
+        return;
+    }
+    __atomic_store_n(&user_mempool_live[mp->mp_id], mp, __ATOMIC_RELEASE);
+
+    /* every chunk in a full magazine, two per thread, the rest empty */
+    mp->mp_depot_empty = 0;
+    mp->mp_depot_full = 0;
+    mp->mp_depot_rounds = 0;
+    user_mag_grow(mp, 2 * (mp->mp_total_chunks / mp->mp_mag_rounds + 1) + 2 * USER_MEMPOOL_MAX);
+}
+
+static void user_depot_push(user_mempool *mp, uint64_t *head, user_magazine *mag)
+{
+    uint64_t old = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+    uint64_t new;
+
+    if (head == &mp->mp_depot_full)
+    {
+        __atomic_fetch_add(&mp->mp_depot_rounds, mag->rounds, __ATOMIC_RELAXED);
+    }
+
+    do
+    {
+        mag->next = (uint32_t) old;
+        new = (((old >> 32) + 1) << 32) | (mag->idx + 1);
+    } while (!__atomic_compare_exchange_n(head, &old, new, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+/* magazines are never freed while the pool lives, reading a stale next is harmless, the tag fails the swap */
+static user_magazine *user_depot_pop(user_mempool *mp, uint64_t *head)
+{
+    uint64_t old = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+    uint64_t new;
+    user_magazine *mag;
+
+    do
+    {
+        if ((uint32_t) old == 0)
+            return NULL;
+
+        mag = user_mag_at(mp, (uint32_t) old - 1);
+        new = (((old >> 32) + 1) << 32) | __atomic_load_n(&mag->next, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(head, &old, new, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    if (head == &mp->mp_depot_full)
+    {
+        __atomic_fetch_sub(&mp->mp_depot_rounds, mag->rounds, __ATOMIC_RELAXED);
+    }
+    return mag;
+}
+
+static void user_mag_put(user_mempool *mp, user_magazine *mag)
+{
+    if (mag == NULL)
+        return;
+
+    user_depot_push(mp, mag->rounds ? &mp->mp_depot_full : &mp->mp_depot_empty, mag);
+}
+
+/* a thread that exits hands its magazines back to the depots of the pools still there */
+static void user_mag_thread_exit(void *arg)
+{
+    user_mag_cache **tls = (user_mag_cache **) arg;
+    int i;
+
+    for (i = 0; i < USER_MEMPOOL_MAX; i++)
+    {
+        if (tls[i] == NULL)
+            continue;
+
+        if (__atomic_load_n(&user_mempool_live[i], __ATOMIC_ACQUIRE) == tls[i]->mp)
+        {
+            user_mag_put(tls[i]->mp, tls[i]->loaded);
+            user_mag_put(tls[i]->mp, tls[i]->prev);
+        }
+        free(tls[i]);
+        tls[i] = NULL;
+    }
+}
+
+static void user_mag_key_create(void)
+{
+    pthread_key_create(&user_mag_key, user_mag_thread_exit);
+}
+
+static inline user_mag_cache *user_mag_cache_get(user_mempool *mp)
+{
+    user_mag_cache *cc;
+
+    if (mp->mp_id < 0)
+        return NULL;
+
+    cc = user_mag_tls[mp->mp_id];
+    if (cc != NULL)
+        return cc;
+
+    cc = calloc(1, sizeof(user_mag_cache));
+    if (cc == NULL)
+        return NULL;
+
+    cc->mp = mp;
+    user_mag_tls[mp->mp_id] = cc;
+
+    pthread_once(&user_mag_once, user_mag_key_create);
+    pthread_setspecific(user_mag_key, user_mag_tls);
+
+    return cc;
+}
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT          26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB            (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB            (30 << MAP_HUGE_SHIFT)
+#endif
+#define USER_MPOL_PREFERRED     1
+#define USER_PAGE_2M            (2UL << 20)
+#define USER_PAGE_1G            (1UL << 30)
+#define USER_ARENA_ORDERS       10      // pieces of 2M << order, up to a whole 1G page
+
+typedef struct _user_mem_piece
+{
+    struct _user_mem_piece *next;
+} user_mem_piece;
+
+#ifdef HUGEPAGE
+static int user_mem_backing = MEM_HUGEPAGE;
+#else
+static int user_mem_backing = MEM_NORMAL;
+#endif
+static __thread int user_mem_node_tls = -2;    // -2 until set, then the node of the cpu is used
+static user_mem_stat user_mem_stats;
+
+/* 1G pages split buddy style without merging, the last row has no node */
+static user_mem_piece *user_mem_arena[USER_MEM_MAX_NODES + 1][USER_ARENA_ORDERS];
+static pthread_mutex_t user_mem_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int user_mempool_set_backing(int mem_type)
+{
+    if (mem_type < MEM_NORMAL || mem_type >= MEM_TYPES)
+        return -1;
+
+    user_mem_backing = mem_type;
+    return 0;
+}
+
+int user_mempool_get_backing(void)
+{
+    return user_mem_backing;
+}
+
+void user_mempool_set_node(int node)
+{
+    user_mem_node_tls = (node < USER_MEM_MAX_NODES) ? node : -1;
+}
+
+/* from sysfs, -1 without numa */
+int user_mem_cpu_node(int cpu)
+{
+    char path[64];
+    struct dirent *d;
+    DIR *dir;
+    int node = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    dir = opendir(path);
+    if (!dir)
+        return -1;
+
+    while ((d = readdir(dir)) != NULL)
+    {
+        if (strncmp(d->d_name, "node", 4) == 0 && d->d_name[4] >= '0' && d->d_name[4] <= '9')
+        {
+            node = atoi(d->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+
+    return (node < USER_MEM_MAX_NODES) ? node : -1;
+}
+
+static int user_mem_cur_node(void)
+{
+    unsigned int cpu, node;
+
+    if (user_mem_node_tls != -2)
+        return user_mem_node_tls;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0 || node >= USER_MEM_MAX_NODES)
+        return -1;
+
+    return node;
+}
+
+/* preferred, not bound, so a full node spills to the others. without numa it fails and nothing changes */
+static void user_mem_bind(void *p, size_t size, int node)
+{
+    unsigned long mask;
+
+    if (node < 0)
+        return;
+
+    mask = 1UL << node;
+    syscall(SYS_mbind, p, size, USER_MPOL_PREFERRED, &mask, USER_MEM_MAX_NODES + 1, 0);
+}
+
+static size_t user_mem_round(size_t size)
+{
+    size_t r = (size < USER_SLAB_MIN_SIZE) ? USER_SLAB_PAGE_SIZE : USER_SLAB_MIN_SIZE;
+
+    while (r < size)
+    {
+        r <<= 1;
+    }
+    return r;
+}
+
+/* huge page mappings are aligned to the page only, larger blocks map twice the size and cut off both ends */
+static void *user_mem_map_huge(size_t size, size_t page, int flags)
+{
+    void *base;
+    uintptr_t start;
+    size_t head;
+    size_t len = (size > page) ? size * 2 : size;
+
+    base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | flags, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    if (len == size)
+        return base;
+
+    start = ((uintptr_t) base + size - 1) & ~(uintptr_t) (size - 1);
+    head = start - (uintptr_t) base;
+    if (head)
+    {
+        munmap(base, head);
+    }
+    munmap((void *) (start + size), size - head);
+    return (void *) start;
+}
+
+static int user_mem_order(size_t size)
+{
+    int order = 0;
+
+    while (((size_t) USER_SLAB_MIN_SIZE << order) < size)
+    {
+        order++;
+    }
+    return order;
+}
+
+static void *user_arena_get(size_t size, int node)
+{
+    user_mem_piece **fl = user_mem_arena[node < 0 ? USER_MEM_MAX_NODES : node];
+    user_mem_piece *piece, *half;
+    int order = user_mem_order(size);
+    int o;
+
+    if (order >= USER_ARENA_ORDERS)
+        return NULL;
+
+    pthread_mutex_lock(&user_mem_arena_lock);
+
+    for (o = order; o < USER_ARENA_ORDERS && fl[o] == NULL; o++)
+        ;
+
+    if (o == USER_ARENA_ORDERS)
+    {
+        piece = user_mem_map_huge(USER_PAGE_1G, USER_PAGE_1G, MAP_HUGE_1GB);
+        if (!piece)
+        {
+            pthread_mutex_unlock(&user_mem_arena_lock);
+            return NULL;
+        }
+        user_mem_bind(piece, USER_PAGE_1G, node);
+
+        o = USER_ARENA_ORDERS - 1;
+        piece->next = NULL;
+        fl[o] = piece;
+    }
+
+    /* split down to the size, the upper halves wait on the lists */
+    while (o > order)
+    {
+        piece = fl[o];
+        fl[o] = piece->next;
+        o--;
+
+        half = (user_mem_piece *) ((u_char *) piece + ((size_t) USER_SLAB_MIN_SIZE << o));
+        half->next = fl[o];
+        piece->next = half;
+        fl[o] = piece;
+    }
+
+    piece = fl[order];
+    fl[order] = piece->next;
+
+    pthread_mutex_unlock(&user_mem_arena_lock);
+
+    return piece;
+}
+
+static void user_arena_put(void *p, size_t size, int node)
 {
+    user_mem_piece **fl = user_mem_arena[node < 0 ? USER_MEM_MAX_NODES : node];
+    user_mem_piece *piece = (user_mem_piece *) p;
+    int order = user_mem_order(size);
+
+    pthread_mutex_lock(&user_mem_arena_lock);
+    piece->next = fl[order];
+    fl[order] = piece;
+    pthread_mutex_unlock(&user_mem_arena_lock);
+}
+
+/*
+ * a block aligned to its size, which is rounded up to a power of two of at
+ * least a page. mem_type is the page size asked for and comes back as the one
+ * used, huge pages fall back to smaller ones when the system has none left.
+ * blocks below 2M always take normal pages.
+ */
+void *user_mem_map(size_t size, int *mem_type, int node)
+{
+    void *p = NULL;
+    int want;
+
+    size = user_mem_round(size);
+    if (*mem_type == MEM_DEFAULT)
+    {
+        *mem_type = user_mem_backing;
+    }
+    if (size < USER_SLAB_MIN_SIZE)
+    {
+        *mem_type = MEM_NORMAL;
+    }
+    want = *mem_type;
+
+    if (*mem_type == MEM_HUGEPAGE_1G)
+    {
+        p = user_arena_get(size, node);
+        if (!p)
+        {
+            *mem_type = MEM_HUGEPAGE;
+        }
+    }
+
+    if (!p && *mem_type == MEM_HUGEPAGE)
+    {
+        p = user_mem_map_huge(size, USER_PAGE_2M, MAP_HUGE_2MB);
+        if (p)
+        {
+            user_mem_bind(p, size, node);
+        }
+        else
+        {
+            *mem_type = MEM_NORMAL;
+        }
+    }
+
+    if (!p)
+    {
+        if (posix_memalign(&p, size, size) != 0)
+            return NULL;
+
+        user_mem_bind(p, size, node);
+    }
+
+    if (*mem_type != want)
+    {
+        __atomic_fetch_add(&user_mem_stats.fallbacks, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&user_mem_stats.bytes[*mem_type], size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&user_mem_stats.maps[*mem_type], 1, __ATOMIC_RELAXED);
+    if (node >= 0)
+    {
+        __atomic_fetch_add(&user_mem_stats.node_bytes[node], size, __ATOMIC_RELAXED);
+    }
+
+    return p;
+}
+
+void user_mem_unmap(void *p, size_t size, int mem_type, int node)
+{
+    size = user_mem_round(size);
+
+    __atomic_fetch_sub(&user_mem_stats.bytes[mem_type], size, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&user_mem_stats.maps[mem_type], 1, __ATOMIC_RELAXED);
+    if (node >= 0)
+    {
+        __atomic_fetch_sub(&user_mem_stats.node_bytes[node], size, __ATOMIC_RELAXED);
+    }
+
+    if (mem_type == MEM_HUGEPAGE_1G)
+    {
+        user_arena_put(p, size, node);
+    }
+    else if (mem_type == MEM_HUGEPAGE)
+    {
+        munmap(p, size);
+    }
+    else
+    {
+        free(p);
+    }
+}
+
+void user_mempool_stats(user_mem_stat *st)
+{
+    int i;
+
+    for (i = 0; i < MEM_TYPES; i++)
+    {
+        st->bytes[i] = __atomic_load_n(&user_mem_stats.bytes[i], __ATOMIC_RELAXED);
+        st->maps[i] = __atomic_load_n(&user_mem_stats.maps[i], __ATOMIC_RELAXED);
+    }
+    st->fallbacks = __atomic_load_n(&user_mem_stats.fallbacks, __ATOMIC_RELAXED);
+    for (i = 0; i < USER_MEM_MAX_NODES; i++)
+    {
+        st->node_bytes[i] = __atomic_load_n(&user_mem_stats.node_bytes[i], __ATOMIC_RELAXED);
+    }
+}
+
+/* the pages column is what the tlb has to cover for the pools */
+void user_mempool_dump(void)
+{
+    static const char *name[MEM_TYPES] = {"4K", "2M", "1G"};
+    static const uint64_t page[MEM_TYPES] = {4096, USER_PAGE_2M, USER_PAGE_1G};
+    user_mem_stat st;
+    int i;
+
+    user_mempool_stats(&st);
+
+    printf("%4s %14s %8s %12s\n", "page", "bytes", "maps", "pages");
+    for (i = 0; i < MEM_TYPES; i++)
+    {
+        printf("%4s %14lu %8lu %12lu\n", name[i],
+               (unsigned long) st.bytes[i], (unsigned long) st.maps[i],
+               (unsigned long) ((st.bytes[i] + page[i] - 1) / page[i]));
+    }
+    printf("huge page fallbacks: %lu\n", (unsigned long) st.fallbacks);
+
+    for (i = 0; i < USER_MEM_MAX_NODES; i++)
+    {
+        if (st.node_bytes[i])
+        {
+            printf("node %d: %lu bytes\n", i, (unsigned long) st.node_bytes[i]);
+        }
+    }
+}
+
+static user_mem_slab *user_slab_create(user_mempool *mp)
+{
+    user_mem_slab *slab;
+    int type = mp->mp_type;
+    int i;
+
+    slab = (user_mem_slab *) user_mem_map(mp->mp_slab_size, &type, mp->mp_node);
+    if (slab == NULL)
+    {
+        printf("user_slab_create --> no memory for %lu bytes\n", (unsigned long) mp->mp_slab_size);
+        return NULL;
+    }
+
+    if (geteuid() == 0)
+    {
+        if (mlock(slab, mp->mp_slab_size) < 0)
+        {
+
+        }
+    }
+
+    memset(slab, 0, sizeof(user_mem_slab));
+    slab->type = type;
+    slab->node = mp->mp_node;
+    slab->startptr = (u_char *) slab + USER_SLAB_HDR_SIZE;
+
+    if (mp->mp_ctor)
+    {
+        for (i = 0; i < mp->mp_slab_chunks; i++)
+        {
+            if (mp->mp_ctor(slab->startptr + (size_t) i * mp->mp_chunk_size, mp->mp_cache_arg) < 0)
+                break;
+        }
+        if (i < mp->mp_slab_chunks)
+        {
+            printf("user_slab_create --> constructor failed\n");
+            while (--i >= 0)
+            {
+                if (mp->mp_dtor)
+                    mp->mp_dtor(slab->startptr + (size_t) i * mp->mp_chunk_size, mp->mp_cache_arg);
+            }
+            user_mem_unmap(slab, mp->mp_slab_size, slab->type, slab->node);
+            return NULL;
+        }
+    }
+
+    slab->free_chunks = mp->mp_slab_chunks;
+    slab->freeptr = (user_mem_chunk *) slab->startptr;
+    slab->freeptr->mc_free_chunks = mp->mp_slab_chunks;
+    slab->freeptr->next = NULL;
+
+    return slab;
+}
+
+static void user_slab_destroy(user_mempool *mp, user_mem_slab *slab)
+{
+    int i;
+
+    /* every chunk is free and constructed */
+    if (mp->mp_dtor)
+    {
+        for (i = 0; i < mp->mp_slab_chunks; i++)
+        {
+            mp->mp_dtor(slab->startptr + (size_t) i * mp->mp_chunk_size, mp->mp_cache_arg);
+        }
+    }
+    user_mem_unmap(slab, mp->mp_slab_size, slab->type, slab->node);
+}
+
+static inline user_mem_slab *user_slab_of(user_mempool *mp, void *p)
+{
+    return (user_mem_slab *) ((uintptr_t) p & ~(uintptr_t) (mp->mp_slab_size - 1));
+}
+
+static void user_slab_link(user_mempool *mp, user_mem_slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = mp->mp_partial;
+    if (mp->mp_partial)
+    {
+        mp->mp_partial->prev = slab;
+    }
+    mp->mp_partial = slab;
+    slab->on_partial = 1;
+}
+
+static void user_slab_unlink(user_mempool *mp, user_mem_slab *slab)
+{
+    if (slab->prev)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        mp->mp_partial = slab->next;
+    }
+    if (slab->next)
+    {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = slab->prev = NULL;
+    slab->on_partial = 0;
+}
+
+/* under mp_lock */
+static void user_mempool_add_slab(user_mempool *mp, user_mem_slab *slab)
+{
+    user_slab_link(mp, slab);
+    mp->mp_nslabs++;
+    mp->mp_total_chunks += mp->mp_slab_chunks;
+    mp->mp_free_chunks += mp->mp_slab_chunks;
+}
+
+/*
+ * out of chunks. the slab and the magazines for its chunks are mapped and
+ * allocated before mp_lock is taken, one thread at a time, so the others
+ * neither spin through the allocation nor map a slab each.
+ */
+static void user_mempool_grow(user_mempool *mp)
+{
+    user_mem_slab *slab;
+
+    pthread_mutex_lock(&mp->mp_grow_lock);
+
+    if (__atomic_load_n(&mp->mp_free_chunks, __ATOMIC_RELAXED) > 0)
+    {
+        /* grown by another thread meanwhile */
+        pthread_mutex_unlock(&mp->mp_grow_lock);
+        return;
+    }
+
+    slab = user_slab_create(mp);
+    if (slab != NULL)
+    {
+        if (mp->mp_id >= 0)
+        {
+            user_mag_grow(mp, 2 * (mp->mp_slab_chunks / mp->mp_mag_rounds + 1));
+        }
+
+        pthread_spin_lock(&mp->mp_lock);
+        user_mempool_add_slab(mp, slab);
+        pthread_spin_unlock(&mp->mp_lock);
+    }
+
+    pthread_mutex_unlock(&mp->mp_grow_lock);
+}
+
+user_mempool *user_mempool_create(int chunk_size, size_t total_size, int mem_type)
+{
+    return user_mempool_create_cache(chunk_size, total_size, mem_type, NULL, NULL, NULL);
+}
+
+user_mempool *user_mempool_create_cache(int chunk_size, size_t total_size, int mem_type,
+                                        user_mem_ctor ctor, user_mem_dtor dtor, void *arg)
+{
+    user_mem_slab *slab;
+    size_t need;
+    int i;
+
     if (chunk_size < (int) sizeof(user_mem_chunk))
     {
         return NULL;
@@ -31,113 +716,322 @@ user_mempool *user_mempool_create(int chunk_size, size_t total_size, int is_huge
         return NULL;
     }
 
-    mp->mp_type = is_hugepage;
+    mp->mp_type = (mem_type == MEM_DEFAULT) ? user_mem_backing : mem_type;
+    mp->mp_node = user_mem_cur_node();
     mp->mp_chunk_size = chunk_size;
-    mp->mp_free_chunks = (total_size + (chunk_size - 1)) / chunk_size;
-    mp->mp_total_chunks = mp->mp_free_chunks;
+    mp->mp_id = -1;
+    mp->mp_ctor = ctor;
+    mp->mp_dtor = dtor;
+    mp->mp_cache_arg = arg;
 
-    if (is_hugepage == MEM_HUGEPAGE)
+    need = USER_SLAB_HDR_SIZE + (size_t) chunk_size * USER_SLAB_MIN_CHUNKS;
+    mp->mp_slab_size = USER_SLAB_MIN_SIZE;
+    if (USER_SLAB_HDR_SIZE + total_size < USER_SLAB_MIN_SIZE)
     {
-        mp->mp_startptr = get_huge_pages(total_size, GHP_DEFAULT);
-        if (!mp->mp_startptr)
+        /* a small pool takes one slab of its size, not a huge page */
+        mp->mp_slab_size = USER_SLAB_PAGE_SIZE;
+        while (mp->mp_slab_size < USER_SLAB_HDR_SIZE + total_size)
         {
-            free(mp);
-            assert(0);
+            mp->mp_slab_size <<= 1;
         }
+        mp->mp_type = MEM_NORMAL;
     }
-    else
+    while (mp->mp_slab_size < need)
     {
-        int res = posix_memalign((void **) &mp->mp_startptr, getpagesize(), total_size);
-        if (res != 0)
-        {
-            free(mp);
-            assert(0);
-        }
+        mp->mp_slab_size <<= 1;
     }
+    mp->mp_slab_chunks = (mp->mp_slab_size - USER_SLAB_HDR_SIZE) / chunk_size;
 
-    if (geteuid() == 0)
+    /* the initial size in whole slabs, these are never given back */
+    mp->mp_min_slabs = ((total_size + (chunk_size - 1)) / chunk_size + mp->mp_slab_chunks - 1) / mp->mp_slab_chunks;
+    if (mp->mp_min_slabs == 0)
     {
-        if (mlock(mp->mp_startptr, total_size) < 0)
-        {
+        mp->mp_min_slabs = 1;
+    }
+
+    pthread_spin_init(&mp->mp_lock, PTHREAD_PROCESS_PRIVATE);
+    pthread_mutex_init(&mp->mp_grow_lock, NULL);
 
+    for (i = 0; i < mp->mp_min_slabs; i++)
+    {
+        slab = user_slab_create(mp);
+        if (slab == NULL)
+        {
+            user_mempool_destory(mp);
+            assert(0);
+            return NULL;
         }
+        user_mempool_add_slab(mp, slab);
     }
 
-    mp->mp_freeptr = (user_mem_chunk *) mp->mp_startptr;
-    mp->mp_freeptr->mc_free_chunks = mp->mp_free_chunks;
-    mp->mp_freeptr->next = NULL;
+    user_mag_init(mp);
 
     return mp;
 }
 
 void user_mempool_destory(user_mempool *mp)
 {
-    if (mp->mp_type == MEM_HUGEPAGE)
+    user_mem_slab *slab;
+    uint32_t b, i;
+
+    if (mp->mp_id >= 0)
     {
-        free_huge_pages(mp->mp_startptr);
+        /* threads exiting later no longer put their magazines back here */
+        __atomic_store_n(&user_mempool_live[mp->mp_id], NULL, __ATOMIC_RELEASE);
+        if (user_mag_tls[mp->mp_id] != NULL)
+        {
+            free(user_mag_tls[mp->mp_id]);
+            user_mag_tls[mp->mp_id] = NULL;
+        }
+
+        /* the rounds of every magazine, in the depot or cached by a thread, back to their slabs */
+        for (b = 0; b < USER_MAG_BLOCKS && mp->mp_mag_blk[b]; b++)
+        {
+            for (i = 0; i < USER_MAG_BLOCK; i++)
+            {
+                if (mp->mp_mag_blk[b][i].rounds > 0)
+                    user_mag_drain(mp, &mp->mp_mag_blk[b][i]);
+            }
+        }
     }
-    else
+
+    /* every chunk has to be back by now, so every slab is on the partial list */
+    while ((slab = mp->mp_partial) != NULL)
+    {
+        user_slab_unlink(mp, slab);
+        user_slab_destroy(mp, slab);
+    }
+
+    for (b = 0; b < USER_MAG_BLOCKS && mp->mp_mag_blk[b]; b++)
     {
-        free(mp->mp_startptr);
+        free(mp->mp_mag_blk[b]);
     }
 
+    pthread_spin_destroy(&mp->mp_lock);
+    pthread_mutex_destroy(&mp->mp_grow_lock);
     free(mp);
 }
 
-void *user_mempool_alloc(user_mempool *mp)
+static void *user_mempool_chunk_alloc(user_mempool *mp)
 {
+    user_mem_slab *slab = mp->mp_partial;
+    user_mem_chunk *p;
 
-    user_mem_chunk *p = mp->mp_freeptr;
-
-    if (mp->mp_free_chunks == 0) return NULL;
+    if (slab == NULL) return NULL;
 
+    p = slab->freeptr;
     assert(p->mc_free_chunks > 0);
 
     p->mc_free_chunks--;
+    slab->free_chunks--;
     mp->mp_free_chunks--;
 
     if (p->mc_free_chunks)
     {
-        mp->mp_freeptr = (user_mem_chunk * )((u_char *) p + mp->mp_chunk_size);
-        mp->mp_freeptr->mc_free_chunks = p->mc_free_chunks;
-        mp->mp_freeptr->next = p->next;
+        slab->freeptr = (user_mem_chunk * )((u_char *) p + mp->mp_chunk_size);
+        slab->freeptr->mc_free_chunks = p->mc_free_chunks;
+        slab->freeptr->next = p->next;
     }
     else
     {
-        mp->mp_freeptr = p->next;
+        slab->freeptr = p->next;
+    }
+
+    if (slab->free_chunks == 0)
+    {
+        user_slab_unlink(mp, slab);
     }
 
     return p;
 }
 
-void user_mempool_free(user_mempool *mp, void *p)
+/* returns a slab that became free and is no longer needed, to be unmapped after the lock */
+static user_mem_slab *user_mempool_chunk_free(user_mempool *mp, void *p)
 {
     user_mem_chunk *mcp = (user_mem_chunk *) p;
-
-    assert(((u_char *) p - mp->mp_startptr) % mp->mp_chunk_size == 0);
+    user_mem_slab *slab = user_slab_of(mp, p);
 
     mcp->mc_free_chunks = 1;
-    mcp->next = mp->mp_freeptr;
-    mp->mp_freeptr = mcp;
+    mcp->next = slab->freeptr;
+    slab->freeptr = mcp;
+    slab->free_chunks++;
     mp->mp_free_chunks++;
+
+    if (!slab->on_partial)
+    {
+        user_slab_link(mp, slab);
+    }
+
+    if (slab->free_chunks == mp->mp_slab_chunks && mp->mp_nslabs > mp->mp_min_slabs &&
+        mp->mp_free_chunks - mp->mp_slab_chunks >= USER_MEMPOOL_HIWAT * mp->mp_slab_chunks)
+    {
+        user_slab_unlink(mp, slab);
+        mp->mp_nslabs--;
+        mp->mp_total_chunks -= mp->mp_slab_chunks;
+        mp->mp_free_chunks -= mp->mp_slab_chunks;
+        return slab;
+    }
+
+    return NULL;
 }
 
-int user_mempool_getfree_chunks(user_mempool *mp)
+/* the rounds of a magazine back to their slabs, the magazine is empty after */
+static void user_mag_drain(user_mempool *mp, user_magazine *mag)
 {
-    return mp->mp_free_chunks;
+    user_mem_slab *release = NULL;
+    user_mem_slab *slab;
+
+    pthread_spin_lock(&mp->mp_lock);
+    while (mag->rounds > 0)
+    {
+        slab = user_mempool_chunk_free(mp, mag->obj[--mag->rounds]);
+        if (slab != NULL)
+        {
+            slab->next = release;
+            release = slab;
+        }
+    }
+    pthread_spin_unlock(&mp->mp_lock);
+
+    while ((slab = release) != NULL)
+    {
+        release = slab->next;
+        user_slab_destroy(mp, slab);
+    }
 }
 
-uint32_t user_mempool_isdanger(user_mempool *mp)
+void *user_mempool_alloc(user_mempool *mp)
 {
-#define DANGER_THREADSHOLD    0.95
-#define SAFE_THREADSHOLD    0.90
+    user_mag_cache *cc = user_mag_cache_get(mp);
+    user_magazine *mag;
+    void *p;
 
-    uint32_t danger_num = mp->mp_total_chunks * DANGER_THREADSHOLD;
-    uint32_t safe_num = mp->mp_total_chunks * SAFE_THREADSHOLD;
+    if (cc != NULL)
+    {
+        if (cc->loaded && cc->loaded->rounds > 0)
+        {
+            return cc->loaded->obj[--cc->loaded->rounds];
+        }
 
-    if ((int) danger_num < mp->mp_total_chunks - mp->mp_free_chunks)
+        if (cc->prev && cc->prev->rounds > 0)
+        {
+            mag = cc->loaded;
+            cc->loaded = cc->prev;
+            cc->prev = mag;
+            return cc->loaded->obj[--cc->loaded->rounds];
+        }
+
+        mag = user_depot_pop(mp, &mp->mp_depot_full);
+        if (mag != NULL)
+        {
+            user_mag_put(mp, cc->prev);
+            cc->prev = cc->loaded;
+            cc->loaded = mag;
+            return cc->loaded->obj[--cc->loaded->rounds];
+        }
+
+        /* the depot ran dry, refill half a magazine from the free list */
+        if (cc->loaded == NULL)
+        {
+            cc->loaded = user_depot_pop(mp, &mp->mp_depot_empty);
+        }
+    }
+
+    pthread_spin_lock(&mp->mp_lock);
+    p = user_mempool_chunk_alloc(mp);
+    if (p == NULL)
     {
-        return mp->mp_total_chunks - mp->mp_free_chunks - safe_num;
+        pthread_spin_unlock(&mp->mp_lock);
+        user_mempool_grow(mp);
+        pthread_spin_lock(&mp->mp_lock);
+
+        p = user_mempool_chunk_alloc(mp);
     }
-    return 0;
-}
\ No newline at end of file
+    if (p != NULL && cc != NULL && cc->loaded != NULL)
+    {
+        void *q;
+        while (cc->loaded->rounds < mp->mp_mag_rounds / 2 &&
+               (q = user_mempool_chunk_alloc(mp)) != NULL)
+        {
+            cc->loaded->obj[cc->loaded->rounds++] = q;
+        }
+    }
+    pthread_spin_unlock(&mp->mp_lock);
+
+    return p;
+}
+
+void user_mempool_free(user_mempool *mp, void *p)
+{
+    user_mag_cache *cc;
+    user_mem_slab *slab;
+    user_magazine *mag;
+
+    assert(((u_char *) p - user_slab_of(mp, p)->startptr) % mp->mp_chunk_size == 0);
+
+    cc = user_mag_cache_get(mp);
+    if (cc != NULL)
+    {
+        if (cc->loaded && cc->loaded->rounds < mp->mp_mag_rounds)
+        {
+            cc->loaded->obj[cc->loaded->rounds++] = p;
+            return;
+        }
+
+        if (cc->prev && cc->prev->rounds == 0)
+        {
+            mag = cc->loaded;
+            cc->loaded = cc->prev;
+            cc->prev = mag;
+            cc->loaded->obj[cc->loaded->rounds++] = p;
+            return;
+        }
+
+        /* the depot keeps more than the high watermark, return rounds to the slabs so they can go */
+        if (cc->loaded && mp->mp_nslabs > mp->mp_min_slabs &&
+            __atomic_load_n(&mp->mp_depot_rounds, __ATOMIC_RELAXED) > USER_MEMPOOL_HIWAT * mp->mp_slab_chunks)
+        {
+            user_mag_drain(mp, cc->loaded);
+            cc->loaded->obj[cc->loaded->rounds++] = p;
+
+            mag = user_depot_pop(mp, &mp->mp_depot_full);
+            if (mag != NULL)
+            {
+                user_mag_drain(mp, mag);
+                user_mag_put(mp, mag);
+            }
+            return;
+        }
+
+        mag = user_depot_pop(mp, &mp->mp_depot_empty);
+        if (mag != NULL)
+        {
+            user_mag_put(mp, cc->prev);
+            cc->prev = cc->loaded;
+            cc->loaded = mag;
+            cc->loaded->obj[cc->loaded->rounds++] = p;
+            return;
+        }
+    }
+
+    pthread_spin_lock(&mp->mp_lock);
+    slab = user_mempool_chunk_free(mp, p);
+    pthread_spin_unlock(&mp->mp_lock);
+
+    if (slab != NULL)
+    {
+        user_slab_destroy(mp, slab);
+    }
+}
+
+/* slabs and depot, the magazines threads hold are not counted */
+int user_mempool_getfree_chunks(user_mempool *mp)
+{
+    return mp->mp_free_chunks + __atomic_load_n(&mp->mp_depot_rounds, __ATOMIC_RELAXED);
+}
+
+/* handed out, or held by the magazines of threads */
+int user_mempool_used_chunks(user_mempool *mp)
+{
+    return mp->mp_total_chunks - user_mempool_getfree_chunks(mp);
+}
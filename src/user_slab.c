@@ -0,0 +1,151 @@
+#include "user_slab.h"
+#include "user_mempool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* spaced at most 50% apart, so a class wastes at most a third of a chunk */
+static const uint32_t user_slab_sizes[USER_SLAB_NCLASS] =
+{
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
+
+static user_mempool *user_slab_mp[USER_SLAB_NCLASS];
+static uint8_t user_slab_index[USER_SLAB_MAX_SIZE / 16];   // (size - 1) / 16 -> class
+static uint64_t user_slab_req[USER_SLAB_NCLASS];
+static uint64_t user_slab_large;
+static pthread_once_t user_slab_once = PTHREAD_ONCE_INIT;
+
+static void user_slab_init(void)
+{
+    int cls = 0;
+    int i;
+
+    for (i = 0; i < USER_SLAB_MAX_SIZE / 16; i++)
+    {
+        while (user_slab_sizes[cls] < (uint32_t) (i + 1) * 16)
+        {
+            cls++;
+        }
+        user_slab_index[i] = cls;
+    }
+
+    /* one slab each to start with, the pools grow with use */
+    for (i = 0; i < USER_SLAB_NCLASS; i++)
+    {
+        user_slab_mp[i] = user_mempool_create(user_slab_sizes[i], user_slab_sizes[i], MEM_DEFAULT);
+        if (!user_slab_mp[i])
+        {
+            printf("user_slab_init --> no pool for class %u\n", user_slab_sizes[i]);
+        }
+    }
+}
+
+void *user_slab_alloc(size_t size)
+{
+    void *p;
+    int cls;
+
+    if (size > USER_SLAB_MAX_SIZE)
+    {
+        p = malloc(size);
+        if (p)
+        {
+            __atomic_fetch_add(&user_slab_large, size, __ATOMIC_RELAXED);
+        }
+        return p;
+    }
+
+    pthread_once(&user_slab_once, user_slab_init);
+
+    cls = user_slab_index[size ? (size - 1) >> 4 : 0];
+    if (!user_slab_mp[cls])
+        return NULL;
+
+    p = user_mempool_alloc(user_slab_mp[cls]);
+    if (p)
+    {
+        __atomic_fetch_add(&user_slab_req[cls], size, __ATOMIC_RELAXED);
+    }
+    return p;
+}
+
+void *user_slab_zalloc(size_t size)
+{
+    void *p = user_slab_alloc(size);
+
+    if (p)
+    {
+        memset(p, 0, size);
+    }
+    return p;
+}
+
+void user_slab_free(void *p, size_t size)
+{
+    int cls;
+
+    if (!p)
+        return;
+
+    if (size > USER_SLAB_MAX_SIZE)
+    {
+        __atomic_fetch_sub(&user_slab_large, size, __ATOMIC_RELAXED);
+        free(p);
+        return;
+    }
+
+    cls = user_slab_index[size ? (size - 1) >> 4 : 0];
+    __atomic_fetch_sub(&user_slab_req[cls], size, __ATOMIC_RELAXED);
+    user_mempool_free(user_slab_mp[cls], p);
+}
+
+int user_slab_stats(user_slab_stat *st, int n)
+{
+    user_mempool *mp;
+    int i;
+
+    pthread_once(&user_slab_once, user_slab_init);
+
+    for (i = 0; i < n && i < USER_SLAB_NCLASS; i++)
+    {
+        mp = user_slab_mp[i];
+        memset(&st[i], 0, sizeof(user_slab_stat));
+        st[i].size = user_slab_sizes[i];
+        if (!mp)
+            continue;
+
+        st[i].slabs = mp->mp_nslabs;
+        st[i].total = mp->mp_total_chunks;
+        st[i].used = mp->mp_total_chunks - user_mempool_getfree_chunks(mp);
+        st[i].req_bytes = __atomic_load_n(&user_slab_req[i], __ATOMIC_RELAXED);
+    }
+    return i;
+}
+
+/* internal: rounding up to the class, external: free chunks in the slabs */
+void user_slab_dump(void)
+{
+    user_slab_stat st[USER_SLAB_NCLASS];
+    uint64_t used_bytes, total_bytes;
+    int i, n;
+
+    n = user_slab_stats(st, USER_SLAB_NCLASS);
+
+    printf("%6s %6s %10s %10s %12s %8s %8s\n",
+           "size", "slabs", "total", "used", "requested", "int%", "ext%");
+    for (i = 0; i < n; i++)
+    {
+        used_bytes = st[i].used * st[i].size;
+        total_bytes = st[i].total * st[i].size;
+        printf("%6u %6u %10lu %10lu %12lu %8.1f %8.1f\n",
+               st[i].size, st[i].slabs,
+               (unsigned long) st[i].total, (unsigned long) st[i].used,
+               (unsigned long) st[i].req_bytes,
+               used_bytes ? 100.0 * (used_bytes - st[i].req_bytes) / used_bytes : 0.0,
+               total_bytes ? 100.0 * (total_bytes - used_bytes) / total_bytes : 0.0);
+    }
+    printf("large: %lu bytes\n", (unsigned long) __atomic_load_n(&user_slab_large, __ATOMIC_RELAXED));
+}
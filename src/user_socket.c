@@ -1,14 +1,51 @@
 #include "user_epoll_inner.h"
 #include "user_header.h"
 #include "user_socket.h"
+#include "user_slab.h"
+#include "user_mempool.h"
 
-#include <hugetlbfs.h>
 #include <pthread.h>
 #include <errno.h>
 
 extern user_tcp_manager *user_get_tcp_manager(void);
 
-user_socket_map *user_allocate_socket(int socktype, int need_lock)
+/*
+ * the socket map is a table of blocks of USER_MAX_CONCURRENCY entries,
+ * one more is added when the free ones run out. blocks are never moved
+ * or freed, so an id handed out stays valid without the lock. called
+ * under smap_lock, or at init before any app thread runs.
+ */
+int user_socket_map_grow(struct _user_tcp_manager *tcp)
+{
+    user_socket_map *block;
+    int base = tcp->smap_cnt;
+    int i;
+
+    if (base + USER_MAX_CONCURRENCY > USER_MAX_SOCKETS)
+        return -1;
+
+    block = (user_socket_map *) calloc(USER_MAX_CONCURRENCY, sizeof(user_socket_map));
+    if (!block)
+        return -1;
+
+    for (i = 0; i < USER_MAX_CONCURRENCY; i++)
+    {
+        block[i].id = base + i;
+        block[i].socktype = USER_TCP_SOCK_UNUSED;
+        TAILQ_INSERT_TAIL(&tcp->free_smap, &block[i], free_smap_link);
+    }
+
+    tcp->smap[base / USER_MAX_CONCURRENCY] = block;
+    __atomic_store_n(&tcp->smap_cnt, base + USER_MAX_CONCURRENCY, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/*
+ * sockets are allocated from app threads (socket, accept, epoll_create),
+ * the free list and the growth of the map are under smap_lock.
+ */
+user_socket_map *user_allocate_socket(int socktype)
 {
     user_tcp_manager *tcp = user_get_tcp_manager();
     if (tcp == NULL)
@@ -17,21 +54,19 @@ user_socket_map *user_allocate_socket(int socktype, int need_lock)
         return NULL;
     }
 
-    if (need_lock)
-    {
-        pthread_mutex_lock(&tcp->ctx->smap_lock);
-    }
+    pthread_mutex_lock(&tcp->ctx->smap_lock);
 
     user_socket_map *socket = NULL;
     while (socket == NULL)
     {
         socket = TAILQ_FIRST(&tcp->free_smap);
+        if (!socket && user_socket_map_grow(tcp) == 0)
+        {
+            socket = TAILQ_FIRST(&tcp->free_smap);
+        }
         if (!socket)
         {
-            if (need_lock)
-            {
-                pthread_mutex_unlock(&tcp->ctx->smap_lock);
-            }
+            pthread_mutex_unlock(&tcp->ctx->smap_lock);
             printf("The concurrent sockets are at maximum.\n");
             return NULL;
         }
@@ -45,10 +80,8 @@ user_socket_map *user_allocate_socket(int socktype, int need_lock)
         }
     }
 
-    if (need_lock)
-    {
-        pthread_mutex_unlock(&tcp->ctx->smap_lock);
-    }
+    pthread_mutex_unlock(&tcp->ctx->smap_lock);
+
     socket->socktype = socktype;
     socket->opts = 0;
     socket->stream = NULL;
@@ -60,10 +93,10 @@ user_socket_map *user_allocate_socket(int socktype, int need_lock)
     return socket;
 }
 
-void user_free_socket(int sockid, int need_lock)
+void user_free_socket(int sockid)
 {
     user_tcp_manager *tcp = user_get_tcp_manager();
-    user_socket_map *socket = &tcp->smap[sockid];
+    user_socket_map *socket = USER_SMAP(tcp, sockid);
 
     if (socket->socktype == USER_TCP_SOCK_UNUSED)
     {
@@ -73,30 +106,23 @@ void user_free_socket(int sockid, int need_lock)
     socket->socktype = USER_EPOLLNONE;
     socket->events = 0;
 
-    if (need_lock)
-    {
-        pthread_mutex_lock(&tcp->ctx->smap_lock);
-    }
-    tcp->smap[sockid].stream = NULL;
+    pthread_mutex_lock(&tcp->ctx->smap_lock);
+    USER_SMAP(tcp, sockid)->stream = NULL;
     TAILQ_INSERT_TAIL(&tcp->free_smap, socket, free_smap_link);
-
-    if (need_lock)
-    {
-        pthread_mutex_unlock(&tcp->ctx->smap_lock);
-    }
+    pthread_mutex_unlock(&tcp->ctx->smap_lock);
 }
 
 user_socket_map *user_get_socket(int sockid)
 {
+    user_tcp_manager *tcp = user_get_tcp_manager();
 #if 1
-    if (sockid < 0 || sockid >= USER_MAX_CONCURRENCY)
+    if (sockid < 0 || sockid >= tcp->smap_cnt)
     {
         errno = EBADF;
         return NULL;
     }
 #endif
-    user_tcp_manager *tcp = user_get_tcp_manager();
-    user_socket_map *socket = &tcp->smap[sockid];
+    user_socket_map *socket = USER_SMAP(tcp, sockid);
 
     return socket;
 }
@@ -120,23 +146,15 @@ struct _user_socket_table * user_socket_allocate_fdtable(void)
     }
 
     size_t total_size = USER_SOCKFD_NR * sizeof(struct _user_socket *);
-#if 0 //(USER_SOCKFD_NR > 1024)
-    sock_table->sockfds = (struct _user_socket **)get_huge_pages(total_size, GHP_DEFAULT);
+    sock_table->mem_type = MEM_DEFAULT;
+    sock_table->sockfds = (struct _user_socket **) user_mem_map(total_size, &sock_table->mem_type, -1);
     if (sock_table->sockfds == NULL)
     {
         errno = -ENOMEM;
         free(sock_table);
         return NULL;
     }
-#else
-    int res = posix_memalign((void **)&sock_table->sockfds, getpagesize(), total_size);
-    if (res != 0)
-    {
-        errno = -ENOMEM;
-        free(sock_table);
-        return NULL;
-    }
-#endif
+    memset(sock_table->sockfds, 0, total_size);
 
     sock_table->max_fds = (USER_SOCKFD_NR % USER_BITS_PER_BYTE ? USER_SOCKFD_NR / USER_BITS_PER_BYTE + 1 : USER_SOCKFD_NR / USER_BITS_PER_BYTE);
 
@@ -144,11 +162,7 @@ struct _user_socket_table * user_socket_allocate_fdtable(void)
     if (sock_table->open_fds == NULL)
     {
         errno = -ENOMEM;
-#if 0 //(USER_SOCKFD_NR > 1024)
-        free_huge_pages(sock_table->sockfds);
-#else
-        free(sock_table->sockfds);
-#endif
+        user_mem_unmap(sock_table->sockfds, total_size, sock_table->mem_type, -1);
         free(sock_table);
         return NULL;
     }
@@ -157,11 +171,7 @@ struct _user_socket_table * user_socket_allocate_fdtable(void)
     {
         errno = -EINVAL;
         free(sock_table->open_fds);
-#if 0 //(USER_SOCKFD_NR > 1024)
-        free_huge_pages(sock_table->sockfds);
-#else
-        free(sock_table->sockfds);
-#endif
+        user_mem_unmap(sock_table->sockfds, total_size, sock_table->mem_type, -1);
         free(sock_table);
 
         return NULL;
@@ -174,11 +184,7 @@ void user_socket_free_fdtable(struct _user_socket_table *fdtable)
 {
     pthread_spin_destroy(&fdtable->lock);
     free(fdtable->open_fds);
-#if (USER_SOCKFD_NR > 1024)
-    free_huge_pages(fdtable->sockfds);
-#else
-    free(fdtable->sockfds);
-#endif
+    user_mem_unmap(fdtable->sockfds, USER_SOCKFD_NR * sizeof(struct _user_socket *), fdtable->mem_type, -1);
     free(fdtable);
 }
 
@@ -254,7 +260,7 @@ char user_socket_use_id(unsigned char *fds, size_t idx)
 
 struct _user_socket* user_socket_allocate(int socktype)
 {
-    struct _user_socket *s = (struct _user_socket*)calloc(1, sizeof(struct _user_socket));
+    struct _user_socket *s = (struct _user_socket*)user_slab_zalloc(sizeof(struct _user_socket));
     if (s == NULL)
     {
         errno = -ENOMEM;
@@ -268,6 +274,7 @@ struct _user_socket* user_socket_allocate(int socktype)
     if (s->id == -1)
     {
         pthread_spin_unlock(&sock_table->lock);
+        user_slab_free(s, sizeof(struct _user_socket));
         errno = -ENFILE;
         return NULL;
     }
@@ -305,7 +312,7 @@ void user_socket_free(int sockid)
 
     pthread_spin_unlock(&sock_table->lock);
 
-    free(s);
+    user_slab_free(s, sizeof(struct _user_socket));
 
     UNUSED(byte);
     user_trace_socket("user_socket_free --> Exit\n");
@@ -41,6 +41,8 @@ user_addr_pool *global_addr_pool[ETH_NUM] = {NULL};
 extern void RemoveFromRTOList(user_tcp_manager *tcp, user_tcp_stream *cur_stream);
 extern void RemoveFromTimeoutList(user_tcp_manager *tcp, user_tcp_stream *cur_stream);
 extern void RemoveFromTimewaitList(user_tcp_manager *tcp, user_tcp_stream *cur_stream);
+extern void RemoveFromDelackList(user_tcp_manager *tcp, user_tcp_stream *cur_stream);
+extern void RemoveFromCorkList(user_tcp_manager *tcp, user_tcp_stream *cur_stream);
 extern int GetOutputInterface(uint32_t daddr);
 
 char *TCPStateToString(user_tcp_stream *stream)
@@ -188,52 +190,101 @@ void RaiseErrorEvent(user_tcp_manager *tcp, user_tcp_stream *stream)
 }
 
 
-user_tcp_stream *CreateTcpStream(user_tcp_manager *tcp, struct _user_socket_map *socket, int type,
-                                 uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport)
+/* constructor and destructor of the flow pool, see user_mempool_create_cache */
+int user_tcp_conn_ctor(void *obj, void *arg)
 {
-    user_tcp_stream *stream = NULL;
-    pthread_mutex_lock(&tcp->ctx->flow_pool_lock);
+    user_tcp_conn *conn = (user_tcp_conn *) obj;
 
-    stream = user_mempool_alloc(tcp->flow);
-    if (stream == NULL)
+#if USER_ENABLE_BLOCKING
+    if (pthread_mutex_init(&conn->rcv.read_lock, NULL))
     {
-        pthread_mutex_unlock(&tcp->ctx->flow_pool_lock);
-        return NULL;
+        perror("pthread_mutex_init of read_lock");
+        return -1;
     }
-    memset(stream, 0, sizeof(user_tcp_stream));
 
-    stream->rcv = (user_tcp_recv *) user_mempool_alloc(tcp->rcv);
-    if (stream->rcv == NULL)
+    if (pthread_mutex_init(&conn->snd.write_lock, NULL))
     {
-        user_mempool_free(tcp->flow, stream);
-        pthread_mutex_unlock(&tcp->ctx->flow_pool_lock);
-        return NULL;
+        perror("pthread_mutex_init of write_lock");
+        pthread_mutex_destroy(&conn->rcv.read_lock);
+        return -1;
     }
-    memset(stream->rcv, 0, sizeof(user_tcp_recv));
 
-    stream->snd = (user_tcp_send *) user_mempool_alloc(tcp->snd);
-    if (!stream->snd)
+    if (pthread_cond_init(&conn->rcv.read_cond, NULL))
+    {
+        perror("pthread_cond_init of read_cond");
+        pthread_mutex_destroy(&conn->snd.write_lock);
+        pthread_mutex_destroy(&conn->rcv.read_lock);
+        return -1;
+    }
+
+    if (pthread_cond_init(&conn->snd.write_cond, NULL))
+    {
+        perror("pthread_cond_init of write_cond");
+        pthread_cond_destroy(&conn->rcv.read_cond);
+        pthread_mutex_destroy(&conn->snd.write_lock);
+        pthread_mutex_destroy(&conn->rcv.read_lock);
+        return -1;
+    }
+#else
+    if (pthread_spin_init(&conn->rcv.read_lock, PTHREAD_PROCESS_PRIVATE))
+    {
+        perror("pthread_spin_init of read_lock");
+        return -1;
+    }
+
+    if (pthread_spin_init(&conn->snd.write_lock, PTHREAD_PROCESS_PRIVATE))
+    {
+        perror("pthread_spin_init of write_lock");
+        pthread_spin_destroy(&conn->rcv.read_lock);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+void user_tcp_conn_dtor(void *obj, void *arg)
+{
+    user_tcp_conn *conn = (user_tcp_conn *) obj;
+
+#if USER_ENABLE_BLOCKING
+    pthread_cond_destroy(&conn->snd.write_cond);
+    pthread_cond_destroy(&conn->rcv.read_cond);
+#endif
+    SBUF_LOCK_DESTROY(&conn->snd.write_lock);
+    SBUF_LOCK_DESTROY(&conn->rcv.read_lock);
+}
+
+user_tcp_stream *CreateTcpStream(user_tcp_manager *tcp, struct _user_socket_map *socket, int type,
+                                 uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport)
+{
+    user_tcp_stream *stream = NULL;
+
+    /* the pools have per-thread magazines, only the flow table needs the lock */
+    user_tcp_conn *conn = user_mempool_alloc(tcp->flow);
+    if (conn == NULL)
     {
-        user_mempool_free(tcp->rcv, stream->rcv);
-        user_mempool_free(tcp->flow, stream);
-        pthread_mutex_unlock(&tcp->ctx->flow_pool_lock);
         return NULL;
     }
-    memset(stream->snd, 0, sizeof(user_tcp_send));
+    memset(&conn->stream, 0, sizeof(user_tcp_stream));
+    memset(&conn->rcv, 0, offsetof(user_tcp_recv, read_lock));
+    memset(&conn->snd, 0, offsetof(user_tcp_send, write_lock));
+
+    stream = &conn->stream;
+    stream->rcv = &conn->rcv;
+    stream->snd = &conn->snd;
 
-    stream->id = tcp->gid++;
     stream->saddr = saddr;
     stream->sport = sport;
     stream->daddr = daddr;
     stream->dport = dport;
 
+    pthread_mutex_lock(&tcp->ctx->flow_pool_lock);
+    stream->id = tcp->gid++;
     int ret = StreamHTInsert(tcp->tcp_flow_table, stream);
     if (ret < 0)
     {
-        user_mempool_free(tcp->rcv, stream->rcv);
-        user_mempool_free(tcp->snd, stream->snd);
-        user_mempool_free(tcp->flow, stream);
         pthread_mutex_unlock(&tcp->ctx->flow_pool_lock);
+        user_mempool_free(tcp->flow, conn);
         return NULL;
     }
 
@@ -265,74 +316,43 @@ user_tcp_stream *CreateTcpStream(user_tcp_manager *tcp, struct _user_socket_map
     stream->snd->snd_wnd = USER_SEND_BUFFER_SIZE;
 
     stream->rcv_nxt = 0;
-    stream->rcv->rcv_wnd = TCP_INITIAL_WINDOW;
+    stream->rcv->rcv_wnd = MIN(TCP_INITIAL_WINDOW, USER_RCVBUF_SIZE);
+    stream->rcv->delack_ms = TCP_DELACK_MS;
+    stream->rcv->delack_segs = TCP_DELACK_SEGS;
+    stream->rcv->quickack = TCP_MAX_QUICKACKS;
     stream->rcv->snd_wl1 = stream->rcv->irs - 1;
 
     stream->snd->rto = TCP_INITIAL_RTO;
+    stream->snd->cc_algo = TCP_DEFAULT_CC;
+    stream->snd->keep_idle = TCP_KEEPIDLE_DEFAULT;
+    stream->snd->keep_intvl = TCP_KEEPINTVL_DEFAULT;
+    stream->snd->keep_cnt = TCP_KEEPCNT_DEFAULT;
 
-#if USER_ENABLE_BLOCKING
-
-    if (pthread_mutex_init(&stream->rcv->read_lock, NULL))
-    {
-        printf("pthread_spin_init \n");
-        return NULL;
-    }
-
-    if (pthread_mutex_init(&stream->snd->write_lock, NULL))
-    {
-        pthread_mutex_destroy(&stream->rcv->read_lock);
-        printf("pthread_spin_init \n");
-        return NULL;
-    }
-
-    if (pthread_cond_init(&stream->rcv->read_cond, NULL))
-    {
-        perror("pthread_cond_init of read_cond");
-        return NULL;
-    }
-
-    if (pthread_cond_init(&stream->snd->write_cond, NULL))
-    {
-        perror("pthread_cond_init of write_cond");
-        return NULL;
-    }
-
-#else
-    if (pthread_spin_init(&stream->rcv->read_lock, PTHREAD_PROCESS_PRIVATE))
-    {
-        printf("pthread_spin_init \n");
-        return NULL;
-    }
-
-    if (pthread_spin_init(&stream->snd->write_lock, PTHREAD_PROCESS_PRIVATE))
-    {
-        pthread_spin_destroy(&stream->rcv->read_lock);
-        printf("pthread_spin_init \n");
-        return NULL;
-    }
-#endif
+#ifdef USER_DEBUG
     uint8_t *sa = (uint8_t * ) & stream->saddr;
     uint8_t *da = (uint8_t * ) & stream->daddr;
 
-    printf("CREATED NEW TCP STREAM %d: "
+    user_trace_tcp("CREATED NEW TCP STREAM %d: "
            "%u.%u.%u.%u(%d) -> %u.%u.%u.%u(%d) (ISS: %u)\n", stream->id,
            sa[0], sa[1], sa[2], sa[3], ntohs(stream->sport),
            da[0], da[1], da[2], da[3], ntohs(stream->dport),
            stream->snd->iss);
+#endif
     return stream;
 }
 
 void DestroyTcpStream(user_tcp_manager *tcp, user_tcp_stream *stream)
 {
-
+#ifdef USER_DEBUG
     uint8_t *sa = (uint8_t * ) & stream->saddr;
     uint8_t *da = (uint8_t * ) & stream->daddr;
 
-    printf("DESTROY TCP STREAM %d: "
+    user_trace_tcp("DESTROY TCP STREAM %d: "
            "%u.%u.%u.%u(%d) -> %u.%u.%u.%u(%d) (%s)\n", stream->id,
            sa[0], sa[1], sa[2], sa[3], ntohs(stream->sport),
            da[0], da[1], da[2], da[3], ntohs(stream->dport),
            close_reason_str[stream->close_reason]);
+#endif
 
     if (stream->snd->sndbuf)
     {
@@ -374,14 +394,12 @@ void DestroyTcpStream(user_tcp_manager *tcp, user_tcp_stream *stream)
         RemoveFromTimewaitList(tcp, stream);
     }
     RemoveFromTimeoutList(tcp, stream);
+    RemoveFromDelackList(tcp, stream);
+    RemoveFromCorkList(tcp, stream);
+    user_tcp_keepalive_disarm(tcp, stream);
+    user_tcp_mem_idle_disarm(tcp, stream);
+    user_tcp_fastopen_release(tcp, stream);
 
-#if USER_ENABLE_BLOCKING
-    pthread_mutex_destroy(&stream->rcv->read_lock);
-    pthread_mutex_destroy(&stream->snd->write_lock);
-#else
-    SBUF_LOCK_DESTROY(&stream->rcv->read_lock);
-    SBUF_LOCK_DESTROY(&stream->snd->write_lock);
-#endif
     assert(stream->on_hash_table == 1);
 
     if (stream->snd->sndbuf)
@@ -389,6 +407,7 @@ void DestroyTcpStream(user_tcp_manager *tcp, user_tcp_stream *stream)
         SBFree(tcp->rbm_snd, stream->snd->sndbuf);
         stream->snd->sndbuf = NULL;
     }
+    user_tcp_cc_destroy(stream);
 
     if (stream->rcv->recvbuf)
     {
@@ -400,13 +419,11 @@ void DestroyTcpStream(user_tcp_manager *tcp, user_tcp_stream *stream)
     StreamHTRemove(tcp->tcp_flow_table, stream);
     stream->on_hash_table = 0;
     tcp->flow_cnt--;
+    pthread_mutex_unlock(&tcp->ctx->flow_pool_lock);
 
-    user_mempool_free(tcp->rcv, stream->rcv);
-    user_mempool_free(tcp->snd, stream->snd);
+    /* the stream is the first member of its user_tcp_conn */
     user_mempool_free(tcp->flow, stream);
 
-    pthread_mutex_unlock(&tcp->ctx->flow_pool_lock);
-
     int ret = -1;
     if (bound_addr)
     {
@@ -61,9 +61,13 @@ static void user_tcp_process_ack(user_tcp_manager *tcp, user_tcp_stream *cur_str
 
 static int user_tcp_process_rst(user_tcp_manager *tcp, user_tcp_stream *cur_stream, uint32_t ack_seq);
 
+static int user_tcp_accept_enqueue(user_tcp_manager *tcp, user_tcp_listener *listener, user_tcp_stream *cur_stream);
+
 extern unsigned short in_cksum(unsigned short *addr, int len);
 
 extern void AddtoRTOList(user_tcp_manager *tcp, user_tcp_stream *cur_stream);
+extern int  user_tcp_conn_ctor(void *obj, void *arg);
+extern void user_tcp_conn_dtor(void *obj, void *arg);
 
 extern void UpdateRetransmissionTimer(user_tcp_manager *tcp,
                                       user_tcp_stream *cur_stream, uint32_t cur_ts);
@@ -76,6 +80,10 @@ extern void RemoveFromTimewaitList(user_tcp_manager *tcp, user_tcp_stream *cur_s
 
 extern void UpdateTimeoutList(user_tcp_manager *tcp, user_tcp_stream *cur_stream);
 extern void RemoveFromTimeoutList(user_tcp_manager *tcp, user_tcp_stream *cur_stream);
+extern void AddtoDelackList(user_tcp_manager *tcp, user_tcp_stream *cur_stream, uint32_t ts_delack);
+extern void RemoveFromDelackList(user_tcp_manager *tcp, user_tcp_stream *cur_stream);
+extern void AddtoCorkList(user_tcp_manager *tcp, user_tcp_stream *cur_stream, uint32_t ts_due);
+extern void RemoveFromCorkList(user_tcp_manager *tcp, user_tcp_stream *cur_stream);
 
 extern void InitializeTCPStreamManager();
 
@@ -90,7 +98,7 @@ user_tcp_manager *user_get_tcp_manager(void)
     return user_tcp;
 }
 
-static inline uint16_t user_calculate_option(uint8_t flags)
+static inline uint16_t user_calculate_option(uint16_t flags)
 {
     uint16_t optlen = 0;
 
@@ -158,10 +166,11 @@ static void user_tcp_generate_timestamp(user_tcp_stream *cur_stream, uint8_t *tc
 }
 
 static void user_tcp_generate_options(user_tcp_stream *cur_stream, uint32_t cur_ts,
-                                      uint8_t flags, uint8_t *tcpopt, uint16_t optlen)
+                                      uint16_t flags, uint8_t *tcpopt, uint16_t optlen,
+                                      user_tcp_sack_block *sack, int nsack)
 {
 
-    int i = 0;
+    int i = 0, j;
 
     if (flags & USER_TCPHDR_SYN)
     {
@@ -172,8 +181,16 @@ static void user_tcp_generate_options(user_tcp_stream *cur_stream, uint32_t cur_
         tcpopt[i++] = mss >> 8;
         tcpopt[i++] = mss % 256;
 
-        tcpopt[i++] = TCP_OPT_NOP;
-        tcpopt[i++] = TCP_OPT_NOP;
+        if (TCP_SACK_ENABLE && (!(flags & USER_TCPHDR_ACK) || cur_stream->sack_permit))
+        {
+            tcpopt[i++] = TCP_OPT_SACK_PERMIT;
+            tcpopt[i++] = USER_TCPOPT_SACK_PERMIT_LEN;
+        }
+        else
+        {
+            tcpopt[i++] = TCP_OPT_NOP;
+            tcpopt[i++] = TCP_OPT_NOP;
+        }
 
         user_tcp_generate_timestamp(cur_stream, tcpopt + i, cur_ts);
         i += USER_TCPOPT_TIMESTAMP_LEN;
@@ -191,12 +208,27 @@ static void user_tcp_generate_options(user_tcp_stream *cur_stream, uint32_t cur_
         tcpopt[i++] = TCP_OPT_NOP;
         user_tcp_generate_timestamp(cur_stream, tcpopt + i, cur_ts);
         i += USER_TCPOPT_TIMESTAMP_LEN;
+
+        if (nsack > 0)
+        {
+            tcpopt[i++] = TCP_OPT_NOP;
+            tcpopt[i++] = TCP_OPT_NOP;
+            tcpopt[i++] = TCP_OPT_SACK;
+            tcpopt[i++] = 2 + nsack * 8;
+            for (j = 0; j < nsack; j++)
+            {
+                *(uint32_t *)(tcpopt + i) = htonl(sack[j].start);
+                *(uint32_t *)(tcpopt + i + 4) = htonl(sack[j].end);
+                i += 8;
+            }
+        }
     }
 
     assert(i == optlen);
 }
 
-uint16_t user_calculate_chksum(uint16_t *buf, uint16_t len, uint32_t saddr, uint32_t daddr)
+/* takes bytes, the header may be a packed struct at any alignment in the frame */
+uint16_t user_calculate_chksum(uint8_t *buf, uint16_t len, uint32_t saddr, uint32_t daddr)
 {
     uint32_t sum;
     uint16_t *w;
@@ -204,7 +236,7 @@ uint16_t user_calculate_chksum(uint16_t *buf, uint16_t len, uint32_t saddr, uint
 
     sum = 0;
     nleft = len;
-    w = buf;
+    w = (uint16_t *) buf;
 
     while (nleft > 1)
     {
@@ -315,7 +347,12 @@ void user_tcp_remove_sendlist(user_tcp_manager *tcp, user_tcp_stream *cur_stream
 {
     user_sender *sender = user_tcp_getsender(tcp, cur_stream);
 
-    if (cur_stream->snd->on_send_list)
+    if (cur_stream->snd->on_pace_wheel)
+    {
+        user_tcp_pace_unpark(sender, cur_stream);
+        cur_stream->snd->on_send_list = 0;
+    }
+    else if (cur_stream->snd->on_send_list)
     {
         cur_stream->snd->on_send_list = 0;
         TAILQ_REMOVE(&sender->send_list, cur_stream, snd->send_link);
@@ -355,12 +392,13 @@ void user_tcp_parse_options(user_tcp_stream *cur_stream, uint32_t cur_ts, uint8_
             }
             else if (opt == TCP_OPT_WSCALE)
             {
-                cur_stream->snd->wscale_peer = *(tcpopt + i++);
+                cur_stream->snd->wscale_peer = MIN(*(tcpopt + i++), 14);
+                cur_stream->wscale_ok = 1;
 
             }
             else if (opt == TCP_OPT_SACK_PERMIT)
             {
-                cur_stream->sack_permit = 1;
+                cur_stream->sack_permit = TCP_SACK_ENABLE;
                 user_trace_tcp("Remote SACK permited.\n");
 
             }
@@ -412,6 +450,67 @@ void user_tcp_enqueue_acklist(user_tcp_manager *tcp, user_tcp_stream *cur_stream
     user_tcp_addto_acklist(tcp, cur_stream);
 }
 
+static int user_tcp_ooo_pending(user_tcp_stream *cur_stream)
+{
+    user_fragment_ctx *frag;
+    int pending;
+
+    if (!cur_stream->rcv->recvbuf)
+        return 0;
+
+    /* ranges are in order and apart, only the first can start at rcv_nxt */
+    SBUF_LOCK(&cur_stream->rcv->read_lock);
+    frag = cur_stream->rcv->recvbuf->fctx;
+    if (frag && TCP_SEQ_LEQ(frag->seq, cur_stream->rcv_nxt))
+        frag = frag->next;
+    pending = (frag != NULL);
+    SBUF_UNLOCK(&cur_stream->rcv->read_lock);
+
+    return pending;
+}
+
+/*
+ * in-order data was queued. ack at once in quick-ack mode, while
+ * out-of-order data is held, when the segment filled a hole or every
+ * delack_segs full segments, else within delack_ms.
+ */
+static void user_tcp_enqueue_delack(user_tcp_manager *tcp, user_tcp_stream *cur_stream, uint32_t cur_ts,
+                                    uint32_t seq, int payloadlen)
+{
+    user_tcp_recv *rcv = cur_stream->rcv;
+    uint32_t mss = cur_stream->snd->mss;
+    int now = 0;
+
+    /* idle for an rto, the peer restarts in slow start */
+    if (rcv->ts_last_data && (int32_t)(cur_ts - rcv->ts_last_data) > (int32_t) cur_stream->snd->rto)
+    {
+        rcv->quickack = MIN(MAX(rcv->rcv_wnd / (2 * mss), 2), TCP_MAX_QUICKACKS);
+    }
+    rcv->ts_last_data = cur_ts;
+    rcv->delack_bytes += payloadlen;
+
+    if (rcv->delack_ms == 0 || rcv->quickack > 0)
+    {
+        if (rcv->quickack > 0) rcv->quickack--;
+        now = 1;
+    }
+    else if (rcv->delack_bytes >= rcv->delack_segs * mss ||
+             TCP_SEQ_GT(cur_stream->rcv_nxt, seq + payloadlen) ||
+             user_tcp_ooo_pending(cur_stream))
+    {
+        now = 1;
+    }
+
+    if (now)
+    {
+        user_tcp_enqueue_acklist(tcp, cur_stream, cur_ts, ACK_OPT_AGGREGATE);
+    }
+    else if (!rcv->on_delack_list)
+    {
+        AddtoDelackList(tcp, cur_stream, cur_ts + MSEC_TO_USEC(rcv->delack_ms) / TIME_TICK);
+    }
+}
+
 int user_tcp_parse_timestamp(user_tcp_timestamp *ts, uint8_t *tcpopt, int len)
 {
     int i;
@@ -514,7 +613,7 @@ int user_tcppkt_alone(user_tcp_manager *tcp,
     {
         memcpy((uint8_t *) tcph + TCP_HEADER_LEN + optlen, payload, payloadlen);
     }
-    tcph->check = user_calculate_chksum((uint16_t *) tcph,
+    tcph->check = user_calculate_chksum((uint8_t *) tcph,
                                         TCP_HEADER_LEN + optlen + payloadlen, saddr, daddr);
 
     if (tcph->syn || tcph->fin)
@@ -524,12 +623,88 @@ int user_tcppkt_alone(user_tcp_manager *tcp,
     return payloadlen;
 }
 
+static inline int user_tcp_ecn_wanted_cc(uint8_t cc_algo, int active)
+{
+    if (cc_algo == USER_TCP_CC_DCTCP)
+        return 1;
+
+    return active ? (TCP_ECN_MODE == 1) : (TCP_ECN_MODE != 0);
+}
+
+static inline int user_tcp_ecn_wanted(user_tcp_stream *cur_stream, int active)
+{
+    return user_tcp_ecn_wanted_cc(cur_stream->snd->cc_algo, active);
+}
+
+/* ECT on data segments, and on every non-SYN segment for DCTCP (RFC 8257) */
+static inline uint8_t user_tcp_ecn_tos(user_tcp_stream *cur_stream, uint16_t flags, uint16_t payloadlen)
+{
+    user_tcp_send *snd = cur_stream->snd;
+
+    if (!(snd->ecn_flags & TCP_ECN_OK) || (flags & (USER_TCPHDR_SYN | USER_TCPHDR_RST)))
+        return 0;
+
+    if (payloadlen > 0 || snd->cc_algo == USER_TCP_CC_DCTCP)
+        return IP_ECN_ECT0;
+
+    return 0;
+}
+
+static void user_tcp_ecn_set_flags(user_tcp_stream *cur_stream, struct tcphdr *tcph,
+                                   uint16_t flags, uint16_t payloadlen)
+{
+    user_tcp_send *snd = cur_stream->snd;
+
+    if (flags & USER_TCPHDR_SYN)
+    {
+        if (flags & USER_TCPHDR_ACK)
+        {
+            if (snd->ecn_flags & TCP_ECN_OK) tcph->ece = 1;
+        }
+        else if (user_tcp_ecn_wanted(cur_stream, 1))
+        {
+            tcph->ece = 1;
+            tcph->cwr = 1;
+        }
+        return;
+    }
+
+    if (!(snd->ecn_flags & TCP_ECN_OK))
+        return;
+
+    if ((flags & USER_TCPHDR_ACK) &&
+        ((snd->ecn_flags & TCP_ECN_DEMAND_CWR) ||
+         (snd->cc_algo == USER_TCP_CC_DCTCP && (snd->ecn_flags & TCP_ECN_CE_STATE))))
+    {
+        tcph->ece = 1;
+    }
+
+    if (payloadlen > 0 && (snd->ecn_flags & TCP_ECN_QUEUE_CWR))
+    {
+        tcph->cwr = 1;
+        snd->ecn_flags &= ~TCP_ECN_QUEUE_CWR;
+    }
+}
+
 int user_tcp_send_tcppkt(user_tcp_stream *cur_stream,
-                         uint32_t cur_ts, uint8_t flags, uint8_t *payload, uint16_t payloadlen)
+                         uint32_t cur_ts, uint16_t flags, uint8_t *payload, uint16_t payloadlen)
 {
     uint16_t optlen = user_calculate_option(flags);
+    user_tcp_sack_block sack[USER_TCP_SACK_BLOCKS_TS];
+    int nsack = 0;
 
-    user_trace_tcp("payload:%d, mss:%d, optlen:%d, data:%s\n", payloadlen, cur_stream->snd->mss, optlen, payload);
+    /* sack blocks ride on pure acks, data segments keep the full mss */
+    if (cur_stream->sack_permit && payloadlen == 0 &&
+        (flags & USER_TCPHDR_ACK) && !(flags & (USER_TCPHDR_SYN | USER_TCPHDR_RST)))
+    {
+        nsack = user_tcp_sack_generate(cur_stream, sack, USER_TCP_SACK_BLOCKS_TS);
+        if (nsack > 0)
+        {
+            optlen += 4 + nsack * 8;
+        }
+    }
+
+    user_trace_tcp("payload:%d, mss:%d, optlen:%d\n", payloadlen, cur_stream->snd->mss, optlen);
     if (payloadlen > cur_stream->snd->mss + optlen)
     {
         user_trace_tcp("Payload size exceeds MSS\n");
@@ -537,12 +712,14 @@ int user_tcp_send_tcppkt(user_tcp_stream *cur_stream,
     }
 
     user_tcp_manager *tcp = user_get_tcp_manager();
-    struct tcphdr *tcph = (struct tcphdr *) IPOutput(tcp, cur_stream, TCP_HEADER_LEN + optlen + payloadlen);
+    struct tcphdr *tcph = (struct tcphdr *) IPOutput(tcp, cur_stream, TCP_HEADER_LEN + optlen + payloadlen,
+                                                     user_tcp_ecn_tos(cur_stream, flags, payloadlen));
     if (tcph == NULL) return -2;
 
     memset(tcph, 0, TCP_HEADER_LEN + optlen);
     tcph->source = cur_stream->sport;
     tcph->dest = cur_stream->dport;
+    user_tcp_ecn_set_flags(cur_stream, tcph, flags, payloadlen);
 
     if (flags & USER_TCPHDR_SYN)
     {
@@ -566,7 +743,7 @@ int user_tcp_send_tcppkt(user_tcp_stream *cur_stream,
         tcph->psh = 1;
     }
 
-    if (flags & USER_TCPHDR_CWR)
+    if (flags & USER_TCPHDR_WACK)
     {
         tcph->seq = htonl(cur_stream->snd_nxt - 1);
         user_trace_tcp("%u Sending ACK to get new window advertisement. "
@@ -600,11 +777,15 @@ int user_tcp_send_tcppkt(user_tcp_stream *cur_stream,
         cur_stream->snd->ts_lastack_sent = cur_ts;
         cur_stream->last_active_ts = cur_ts;
 
+        /* any ack carries what the delayed one was waiting for */
+        cur_stream->rcv->delack_bytes = 0;
+        RemoveFromDelackList(tcp, cur_stream);
+
         UpdateTimeoutList(tcp, cur_stream);
     }
 
     uint8_t wscale = 0;
-    if (flags & USER_TCPHDR_SYN)
+    if (flags & USER_TCPHDR_SYN || !cur_stream->wscale_ok)
     {
         wscale = 0;
     }
@@ -613,23 +794,35 @@ int user_tcp_send_tcppkt(user_tcp_stream *cur_stream,
         wscale = cur_stream->snd->wscale_mine;
     }
 
-    uint32_t window32 = cur_stream->rcv->rcv_wnd >> wscale;
-    tcph->window = htons((uint16_t) MIN(window32, TCP_MAX_WINDOW));
+    uint32_t window32 = user_tcp_mem_rcv_wnd(tcp, cur_stream) >> wscale;
+    window32 = MIN(window32, TCP_MAX_WINDOW);
+    tcph->window = htons((uint16_t) window32);
+    cur_stream->rcv->rcv_adv = cur_stream->rcv_nxt + (window32 << wscale);
 
     if (window32 == 0) cur_stream->need_wnd_adv = 1;
 
     user_tcp_generate_options(cur_stream, cur_ts, flags,
-                              (uint8_t *) tcph + TCP_HEADER_LEN, optlen);
+                              (uint8_t *) tcph + TCP_HEADER_LEN, optlen, sack, nsack);
 
     tcph->doff = (TCP_HEADER_LEN + optlen) >> 2;
-    if (payloadlen > 0)
+    if (payloadlen > 0 && payload)
     {
         memcpy((uint8_t *) tcph + TCP_HEADER_LEN + optlen, payload, payloadlen);
     }
+    else if (payloadlen > 0)
+    {
+        /* no payload given: it is sent from the send buffer at snd_nxt, copied out of the segments */
+        SBCopy(cur_stream->snd->sndbuf, cur_stream->snd_nxt,
+               (uint8_t *) tcph + TCP_HEADER_LEN + optlen, payloadlen);
+    }
 
     tcph->check = user_tcp_calculate_checksum((uint16_t *) tcph,
                                               TCP_HEADER_LEN + optlen + payloadlen,
                                               cur_stream->saddr, cur_stream->daddr);
+    if (payloadlen > 0)
+    {
+        user_tcp_rate_on_send(cur_stream, cur_stream->snd_nxt, payloadlen, user_tcp_clock_us());
+    }
     cur_stream->snd_nxt += payloadlen;
 
     if (tcph->syn || tcph->fin)
@@ -646,12 +839,11 @@ int user_tcp_send_tcppkt(user_tcp_stream *cur_stream,
                            payloadlen, cur_stream->snd_nxt);
         }
 
-        cur_stream->snd->ts_rto = cur_ts + cur_stream->snd->rto;
+        user_tcp_recovery_on_send(tcp, cur_stream, cur_ts, payloadlen);
         user_trace_tcp("Updating retransmission timer. "
                        "cur_ts: %u, rto: %u, ts_rto: %u, mss:%d\n",
                        cur_ts, cur_stream->snd->rto, cur_stream->snd->ts_rto, cur_stream->snd->mss);
 
-        AddtoRTOList(tcp, cur_stream);
         user_trace_tcp(" user_tcp_send_tcppkt : %d\n", payloadlen);
     }
 
@@ -685,10 +877,34 @@ static inline int user_tcp_filter_synpkt(user_tcp_manager *tcp, uint32_t ip, uin
     return 0;
 }
 
-static inline user_tcp_stream *user_tcp_passive_open(user_tcp_manager *tcp, uint32_t cur_ts, const struct iphdr *iph,
-                                                     const struct tcphdr *tcph, uint32_t seq, uint16_t window)
+static void user_tcp_inherit_listener(user_tcp_stream *cur_stream, user_tcp_listener *listener)
 {
+    cur_stream->snd->cc_algo = listener->cc_algo;
+    cur_stream->rcv->delack_ms = listener->delack_ms;
+    cur_stream->rcv->delack_segs = listener->delack_segs;
+    cur_stream->snd->nodelay = listener->nodelay;
+    cur_stream->snd->notsent_lowat = listener->notsent_lowat;
+    cur_stream->snd->max_pacing_rate = listener->max_pacing_rate;
+
+    cur_stream->snd->keepalive = listener->keepalive;
+    cur_stream->snd->no_idle_kill = listener->no_idle_kill;
+    if (listener->keep_idle)
+        cur_stream->snd->keep_idle = listener->keep_idle;
+    if (listener->keep_intvl)
+        cur_stream->snd->keep_intvl = listener->keep_intvl;
+    if (listener->keep_cnt)
+        cur_stream->snd->keep_cnt = listener->keep_cnt;
+}
 
+/*
+ * the stream of a handshake whose final ack just arrived, built in SYN_RCVD
+ * from a request sock or a syn cookie. the syn_rcvd handler completes it.
+ */
+static user_tcp_stream *user_tcp_synrecv_open(user_tcp_manager *tcp, uint32_t cur_ts, user_tcp_listener *listener,
+                                              const struct iphdr *iph, const struct tcphdr *tcph,
+                                              uint32_t irs, uint32_t iss, uint16_t window,
+                                              const user_tcp_synopt *opt)
+{
     user_tcp_stream *cur_stream = CreateTcpStream(tcp, NULL, USER_TCP_SOCK_STREAM,
                                                   iph->daddr, tcph->dest, iph->saddr, tcph->source);
     if (cur_stream == NULL)
@@ -696,26 +912,180 @@ static inline user_tcp_stream *user_tcp_passive_open(user_tcp_manager *tcp, uint
         user_trace_tcp("INFO: Could not allocate tcp_stream!\n");
         return NULL;
     }
+    user_tcp_inherit_listener(cur_stream, listener);
 
-    cur_stream->rcv->irs = seq;
-    cur_stream->snd->peer_wnd = window;
-    cur_stream->rcv_nxt = cur_stream->rcv->irs;
-    cur_stream->snd->cwnd = 1;
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_recv *rcv = cur_stream->rcv;
 
-#if 1
-    cur_stream->rcv->recvbuf = RBInit(tcp->rbm_rcv, cur_stream->rcv->irs + 1);
-    if (!cur_stream->rcv->recvbuf)
+    rcv->irs = irs;
+    cur_stream->rcv_nxt = irs + 1;
+    snd->iss = iss;
+    snd->snd_una = iss;
+    cur_stream->snd_nxt = iss + 1;
+    snd->peer_wnd = window;
+    snd->cwnd = 1;
+
+    snd->mss = opt->mss;
+    snd->eff_mss = snd->mss - (USER_TCPOPT_TIMESTAMP_LEN + 2);
+    if (opt->ts_ok)
+    {
+        cur_stream->saw_timestamp = 1;
+        rcv->ts_recent = opt->tsval;
+        rcv->ts_last_ts_upd = cur_ts;
+    }
+    if (opt->wscale_ok)
+    {
+        snd->wscale_peer = opt->wscale;
+        cur_stream->wscale_ok = 1;
+    }
+    cur_stream->sack_permit = opt->sack_ok;
+    if (opt->ecn_ok)
+    {
+        snd->ecn_flags |= TCP_ECN_OK;
+    }
+
+    rcv->recvbuf = RBInit(tcp->rbm_rcv, irs + 1);
+    if (!rcv->recvbuf)
     {
         cur_stream->state = USER_TCP_CLOSED;
         cur_stream->close_reason = TCP_NO_MEM;
+        DestroyTcpStream(tcp, cur_stream);
+        return NULL;
+    }
+    cur_stream->state = USER_TCP_SYN_RCVD;
+
+    user_trace_tcp("Stream %d: SYN_RCVD, mss %u\n", cur_stream->id, snd->mss);
+    return cur_stream;
+}
+
+/* the final ack of a handshake answered with a syn cookie */
+static user_tcp_stream *user_tcp_cookie_open(user_tcp_manager *tcp, uint32_t cur_ts, const struct iphdr *iph,
+                                             const struct tcphdr *tcph, uint32_t seq, uint32_t ack_seq,
+                                             uint16_t window)
+{
+    user_tcp_listener *listener = (user_tcp_listener *) ListenerHTSearch(tcp->listeners, &tcph->dest);
+    user_tcp_synopt opt;
 
+    if (!listener || listener->ts_synq_overflow == 0 ||
+        TS_TO_MSEC(cur_ts - listener->ts_synq_overflow) > USER_SYNCOOKIE_PERIOD_MS * USER_SYNCOOKIE_MAX_AGE)
+    {
+        return NULL;
     }
-#endif
 
-    user_tcp_parse_options(cur_stream, cur_ts, (uint8_t *) tcph + TCP_HEADER_LEN,
-                           (tcph->doff << 2) - TCP_HEADER_LEN);
-    user_trace_tcp("user_tcp_passive_open : %d, %d\n", cur_stream->rcv_nxt, cur_stream->snd->mss);
+    if (!user_tcp_syncookie_check(tcp, cur_ts, iph, tcph, &opt))
+    {
+        return NULL;
+    }
+
+    user_tcp_stream *cur_stream = user_tcp_synrecv_open(tcp, cur_ts, listener, iph, tcph,
+                                                        seq - 1, ack_seq - 1, window, &opt);
+    if (cur_stream)
+    {
+        listener->syncookies_ok++;
+    }
+    return cur_stream;
+}
+
+/*
+ * a segment for a connection that only has a request sock. the final ack
+ * promotes it to a stream, a retransmitted SYN gets the syn-ack again.
+ */
+static user_tcp_stream *user_tcp_reqsk_process(user_tcp_manager *tcp, uint32_t cur_ts, user_tcp_reqsk *rsk,
+                                               const struct iphdr *iph, const struct tcphdr *tcph,
+                                               uint32_t seq, uint32_t ack_seq, uint16_t window)
+{
+    user_tcp_stream *cur_stream;
+
+    if (tcph->rst)
+    {
+        if (seq == rsk->irs + 1)
+        {
+            user_tcp_reqsk_destroy(tcp, rsk);
+        }
+        return NULL;
+    }
+
+    if (tcph->syn)
+    {
+        if (!tcph->ack && seq == rsk->irs)
+        {
+            user_tcp_reqsk_synack(tcp, rsk, cur_ts);
+        }
+        return NULL;
+    }
+
+    if (!tcph->ack)
+    {
+        return NULL;
+    }
+
+    if (ack_seq != rsk->iss + 1)
+    {
+        user_tcppkt_alone(tcp, iph->daddr, tcph->dest, iph->saddr, tcph->source,
+                          ack_seq, 0, 0, USER_TCPHDR_RST, NULL, 0, cur_ts, 0);
+        return NULL;
+    }
+
+    user_tcp_listener *listener = (user_tcp_listener *) ListenerHTSearch(tcp->listeners, &tcph->dest);
+    if (listener == NULL)
+    {
+        /* the listener closed while the handshake was pending */
+        user_tcppkt_alone(tcp, iph->daddr, tcph->dest, iph->saddr, tcph->source,
+                          ack_seq, 0, 0, USER_TCPHDR_RST, NULL, 0, cur_ts, 0);
+        user_tcp_reqsk_destroy(tcp, rsk);
+        return NULL;
+    }
+
+    cur_stream = user_tcp_synrecv_open(tcp, cur_ts, listener, iph, tcph,
+                                       rsk->irs, rsk->iss, rsk->peer_wnd, &rsk->opt);
+    if (cur_stream == NULL)
+    {
+        /* keep the request, the peer retransmits its ack */
+        return NULL;
+    }
+
+    user_tcp_reqsk_destroy(tcp, rsk);
+    return cur_stream;
+}
 
+/*
+ * a SYN with a valid fast open cookie: the stream skips the request sock,
+ * its data is queued now and it is accepted before the handshake is done.
+ */
+static user_tcp_stream *user_tcp_fastopen_open(user_tcp_manager *tcp, uint32_t cur_ts, user_tcp_listener *listener,
+                                               const struct iphdr *iph, const struct tcphdr *tcph,
+                                               uint32_t seq, uint16_t window, const user_tcp_synopt *opt,
+                                               uint8_t *payload, int payloadlen)
+{
+    user_tcp_stream *cur_stream = user_tcp_synrecv_open(tcp, cur_ts, listener, iph, tcph,
+                                                        seq, (uint32_t) rand(), window, opt);
+    if (cur_stream == NULL)
+    {
+        return NULL;
+    }
+
+    user_tcp_recv *rcv = cur_stream->rcv;
+    cur_stream->snd_nxt = cur_stream->snd->iss;
+
+    if (payloadlen > 0)
+    {
+        RBPut(tcp->rbm_rcv, rcv->recvbuf, payload, (uint32_t) payloadlen, seq + 1);
+        cur_stream->rcv_nxt = rcv->recvbuf->head_seq + rcv->recvbuf->merged_len;
+        rcv->rcv_wnd = rcv->recvbuf->size - rcv->recvbuf->merged_len;
+    }
+
+    cur_stream->fastopen = 1;
+    listener->fastopen_pending++;
+
+    if (user_tcp_accept_enqueue(tcp, listener, cur_stream) < 0)
+    {
+        user_tcp_fastopen_release(tcp, cur_stream);
+        cur_stream->close_reason = TCP_NOT_ACCEPTED;
+        DestroyTcpStream(tcp, cur_stream);
+        return NULL;
+    }
+
+    user_trace_tcp("Stream %d: fast open, %d bytes in the SYN\n", cur_stream->id, payloadlen);
     return cur_stream;
 }
 
@@ -732,9 +1102,23 @@ int user_tcp_active_open(user_tcp_manager *tcp, user_tcp_stream *cur_stream, uin
     user_tcp_parse_options(cur_stream, cur_ts, (uint8_t *) tcph + TCP_HEADER_LEN,
                            (tcph->doff << 2) - TCP_HEADER_LEN);
 
+    /* remember a fast open cookie for the next connection to this server */
+    uint8_t cookie[USER_TFO_COOKIE_MAX];
+    int tfo = user_tcp_parse_fastopen(tcph, cookie);
+    if (tfo > 0)
+    {
+        user_tcp_fastopen_cache_put(tcp, cur_stream->daddr, cookie, tfo);
+    }
+
+    if (tcph->ece && !tcph->cwr && user_tcp_ecn_wanted(cur_stream, 1))
+    {
+        cur_stream->snd->ecn_flags |= TCP_ECN_OK;
+    }
+
     cur_stream->snd->cwnd = ((cur_stream->snd->cwnd == 1) ?
                              (cur_stream->snd->mss * 2) : cur_stream->snd->mss);
     cur_stream->snd->ssthresh = cur_stream->snd->mss * 10;
+    user_tcp_cc_init(cur_stream, cur_stream->snd->cc_algo);
 
     UpdateRetransmissionTimer(tcp, cur_stream, cur_ts);
     return 1;
@@ -789,6 +1173,11 @@ static inline int user_tcp_validseq(user_tcp_manager *tcp, user_tcp_stream *cur_
 
             if (TCP_SEQ_LEQ(seq, cur_stream->rcv_nxt))
             {
+                if (cur_stream->sack_permit && payloadlen > 0 &&
+                    TCP_SEQ_LEQ(seq + payloadlen, cur_stream->rcv_nxt))
+                {
+                    user_tcp_sack_dsack(cur_stream, seq, seq + payloadlen);
+                }
                 user_tcp_enqueue_acklist(tcp, cur_stream, cur_ts, ACK_OPT_AGGREGATE);
             }
             else
@@ -831,11 +1220,69 @@ static user_tcp_stream *user_create_stream(user_tcp_manager *tcp, uint32_t cur_t
                               NULL, 0, cur_ts, 0);
             return NULL;
         }
+        if (tcp->mem.state == USER_TCP_MEM_CRITICAL)
+        {
+            /* dropped, the client retries once memory is back */
+            tcp->mem.syn_dropped++;
+            return NULL;
+        }
+
+        user_tcp_listener *listener = (user_tcp_listener *) ListenerHTSearch(tcp->listeners, &tcph->dest);
+        if (listener && tcp->mem.state == USER_TCP_MEM_PRESSURE)
+        {
+            /* no state for new connections while under pressure */
+            tcp->mem.syn_cookied++;
+            listener->ts_synq_overflow = cur_ts ? cur_ts : 1;
+            listener->syncookies_sent++;
+            user_tcp_syncookie_synack(tcp, cur_ts, iph, tcph);
+            return NULL;
+        }
+        if (listener && listener->syn_cnt >= listener->syn_backlog)
+        {
+            /* syn queue full, answer without keeping any state */
+            listener->ts_synq_overflow = cur_ts ? cur_ts : 1;
+            listener->syncookies_sent++;
+            user_tcp_syncookie_synack(tcp, cur_ts, iph, tcph);
+            return NULL;
+        }
+
         user_trace_tcp("user_create_stream\n");
-        cur_stream = user_tcp_passive_open(tcp, cur_ts, iph, tcph, seq, window);
-        if (!cur_stream)
+        user_tcp_synopt opt;
+        user_tcp_parse_synopt(tcph, &opt);
+        opt.ecn_ok = tcph->ece && tcph->cwr &&
+                     user_tcp_ecn_wanted_cc(listener ? listener->cc_algo : TCP_DEFAULT_CC, 0);
+
+        uint8_t cookie[USER_TFO_COOKIE_MAX];
+        int tfo = (listener && listener->fastopen_qlen) ? user_tcp_parse_fastopen(tcph, cookie) : -1;
+        if (tfo > 0 && listener->fastopen_pending < listener->fastopen_qlen &&
+            user_tcp_fastopen_check(tcp, iph->saddr, cookie, tfo))
+        {
+            cur_stream = user_tcp_fastopen_open(tcp, cur_ts, listener, iph, tcph, seq, window, &opt,
+                                                (uint8_t *) tcph + (tcph->doff << 2), payloadlen);
+            if (cur_stream)
+            {
+                return cur_stream;
+            }
+        }
+
+        /* a regular handshake, the SYN data if any is retransmitted by the client */
+        user_tcp_reqsk *rsk = user_tcp_reqsk_create(tcp, cur_ts, iph, tcph, &opt);
+        if (rsk && tfo >= 0)
+        {
+            rsk->tfo_req = 1;
+        }
+        if (!rsk)
         {
-            user_trace_tcp("Not available space in flow pool.\n");
+            user_trace_tcp("Not available space in request sock pool.\n");
+
+            if (listener)
+            {
+                /* the pool is out, a cookie still lets the peer in */
+                listener->ts_synq_overflow = cur_ts ? cur_ts : 1;
+                listener->syncookies_sent++;
+                user_tcp_syncookie_synack(tcp, cur_ts, iph, tcph);
+                return NULL;
+            }
 
             user_tcppkt_alone(tcp, iph->daddr, tcph->dest, iph->saddr, tcph->source,
                               0, seq + payloadlen + 1, 0, USER_TCPHDR_RST | USER_TCPHDR_ACK,
@@ -843,7 +1290,9 @@ static user_tcp_stream *user_create_stream(user_tcp_manager *tcp, uint32_t cur_t
 
             return NULL;
         }
-        return cur_stream;
+
+        user_tcp_reqsk_synack(tcp, rsk, cur_ts);
+        return NULL;
     }
     else if (tcph->rst)
     {
@@ -854,6 +1303,12 @@ static user_tcp_stream *user_create_stream(user_tcp_manager *tcp, uint32_t cur_t
     {
         if (tcph->ack)
         {
+            cur_stream = user_tcp_cookie_open(tcp, cur_ts, iph, tcph, seq, ack_seq, window);
+            if (cur_stream)
+            {
+                return cur_stream;
+            }
+
             user_tcppkt_alone(tcp, iph->daddr, tcph->dest, iph->saddr, tcph->source,
                               ack_seq, 0, 0, USER_TCPHDR_RST,
                               NULL, 0, cur_ts, 0);
@@ -882,6 +1337,38 @@ static void user_tcp_flush_accept_event(user_tcp_listener *listener)
     pthread_mutex_unlock(&listener->accept_lock);
 }
 
+/* queue a stream for accept() and wake the listener */
+static int user_tcp_accept_enqueue(user_tcp_manager *tcp, user_tcp_listener *listener, user_tcp_stream *cur_stream)
+{
+    if (StreamEnqueue(listener->acceptq, cur_stream) < 0)
+    {
+        return -1;
+    }
+
+    if (listener->s)
+    {
+        /*
+         * should move to epoll for check s->epoll type.
+         */
+#if USER_ENABLE_EPOLL_RB
+        if (tcp->ep)
+        {
+            epoll_event_callback(tcp->ep, listener->s->id, USER_EPOLLIN);
+        }
+#else
+        if (listener->s->epoll & USER_EPOLLIN)
+        {
+            user_epoll_add_event(tcp->ep, USER_EVENT_QUEUE, listener->s, USER_EPOLLIN);
+        }
+#endif
+        if (!(listener->s->opts & USER_TCP_NONBLOCK))
+        {
+            user_tcp_flush_accept_event(listener);
+        }
+    }
+    return 0;
+}
+
 static void user_tcp_flush_read_event(user_tcp_recv *rcv)
 {
 
@@ -895,17 +1382,119 @@ static void user_tcp_flush_read_event(user_tcp_recv *rcv)
     pthread_mutex_unlock(&rcv->read_lock);
 }
 
+/* free space in the send buffer, and with notsent_lowat little unsent data */
+int user_tcp_sndbuf_writable(user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    uint32_t notsent = 0;
+
+    if ((int32_t) snd->snd_wnd <= 0)
+        return 0;
+
+    if (snd->notsent_lowat && snd->sndbuf)
+    {
+        notsent = snd->sndbuf->head_seq + snd->sndbuf->len - cur_stream->snd_nxt;
+        if ((int32_t) notsent >= (int32_t) snd->notsent_lowat)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* wake a writer that found the stream full, called with write_lock held */
+static void user_tcp_check_write_space(user_tcp_manager *tcp, user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+
+    if (!snd->write_wait || !user_tcp_sndbuf_writable(cur_stream))
+        return;
+
+    snd->write_wait = 0;
+#if USER_ENABLE_BLOCKING
+    pthread_cond_signal(&snd->write_cond);
+#endif
+
+    if (cur_stream->s)
+    {
+#if USER_ENABLE_EPOLL_RB
+        if (tcp->ep)
+        {
+            epoll_event_callback(tcp->ep, cur_stream->s->id, USER_EPOLLOUT);
+        }
+#else
+        user_epoll_add_event(tcp->ep, USER_EVENT_QUEUE, cur_stream->s, USER_EPOLLOUT);
+#endif
+    }
+}
+
+/*
+ * send buffer autotuning: a writer that fills the buffer while the flow is
+ * not cwnd limited gets room for two windows, like the receive side.
+ * called with write_lock held.
+ */
+static void user_tcp_sndbuf_expand(user_tcp_manager *tcp, user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    uint32_t target = 2 * MAX(snd->cwnd, (uint32_t) snd->mss * 4);
+
+    if (!snd->write_wait || snd->sndbuf->size >= target ||
+        cur_stream->snd_nxt - snd->snd_una >= snd->cwnd ||
+        tcp->mem.state != USER_TCP_MEM_NORMAL)
+    {
+        return;
+    }
+
+    if (SBResize(tcp->rbm_snd, snd->sndbuf, MIN(target, USER_SNDBUF_MAX)) > 0)
+    {
+        snd->snd_wnd = snd->sndbuf->size - snd->sndbuf->len;
+        user_trace_tcp("Stream %d: sndbuf %u, cwnd %u\n",
+                       cur_stream->id, snd->sndbuf->size, snd->cwnd);
+    }
+}
+
 static void user_tcp_flush_send_event(user_tcp_send *snd)
 {
 
-    pthread_mutex_lock(&snd->write_lock);
+    pthread_mutex_lock(&snd->write_lock);
+
+    if (snd->snd_wnd > 0)
+    {
+        pthread_cond_signal(&snd->write_cond);
+    }
+
+    pthread_mutex_unlock(&snd->write_lock);
+}
+
+static void user_tcp_ecn_check_ce(user_tcp_manager *tcp, uint32_t cur_ts, user_tcp_stream *cur_stream,
+                                  const struct iphdr *iph, const struct tcphdr *tcph, int payloadlen)
+{
+    user_tcp_send *snd = cur_stream->snd;
+
+    if (!(snd->ecn_flags & TCP_ECN_OK) || tcph->syn)
+        return;
+
+    if (tcph->cwr)
+    {
+        snd->ecn_flags &= ~TCP_ECN_DEMAND_CWR;
+    }
+
+    if (payloadlen <= 0)
+        return;
 
-    if (snd->snd_wnd > 0)
+    int ce = (iph->tos & IP_ECN_MASK) == IP_ECN_CE;
+    if (snd->cc_algo == USER_TCP_CC_DCTCP)
     {
-        pthread_cond_signal(&snd->write_cond);
+        /* echo the exact CE state, ack at once when it flips */
+        if (ce != !!(snd->ecn_flags & TCP_ECN_CE_STATE))
+        {
+            snd->ecn_flags ^= TCP_ECN_CE_STATE;
+            user_tcp_enqueue_acklist(tcp, cur_stream, cur_ts, ACK_OPT_NOW);
+        }
+    }
+    else if (ce)
+    {
+        snd->ecn_flags |= TCP_ECN_DEMAND_CWR;
     }
-
-    pthread_mutex_unlock(&snd->write_lock);
 }
 
 static void user_tcp_handle_listen(user_tcp_manager *tcp, uint32_t cur_ts,
@@ -992,6 +1581,8 @@ static void user_tcp_handle_syn_sent(user_tcp_manager *tcp, uint32_t cur_ts,
 
         user_tcp_addto_controllist(tcp, cur_stream);
         AddtoTimeoutList(tcp, cur_stream);
+        user_tcp_keepalive_arm(tcp, cur_stream, cur_ts);
+        user_tcp_mem_idle_arm(tcp, cur_stream, cur_ts);
     }
     else
     {
@@ -1025,46 +1616,37 @@ static void user_tcp_handle_syn_rcvd(user_tcp_manager *tcp, uint32_t cur_ts,
         snd->cwnd = (prior_cwnd == 1) ? snd->mss * 2 : snd->mss;
         snd->nrtx = 0;
 
-        cur_stream->rcv_nxt = cur_stream->rcv->irs + 1;
+        if (!cur_stream->fastopen)
+        {
+            cur_stream->rcv_nxt = cur_stream->rcv->irs + 1;
+        }
         RemoveFromRTOList(tcp, cur_stream);
 
         cur_stream->state = USER_TCP_ESTABLISHED;
 
-        struct _user_tcp_listener *listener = ListenerHTSearch(tcp->listeners, &tcph->dest);
-        int ret = StreamEnqueue(listener->acceptq, cur_stream);
-        if (ret < 0)
-        {
-            cur_stream->close_reason = TCP_NOT_ACCEPTED;
-            cur_stream->state = USER_TCP_CLOSED;
-            user_tcp_addto_controllist(tcp, cur_stream);
-        }
-
+        user_tcp_cc_init(cur_stream, snd->cc_algo);
         AddtoTimeoutList(tcp, cur_stream);
+        user_tcp_keepalive_arm(tcp, cur_stream, cur_ts);
+        user_tcp_mem_idle_arm(tcp, cur_stream, cur_ts);
 
-        user_trace_tcp("user_tcp_handle_syn_rcvd\n");
-        if (listener->s)
+        if (cur_stream->fastopen)
         {
-            //&&
-            /*
-             * should move to epoll for check s->epoll type.
-             */
-            //AddtoEpollEvent
-#if USER_ENABLE_EPOLL_RB
-            if (tcp->ep)
-            {
-                epoll_event_callback(tcp->ep, listener->s->id, USER_EPOLLIN);
-            }
-#else
-            if (listener->s->epoll & USER_EPOLLIN)
-            {
-                user_epoll_add_event(tcp->ep, USER_EVENT_QUEUE, listener->s, USER_EPOLLIN);
-            }
-#endif
-            if (!(listener->s->opts & USER_TCP_NONBLOCK))
+            /* accepted with its SYN already, what was written meanwhile can go now */
+            user_tcp_fastopen_release(tcp, cur_stream);
+            if (snd->sndbuf && snd->sndbuf->len > 0)
             {
-                user_tcp_flush_accept_event(listener);
+                user_tcp_addto_sendlist(tcp, cur_stream);
             }
+            return;
+        }
 
+        user_trace_tcp("user_tcp_handle_syn_rcvd\n");
+        struct _user_tcp_listener *listener = ListenerHTSearch(tcp->listeners, &tcph->dest);
+        if (user_tcp_accept_enqueue(tcp, listener, cur_stream) < 0)
+        {
+            cur_stream->close_reason = TCP_NOT_ACCEPTED;
+            cur_stream->state = USER_TCP_CLOSED;
+            user_tcp_addto_controllist(tcp, cur_stream);
         }
 
     }
@@ -1100,7 +1682,7 @@ void user_tcp_handle_established(user_tcp_manager *tcp, uint32_t cur_ts,
     {
         if (user_tcp_process_payload(tcp, cur_stream, cur_ts, payload, seq, payloadlen))
         {
-            user_tcp_enqueue_acklist(tcp, cur_stream, cur_ts, ACK_OPT_AGGREGATE);
+            user_tcp_enqueue_delack(tcp, cur_stream, cur_ts, seq, payloadlen);
         }
         else
         {
@@ -1271,7 +1853,7 @@ void user_tcp_handle_fin_wait_1(user_tcp_manager *tcp, uint32_t cur_ts,
     {
         if (user_tcp_process_payload(tcp, cur_stream, cur_ts, payload, seq, payloadlen))
         {
-            user_tcp_enqueue_acklist(tcp, cur_stream, cur_ts, ACK_OPT_AGGREGATE);
+            user_tcp_enqueue_delack(tcp, cur_stream, cur_ts, seq, payloadlen);
         }
         else
         {
@@ -1293,7 +1875,7 @@ void user_tcp_handle_fin_wait_1(user_tcp_manager *tcp, uint32_t cur_ts,
             else if (cur_stream->state == USER_TCP_FIN_WAIT_2)
             {
 
-                cur_stream->state = USER_TCP_TIMEWAIT;
+                cur_stream->state = USER_TCP_TIME_WAIT;
                 user_trace_tcp("Stream %d: TCP_ST_TIME_WAIT\n", cur_stream->id);
                 AddtoTimewaitList(tcp, cur_stream, cur_ts);
 
@@ -1331,7 +1913,7 @@ void user_tcp_handle_fin_wait_2(user_tcp_manager *tcp, uint32_t cur_ts,
     {
         if (user_tcp_process_payload(tcp, cur_stream, cur_ts, payload, seq, payloadlen))
         {
-            user_tcp_enqueue_acklist(tcp, cur_stream, cur_ts, ACK_OPT_AGGREGATE);
+            user_tcp_enqueue_delack(tcp, cur_stream, cur_ts, seq, payloadlen);
         }
         else
         {
@@ -1407,7 +1989,7 @@ void user_tcp_estimate_rtt(user_tcp_manager *tcp, user_tcp_stream *cur_stream, u
     if (rcv->srtt != 0)
     {
         m -= (rcv->srtt >> 3);
-        rcv->srtt += 3;
+        rcv->srtt += m;
         if (m < 0)
         {
             m = -m;
@@ -1456,6 +2038,53 @@ void user_tcp_estimate_rtt(user_tcp_manager *tcp, user_tcp_stream *cur_stream, u
 
 }
 
+/*
+ * receive buffer autotuning, dynamic right-sizing. once per receiver rtt
+ * the bytes the app consumed in that rtt estimate the bdp the sender is
+ * after, and the buffer grows to twice that. called with read_lock held.
+ */
+static void user_tcp_rcv_space_adjust(user_tcp_manager *tcp, user_tcp_stream *cur_stream, uint32_t cur_ts)
+{
+    user_tcp_recv *rcv = cur_stream->rcv;
+    user_ring_buffer *buf = rcv->recvbuf;
+    uint32_t rtt, copied;
+
+    if (cur_stream->saw_timestamp && rcv->ts_lastack_rcvd)
+    {
+        /* the echo of our last ack, covers the peer's send delay too */
+        rtt = MAX(cur_ts - rcv->ts_lastack_rcvd, 1);
+        if (rcv->rcv_rtt == 0 || rtt < rcv->rcv_rtt)
+            rcv->rcv_rtt = rtt;
+        else
+            rcv->rcv_rtt = rcv->rcv_rtt - (rcv->rcv_rtt >> 3) + (rtt >> 3);
+    }
+
+    rtt = rcv->rcv_rtt ? rcv->rcv_rtt : (rcv->srtt >> 3);
+    if (rcv->rcvq_ts == 0)
+    {
+        rcv->rcvq_ts = cur_ts;
+        rcv->rcvq_seq = buf->head_seq;
+        return;
+    }
+    if (rtt == 0 || cur_ts - rcv->rcvq_ts < rtt)
+        return;
+
+    copied = buf->head_seq - rcv->rcvq_seq;
+    if (copied > rcv->rcvq_space)
+    {
+        rcv->rcvq_space = copied;
+        if (2 * copied > (uint32_t) buf->size && tcp->mem.state == USER_TCP_MEM_NORMAL &&
+            RBResize(tcp->rbm_rcv, buf, MIN(2 * copied, USER_RCVBUF_MAX)) > 0)
+        {
+            user_trace_tcp("Stream %d: rcvbuf %d, copied %u in %u ticks\n",
+                           cur_stream->id, buf->size, copied, cur_ts - rcv->rcvq_ts);
+        }
+    }
+
+    rcv->rcvq_seq = buf->head_seq;
+    rcv->rcvq_ts = cur_ts;
+}
+
 static int user_tcp_process_payload(user_tcp_manager *tcp, user_tcp_stream *cur_stream,
                                     uint32_t cur_ts, uint8_t *payload, uint32_t seq, int payloadlen)
 {
@@ -1506,12 +2135,31 @@ static int user_tcp_process_payload(user_tcp_manager *tcp, user_tcp_stream *cur_
         assert(0);
     }
 #endif
+    if (cur_stream->state == USER_TCP_ESTABLISHED)
+    {
+        user_tcp_rcv_space_adjust(tcp, cur_stream, cur_ts);
+    }
+
     uint32_t prev_rcv_nxt = cur_stream->rcv_nxt;
-    int ret = RBPut(tcp->rbm_rcv, rcv->recvbuf, payload, (uint32_t) payloadlen, seq);
+    int ret;
+    if (tcp->mem.state == USER_TCP_MEM_CRITICAL && TCP_SEQ_GT(seq, prev_rcv_nxt))
+    {
+        /* no memory to hold data out of order, the peer sends it again */
+        user_tcp_mem_prune_ofo(tcp, cur_stream);
+        ret = -3;
+    }
+    else
+    {
+        ret = RBPut(tcp->rbm_rcv, rcv->recvbuf, payload, (uint32_t) payloadlen, seq);
+    }
     if (ret < 0)
     {
         user_trace_tcp("Cannot merge payload. reason: %d\n", ret);
     }
+    else if (TCP_SEQ_GT(seq, prev_rcv_nxt))
+    {
+        rcv->sack_recent = seq;
+    }
 
     if (cur_stream->state == USER_TCP_FIN_WAIT_1 ||
         cur_stream->state == USER_TCP_FIN_WAIT_2)
@@ -1637,6 +2285,35 @@ static void user_tcp_process_ack(user_tcp_manager *tcp, user_tcp_stream *cur_str
         return;
     }
 
+    uint64_t now_us = user_tcp_clock_us();
+    uint32_t prior_sacked = snd->sack.sacked_bytes;
+    uint32_t lost_seq = ack_seq;
+    int lost = 0;
+
+    if (cur_stream->sack_permit)
+    {
+        user_tcp_sack_block sack[USER_TCP_MAX_SACK_BLOCKS];
+        uint32_t prior_dsack = snd->sack.dsack_cnt;
+        int nsack = user_tcp_sack_parse((uint8_t *) tcph + TCP_HEADER_LEN,
+                                        (tcph->doff << 2) - TCP_HEADER_LEN,
+                                        sack, USER_TCP_MAX_SACK_BLOCKS);
+        user_tcp_sack_update(cur_stream, ack_seq, sack, nsack);
+
+        user_tcp_rack_on_ack(cur_stream, ack_seq, now_us, snd->sack.dsack_cnt != prior_dsack);
+        user_tcp_tlp_on_ack(cur_stream, ack_seq, snd->sack.dsack_cnt != prior_dsack);
+
+        if (snd->sack.in_recovery && TCP_SEQ_GEQ(ack_seq, snd->sack.recover))
+        {
+            user_tcp_exit_recovery(cur_stream);
+        }
+
+#if TCP_RACK_ENABLE
+        lost = user_tcp_rack_detect_loss(cur_stream, ack_seq, now_us, &lost_seq);
+#else
+        lost = user_tcp_sack_lost(cur_stream);
+#endif
+    }
+
     uint32_t cwindow_prev;
     if (TCP_SEQ_LT(cur_stream->rcv->snd_wl1, seq) ||
         (cur_stream->rcv->snd_wl1 == seq &&
@@ -1684,51 +2361,40 @@ static void user_tcp_process_ack(user_tcp_manager *tcp, user_tcp_stream *cur_str
         cur_stream->rcv->last_ack_seq = ack_seq;
     }
 
-    if (dup && cur_stream->rcv->dup_acks == 3)
+    if (snd->undo.marker)
     {
-        user_trace_tcp("Triple duplicated ACKs!! ack_seq: %u\n", ack_seq);
-        if (TCP_SEQ_LT(ack_seq, cur_stream->snd_nxt))
-        {
-            user_trace_tcp("Reducing snd_nxt from %u to %u\n",
-                           cur_stream->snd_nxt, ack_seq);
-
-            if (ack_seq != snd->snd_una)
-            {
-                user_trace_tcp("ack_seq and snd_una mismatch on tdp ack. "
-                               "ack_seq: %u, snd_una: %u\n",
-                               ack_seq, snd->snd_una);
-            }
-            cur_stream->snd_nxt = ack_seq;
-        }
-
-        snd->ssthresh = MIN(snd->cwnd, snd->peer_wnd) / 2;
-        if (snd->ssthresh < 2 * snd->mss)
-        {
-            snd->ssthresh = 2 * snd->mss;
-        }
-        snd->cwnd = snd->ssthresh + 3 * snd->mss;
-        user_trace_tcp("Fast retransmission. cwnd: %u, ssthresh: %u\n",
-                       snd->cwnd, snd->ssthresh);
+        user_tcp_undo_on_ack(tcp, cur_stream, ack_seq);
+    }
 
-        if (snd->nrtx < TCP_MAX_RTX)
-        {
-            snd->nrtx++;
-        }
-        else
-        {
-            user_trace_tcp("Exceed MAX_RTX. \n");
-        }
-        user_tcp_addto_sendlist(tcp, cur_stream);
+    if (!snd->sack.in_recovery && dup && cur_stream->rcv->dup_acks == 3)
+    {
+        user_trace_tcp("Triple duplicated ACKs!! ack_seq: %u\n", ack_seq);
+        user_tcp_enter_recovery(tcp, cur_stream, ack_seq);
+    }
+    else if (lost)
+    {
+        user_tcp_rack_retransmit(tcp, cur_stream, ack_seq, lost_seq);
     }
-    else if (cur_stream->rcv->dup_acks > 3)
+    else if (cur_stream->rcv->dup_acks > 3 && !snd->sack.in_recovery)
     {
+        user_tcp_cc_on_dupack(cur_stream);
+    }
 
-        if ((uint32_t)(snd->cwnd + snd->mss) > snd->cwnd)
+    if (snd->sack.in_recovery)
+    {
+        int32_t delivered = (int32_t)(snd->sack.sacked_bytes - prior_sacked);
+        if (TCP_SEQ_GT(ack_seq, snd->snd_una))
         {
-            snd->cwnd += snd->mss;
-            user_trace_tcp("Dupack cwnd inflate. cwnd: %u, ssthresh: %u\n",
-                           snd->cwnd, snd->ssthresh);
+            delivered += ack_seq - snd->snd_una;
         }
+        user_tcp_prr_on_ack(cur_stream, delivered > 0 ? delivered : 0);
+    }
+
+    if (snd->rack.reo_deadline_us && snd->loss_timer != USER_TCP_TIMER_REO &&
+        TCP_SEQ_LEQ(ack_seq, snd->snd_una))
+    {
+        /* no cumulative progress, UpdateRetransmissionTimer will not run */
+        user_tcp_recovery_arm_timer(tcp, cur_stream, cur_ts);
     }
 
     if (TCP_SEQ_GT(ack_seq, cur_stream->snd_nxt))
@@ -1742,6 +2408,10 @@ static void user_tcp_process_ack(user_tcp_manager *tcp, user_tcp_stream *cur_str
         }
     }
 
+    user_tcp_cc_on_ecn(cur_stream, ack_seq,
+                       TCP_SEQ_GT(ack_seq, snd->snd_una) ? ack_seq - snd->snd_una : 0,
+                       tcph->ece && !tcph->syn);
+
     if (TCP_SEQ_GEQ(snd->sndbuf->head_seq, ack_seq))
     {
         return;
@@ -1750,11 +2420,8 @@ static void user_tcp_process_ack(user_tcp_manager *tcp, user_tcp_stream *cur_str
     uint32_t rmlen = ack_seq - snd->sndbuf->head_seq;
     if (rmlen > 0)
     {
-        uint16_t packets = rmlen / snd->eff_mss;
-        if ((rmlen / snd->eff_mss) * snd->eff_mss > rmlen)
-        {
-            packets++;
-        }
+        user_tcp_rate_sample rs;
+
         if (cur_stream->saw_timestamp)
         {
             user_tcp_estimate_rtt(tcp, cur_stream, cur_ts - cur_stream->rcv->ts_lastack_rcvd);
@@ -1766,26 +2433,7 @@ static void user_tcp_process_ack(user_tcp_manager *tcp, user_tcp_stream *cur_str
             user_trace_tcp("not implemented.\n");
         }
 
-        if (cur_stream->state >= USER_TCP_ESTABLISHED)
-        {
-            if (snd->cwnd < snd->ssthresh)
-            {
-                if ((snd->cwnd + snd->mss) > snd->cwnd)
-                {
-                    snd->cwnd += snd->mss * packets;
-                }
-                user_trace_tcp("slow start cwnd : %u, ssthresh: %u\n",
-                               snd->cwnd, snd->ssthresh);
-            }
-        }
-        else
-        {
-            uint32_t new_cwnd = snd->cwnd + packets * snd->mss * snd->mss / snd->cwnd;
-            if (new_cwnd > snd->cwnd)
-            {
-                snd->cwnd = new_cwnd;
-            }
-        }
+        user_tcp_rate_on_ack(cur_stream, ack_seq, now_us, &rs);
 
         if (pthread_mutex_lock(&snd->write_lock))
         {
@@ -1796,19 +2444,28 @@ static void user_tcp_process_ack(user_tcp_manager *tcp, user_tcp_stream *cur_str
             assert(0);
         }
         int ret = SBRemove(tcp->rbm_snd, snd->sndbuf, rmlen);
-        if (ret <= 0) return;
+        if (ret <= 0)
+        {
+            pthread_mutex_unlock(&snd->write_lock);
+            return;
+        }
 
         snd->snd_una = ack_seq;
-        uint32_t snd_wnd_prev = snd->snd_wnd;
         snd->snd_wnd = snd->sndbuf->size - snd->sndbuf->len;
 
-        if (snd_wnd_prev <= 0)
+        user_tcp_sndbuf_expand(tcp, cur_stream);
+        user_tcp_check_write_space(tcp, cur_stream);
+
+        /* a tail segment held back by nagle may go now */
+        if (TCP_SEQ_LT(cur_stream->snd_nxt, snd->sndbuf->head_seq + snd->sndbuf->len) &&
+            (cur_stream->state == USER_TCP_ESTABLISHED || cur_stream->state == USER_TCP_CLOSE_WAIT))
         {
-            //Raise Write Event
-            user_tcp_flush_send_event(snd);
+            user_tcp_addto_sendlist(tcp, cur_stream);
         }
 
         pthread_mutex_unlock(&snd->write_lock);
+
+        user_tcp_cc_on_ack(cur_stream, &rs, rmlen);
         UpdateRetransmissionTimer(tcp, cur_stream, cur_ts);
     }
 
@@ -1859,7 +2516,21 @@ int user_tcp_process(user_nic_context *ctx, unsigned char *stream)
     user_tcp_stream *cur_stream = (user_tcp_stream *) StreamHTSearch(user_tcp->tcp_flow_table, &tstream);
     if (cur_stream == NULL)
     {
-        cur_stream = user_create_stream(user_tcp, ts, iph, ip_len, tcph, seq, ack_seq, payloadlen, window);
+        user_tcp_tw *tw = user_tcp_tw_lookup(user_tcp, iph->daddr, tcph->dest, iph->saddr, tcph->source);
+        if (tw && user_tcp_tw_process(user_tcp, ts, tw, iph, tcph, seq))
+        {
+            return 1;
+        }
+
+        user_tcp_reqsk *rsk = user_tcp_reqsk_lookup(user_tcp, iph, tcph);
+        if (rsk)
+        {
+            cur_stream = user_tcp_reqsk_process(user_tcp, ts, rsk, iph, tcph, seq, ack_seq, window);
+        }
+        else
+        {
+            cur_stream = user_create_stream(user_tcp, ts, iph, ip_len, tcph, seq, ack_seq, payloadlen, window);
+        }
         if (!cur_stream)
         {
             return -2;
@@ -1889,8 +2560,11 @@ int user_tcp_process(user_nic_context *ctx, unsigned char *stream)
     }
 
     cur_stream->last_active_ts = ts;
+    cur_stream->rcv->ts_last_seg = ts;
     UpdateTimeoutList(user_tcp, cur_stream);
 
+    user_tcp_ecn_check_ce(user_tcp, ts, cur_stream, iph, tcph, payloadlen);
+
     if (tcph->rst)
     {
         cur_stream->have_reset = 1;
@@ -2003,6 +2677,7 @@ user_sender *user_tcp_create_sender(int ifidx)
     sender->control_list_cnt = 0;
     sender->send_list_cnt = 0;
     sender->ack_list_cnt = 0;
+    user_tcp_pacer_init(&sender->pacer);
 
     return sender;
 }
@@ -2032,37 +2707,21 @@ int user_tcp_init_manager(user_thread_context *ctx)
         user_trace_tcp("[%s:%s:%d] --> create hash table\n", __FILE__, __func__, __LINE__);
         return -2;
     }
-#ifdef HUGEPAGE
-#define IS_HUGEPAGE		1
-#else
-#define IS_HUGEPAGE        0
-#endif
-    tcp->flow = user_mempool_create(sizeof(user_tcp_stream), sizeof(user_tcp_stream) * USER_MAX_CONCURRENCY,
-                                    IS_HUGEPAGE);
+    tcp->flow = user_mempool_create_cache(sizeof(user_tcp_conn), sizeof(user_tcp_conn) * USER_MAX_CONCURRENCY,
+                                          MEM_DEFAULT, user_tcp_conn_ctor, user_tcp_conn_dtor, NULL);
     if (!tcp->flow)
     {
         user_trace_tcp("Failed to allocate tcp flow pool.\n");
         return -3;
     }
-    tcp->rcv = user_mempool_create(sizeof(user_tcp_recv), sizeof(user_tcp_recv) * USER_MAX_CONCURRENCY, IS_HUGEPAGE);
-    if (!tcp->rcv)
-    {
-        user_trace_tcp("Failed to allocate tcp recv pool.\n");
-        return -3;
-    }
-    tcp->snd = user_mempool_create(sizeof(user_tcp_send), sizeof(user_tcp_send) * USER_MAX_CONCURRENCY, IS_HUGEPAGE);
-    if (!tcp->snd)
-    {
-        user_trace_tcp("Failed to allocate tcp recv pool.\n");
-        return -3;
-    }
-    tcp->rbm_snd = user_sbmanager_create(USER_SNDBUF_SIZE, USER_MAX_NUM_BUFFERS);
+    tcp->rbm_snd = user_sbmanager_create(USER_SNDBUF_SIZE, USER_SNDBUF_MAX, USER_MAX_NUM_BUFFERS);
     if (!tcp->rbm_snd)
     {
         user_trace_tcp("Failed to create send ring buffer.\n");
         return -4;
     }
-    tcp->rbm_rcv = RBManagerCreate(USER_RCVBUF_SIZE, USER_MAX_NUM_BUFFERS);
+    tcp->rbm_rcv = RBManagerCreate(USER_RCVBUF_SIZE, USER_RCVBUF_MAX, USER_MAX_NUM_BUFFERS,
+                                   USER_RCVBUF_FRAGS, USER_RCVBUF_FRAGS_TOTAL);
     if (!tcp->rbm_rcv)
     {
         user_trace_tcp("Failed to create recv ring buffer.\n");
@@ -2081,7 +2740,7 @@ int user_tcp_init_manager(user_thread_context *ctx)
     }
 
 #endif
-    tcp->smap = (user_socket_map *) calloc(USER_MAX_CONCURRENCY, sizeof(user_socket_map));
+    tcp->smap = (user_socket_map **) calloc(USER_MAX_SOCKETS / USER_MAX_CONCURRENCY, sizeof(user_socket_map *));
     if (!tcp->smap)
     {
         user_trace_tcp("Failed to allocate memory for stream map.\n");
@@ -2089,16 +2748,13 @@ int user_tcp_init_manager(user_thread_context *ctx)
     }
     TAILQ_INIT(&tcp->free_smap);
 
-    int i = 0;
-    for (i = 0; i < USER_MAX_CONCURRENCY; i++)
+    if (user_socket_map_grow(tcp) < 0)
     {
-        tcp->smap[i].id = i;
-        tcp->smap[i].socktype = USER_TCP_SOCK_UNUSED;
-        memset(&tcp->smap[i].s_addr, 0, sizeof(struct sockaddr_in));
-        tcp->smap[i].stream = NULL;
-        TAILQ_INSERT_TAIL(&tcp->free_smap, &tcp->smap[i], free_smap_link);
+        user_trace_tcp("Failed to allocate memory for stream map.\n");
+        return -5;
     }
 
+    int i = 0;
     tcp->ctx = ctx;
 
     tcp->connectq = CreateStreamQueue(USER_BACKLOG_SIZE);
@@ -2108,19 +2764,19 @@ int user_tcp_init_manager(user_thread_context *ctx)
         return -6;
     }
 
-    tcp->sendq = CreateStreamQueue(USER_MAX_CONCURRENCY);
+    tcp->sendq = CreateGrowingStreamQueue(USER_MAX_CONCURRENCY);
     if (!tcp->sendq)
     {
         user_trace_tcp("Failed to create send queue.\n");
         return -6;
     }
-    tcp->ackq = CreateStreamQueue(USER_MAX_CONCURRENCY);
+    tcp->ackq = CreateGrowingStreamQueue(USER_MAX_CONCURRENCY);
     if (!tcp->sendq)
     {
         user_trace_tcp("Failed to create ack queue.\n");
         return -6;
     }
-    tcp->closeq = CreateStreamQueue(USER_MAX_CONCURRENCY);
+    tcp->closeq = CreateGrowingStreamQueue(USER_MAX_CONCURRENCY);
     if (!tcp->closeq)
     {
         user_trace_tcp("Failed to create close queue.\n");
@@ -2133,7 +2789,7 @@ int user_tcp_init_manager(user_thread_context *ctx)
         return -6;
     }
 
-    tcp->resetq = CreateStreamQueue(USER_MAX_CONCURRENCY);
+    tcp->resetq = CreateGrowingStreamQueue(USER_MAX_CONCURRENCY);
     if (!tcp->resetq)
     {
         user_trace_tcp("Failed to create reset queue.\n");
@@ -2145,12 +2801,18 @@ int user_tcp_init_manager(user_thread_context *ctx)
         user_trace_tcp("Failed to create reset int queue.\n");
         return -6;
     }
-    tcp->destroyq = CreateStreamQueue(USER_MAX_CONCURRENCY);
+    tcp->destroyq = CreateGrowingStreamQueue(USER_MAX_CONCURRENCY);
     if (!tcp->destroyq)
     {
         user_trace_tcp("Failed to create destroy queue.\n");
         return -6;
     }
+    tcp->optq = CreateGrowingStreamQueue(USER_MAX_CONCURRENCY);
+    if (!tcp->optq)
+    {
+        user_trace_tcp("Failed to create option queue.\n");
+        return -6;
+    }
     tcp->g_sender = user_tcp_create_sender(-1);
     if (!tcp->g_sender)
     {
@@ -2171,12 +2833,33 @@ int user_tcp_init_manager(user_thread_context *ctx)
 
     TAILQ_INIT(&tcp->timewait_list);
     TAILQ_INIT(&tcp->timeout_list);
+    TAILQ_INIT(&tcp->delack_list);
+    TAILQ_INIT(&tcp->cork_list);
 
 #if USER_ENABLE_BLOCKING
     TAILQ_INIT(&tcp->rcv_br_list);
     TAILQ_INIT(&tcp->snd_br_list);
 #endif
 
+    user_tcp_syncookie_init(tcp);
+    user_tcp_fastopen_init(tcp);
+    if (user_tcp_reqsk_init(tcp) < 0)
+    {
+        user_trace_tcp("Failed to create request sock table.\n");
+        return -6;
+    }
+    if (user_tcp_tw_init(tcp) < 0)
+    {
+        user_trace_tcp("Failed to create time wait table.\n");
+        return -6;
+    }
+    if (user_tcp_keepalive_init(tcp) < 0)
+    {
+        user_trace_tcp("Failed to create keepalive wheel.\n");
+        return -6;
+    }
+    user_tcp_mem_init(tcp);
+
     user_tcp = tcp;
 
     return 0;
@@ -2190,6 +2873,9 @@ void user_tcp_init_thread_context(user_thread_context *ctx)
     ctx->cpu = 0;
     ctx->thread = pthread_self();
 
+    /* the pools of this context on the node of its core */
+    user_mempool_set_node(user_mem_cpu_node(ctx->cpu));
+
     user_tcp_init_manager(ctx);
 
     if (pthread_mutex_init(&ctx->smap_lock, NULL))
@@ -2227,7 +2913,7 @@ int user_tcp_handle_apicall(uint32_t cur_ts)
 
     while ((stream = StreamDequeue(tcp->sendq)))
     {
-        user_trace_tcp("buf: %s, mss:%d\n", stream->snd->sndbuf->data, stream->snd->mss);
+        user_trace_tcp("buf: %u, mss:%d\n", stream->snd->sndbuf->len, stream->snd->mss);
         stream->snd->on_sendq = 0;
         user_tcp_addto_sendlist(tcp, stream);
     }
@@ -2238,6 +2924,17 @@ int user_tcp_handle_apicall(uint32_t cur_ts)
         user_tcp_enqueue_acklist(tcp, stream, cur_ts, ACK_OPT_AGGREGATE);
     }
 
+    while ((stream = StreamDequeue(tcp->optq)))
+    {
+        stream->snd->on_optq = 0;
+        user_tcp_keepalive_apply(tcp, stream, cur_ts);
+        if (stream->snd->cc_change)
+        {
+            stream->snd->cc_change = 0;
+            user_tcp_cc_init(stream, stream->snd->cc_next);
+        }
+    }
+
     int handled = 0, delayed = 0;
     int control = 0, send = 0, ack = 0;
 
@@ -2418,6 +3115,40 @@ int user_tcp_handle_apicall(uint32_t cur_ts)
     return 0;
 }
 
+/*
+ * whether a partial segment at the tail of the send buffer should wait for
+ * more data: while the stream is corked (TCP_CORK, MSG_MORE) for up to
+ * TCP_CORK_MS, or under nagle while sent data is unacknowledged. returns 0
+ * to send it, TCP_FLUSH_HELD to park the stream on the cork list, 1 to wait
+ * for an ack.
+ */
+static int user_tcp_hold_tail(user_tcp_stream *cur_stream, uint32_t seq, uint32_t cur_ts)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_txq *txq = &snd->txq;
+
+    /* a closing stream sends everything, and resends are never held */
+    if (cur_stream->state != USER_TCP_ESTABLISHED && cur_stream->state != USER_TCP_CLOSE_WAIT)
+        return 0;
+    if (txq->cnt > 0 && TCP_SEQ_LT(seq, txq->high_seq))
+        return 0;
+
+    if (snd->cork || snd->more)
+    {
+        if (snd->ts_cork == 0)
+            snd->ts_cork = cur_ts;
+
+        if (TS_TO_MSEC(cur_ts - snd->ts_cork) < TCP_CORK_MS)
+            return TCP_FLUSH_HELD;
+        return 0;
+    }
+
+    if (!snd->nodelay && TCP_SEQ_GT(cur_stream->snd_nxt, snd->snd_una))
+        return 1;
+
+    return 0;
+}
+
 int user_tcp_flush_sendbuffer(user_tcp_stream *cur_stream, uint32_t cur_ts)
 {
 
@@ -2436,6 +3167,7 @@ int user_tcp_flush_sendbuffer(user_tcp_stream *cur_stream, uint32_t cur_ts)
     pthread_mutex_lock(&snd->write_lock);
 
     int packets = 0;
+    uint32_t seq_start = cur_stream->snd_nxt;
     if (snd->sndbuf->len == 0)
     {
         packets = 0;
@@ -2445,11 +3177,13 @@ int user_tcp_flush_sendbuffer(user_tcp_stream *cur_stream, uint32_t cur_ts)
     uint32_t window = MIN(snd->cwnd, snd->peer_wnd);
     uint32_t seq = 0;
     uint32_t buffered_len = 0;
-    uint8_t *data = NULL;
     uint32_t maxlen = snd->mss - user_calculate_option(USER_TCPHDR_ACK);
     uint16_t len = 0;
     uint8_t wack_sent = 0;
     int16_t sndlen = 0;
+    uint32_t hole = 0, in_flight = 0;
+    int limited = 0, hold = 0;
+    uint64_t now_us = snd->pacing_rate ? user_tcp_clock_us() : 0;
 
     while (1)
     {
@@ -2464,6 +3198,14 @@ int user_tcp_flush_sendbuffer(user_tcp_stream *cur_stream, uint32_t cur_ts)
             break;
         }
 
+        hole = 0;
+        if (snd->sack.cnt > 0)
+        {
+            /* skip the ranges the peer already holds */
+            seq = user_tcp_sack_next_seq(cur_stream, seq, &hole);
+            cur_stream->snd_nxt = seq;
+        }
+
         buffered_len = snd->sndbuf->head_seq + snd->sndbuf->len - seq;
         if (cur_stream->state == USER_TCP_ESTABLISHED)
         {
@@ -2471,9 +3213,12 @@ int user_tcp_flush_sendbuffer(user_tcp_stream *cur_stream, uint32_t cur_ts)
                            "buffered_len: %u, mss:%d, cur_mss:%d\n", snd->sndbuf->head_seq,
                            snd->sndbuf->len, seq, buffered_len, snd->mss, cur_stream->snd->mss);
         }
-        if (buffered_len == 0) break;
+        if (buffered_len == 0)
+        {
+            user_tcp_rate_check_app_limited(cur_stream);
+            break;
+        }
 
-        data = snd->sndbuf->head + (seq - snd->sndbuf->head_seq);
         if (buffered_len > maxlen)
         {
             len = maxlen;
@@ -2483,6 +3228,11 @@ int user_tcp_flush_sendbuffer(user_tcp_stream *cur_stream, uint32_t cur_ts)
             len = buffered_len;
         }
 
+        if (hole > 0 && len > hole)
+        {
+            len = hole;
+        }
+
         if (len > window)
         {
             len = window;
@@ -2490,13 +3240,34 @@ int user_tcp_flush_sendbuffer(user_tcp_stream *cur_stream, uint32_t cur_ts)
 
         if (len <= 0) break;
 
+        if (buffered_len < maxlen && hole == 0)
+        {
+            hold = user_tcp_hold_tail(cur_stream, seq, cur_ts);
+            if (hold)
+            {
+                if (hold == TCP_FLUSH_HELD) packets = TCP_FLUSH_HELD;
+                goto out;
+            }
+        }
+
         if (cur_stream->state > USER_TCP_ESTABLISHED)
         {
             user_trace_tcp("Flushing after ESTABLISHED: seq: %u, len: %u, "
                            "buffered_len: %u\n", seq, len, buffered_len);
         }
 
-        if (seq - snd->snd_una + len > window)
+        if (snd->sack.in_recovery && !USER_TCP_BBR_ACTIVE(snd))
+        {
+            /* in sack recovery prr hands out what may be sent */
+            limited = snd->prr.quota == 0 || seq - snd->snd_una + len > snd->peer_wnd;
+        }
+        else
+        {
+            in_flight = snd->sack.cnt > 0 ? user_tcp_sack_pipe(cur_stream, seq) : seq - snd->snd_una;
+            limited = in_flight + len > window;
+        }
+
+        if (limited)
         {
             if (seq - snd->snd_una + len > snd->peer_wnd)
             {
@@ -2513,24 +3284,95 @@ int user_tcp_flush_sendbuffer(user_tcp_stream *cur_stream, uint32_t cur_ts)
             goto out;
         }
 
-        sndlen = user_tcp_send_tcppkt(cur_stream, cur_ts, USER_TCPHDR_ACK, data, len);
+        if (snd->pacing_rate && snd->ts_pace_us > now_us + TCP_PACING_HORIZON_US)
+        {
+            packets = TCP_FLUSH_PACED;
+            goto out;
+        }
+
+        sndlen = user_tcp_send_tcppkt(cur_stream, cur_ts, USER_TCPHDR_ACK, NULL, len);
         if (sndlen < 0)
         {
             packets = sndlen;
             goto out;
         }
         packets++;
+        snd->ts_cork = 0;
+        RemoveFromCorkList(tcp, cur_stream);
+
+        if (snd->pacing_rate)
+        {
+            if (snd->ts_pace_us < now_us) snd->ts_pace_us = now_us;
+            snd->ts_pace_us += (uint64_t) len * 1000000 / snd->pacing_rate;
+        }
 
         user_trace_api("window:%d, len:%d\n", window, len);
         window -= len;
     }
 
 out:
+    if (snd->notsent_lowat && cur_stream->snd_nxt != seq_start)
+    {
+        user_tcp_check_write_space(tcp, cur_stream);
+    }
     pthread_mutex_unlock(&snd->write_lock);
 
     return packets;
 }
 
+/*
+ * tail loss probe: one new segment if the peer window allows it, else the
+ * last segment sent once more.
+ */
+int user_tcp_send_loss_probe(user_tcp_stream *cur_stream, uint32_t cur_ts)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    uint32_t maxlen = snd->mss - user_calculate_option(USER_TCPHDR_ACK);
+    uint32_t snd_nxt = cur_stream->snd_nxt;
+    uint32_t end_seq, seq, len;
+    int ret = 0;
+
+    if (!snd->sndbuf)
+        return -1;
+
+    pthread_mutex_lock(&snd->write_lock);
+
+    end_seq = snd->sndbuf->head_seq + snd->sndbuf->len;
+    len = MIN(end_seq - snd_nxt, maxlen);
+    if (TCP_SEQ_LT(snd_nxt, end_seq) && snd_nxt + len - snd->snd_una <= snd->peer_wnd)
+    {
+        seq = snd_nxt;
+        snd->rack.tlp_retrans = 0;
+    }
+    else
+    {
+        len = MIN(snd_nxt - snd->snd_una, maxlen);
+        seq = snd_nxt - len;
+        snd->rack.tlp_retrans = 1;
+    }
+
+    if (len > 0)
+    {
+        snd->rack.tlp_out = 1;
+        snd->rack.tlp_high_seq = seq + len;
+
+        cur_stream->snd_nxt = seq;
+        ret = user_tcp_send_tcppkt(cur_stream, cur_ts, USER_TCPHDR_ACK, NULL, len);
+        if (ret < 0)
+        {
+            snd->rack.tlp_out = 0;
+        }
+        if (ret < 0 || TCP_SEQ_LT(cur_stream->snd_nxt, snd_nxt))
+        {
+            cur_stream->snd_nxt = snd_nxt;
+        }
+    }
+
+    pthread_mutex_unlock(&snd->write_lock);
+
+    return ret;
+}
+
 int user_tcp_send_controlpkt(user_tcp_stream *cur_stream, uint32_t cur_ts)
 {
     user_tcp_manager *tcp = user_get_tcp_manager();
@@ -2713,7 +3555,21 @@ int user_tcp_write_datalist(user_sender *sender, uint32_t cur_ts, int thresh)
                                cur_stream->id, cur_stream->state);
             }
 
-            if (ret < 0)
+            if (ret == TCP_FLUSH_PACED)
+            {
+                /* next send time is ahead, wait on the wheel, still on_send_list */
+                sender->send_list_cnt--;
+                user_tcp_pace_park(sender, cur_stream, user_tcp_clock_us());
+            }
+            else if (ret == TCP_FLUSH_HELD)
+            {
+                /* off the send list until the cork runs out or the app adds data */
+                cur_stream->snd->on_send_list = 0;
+                sender->send_list_cnt--;
+                AddtoCorkList(tcp, cur_stream,
+                              cur_stream->snd->ts_cork + MSEC_TO_USEC(TCP_CORK_MS) / TIME_TICK);
+            }
+            else if (ret < 0)
             {
                 TAILQ_INSERT_TAIL(&sender->send_list, cur_stream, snd->send_link);
                 break;
@@ -2820,7 +3676,7 @@ int user_tcp_write_acklist(user_sender *sender, uint32_t cur_ts, int thresh)
                 if (cur_stream->snd->is_wack)
                 {
                     cur_stream->snd->is_wack = 0;
-                    ret = user_tcp_send_tcppkt(cur_stream, cur_ts, USER_TCPHDR_ACK | USER_TCPHDR_CWR, NULL, 0);
+                    ret = user_tcp_send_tcppkt(cur_stream, cur_ts, USER_TCPHDR_ACK | USER_TCPHDR_WACK, NULL, 0);
                     if (ret < 0)
                     {
                         cur_stream->snd->is_wack = 1;
@@ -2887,6 +3743,11 @@ void user_tcp_write_chunks(uint32_t cur_ts)
         user_tcp_write_acklist(tcp->g_sender, cur_ts, thresh);
     }
 
+    if (tcp->g_sender->pacer.cnt)
+    {
+        user_tcp_pace_run(tcp->g_sender, user_tcp_clock_us());
+    }
+
     if (tcp->g_sender->send_list_cnt)
     {
         user_tcp_write_datalist(tcp->g_sender, cur_ts, thresh);
@@ -2904,6 +3765,10 @@ void user_tcp_write_chunks(uint32_t cur_ts)
         {
             user_tcp_write_acklist(tcp->n_sender[i], cur_ts, thresh);
         }
+        if (tcp->n_sender[i]->pacer.cnt)
+        {
+            user_tcp_pace_run(tcp->n_sender[i], user_tcp_clock_us());
+        }
         if (tcp->n_sender[i]->send_list_cnt)
         {
             user_tcp_write_datalist(tcp->n_sender[i], cur_ts, thresh);
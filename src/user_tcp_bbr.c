@@ -0,0 +1,458 @@
+#include "user_tcp.h"
+#include "user_tcp_cc.h"
+
+/*
+ * BBR congestion control (v1 model).
+ *
+ * bw is the windowed max of the delivery rate samples over the last
+ * BBR_BW_RTTS round trips, min_rtt the windowed min rtt over the last
+ * BBR_MIN_RTT_WIN_US. cwnd tracks cwnd_gain * bw * min_rtt, and the
+ * pacing rate is pacing_gain * bw. gains are fixed point, BBR_UNIT is 1.0
+ */
+
+#define BBR_SCALE               8
+#define BBR_UNIT                (1 << BBR_SCALE)
+
+#define BBR_HIGH_GAIN           (BBR_UNIT * 2885 / 1000 + 1)
+#define BBR_DRAIN_GAIN          (BBR_UNIT * 1000 / 2885)
+#define BBR_CWND_GAIN           (BBR_UNIT * 2)
+#define BBR_FULL_BW_THRESH      (BBR_UNIT * 5 / 4)
+#define BBR_FULL_BW_CNT         3
+
+#define BBR_BW_RTTS             10
+#define BBR_MIN_RTT_WIN_US      (10 * 1000000ULL)
+#define BBR_PROBE_RTT_US        (200 * 1000)
+#define BBR_MIN_CWND_SEGS       4
+#define BBR_INIT_CWND_SEGS      10
+#define BBR_CYCLE_LEN           8
+
+static const uint32_t bbr_pacing_gain[BBR_CYCLE_LEN] =
+{
+    BBR_UNIT * 5 / 4,
+    BBR_UNIT * 3 / 4,
+    BBR_UNIT, BBR_UNIT, BBR_UNIT,
+    BBR_UNIT, BBR_UNIT, BBR_UNIT,
+};
+
+/*----------------------------------------------------------------------------*/
+static uint64_t user_minmax_reset(user_minmax *m, uint64_t t, uint64_t v)
+{
+    m->s[0].t = m->s[1].t = m->s[2].t = t;
+    m->s[0].v = m->s[1].v = m->s[2].v = v;
+    return v;
+}
+
+static uint64_t user_minmax_subwin_update(user_minmax *m, uint64_t win, const user_minmax_sample *val)
+{
+    uint64_t dt = val->t - m->s[0].t;
+
+    if (dt > win)
+    {
+        m->s[0] = m->s[1];
+        m->s[1] = m->s[2];
+        m->s[2] = *val;
+        if (val->t - m->s[0].t > win)
+        {
+            m->s[0] = m->s[1];
+            m->s[1] = m->s[2];
+            m->s[2] = *val;
+        }
+    }
+    else if (m->s[1].t == m->s[0].t && dt > win / 4)
+    {
+        m->s[2] = m->s[1] = *val;
+    }
+    else if (m->s[2].t == m->s[1].t && dt > win / 2)
+    {
+        m->s[2] = *val;
+    }
+    return m->s[0].v;
+}
+
+static uint64_t user_minmax_running_max(user_minmax *m, uint64_t win, uint64_t t, uint64_t v)
+{
+    user_minmax_sample val = { t, v };
+
+    if (val.v >= m->s[0].v || val.t - m->s[2].t > win)
+    {
+        return user_minmax_reset(m, t, v);
+    }
+
+    if (val.v >= m->s[1].v)
+    {
+        m->s[2] = m->s[1] = val;
+    }
+    else if (val.v >= m->s[2].v)
+    {
+        m->s[2] = val;
+    }
+    return user_minmax_subwin_update(m, win, &val);
+}
+
+/*----------------------------------------------------------------------------*/
+uint64_t user_bbr_bw(user_tcp_stream *cur_stream)
+{
+    return cur_stream->snd->rate->bbr.bw.s[0].v;
+}
+
+static uint32_t user_bbr_bdp(user_tcp_stream *cur_stream, uint64_t bw, uint32_t gain)
+{
+    user_tcp_bbr *bbr = &cur_stream->snd->rate->bbr;
+    uint64_t bdp;
+
+    if (bbr->min_rtt_us == UINT32_MAX || bw == 0)
+    {
+        return BBR_INIT_CWND_SEGS * cur_stream->snd->mss;
+    }
+
+    bdp = bw * bbr->min_rtt_us / 1000000;
+    bdp = bdp * gain / BBR_UNIT;
+    if (bdp > UINT32_MAX)
+        bdp = UINT32_MAX;
+
+    return (uint32_t) bdp;
+}
+
+static void user_bbr_set_pacing_rate(user_tcp_stream *cur_stream, uint64_t bw, uint32_t gain)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    uint64_t rate = bw * gain / BBR_UNIT * 99 / 100;
+
+    if (rate == 0)
+        return;
+
+    if (snd->rate->bbr.full_bw_reached || rate > snd->pacing_rate)
+    {
+        snd->pacing_rate = rate;
+    }
+}
+
+static void user_bbr_init_pacing_rate(user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    uint64_t rtt_us = 1000;
+
+    if (cur_stream->rcv && cur_stream->rcv->srtt)
+    {
+        rtt_us = (uint64_t)(cur_stream->rcv->srtt >> 3) * 1000;
+        if (rtt_us == 0)
+            rtt_us = 1000;
+    }
+
+    snd->pacing_rate = (uint64_t) snd->cwnd * 1000000 / rtt_us;
+    snd->pacing_rate = snd->pacing_rate * BBR_HIGH_GAIN / BBR_UNIT;
+}
+
+static void user_bbr_save_cwnd(user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_bbr *bbr = &snd->rate->bbr;
+
+    if (!bbr->packet_conservation && bbr->mode != USER_BBR_PROBE_RTT)
+    {
+        bbr->prior_cwnd = snd->cwnd;
+    }
+    else
+    {
+        bbr->prior_cwnd = MAX(bbr->prior_cwnd, snd->cwnd);
+    }
+}
+
+static void user_bbr_reset_startup(user_tcp_stream *cur_stream)
+{
+    user_tcp_bbr *bbr = &cur_stream->snd->rate->bbr;
+
+    bbr->mode = USER_BBR_STARTUP;
+    bbr->pacing_gain = BBR_HIGH_GAIN;
+    bbr->cwnd_gain = BBR_HIGH_GAIN;
+}
+
+static void user_bbr_reset_probe_bw(user_tcp_stream *cur_stream, uint64_t now_us)
+{
+    user_tcp_bbr *bbr = &cur_stream->snd->rate->bbr;
+
+    bbr->mode = USER_BBR_PROBE_BW;
+    bbr->cwnd_gain = BBR_CWND_GAIN;
+    /* start anywhere but the drain phase */
+    bbr->cycle_idx = BBR_CYCLE_LEN - 1 - (rand() % (BBR_CYCLE_LEN - 1));
+    bbr->cycle_idx = (bbr->cycle_idx + 1) % BBR_CYCLE_LEN;
+    bbr->cycle_stamp_us = now_us;
+    bbr->pacing_gain = bbr_pacing_gain[bbr->cycle_idx];
+}
+
+static void user_bbr_reset_mode(user_tcp_stream *cur_stream, uint64_t now_us)
+{
+    if (!cur_stream->snd->rate->bbr.full_bw_reached)
+    {
+        user_bbr_reset_startup(cur_stream);
+    }
+    else
+    {
+        user_bbr_reset_probe_bw(cur_stream, now_us);
+    }
+}
+
+void user_bbr_init(user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_bbr *bbr = &snd->rate->bbr;
+    uint64_t now_us = user_tcp_clock_us();
+
+    memset(bbr, 0, sizeof(user_tcp_bbr));
+
+    bbr->min_rtt_us = UINT32_MAX;
+    bbr->min_rtt_stamp_us = now_us;
+    bbr->next_rtt_delivered = snd->rate->delivered;
+    bbr->prior_cwnd = snd->cwnd;
+
+    user_bbr_reset_startup(cur_stream);
+    user_bbr_init_pacing_rate(cur_stream);
+}
+
+/*----------------------------------------------------------------------------*/
+static void user_bbr_update_bw(user_tcp_stream *cur_stream, const user_tcp_rate_sample *rs)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_bbr *bbr = &snd->rate->bbr;
+    uint64_t bw;
+
+    bbr->round_start = 0;
+    if (rs->delivered == 0 || rs->interval_us <= 0)
+        return;
+
+    if (rs->prior_delivered >= bbr->next_rtt_delivered)
+    {
+        bbr->next_rtt_delivered = snd->rate->delivered;
+        bbr->round_cnt++;
+        bbr->round_start = 1;
+
+        if (bbr->packet_conservation)
+        {
+            /* one round of recovery is over */
+            bbr->packet_conservation = 0;
+            snd->cwnd = MAX(snd->cwnd, bbr->prior_cwnd);
+        }
+    }
+
+    bw = (uint64_t) rs->delivered * 1000000 / rs->interval_us;
+    if (!rs->is_app_limited || bw >= user_bbr_bw(cur_stream))
+    {
+        user_minmax_running_max(&bbr->bw, BBR_BW_RTTS, bbr->round_cnt, bw);
+    }
+}
+
+static int user_bbr_is_next_cycle_phase(user_tcp_stream *cur_stream,
+                                        const user_tcp_rate_sample *rs, uint64_t now_us)
+{
+    user_tcp_bbr *bbr = &cur_stream->snd->rate->bbr;
+    int is_full_length = (now_us - bbr->cycle_stamp_us) > bbr->min_rtt_us;
+    uint32_t inflight = rs->prior_in_flight;
+
+    if (bbr->pacing_gain == BBR_UNIT)
+        return is_full_length;
+
+    if (bbr->pacing_gain > BBR_UNIT)
+    {
+        return is_full_length &&
+               inflight >= user_bbr_bdp(cur_stream, user_bbr_bw(cur_stream), bbr->pacing_gain);
+    }
+
+    return is_full_length ||
+           inflight <= user_bbr_bdp(cur_stream, user_bbr_bw(cur_stream), BBR_UNIT);
+}
+
+static void user_bbr_update_cycle_phase(user_tcp_stream *cur_stream,
+                                        const user_tcp_rate_sample *rs, uint64_t now_us)
+{
+    user_tcp_bbr *bbr = &cur_stream->snd->rate->bbr;
+
+    if (bbr->mode == USER_BBR_PROBE_BW && user_bbr_is_next_cycle_phase(cur_stream, rs, now_us))
+    {
+        bbr->cycle_idx = (bbr->cycle_idx + 1) % BBR_CYCLE_LEN;
+        bbr->cycle_stamp_us = now_us;
+        bbr->pacing_gain = bbr_pacing_gain[bbr->cycle_idx];
+    }
+}
+
+static void user_bbr_check_full_bw_reached(user_tcp_stream *cur_stream, const user_tcp_rate_sample *rs)
+{
+    user_tcp_bbr *bbr = &cur_stream->snd->rate->bbr;
+    uint64_t bw_thresh;
+
+    if (bbr->full_bw_reached || !bbr->round_start || rs->is_app_limited)
+        return;
+
+    bw_thresh = bbr->full_bw * BBR_FULL_BW_THRESH / BBR_UNIT;
+    if (user_bbr_bw(cur_stream) >= bw_thresh)
+    {
+        bbr->full_bw = user_bbr_bw(cur_stream);
+        bbr->full_bw_cnt = 0;
+        return;
+    }
+
+    bbr->full_bw_cnt++;
+    bbr->full_bw_reached = bbr->full_bw_cnt >= BBR_FULL_BW_CNT;
+}
+
+static void user_bbr_check_drain(user_tcp_stream *cur_stream, const user_tcp_rate_sample *rs, uint64_t now_us)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_bbr *bbr = &snd->rate->bbr;
+
+    if (bbr->mode == USER_BBR_STARTUP && bbr->full_bw_reached)
+    {
+        bbr->mode = USER_BBR_DRAIN;
+        bbr->pacing_gain = BBR_DRAIN_GAIN;
+        bbr->cwnd_gain = BBR_HIGH_GAIN;
+        user_trace_tcp("bbr: startup -> drain, bw %lu\n", (unsigned long) user_bbr_bw(cur_stream));
+    }
+
+    if (bbr->mode == USER_BBR_DRAIN &&
+        (uint32_t)(cur_stream->snd_nxt - snd->snd_una) <=
+        user_bbr_bdp(cur_stream, user_bbr_bw(cur_stream), BBR_UNIT))
+    {
+        user_bbr_reset_probe_bw(cur_stream, now_us);
+    }
+}
+
+static void user_bbr_update_min_rtt(user_tcp_stream *cur_stream, const user_tcp_rate_sample *rs, uint64_t now_us)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_bbr *bbr = &snd->rate->bbr;
+    int expired = now_us > bbr->min_rtt_stamp_us + BBR_MIN_RTT_WIN_US;
+
+    if (rs->rtt_us >= 0 && ((uint64_t) rs->rtt_us <= bbr->min_rtt_us || expired))
+    {
+        bbr->min_rtt_us = (uint32_t) MIN(rs->rtt_us, UINT32_MAX - 1);
+        bbr->min_rtt_stamp_us = now_us;
+    }
+
+    if (expired && !bbr->idle_restart && bbr->mode != USER_BBR_PROBE_RTT)
+    {
+        bbr->mode = USER_BBR_PROBE_RTT;
+        bbr->pacing_gain = BBR_UNIT;
+        bbr->cwnd_gain = BBR_UNIT;
+        user_bbr_save_cwnd(cur_stream);
+        bbr->probe_rtt_done_us = 0;
+    }
+
+    if (bbr->mode == USER_BBR_PROBE_RTT)
+    {
+        uint32_t inflight = cur_stream->snd_nxt - snd->snd_una;
+
+        if (!bbr->probe_rtt_done_us && inflight <= BBR_MIN_CWND_SEGS * snd->mss)
+        {
+            bbr->probe_rtt_done_us = now_us + BBR_PROBE_RTT_US;
+            bbr->probe_rtt_round_done = 0;
+            bbr->next_rtt_delivered = snd->rate->delivered;
+        }
+        else if (bbr->probe_rtt_done_us)
+        {
+            if (bbr->round_start)
+                bbr->probe_rtt_round_done = 1;
+
+            if (bbr->probe_rtt_round_done && now_us >= bbr->probe_rtt_done_us)
+            {
+                bbr->min_rtt_stamp_us = now_us;
+                snd->cwnd = MAX(snd->cwnd, bbr->prior_cwnd);
+                user_bbr_reset_mode(cur_stream, now_us);
+            }
+        }
+    }
+
+    if (rs->delivered > 0)
+        bbr->idle_restart = 0;
+}
+
+static void user_bbr_set_cwnd(user_tcp_stream *cur_stream, const user_tcp_rate_sample *rs,
+                              uint32_t acked, uint64_t bw, uint32_t gain)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_bbr *bbr = &snd->rate->bbr;
+    uint32_t target;
+    uint32_t cwnd = snd->cwnd;
+
+    if (!acked)
+        goto done;
+
+    if (bbr->packet_conservation)
+    {
+        cwnd = MAX(cwnd, rs->prior_in_flight);
+        goto done;
+    }
+
+    /* allow a few extra segments for delayed and stretched acks */
+    target = user_bbr_bdp(cur_stream, bw, gain) + 3 * snd->mss;
+
+    if (bbr->full_bw_reached)
+    {
+        cwnd = MIN(cwnd + acked, target);
+    }
+    else if (cwnd < target || snd->rate->delivered < BBR_INIT_CWND_SEGS * snd->mss)
+    {
+        cwnd = cwnd + acked;
+    }
+    cwnd = MAX(cwnd, BBR_MIN_CWND_SEGS * snd->mss);
+
+done:
+    if (bbr->mode == USER_BBR_PROBE_RTT)
+    {
+        cwnd = MIN(cwnd, BBR_MIN_CWND_SEGS * snd->mss);
+    }
+    snd->cwnd = cwnd;
+}
+
+void user_bbr_main(user_tcp_stream *cur_stream, const user_tcp_rate_sample *rs, uint32_t acked)
+{
+    user_tcp_bbr *bbr = &cur_stream->snd->rate->bbr;
+    uint64_t now_us = user_tcp_clock_us();
+
+    user_bbr_update_bw(cur_stream, rs);
+    user_bbr_update_cycle_phase(cur_stream, rs, now_us);
+    user_bbr_check_full_bw_reached(cur_stream, rs);
+    user_bbr_check_drain(cur_stream, rs, now_us);
+    user_bbr_update_min_rtt(cur_stream, rs, now_us);
+
+    user_bbr_set_pacing_rate(cur_stream, user_bbr_bw(cur_stream), bbr->pacing_gain);
+    user_bbr_set_cwnd(cur_stream, rs, acked, user_bbr_bw(cur_stream), bbr->cwnd_gain);
+}
+
+void user_bbr_on_loss(user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_bbr *bbr = &snd->rate->bbr;
+    uint32_t inflight = cur_stream->snd_nxt - snd->snd_una;
+
+    user_bbr_save_cwnd(cur_stream);
+    bbr->packet_conservation = 1;
+    bbr->next_rtt_delivered = snd->rate->delivered;
+    snd->cwnd = MAX(inflight, snd->mss);
+}
+
+void user_bbr_on_rto(user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_bbr *bbr = &snd->rate->bbr;
+
+    user_bbr_save_cwnd(cur_stream);
+    bbr->packet_conservation = 0;
+    bbr->full_bw = 0;
+    bbr->round_start = 1;
+    snd->cwnd = snd->mss;
+}
+
+void user_bbr_on_tx_start(user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_bbr *bbr = &snd->rate->bbr;
+
+    if (!snd->rate->app_limited)
+        return;
+
+    /* restarting from idle, don't burst above the estimated bw */
+    bbr->idle_restart = 1;
+    if (bbr->mode == USER_BBR_PROBE_BW)
+    {
+        user_bbr_set_pacing_rate(cur_stream, user_bbr_bw(cur_stream), BBR_UNIT);
+    }
+}
@@ -0,0 +1,640 @@
+#include "user_tcp.h"
+#include "user_tcp_cc.h"
+#include "user_slab.h"
+
+extern user_tcp_manager *user_get_tcp_manager(void);
+
+/*
+ * congestion control dispatch and delivery rate sampling.
+ *
+ * the send path records every data segment in snd->txq when it goes out
+ * (user_tcp_rate_on_send), the ack path turns the newly delivered
+ * segments into one rate sample (user_tcp_rate_on_ack) and hands it to the
+ * congestion control of the stream. only bbr has snd->rate, the delivery
+ * rate part of the sample; the others get the acked bytes and the rtt.
+ */
+
+int user_tcp_cc_by_name(const char *name)
+{
+    if (name == NULL)
+        return -1;
+
+    if (strcmp(name, "reno") == 0)
+        return USER_TCP_CC_RENO;
+    if (strcmp(name, "bbr") == 0)
+        return USER_TCP_CC_BBR;
+    if (strcmp(name, "dctcp") == 0)
+        return USER_TCP_CC_DCTCP;
+
+    return -1;
+}
+
+const char *user_tcp_cc_name(int algo)
+{
+    switch (algo)
+    {
+        case USER_TCP_CC_BBR:
+            return "bbr";
+        case USER_TCP_CC_DCTCP:
+            return "dctcp";
+        default:
+            return "reno";
+    }
+}
+
+static int  user_tcp_rate_attach(user_tcp_stream *cur_stream);
+static void user_tcp_rate_detach(user_tcp_stream *cur_stream);
+
+/* on the stack thread: the rate state of bbr is allocated and freed here */
+void user_tcp_cc_init(user_tcp_stream *cur_stream, int algo)
+{
+    user_tcp_send *snd = cur_stream->snd;
+
+    if (algo != USER_TCP_CC_BBR)
+    {
+        user_tcp_rate_detach(cur_stream);
+    }
+    else if (user_tcp_rate_attach(cur_stream) < 0)
+    {
+        user_trace_tcp("Stream %d: no memory for bbr, using reno\n", cur_stream->id);
+        algo = USER_TCP_CC_RENO;
+    }
+
+    snd->cc_algo = algo;
+    snd->pacing_rate = 0;
+    snd->ts_pace_us = 0;
+
+    if (algo == USER_TCP_CC_BBR)
+    {
+        user_bbr_init(cur_stream);
+    }
+    else if (algo == USER_TCP_CC_DCTCP)
+    {
+        memset(&snd->dctcp, 0, sizeof(user_tcp_dctcp));
+        snd->dctcp.alpha = USER_DCTCP_MAX_ALPHA;
+        snd->dctcp.next_seq = cur_stream->snd_nxt;
+    }
+
+    user_tcp_pacing_update(cur_stream, NULL);
+}
+
+static void user_tcp_reno_on_ack(user_tcp_stream *cur_stream, uint32_t acked)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    uint32_t packets = (acked + snd->mss - 1) / snd->mss;
+
+    if (snd->cwnd < snd->ssthresh)
+    {
+        if ((snd->cwnd + snd->mss * packets) > snd->cwnd)
+        {
+            snd->cwnd += snd->mss * packets;
+        }
+        user_trace_tcp("slow start cwnd : %u, ssthresh: %u\n",
+                       snd->cwnd, snd->ssthresh);
+    }
+    else
+    {
+        uint32_t new_cwnd = snd->cwnd + packets * snd->mss * snd->mss / snd->cwnd;
+        if (new_cwnd > snd->cwnd)
+        {
+            snd->cwnd = new_cwnd;
+        }
+    }
+}
+
+void user_tcp_cc_on_ack(user_tcp_stream *cur_stream, const user_tcp_rate_sample *rs, uint32_t acked)
+{
+    if (cur_stream->state < USER_TCP_ESTABLISHED)
+        return;
+
+    if (USER_TCP_BBR_ACTIVE(cur_stream->snd))
+    {
+        user_bbr_main(cur_stream, rs, acked);
+    }
+    else if (!cur_stream->snd->sack.in_recovery)
+    {
+        /* in recovery prr sets the window */
+        user_tcp_reno_on_ack(cur_stream, acked);
+    }
+
+    user_tcp_pacing_update(cur_stream, rs);
+}
+
+void user_tcp_cc_on_fast_retransmit(user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+
+    snd->ssthresh = MIN(snd->cwnd, snd->peer_wnd) / 2;
+    if (snd->ssthresh < 2 * snd->mss)
+    {
+        snd->ssthresh = 2 * snd->mss;
+    }
+
+    if (USER_TCP_BBR_ACTIVE(snd))
+    {
+        user_bbr_on_loss(cur_stream);
+    }
+    else
+    {
+        snd->cwnd = snd->ssthresh + 3 * snd->mss;
+    }
+
+    user_trace_tcp("Fast retransmission. cwnd: %u, ssthresh: %u\n",
+                   snd->cwnd, snd->ssthresh);
+}
+
+void user_tcp_cc_on_dupack(user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+
+    if (snd->cc_algo != USER_TCP_CC_RENO)
+        return;
+
+    if ((uint32_t)(snd->cwnd + snd->mss) > snd->cwnd)
+    {
+        snd->cwnd += snd->mss;
+        user_trace_tcp("Dupack cwnd inflate. cwnd: %u, ssthresh: %u\n",
+                       snd->cwnd, snd->ssthresh);
+    }
+}
+
+void user_tcp_cc_on_recovered(user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+
+    /* bbr restores its own cwnd when the recovery round ends */
+    if (USER_TCP_BBR_ACTIVE(snd))
+        return;
+
+    if (snd->cwnd > snd->ssthresh)
+    {
+        snd->cwnd = snd->ssthresh;
+    }
+}
+
+void user_tcp_cc_on_rto(user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+
+    snd->ssthresh = MIN(snd->cwnd, snd->peer_wnd) / 2;
+    if (snd->ssthresh < (2 * snd->mss))
+    {
+        snd->ssthresh = snd->mss * 2;
+    }
+
+    if (USER_TCP_BBR_ACTIVE(snd))
+    {
+        user_bbr_on_rto(cur_stream);
+    }
+    else
+    {
+        snd->cwnd = snd->mss;
+    }
+}
+
+/* the reduction was for a spurious retransmission, go back to the saved window */
+void user_tcp_cc_undo(user_tcp_stream *cur_stream, uint32_t cwnd, uint32_t ssthresh)
+{
+    user_tcp_send *snd = cur_stream->snd;
+
+    snd->cwnd = MAX(snd->cwnd, cwnd);
+    snd->ssthresh = MAX(snd->ssthresh, ssthresh);
+
+    if (USER_TCP_BBR_ACTIVE(snd))
+    {
+        snd->rate->bbr.packet_conservation = 0;
+    }
+
+    user_trace_tcp("Undo window reduction. cwnd: %u, ssthresh: %u\n",
+                   snd->cwnd, snd->ssthresh);
+}
+
+/*
+ * a retransmitted tail loss probe was the only copy that arrived, the
+ * original was lost: reduce once as for a fast retransmit, no recovery.
+ */
+void user_tcp_cc_on_probe_loss(user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+
+    if (USER_TCP_BBR_ACTIVE(snd))
+        return;
+
+    snd->ssthresh = MIN(snd->cwnd, snd->peer_wnd) / 2;
+    if (snd->ssthresh < 2 * snd->mss)
+    {
+        snd->ssthresh = 2 * snd->mss;
+    }
+    snd->cwnd = snd->ssthresh;
+
+    user_trace_tcp("Loss probe repaired a loss. cwnd: %u, ssthresh: %u\n",
+                   snd->cwnd, snd->ssthresh);
+}
+
+/*
+ * once per window of data, fold the fraction of CE marked bytes into alpha:
+ * alpha = (1 - g) * alpha + g * F, g = 1/16
+ */
+static void user_dctcp_update_alpha(user_tcp_stream *cur_stream, uint32_t ack_seq, uint32_t acked, int ece)
+{
+    user_tcp_dctcp *dctcp = &cur_stream->snd->dctcp;
+    uint32_t delivered_ce, decay;
+
+    dctcp->acked_bytes_total += acked;
+    if (ece)
+    {
+        dctcp->acked_bytes_ecn += acked;
+    }
+
+    if (TCP_SEQ_LT(ack_seq, dctcp->next_seq))
+        return;
+
+    delivered_ce = (uint64_t) dctcp->acked_bytes_ecn << (10 - USER_DCTCP_SHIFT_G);
+    delivered_ce /= MAX(dctcp->acked_bytes_total, 1);
+
+    decay = dctcp->alpha >> USER_DCTCP_SHIFT_G;
+    dctcp->alpha -= decay ? decay : dctcp->alpha;
+    dctcp->alpha = MIN(dctcp->alpha + delivered_ce, USER_DCTCP_MAX_ALPHA);
+
+    dctcp->acked_bytes_ecn = 0;
+    dctcp->acked_bytes_total = 0;
+    dctcp->next_seq = cur_stream->snd_nxt;
+}
+
+void user_tcp_cc_on_ecn(user_tcp_stream *cur_stream, uint32_t ack_seq, uint32_t acked, int ece)
+{
+    user_tcp_send *snd = cur_stream->snd;
+
+    if (!(snd->ecn_flags & TCP_ECN_OK))
+        return;
+
+    if (snd->cc_algo == USER_TCP_CC_DCTCP)
+    {
+        user_dctcp_update_alpha(cur_stream, ack_seq, acked, ece);
+    }
+
+    if ((snd->ecn_flags & TCP_ECN_IN_CWR) && TCP_SEQ_GEQ(ack_seq, snd->ecn_high_seq))
+    {
+        snd->ecn_flags &= ~TCP_ECN_IN_CWR;
+    }
+
+    if (!ece || (snd->ecn_flags & TCP_ECN_IN_CWR))
+        return;
+
+    /* at most one reduction per window, and tell the peer with CWR */
+    snd->ecn_flags |= TCP_ECN_IN_CWR | TCP_ECN_QUEUE_CWR;
+    snd->ecn_high_seq = cur_stream->snd_nxt;
+
+    if (USER_TCP_BBR_ACTIVE(snd))
+        return;
+
+    if (snd->cc_algo == USER_TCP_CC_DCTCP)
+    {
+        snd->ssthresh = snd->cwnd - (uint32_t)(((uint64_t) snd->cwnd * snd->dctcp.alpha) >> 11);
+    }
+    else
+    {
+        snd->ssthresh = snd->cwnd / 2;
+    }
+
+    if (snd->ssthresh < 2 * snd->mss)
+    {
+        snd->ssthresh = 2 * snd->mss;
+    }
+    snd->cwnd = snd->ssthresh;
+
+    user_trace_tcp("ECN congestion signal. cwnd: %u, ssthresh: %u\n",
+                   snd->cwnd, snd->ssthresh);
+}
+
+/*----------------------------------------------------------------------------*/
+/* the size classes are shared, the stack counts what its streams hold for the pressure states */
+static inline void user_tcp_cc_account(int64_t bytes)
+{
+    user_tcp_manager *tcp = user_get_tcp_manager();
+
+    if (tcp)
+    {
+        tcp->mem.cc_bytes += bytes;
+    }
+}
+
+static inline int64_t user_tcp_txq_bytes(user_tcp_txq *txq)
+{
+    return (int64_t) txq->size * (sizeof(user_tcp_txseg) + (txq->rate ? sizeof(user_tcp_txrate) : 0));
+}
+
+static int user_tcp_txq_grow(user_tcp_txq *txq, int with_rate)
+{
+    uint32_t size = txq->size ? txq->size * 2 : USER_TCP_TXQ_MIN;
+    user_tcp_txseg *seg;
+    user_tcp_txrate *rate = NULL;
+    uint32_t i;
+
+    if (size > USER_TCP_TXQ_MAX)
+        return -1;
+
+    seg = user_slab_alloc(size * sizeof(user_tcp_txseg));
+    if (!seg)
+        return -1;
+
+    if (with_rate)
+    {
+        rate = user_slab_alloc(size * sizeof(user_tcp_txrate));
+        if (!rate)
+        {
+            user_slab_free(seg, size * sizeof(user_tcp_txseg));
+            return -1;
+        }
+    }
+
+    for (i = 0; i < txq->cnt; i++)
+    {
+        seg[i] = *TXSEG_AT(txq, i);
+        if (rate)
+        {
+            rate[i] = *TXRATE_AT(txq, i);
+        }
+    }
+    user_tcp_cc_account(-user_tcp_txq_bytes(txq));
+    user_slab_free(txq->seg, txq->size * sizeof(user_tcp_txseg));
+    user_slab_free(txq->rate, txq->size * sizeof(user_tcp_txrate));
+
+    txq->seg = seg;
+    txq->rate = rate;
+    txq->head = 0;
+    txq->size = size;
+    user_tcp_cc_account(user_tcp_txq_bytes(txq));
+    return 0;
+}
+
+static void user_tcp_txq_release(user_tcp_txq *txq)
+{
+    user_tcp_cc_account(-user_tcp_txq_bytes(txq));
+    user_slab_free(txq->seg, txq->size * sizeof(user_tcp_txseg));
+    user_slab_free(txq->rate, txq->size * sizeof(user_tcp_txrate));
+    txq->seg = NULL;
+    txq->rate = NULL;
+    txq->head = 0;
+    txq->cnt = 0;
+    txq->size = 0;
+}
+
+/* the records already in flight get the delivery state of now */
+static int user_tcp_rate_attach(user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_txq *txq = &snd->txq;
+    user_tcp_txrate *txr;
+    uint64_t now_us = user_tcp_clock_us();
+    uint32_t i;
+
+    if (snd->rate)
+        return 0;
+
+    snd->rate = user_slab_zalloc(sizeof(user_tcp_rate));
+    if (!snd->rate)
+        return -1;
+
+    snd->rate->first_tx_us = now_us;
+    snd->rate->delivered_us = now_us;
+
+    if (txq->size)
+    {
+        txq->rate = user_slab_alloc(txq->size * sizeof(user_tcp_txrate));
+        if (!txq->rate)
+        {
+            user_slab_free(snd->rate, sizeof(user_tcp_rate));
+            snd->rate = NULL;
+            return -1;
+        }
+
+        for (i = 0; i < txq->cnt; i++)
+        {
+            txr = TXRATE_AT(txq, i);
+            txr->first_tx_us = now_us;
+            txr->delivered_us = now_us;
+            txr->delivered = 0;
+        }
+    }
+    user_tcp_cc_account(sizeof(user_tcp_rate) + txq->size * sizeof(user_tcp_txrate));
+    return 0;
+}
+
+static void user_tcp_rate_detach(user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_txq *txq = &snd->txq;
+
+    if (snd->rate)
+    {
+        user_tcp_cc_account(-(int64_t) sizeof(user_tcp_rate));
+    }
+    if (txq->rate)
+    {
+        user_tcp_cc_account(-(int64_t) (txq->size * sizeof(user_tcp_txrate)));
+    }
+    user_slab_free(txq->rate, txq->size * sizeof(user_tcp_txrate));
+    txq->rate = NULL;
+    user_slab_free(snd->rate, sizeof(user_tcp_rate));
+    snd->rate = NULL;
+}
+
+/* an idle stream gives its drained ring back, the next send starts a small one */
+int user_tcp_txq_trim(user_tcp_stream *cur_stream)
+{
+    user_tcp_txq *txq = &cur_stream->snd->txq;
+    int bytes;
+
+    if (txq->cnt > 0 || txq->size == 0)
+        return 0;
+
+    bytes = user_tcp_txq_bytes(txq);
+    user_tcp_txq_release(txq);
+    return bytes;
+}
+
+void user_tcp_cc_destroy(user_tcp_stream *cur_stream)
+{
+    user_tcp_rate_detach(cur_stream);
+    user_tcp_txq_release(&cur_stream->snd->txq);
+}
+
+void user_tcp_rate_on_send(user_tcp_stream *cur_stream, uint32_t seq, uint32_t len, uint64_t now_us)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_rate *rate = snd->rate;
+    user_tcp_txq *txq = &snd->txq;
+    user_tcp_txseg *seg;
+    user_tcp_txrate *txr;
+    uint32_t end_seq = seq + len;
+    uint32_t i;
+
+    if (len == 0)
+        return;
+
+    if (txq->cnt > 0)
+    {
+        if (TCP_SEQ_LT(seq, txq->high_seq))
+        {
+            /* retransmission: refresh the records it covers */
+            for (i = 0; i < txq->cnt; i++)
+            {
+                seg = TXSEG_AT(txq, i);
+                if (TCP_SEQ_GT(seg->end_seq, seq) && TCP_SEQ_LT(seg->seq, end_seq))
+                {
+                    seg->xmit_us = now_us;
+                    seg->flags |= USER_TXSEG_RETRANS;
+                    seg->flags &= ~USER_TXSEG_LOST;
+                }
+            }
+            return;
+        }
+    }
+    else if (rate)
+    {
+        /* nothing in flight, restart the send and ack intervals */
+        rate->first_tx_us = now_us;
+        rate->delivered_us = now_us;
+        user_bbr_on_tx_start(cur_stream);
+    }
+    txq->high_seq = end_seq;
+
+    /*
+     * at the cap, or out of memory: the segment joins the last record, so
+     * its bytes are still delivered and timed by rack. the fresh bytes are
+     * neither sacked nor lost, the record is looked at again as a whole.
+     */
+    if (txq->cnt == txq->size && user_tcp_txq_grow(txq, rate != NULL) < 0)
+    {
+        if (txq->cnt > 0)
+        {
+            seg = TXSEG_AT(txq, txq->cnt - 1);
+            seg->end_seq = end_seq;
+            seg->xmit_us = now_us;
+            seg->flags &= ~(USER_TXSEG_SACKED | USER_TXSEG_LOST);
+        }
+        return;
+    }
+
+    seg = TXSEG_AT(txq, txq->cnt);
+    seg->seq = seq;
+    seg->end_seq = end_seq;
+    seg->xmit_us = now_us;
+    seg->flags = 0;
+
+    if (rate)
+    {
+        txr = TXRATE_AT(txq, txq->cnt);
+        txr->first_tx_us = rate->first_tx_us;
+        txr->delivered_us = rate->delivered_us;
+        txr->delivered = rate->delivered;
+        if (rate->app_limited)
+        {
+            seg->flags |= USER_TXSEG_APP_LIMITED;
+        }
+    }
+    txq->cnt++;
+}
+
+void user_tcp_rate_on_ack(user_tcp_stream *cur_stream, uint32_t ack_seq, uint64_t now_us,
+                          user_tcp_rate_sample *rs)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_rate *rate = snd->rate;
+    user_tcp_txq *txq = &snd->txq;
+    user_tcp_txseg *seg;
+    user_tcp_txrate *txr;
+    int64_t send_us = 0;
+    int sampled = 0;
+
+    memset(rs, 0, sizeof(user_tcp_rate_sample));
+    rs->rtt_us = -1;
+    rs->interval_us = -1;
+    rs->prior_in_flight = cur_stream->snd_nxt - snd->snd_una;
+
+    while (txq->cnt > 0)
+    {
+        seg = TXSEG_AT(txq, 0);
+
+        if (TCP_SEQ_LEQ(seg->end_seq, ack_seq))
+        {
+            rs->acked += seg->end_seq - seg->seq;
+
+            if (rate)
+            {
+                txr = TXRATE_AT(txq, 0);
+                rate->delivered += seg->end_seq - seg->seq;
+                rate->delivered_us = now_us;
+
+                if (!sampled || txr->delivered >= rs->prior_delivered)
+                {
+                    rs->prior_delivered = txr->delivered;
+                    rs->prior_us = txr->delivered_us;
+                    rs->is_app_limited = (seg->flags & USER_TXSEG_APP_LIMITED) ? 1 : 0;
+                    rs->is_retrans = (seg->flags & USER_TXSEG_RETRANS) ? 1 : 0;
+                    send_us = (int64_t)(seg->xmit_us - txr->first_tx_us);
+                    rate->first_tx_us = seg->xmit_us;
+                    sampled = 1;
+                }
+            }
+
+            if (!(seg->flags & USER_TXSEG_RETRANS))
+            {
+                rs->rtt_us = (int64_t)(now_us - seg->xmit_us);
+            }
+
+            txq->head = (txq->head + 1) & (txq->size - 1);
+            txq->cnt--;
+        }
+        else if (TCP_SEQ_GT(ack_seq, seg->seq))
+        {
+            /* partially acked record */
+            rs->acked += ack_seq - seg->seq;
+            if (rate)
+            {
+                rate->delivered += ack_seq - seg->seq;
+            }
+            seg->seq = ack_seq;
+            break;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (!rate)
+        return;
+
+    if (rate->app_limited && rate->delivered > rate->app_limited)
+    {
+        rate->app_limited = 0;
+    }
+
+    if (!sampled)
+        return;
+
+    rs->delivered = (uint32_t)(rate->delivered - rs->prior_delivered);
+    rs->interval_us = MAX(send_us, (int64_t)(rate->delivered_us - rs->prior_us));
+
+    if (rs->interval_us > 0)
+    {
+        uint64_t bps = (uint64_t) rs->delivered * 1000000 / rs->interval_us;
+        if (!rs->is_app_limited || bps > rate->rate_bps)
+        {
+            rate->rate_bps = bps;
+        }
+    }
+}
+
+void user_tcp_rate_check_app_limited(user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    uint32_t in_flight = cur_stream->snd_nxt - snd->snd_una;
+
+    if (snd->rate && in_flight < snd->cwnd)
+    {
+        snd->rate->app_limited = MAX(snd->rate->delivered + in_flight, 1);
+    }
+}
@@ -0,0 +1,139 @@
+#include "user_tcp.h"
+#include "user_header.h"
+#include "user_tcp_fastopen.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+/*
+ * TCP Fast Open. a listener with fastopen_qlen set hands out a cookie,
+ * a keyed hash of the client address, in its syn-ack. a SYN carrying a
+ * valid cookie gets a stream right away: its data is queued before the
+ * handshake completes and the stream is accepted at once, up to
+ * fastopen_qlen of them pending. clients keep the cookies they learn in
+ * a small cache per server address.
+ */
+
+void user_tcp_fastopen_init(user_tcp_manager *tcp)
+{
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    if (fd < 0 || read(fd, tcp->fastopen_secret, sizeof(tcp->fastopen_secret)) !=
+                  (ssize_t) sizeof(tcp->fastopen_secret))
+    {
+        tcp->fastopen_secret[0] = (uint32_t) time(NULL) ^ 0x5bd1e995;
+        tcp->fastopen_secret[1] = (uint32_t) rand();
+        tcp->fastopen_secret[2] = (uint32_t) rand();
+        tcp->fastopen_secret[3] = (uint32_t) getpid();
+    }
+
+    if (fd >= 0)
+        close(fd);
+
+    memset(tcp->fastopen_cache, 0, sizeof(tcp->fastopen_cache));
+}
+
+/* -1 without the option, else the cookie length, 0 for a cookie request */
+int user_tcp_parse_fastopen(const struct tcphdr *tcph, uint8_t *cookie)
+{
+    const uint8_t *tcpopt = (const uint8_t *) tcph + TCP_HEADER_LEN;
+    int len = (tcph->doff << 2) - TCP_HEADER_LEN;
+    unsigned int kind, optlen;
+    int i;
+
+    for (i = 0; i < len;)
+    {
+        kind = tcpopt[i++];
+        if (kind == TCP_OPT_END)
+            break;
+        if (kind == TCP_OPT_NOP)
+            continue;
+
+        if (i >= len)
+            break;
+        optlen = tcpopt[i++];
+        if (optlen < 2 || i + optlen - 2 > (unsigned int) len)
+            break;
+
+        if (kind == TCP_OPT_FASTOPEN)
+        {
+            optlen -= 2;
+            if (optlen > USER_TFO_COOKIE_MAX)
+                return -1;
+            memcpy(cookie, tcpopt + i, optlen);
+            return (int) optlen;
+        }
+        i += optlen - 2;
+    }
+    return -1;
+}
+
+static inline uint32_t user_fastopen_mix(uint32_t h, uint32_t w)
+{
+    h ^= w;
+    h *= 0xcc9e2d51;
+    h = (h << 15) | (h >> 17);
+    h *= 0x1b873593;
+    h ^= h >> 16;
+    return h;
+}
+
+void user_tcp_fastopen_cookie(user_tcp_manager *tcp, uint32_t daddr, uint8_t *cookie)
+{
+    uint32_t h[2];
+
+    h[0] = user_fastopen_mix(user_fastopen_mix(tcp->fastopen_secret[0], daddr), tcp->fastopen_secret[1]);
+    h[1] = user_fastopen_mix(user_fastopen_mix(tcp->fastopen_secret[2], daddr ^ h[0]), tcp->fastopen_secret[3]);
+    memcpy(cookie, h, USER_TFO_COOKIE_LEN);
+}
+
+int user_tcp_fastopen_check(user_tcp_manager *tcp, uint32_t daddr, const uint8_t *cookie, int len)
+{
+    uint8_t valid[USER_TFO_COOKIE_LEN];
+
+    if (len != USER_TFO_COOKIE_LEN)
+        return 0;
+
+    user_tcp_fastopen_cookie(tcp, daddr, valid);
+    return memcmp(cookie, valid, USER_TFO_COOKIE_LEN) == 0;
+}
+
+/* a fast open stream leaves the listener's pending count, established or dropped */
+void user_tcp_fastopen_release(user_tcp_manager *tcp, user_tcp_stream *cur_stream)
+{
+    user_tcp_listener *listener;
+
+    if (!cur_stream->fastopen)
+        return;
+
+    cur_stream->fastopen = 0;
+    listener = (user_tcp_listener *) ListenerHTSearch(tcp->listeners, &cur_stream->sport);
+    if (listener && listener->fastopen_pending > 0)
+    {
+        listener->fastopen_pending--;
+    }
+}
+
+int user_tcp_fastopen_cache_get(user_tcp_manager *tcp, uint32_t daddr, uint8_t *cookie)
+{
+    user_tcp_tfo_cache *c = &tcp->fastopen_cache[HashTuple(daddr, 0, 0, 0) & (USER_TFO_CACHE_SIZE - 1)];
+
+    if (c->daddr != daddr || c->len == 0)
+        return 0;
+
+    memcpy(cookie, c->cookie, c->len);
+    return c->len;
+}
+
+void user_tcp_fastopen_cache_put(user_tcp_manager *tcp, uint32_t daddr, const uint8_t *cookie, int len)
+{
+    user_tcp_tfo_cache *c = &tcp->fastopen_cache[HashTuple(daddr, 0, 0, 0) & (USER_TFO_CACHE_SIZE - 1)];
+
+    if (len < 4 || len > USER_TFO_COOKIE_MAX)
+        return;
+
+    c->daddr = daddr;
+    c->len = (uint8_t) len;
+    memcpy(c->cookie, cookie, len);
+}
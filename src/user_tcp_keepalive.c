@@ -0,0 +1,197 @@
+#include "user_tcp.h"
+#include "user_tcp_keepalive.h"
+
+#include <stdlib.h>
+
+/*
+ * keepalive and the idle kill. a stream with SO_KEEPALIVE is kept on the
+ * keepalive wheel from ESTABLISHED on, without data in flight it sends a
+ * probe (an ack for snd_nxt - 1) once nothing arrived for keep_idle, then
+ * every keep_intvl, and gives up after keep_cnt unanswered probes.
+ * the idle kill (USER_TCP_TIMEOUT) is separate, a stream that turned it
+ * off is simply not on the timeout list.
+ */
+
+extern void DestroyTcpStream(user_tcp_manager *tcp, user_tcp_stream *stream);
+extern void AddtoTimeoutList(user_tcp_manager *tcp, user_tcp_stream *cur_stream);
+extern void RemoveFromTimeoutList(user_tcp_manager *tcp, user_tcp_stream *cur_stream);
+extern void user_tcp_enqueue_acklist(user_tcp_manager *tcp, user_tcp_stream *cur_stream, uint32_t cur_ts, uint8_t opt);
+extern int user_tcp_send_tcppkt(user_tcp_stream *cur_stream,
+                                uint32_t cur_ts, uint16_t flags, uint8_t *payload, uint16_t payloadlen);
+
+/* keep_idle and keep_intvl are seconds, the deadlines and the wheel run in ticks */
+#define USER_KA_SLOT_TS        (MSEC_TO_USEC(USER_KA_SLOT_MS) / TIME_TICK)
+
+int user_tcp_keepalive_init(user_tcp_manager *tcp)
+{
+    int i;
+
+    tcp->ka_wheel = (user_tcp_kawheel *) calloc(1, sizeof(user_tcp_kawheel));
+    if (!tcp->ka_wheel)
+        return -1;
+
+    for (i = 0; i < USER_KA_SLOTS; i++)
+    {
+        TAILQ_INIT(&tcp->ka_wheel->slot[i]);
+    }
+    return 0;
+}
+
+static void user_ka_insert(user_tcp_manager *tcp, user_tcp_stream *cur_stream, uint32_t cur_ts, uint32_t due)
+{
+    user_tcp_kawheel *ka = tcp->ka_wheel;
+    user_tcp_send *snd = cur_stream->snd;
+    uint32_t ahead = 0;
+
+    if (ka->cnt == 0)
+    {
+        ka->cur_ts = cur_ts;
+    }
+
+    /* never behind now, so a stream put back while its slot is served lands in a later one */
+    if ((int32_t) (due - cur_ts) < 0)
+    {
+        due = cur_ts;
+    }
+
+    ahead = TS_TO_MSEC((uint64_t) (due - ka->cur_ts)) / USER_KA_SLOT_MS;
+    if (ahead >= USER_KA_SLOTS)
+    {
+        ahead = USER_KA_SLOTS - 1;
+    }
+
+    snd->ka_slot = (ka->idx + ahead) % USER_KA_SLOTS;
+    snd->on_ka_wheel = 1;
+    TAILQ_INSERT_TAIL(&ka->slot[snd->ka_slot], cur_stream, snd->ka_link);
+    ka->cnt++;
+}
+
+void user_tcp_keepalive_disarm(user_tcp_manager *tcp, user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+
+    if (!snd->on_ka_wheel)
+        return;
+
+    TAILQ_REMOVE(&tcp->ka_wheel->slot[snd->ka_slot], cur_stream, snd->ka_link);
+    snd->on_ka_wheel = 0;
+    tcp->ka_wheel->cnt--;
+}
+
+void user_tcp_keepalive_arm(user_tcp_manager *tcp, user_tcp_stream *cur_stream, uint32_t cur_ts)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    uint32_t last = cur_stream->rcv->ts_last_seg ? cur_stream->rcv->ts_last_seg : cur_ts;
+
+    if (!snd->keepalive)
+        return;
+
+    user_tcp_keepalive_disarm(tcp, cur_stream);
+    snd->ka_probes = 0;
+    user_ka_insert(tcp, cur_stream, cur_ts, last + snd->keep_idle * HZ);
+}
+
+/* the settings of the stream changed in setsockopt, put it on or off the wheel and the timeout list */
+void user_tcp_keepalive_apply(user_tcp_manager *tcp, user_tcp_stream *cur_stream, uint32_t cur_ts)
+{
+    if (cur_stream->state != USER_TCP_ESTABLISHED && cur_stream->state != USER_TCP_CLOSE_WAIT)
+        return;
+
+    if (cur_stream->snd->keepalive)
+    {
+        user_tcp_keepalive_arm(tcp, cur_stream, cur_ts);
+    }
+    else
+    {
+        user_tcp_keepalive_disarm(tcp, cur_stream);
+    }
+
+    if (cur_stream->snd->no_idle_kill)
+    {
+        RemoveFromTimeoutList(tcp, cur_stream);
+    }
+    else if (!cur_stream->on_timeout_list && !cur_stream->closed)
+    {
+        AddtoTimeoutList(tcp, cur_stream);
+    }
+}
+
+static void user_ka_expire(user_tcp_manager *tcp, user_tcp_stream *cur_stream, uint32_t cur_ts)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    uint32_t idle = snd->keep_idle * HZ;
+    uint32_t last = cur_stream->rcv->ts_last_seg;
+
+    if (!snd->keepalive ||
+        (cur_stream->state != USER_TCP_ESTABLISHED && cur_stream->state != USER_TCP_CLOSE_WAIT))
+        return;
+
+    /* with data outstanding the retransmission and persist timers watch the peer */
+    if (cur_stream->snd_nxt != snd->snd_una || (snd->sndbuf && snd->sndbuf->len > 0))
+    {
+        snd->ka_probes = 0;
+        user_ka_insert(tcp, cur_stream, cur_ts, cur_ts + idle);
+        return;
+    }
+
+    if ((int32_t) (cur_ts - last) < (int32_t) idle)
+    {
+        /* the peer spoke since, wait for the idle time from then */
+        snd->ka_probes = 0;
+        user_ka_insert(tcp, cur_stream, cur_ts, last + idle);
+        return;
+    }
+
+    if (snd->ka_probes >= snd->keep_cnt)
+    {
+        user_trace_timer("Stream %d: %u keepalive probes unanswered.\n",
+                         cur_stream->id, snd->ka_probes);
+
+        RemoveFromTimeoutList(tcp, cur_stream);
+        cur_stream->state = USER_TCP_CLOSED;
+        cur_stream->close_reason = TCP_TIMEDOUT;
+        if (cur_stream->socket)
+        {
+            RaiseErrorEvent(tcp, cur_stream);
+        }
+        else
+        {
+            DestroyTcpStream(tcp, cur_stream);
+        }
+        return;
+    }
+
+    /* sent right away, the ack list skips streams that never received data */
+    if (user_tcp_send_tcppkt(cur_stream, cur_ts, USER_TCPHDR_ACK | USER_TCPHDR_WACK, NULL, 0) < 0)
+    {
+        user_tcp_enqueue_acklist(tcp, cur_stream, cur_ts, ACK_OPT_WACK);
+    }
+    snd->ka_probes++;
+    user_ka_insert(tcp, cur_stream, cur_ts, cur_ts + snd->keep_intvl * HZ);
+}
+
+void user_tcp_keepalive_timer(user_tcp_manager *tcp, uint32_t cur_ts, int thresh)
+{
+    user_tcp_kawheel *ka = tcp->ka_wheel;
+    user_tcp_stream *walk;
+    int cnt = 0;
+
+    while (ka->cnt > 0 && (int32_t) (cur_ts - (ka->cur_ts + USER_KA_SLOT_TS)) >= 0)
+    {
+        while ((walk = TAILQ_FIRST(&ka->slot[ka->idx])) != NULL)
+        {
+            if (++cnt > thresh)
+                return;
+
+            TAILQ_REMOVE(&ka->slot[ka->idx], walk, snd->ka_link);
+            walk->snd->on_ka_wheel = 0;
+
+            /* counted until handled, the wheel must not restart under a stream put back */
+            user_ka_expire(tcp, walk, cur_ts);
+            ka->cnt--;
+        }
+
+        ka->idx = (ka->idx + 1) % USER_KA_SLOTS;
+        ka->cur_ts += USER_KA_SLOT_TS;
+    }
+}
@@ -0,0 +1,262 @@
+#include "user_tcp.h"
+#include "user_tcp_mem.h"
+#include "user_buffer.h"
+#include "user_mempool.h"
+
+#include <unistd.h>
+
+static uint64_t user_tcp_mem_pool(user_mempool *mp)
+{
+    if (!mp)
+        return 0;
+
+    return (uint64_t) user_mempool_used_chunks(mp) * mp->mp_chunk_size;
+}
+
+void user_tcp_mem_init(user_tcp_manager *tcp)
+{
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long psize = sysconf(_SC_PAGESIZE);
+    uint64_t high = (pages > 0 && psize > 0) ? (uint64_t) pages * psize / 100 * USER_TCP_MEM_PERCENT : (1ULL << 32);
+
+    memset(&tcp->mem, 0, sizeof(user_tcp_memctl));
+    user_tcp_mem_set_limits(tcp, high / 2, high / 4 * 3, high);
+
+    TAILQ_INIT(&tcp->mem.idle_list);
+    tcp->mem.buf_idle = USER_TCP_BUF_IDLE * HZ;
+}
+
+int user_tcp_mem_set_limits(user_tcp_manager *tcp, uint64_t low, uint64_t pressure, uint64_t high)
+{
+    if (low > pressure || pressure > high || high == 0)
+        return -1;
+
+    tcp->mem.limit[0] = low;
+    tcp->mem.limit[1] = pressure;
+    tcp->mem.limit[2] = high;
+    return 0;
+}
+
+/* once per tick from the stack loop */
+void user_tcp_mem_update(user_tcp_manager *tcp, uint32_t cur_ts)
+{
+    user_tcp_memctl *mem = &tcp->mem;
+    uint64_t used;
+    uint8_t state;
+
+    if (cur_ts == mem->ts_update)
+        return;
+    mem->ts_update = cur_ts;
+
+    used = user_tcp_mem_pool(tcp->flow);
+    used += user_tcp_mem_pool(tcp->rbm_snd->seg_mp) + user_tcp_mem_pool(tcp->rbm_rcv->seg_mp);
+    used += user_tcp_mem_pool(tcp->rbm_rcv->frag_mp);
+    used += user_tcp_mem_pool(tcp->reqsk_pool) + user_tcp_mem_pool(tcp->tw_pool);
+    used += mem->cc_bytes;
+    mem->used = used;
+
+    state = mem->state;
+    if (used > mem->limit[2])
+    {
+        state = USER_TCP_MEM_CRITICAL;
+    }
+    else if (used > mem->limit[1])
+    {
+        if (state == USER_TCP_MEM_NORMAL)
+            state = USER_TCP_MEM_PRESSURE;
+    }
+    else if (state == USER_TCP_MEM_CRITICAL)
+    {
+        state = (used < mem->limit[0]) ? USER_TCP_MEM_NORMAL : USER_TCP_MEM_PRESSURE;
+    }
+    else if (used < mem->limit[0])
+    {
+        state = USER_TCP_MEM_NORMAL;
+    }
+
+    if (state != mem->state)
+    {
+        user_trace_tcp("memory %s, %lu bytes in use\n",
+                       state == USER_TCP_MEM_CRITICAL ? "critical" :
+                       state == USER_TCP_MEM_PRESSURE ? "under pressure" : "normal",
+                       (unsigned long) used);
+
+        if (state == USER_TCP_MEM_PRESSURE && mem->state == USER_TCP_MEM_NORMAL)
+            mem->pressure_cnt++;
+        if (state == USER_TCP_MEM_CRITICAL)
+            mem->critical_cnt++;
+        mem->state = state;
+
+        /* buffers over the lower limit drop their highest ranges as segments arrive */
+        tcp->rbm_rcv->frag_max = (state == USER_TCP_MEM_NORMAL) ?
+                                 USER_RCVBUF_FRAGS : USER_TCP_MEM_PRESSURE_FRAGS;
+    }
+}
+
+/*
+ * the window to advertise. under pressure it does not open past the edge
+ * already promised, which is never taken back, and closes down to a few
+ * segments as data arrives.
+ */
+uint32_t user_tcp_mem_rcv_wnd(user_tcp_manager *tcp, user_tcp_stream *cur_stream)
+{
+    user_tcp_recv *rcv = cur_stream->rcv;
+    uint32_t wnd = rcv->rcv_wnd;
+    uint32_t promised = 0;
+    uint32_t floor;
+
+    if (tcp->mem.state == USER_TCP_MEM_NORMAL)
+        return wnd;
+
+    if (TCP_SEQ_GT(rcv->rcv_adv, cur_stream->rcv_nxt))
+    {
+        promised = rcv->rcv_adv - cur_stream->rcv_nxt;
+    }
+
+    floor = cur_stream->snd->mss * (tcp->mem.state == USER_TCP_MEM_CRITICAL ?
+                                    USER_TCP_MEM_CRITICAL_WND : USER_TCP_MEM_PRESSURE_WND);
+
+    return MIN(wnd, MAX(promised, floor));
+}
+
+/* drop the out-of-order data of the stream, the peer keeps it until acked anyway. called with read_lock held */
+void user_tcp_mem_prune_ofo(user_tcp_manager *tcp, user_tcp_stream *cur_stream)
+{
+    user_ring_buffer *buf = cur_stream->rcv->recvbuf;
+    uint32_t pruned;
+
+    if (!buf || !buf->fctx)
+        return;
+
+    pruned = RBPruneOfo(tcp->rbm_rcv, buf);
+    if (pruned)
+    {
+        tcp->mem.ofo_pruned += pruned;
+        user_trace_tcp("Stream %d: pruned %u out-of-order bytes\n", cur_stream->id, pruned);
+    }
+}
+
+void user_tcp_mem_idle_arm(user_tcp_manager *tcp, user_tcp_stream *cur_stream, uint32_t cur_ts)
+{
+    user_tcp_recv *rcv = cur_stream->rcv;
+
+    if (rcv->on_idle_list)
+        return;
+
+    rcv->ts_idle = cur_ts;
+    rcv->on_idle_list = 1;
+    TAILQ_INSERT_TAIL(&tcp->mem.idle_list, cur_stream, rcv->idle_link);
+    tcp->mem.idle_cnt++;
+}
+
+void user_tcp_mem_idle_disarm(user_tcp_manager *tcp, user_tcp_stream *cur_stream)
+{
+    user_tcp_recv *rcv = cur_stream->rcv;
+
+    if (!rcv->on_idle_list)
+        return;
+
+    TAILQ_REMOVE(&tcp->mem.idle_list, cur_stream, rcv->idle_link);
+    rcv->on_idle_list = 0;
+    tcp->mem.idle_cnt--;
+}
+
+/* segments are linked again as data comes, by the app in SBPut and the stack in RBPut, the ring on send */
+static void user_tcp_mem_release_bufs(user_tcp_manager *tcp, user_tcp_stream *cur_stream)
+{
+    user_tcp_recv *rcv = cur_stream->rcv;
+    user_tcp_send *snd = cur_stream->snd;
+    int released = 0;
+
+    if (rcv->recvbuf && rcv->recvbuf->segs)
+    {
+        SBUF_LOCK(&rcv->read_lock);
+        if (RBRelease(tcp->rbm_rcv, rcv->recvbuf) > 0)
+        {
+            tcp->mem.buf_released++;
+            released = 1;
+        }
+        SBUF_UNLOCK(&rcv->read_lock);
+    }
+
+    if (snd->sndbuf && snd->sndbuf->head)
+    {
+        SBUF_LOCK(&snd->write_lock);
+        if (SBRelease(tcp->rbm_snd, snd->sndbuf) > 0)
+        {
+            tcp->mem.buf_released++;
+            released = 1;
+        }
+        SBUF_UNLOCK(&snd->write_lock);
+    }
+
+    /* nothing in flight either, the transmit ring goes too */
+    if (user_tcp_txq_trim(cur_stream) > 0)
+    {
+        released = 1;
+    }
+
+    if (released)
+    {
+        user_trace_tcp("Stream %d: idle, buffers released\n", cur_stream->id);
+    }
+}
+
+/*
+ * streams come up in the order they were queued, buf_idle after that. one
+ * that heard nothing for buf_idle releases its empty buffers, every
+ * established stream is queued again.
+ */
+void user_tcp_mem_idle_timer(user_tcp_manager *tcp, uint32_t cur_ts, int thresh)
+{
+    user_tcp_memctl *mem = &tcp->mem;
+    user_tcp_stream *walk;
+    uint32_t last;
+    int cnt = 0;
+
+    if (mem->buf_idle == 0)
+        return;
+
+    while ((walk = TAILQ_FIRST(&mem->idle_list)) != NULL)
+    {
+        if ((int32_t) (cur_ts - walk->rcv->ts_idle) < (int32_t) mem->buf_idle)
+            break;
+        if (++cnt > thresh)
+            break;
+
+        user_tcp_mem_idle_disarm(tcp, walk);
+        if (walk->state != USER_TCP_ESTABLISHED && walk->state != USER_TCP_CLOSE_WAIT)
+            continue;
+
+        last = walk->rcv->ts_last_seg ? walk->rcv->ts_last_seg : walk->rcv->ts_idle;
+        if ((int32_t) (cur_ts - last) >= (int32_t) mem->buf_idle)
+        {
+            user_tcp_mem_release_bufs(tcp, walk);
+        }
+        user_tcp_mem_idle_arm(tcp, walk, cur_ts);
+    }
+}
+
+/* what the connection holds: its user_tcp_conn, both buffers and the transmit ring, out-of-order fragments aside */
+uint32_t user_tcp_mem_stream_bytes(user_tcp_stream *cur_stream)
+{
+    user_ring_buffer *rb = cur_stream->rcv->recvbuf;
+    user_send_buffer *sb = cur_stream->snd->sndbuf;
+    uint32_t bytes = sizeof(user_tcp_conn);
+
+    if (rb)
+    {
+        bytes += sizeof(user_ring_buffer) + rb->nsegs * sizeof(user_buf_seg) +
+                 rb->seg_slots * sizeof(user_buf_seg *);
+    }
+    if (sb)
+    {
+        bytes += sizeof(user_send_buffer) + sb->nsegs * sizeof(user_buf_seg);
+    }
+    bytes += cur_stream->snd->txq.size * sizeof(user_tcp_txseg);
+    if (cur_stream->snd->rate)
+    {
+        bytes += sizeof(user_tcp_rate) + cur_stream->snd->txq.size * sizeof(user_tcp_txrate);
+    }
+    return bytes;
+}
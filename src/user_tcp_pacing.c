@@ -0,0 +1,128 @@
+#include "user_tcp.h"
+#include "user_tcp_pacing.h"
+
+/*
+ * per-flow pacing. the flush of the send buffer stops once a stream's next
+ * send time is more than TCP_PACING_HORIZON_US ahead, the stream then
+ * leaves the send list for the pace wheel of its sender and is put back
+ * when that time has come. on_send_list stays set meanwhile, so the api
+ * and the control list see it as still queued.
+ */
+
+void user_tcp_pacer_init(user_tcp_pacer *pacer)
+{
+    int i;
+
+    for (i = 0; i < USER_PACE_SLOTS; i++)
+    {
+        TAILQ_INIT(&pacer->slot[i]);
+    }
+    pacer->cur_us = 0;
+    pacer->idx = 0;
+    pacer->cnt = 0;
+}
+
+void user_tcp_pace_park(user_sender *sender, user_tcp_stream *cur_stream, uint64_t now_us)
+{
+    user_tcp_pacer *pacer = &sender->pacer;
+    user_tcp_send *snd = cur_stream->snd;
+    uint64_t due = snd->ts_pace_us - TCP_PACING_HORIZON_US;
+    uint64_t ahead = 0;
+
+    if (snd->on_pace_wheel)
+        return;
+
+    if (pacer->cnt == 0)
+    {
+        pacer->cur_us = now_us;
+    }
+
+    if (due > pacer->cur_us)
+    {
+        ahead = (due - pacer->cur_us) / USER_PACE_SLOT_US;
+        if (ahead >= USER_PACE_SLOTS)
+        {
+            ahead = USER_PACE_SLOTS - 1;
+        }
+    }
+
+    snd->pace_slot = (pacer->idx + ahead) % USER_PACE_SLOTS;
+    snd->on_pace_wheel = 1;
+    TAILQ_INSERT_TAIL(&pacer->slot[snd->pace_slot], cur_stream, snd->pace_link);
+    pacer->cnt++;
+}
+
+void user_tcp_pace_unpark(user_sender *sender, user_tcp_stream *cur_stream)
+{
+    user_tcp_pacer *pacer = &sender->pacer;
+    user_tcp_send *snd = cur_stream->snd;
+
+    if (!snd->on_pace_wheel)
+        return;
+
+    TAILQ_REMOVE(&pacer->slot[snd->pace_slot], cur_stream, snd->pace_link);
+    snd->on_pace_wheel = 0;
+    pacer->cnt--;
+}
+
+/* the streams of every slot that ended by now go back to the send list */
+int user_tcp_pace_run(user_sender *sender, uint64_t now_us)
+{
+    user_tcp_pacer *pacer = &sender->pacer;
+    user_tcp_stream *cur_stream;
+    int cnt = 0;
+
+    while (pacer->cnt > 0 && pacer->cur_us + USER_PACE_SLOT_US <= now_us)
+    {
+        while ((cur_stream = TAILQ_FIRST(&pacer->slot[pacer->idx])) != NULL)
+        {
+            TAILQ_REMOVE(&pacer->slot[pacer->idx], cur_stream, snd->pace_link);
+            cur_stream->snd->on_pace_wheel = 0;
+            pacer->cnt--;
+
+            TAILQ_INSERT_TAIL(&sender->send_list, cur_stream, snd->send_link);
+            sender->send_list_cnt++;
+            cnt++;
+        }
+
+        pacer->idx = (pacer->idx + 1) % USER_PACE_SLOTS;
+        pacer->cur_us += USER_PACE_SLOT_US;
+    }
+
+    return cnt;
+}
+
+/*
+ * the rate of a window based stream: cwnd per srtt, with headroom so that
+ * pacing does not hold back window growth. bbr sets its own rate, the
+ * app's cap applies to both.
+ */
+void user_tcp_pacing_update(user_tcp_stream *cur_stream, const user_tcp_rate_sample *rs)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    uint64_t rtt_us = TS_TO_USEC((uint64_t) (cur_stream->rcv->srtt >> 3));
+    uint64_t rate;
+
+    if (!USER_TCP_BBR_ACTIVE(snd))
+    {
+        /* below a tick srtt reads 0, use the last sample */
+        if (rtt_us == 0 && rs != NULL && rs->rtt_us > 0)
+        {
+            rtt_us = rs->rtt_us;
+        }
+
+        rate = 0;
+        if (TCP_PACING_ENABLE && rtt_us > 0)
+        {
+            rate = (uint64_t) snd->cwnd * 1000000 / rtt_us;
+            rate = rate * (snd->cwnd < snd->ssthresh / 2 ?
+                           TCP_PACING_SS_RATIO : TCP_PACING_CA_RATIO) / 100;
+        }
+        snd->pacing_rate = rate;
+    }
+
+    if (snd->max_pacing_rate && (snd->pacing_rate == 0 || snd->pacing_rate > snd->max_pacing_rate))
+    {
+        snd->pacing_rate = snd->max_pacing_rate;
+    }
+}
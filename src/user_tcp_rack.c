@@ -0,0 +1,606 @@
+#include "user_tcp.h"
+#include "user_tcp_rack.h"
+
+/*
+ * RACK-TLP loss detection, RFC 8985, proportional rate reduction,
+ * RFC 6937, and the undo of reductions for spurious retransmissions.
+ *
+ * RACK works on the transmit records of snd->txq: a segment is lost
+ * once a segment sent after it was delivered and more than one rtt plus
+ * the reordering window has passed since it went out. the tail loss
+ * probe and the reordering timer share the retransmission timer slot,
+ * snd->loss_timer says what it is armed for. during sack recovery prr
+ * spreads the window reduction over the acks of the recovery round.
+ */
+
+extern void AddtoRTOList(user_tcp_manager *tcp, user_tcp_stream *cur_stream);
+extern void RemoveFromRTOList(user_tcp_manager *tcp, user_tcp_stream *cur_stream);
+extern int user_tcp_send_loss_probe(user_tcp_stream *cur_stream, uint32_t cur_ts);
+
+/* segment 1 was sent after segment 2 */
+static inline int user_rack_sent_after(uint64_t t1, uint32_t seq1, uint64_t t2, uint32_t seq2)
+{
+    return t1 > t2 || (t1 == t2 && TCP_SEQ_GT(seq1, seq2));
+}
+
+static inline uint32_t user_rack_us_to_ts(uint64_t us)
+{
+    return (uint32_t)((us + TIME_TICK - 1) / TIME_TICK);
+}
+
+static int user_rack_sacked(user_tcp_sackboard *board, uint32_t seq, uint32_t end_seq)
+{
+    int i;
+
+    for (i = 0; i < board->cnt; i++)
+    {
+        if (TCP_SEQ_LEQ(board->blk[i].start, seq) && TCP_SEQ_GEQ(board->blk[i].end, end_seq))
+            return 1;
+    }
+    return 0;
+}
+
+static void user_rack_update(user_tcp_rack *rack, user_tcp_txseg *seg, uint64_t now_us)
+{
+    uint32_t rtt = (uint32_t)(now_us - seg->xmit_us);
+
+    if (seg->flags & USER_TXSEG_RETRANS)
+    {
+        /* too fast for the retransmission, the original was delivered */
+        if (rtt < rack->min_rtt_us)
+            return;
+    }
+    else
+    {
+        if (rack->min_rtt_us == 0 || rtt < rack->min_rtt_us)
+        {
+            rack->min_rtt_us = rtt;
+        }
+        if (rack->xmit_us && TCP_SEQ_LT(seg->end_seq, rack->fack))
+        {
+            rack->reordering_seen = 1;
+        }
+    }
+
+    rack->rtt_us = rtt;
+    if (!rack->xmit_us || TCP_SEQ_GT(seg->end_seq, rack->fack))
+    {
+        rack->fack = seg->end_seq;
+    }
+
+    if (user_rack_sent_after(seg->xmit_us, seg->end_seq, rack->xmit_us, rack->end_seq))
+    {
+        rack->xmit_us = seg->xmit_us;
+        rack->end_seq = seg->end_seq;
+    }
+}
+
+void user_tcp_rack_on_ack(user_tcp_stream *cur_stream, uint32_t ack_seq, uint64_t now_us, int dsack)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_rack *rack = &snd->rack;
+    user_tcp_txseg *seg;
+    uint32_t i;
+
+    for (i = 0; i < snd->txq.cnt; i++)
+    {
+        seg = TXSEG_AT(&snd->txq, i);
+        if (seg->flags & USER_TXSEG_SACKED)
+            continue;
+
+        if (TCP_SEQ_LEQ(seg->end_seq, ack_seq) ||
+            user_rack_sacked(&snd->sack, seg->seq, seg->end_seq))
+        {
+            seg->flags |= USER_TXSEG_SACKED;
+            user_rack_update(rack, seg, now_us);
+        }
+    }
+
+    /* widen the reordering window at most once per round for dsacks */
+    if (dsack && (!rack->dsack_round_valid || TCP_SEQ_GEQ(snd->snd_una, rack->dsack_round)))
+    {
+        rack->dsack_round = cur_stream->snd_nxt;
+        rack->dsack_round_valid = 1;
+        if (rack->reo_wnd_steps < 0xff)
+        {
+            rack->reo_wnd_steps++;
+        }
+        rack->reo_wnd_persist = USER_RACK_REO_PERSIST;
+    }
+}
+
+static uint32_t user_rack_reo_wnd(user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_rack *rack = &snd->rack;
+    uint32_t srtt_us = TS_TO_USEC(cur_stream->rcv->srtt >> 3);
+    uint32_t wnd;
+
+    if (!rack->reordering_seen &&
+        (snd->sack.in_recovery || snd->sack.sacked_bytes >= 3 * (uint32_t) snd->mss))
+        return 0;
+
+    wnd = (rack->min_rtt_us >> 2) * (1 + rack->reo_wnd_steps);
+    if (srtt_us && wnd > srtt_us)
+    {
+        wnd = srtt_us;
+    }
+    return wnd;
+}
+
+/*
+ * mark the outstanding segments sent before the rack segment that had
+ * their rtt plus the reordering window. returns 1 if any is newly lost,
+ * *lost_seq is the lowest of them. the ones still inside the window set
+ * rack.reo_deadline_us.
+ */
+int user_tcp_rack_detect_loss(user_tcp_stream *cur_stream, uint32_t ack_seq, uint64_t now_us,
+                              uint32_t *lost_seq)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_rack *rack = &snd->rack;
+    user_tcp_txseg *seg;
+    uint64_t deadline;
+    uint32_t reo_wnd, seq, i;
+    int lost = 0;
+
+    rack->reo_deadline_us = 0;
+    if (!rack->xmit_us)
+        return 0;
+
+    reo_wnd = user_rack_reo_wnd(cur_stream);
+
+    for (i = 0; i < snd->txq.cnt; i++)
+    {
+        seg = TXSEG_AT(&snd->txq, i);
+        if (seg->flags & (USER_TXSEG_SACKED | USER_TXSEG_LOST))
+            continue;
+        if (TCP_SEQ_LEQ(seg->end_seq, ack_seq))
+            continue;
+        if (!user_rack_sent_after(rack->xmit_us, rack->end_seq, seg->xmit_us, seg->end_seq))
+            continue;
+
+        deadline = seg->xmit_us + rack->rtt_us + reo_wnd;
+        if (deadline <= now_us)
+        {
+            seg->flags |= USER_TXSEG_LOST;
+            seq = TCP_SEQ_GT(seg->seq, ack_seq) ? seg->seq : ack_seq;
+            if (!lost || TCP_SEQ_LT(seq, *lost_seq))
+            {
+                *lost_seq = seq;
+            }
+            lost = 1;
+        }
+        else if (deadline > rack->reo_deadline_us)
+        {
+            rack->reo_deadline_us = deadline;
+        }
+    }
+
+    if (lost)
+    {
+        user_trace_tcp("Stream %d: rack lost from %u. rtt: %uus, reo_wnd: %uus\n",
+                       cur_stream->id, *lost_seq, rack->rtt_us, reo_wnd);
+    }
+    return lost;
+}
+
+void user_tcp_rack_retransmit(user_tcp_manager *tcp, user_tcp_stream *cur_stream,
+                              uint32_t ack_seq, uint32_t lost_seq)
+{
+    if (!cur_stream->snd->sack.in_recovery)
+    {
+        user_tcp_enter_recovery(tcp, cur_stream, ack_seq);
+    }
+    else if (TCP_SEQ_LT(lost_seq, cur_stream->snd_nxt))
+    {
+        /* a hole or a retransmission went missing again */
+        cur_stream->snd_nxt = lost_seq;
+        user_tcp_addto_sendlist(tcp, cur_stream);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void user_tcp_tlp_on_ack(user_tcp_stream *cur_stream, uint32_t ack_seq, int dsack)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_rack *rack = &snd->rack;
+
+    if (!rack->tlp_out || TCP_SEQ_LT(ack_seq, rack->tlp_high_seq))
+        return;
+
+    if (!rack->tlp_retrans || dsack)
+    {
+        /* new data probe, or both the original and the probe arrived */
+        rack->tlp_out = 0;
+    }
+    else if (TCP_SEQ_GT(ack_seq, rack->tlp_high_seq))
+    {
+        rack->tlp_out = 0;
+        user_tcp_cc_on_probe_loss(cur_stream);
+    }
+    else if (ack_seq == snd->snd_una)
+    {
+        /* pure dupack of the probe, nothing was lost */
+        rack->tlp_out = 0;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+static void user_tcp_undo_save(user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_undo *undo = &snd->undo;
+
+    /* a later reduction of the same episode keeps the first window */
+    if (undo->marker)
+        return;
+
+    undo->marker = 1;
+    undo->cwnd = snd->cwnd;
+    undo->ssthresh = snd->ssthresh;
+    undo->high_seq = cur_stream->snd_nxt;
+    undo->retrans_ts = 0;
+}
+
+static void user_tcp_undo_reduction(user_tcp_manager *tcp, user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_undo *undo = &snd->undo;
+
+    user_trace_tcp("Stream %d: spurious retransmission. snd_nxt: %u, high_seq: %u\n",
+                   cur_stream->id, cur_stream->snd_nxt, undo->high_seq);
+
+    user_tcp_cc_undo(cur_stream, undo->cwnd, undo->ssthresh);
+    snd->sack.in_recovery = 0;
+
+    /* the originals arrived, don't resend the rest of the window */
+    if (TCP_SEQ_LT(cur_stream->snd_nxt, undo->high_seq))
+    {
+        cur_stream->snd_nxt = undo->high_seq;
+    }
+
+    undo->marker = 0;
+    undo->frto = 0;
+    undo->spurious++;
+    user_tcp_addto_sendlist(tcp, cur_stream);
+}
+
+/* called before snd_una moves to ack_seq */
+void user_tcp_undo_on_ack(user_tcp_manager *tcp, user_tcp_stream *cur_stream, uint32_t ack_seq)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_undo *undo = &snd->undo;
+    int advanced = TCP_SEQ_GT(ack_seq, snd->snd_una);
+
+    if (!undo->marker)
+        return;
+
+    if (cur_stream->saw_timestamp)
+    {
+        if (!advanced || !undo->retrans_ts)
+        {
+            if (!advanced) undo->frto = 0;
+            return;
+        }
+
+        /* Eifel: the ack echoes a segment sent before the retransmission */
+        if (TCP_SEQ_LT(cur_stream->rcv->ts_lastack_rcvd, undo->retrans_ts))
+        {
+            user_tcp_undo_reduction(tcp, cur_stream);
+        }
+        else
+        {
+            undo->marker = 0;
+            undo->frto = 0;
+        }
+        return;
+    }
+
+    if (undo->frto == 1)
+    {
+        uint32_t end_seq = snd->sndbuf->head_seq + snd->sndbuf->len;
+
+        /* a dupack, the whole window acked or nothing new to send: conventional rto */
+        if (!advanced || TCP_SEQ_GEQ(ack_seq, undo->high_seq) ||
+            TCP_SEQ_GEQ(undo->high_seq, end_seq))
+        {
+            undo->marker = 0;
+            undo->frto = 0;
+            return;
+        }
+
+        /* step 2b: two new segments instead of the rest of the window */
+        cur_stream->snd_nxt = undo->high_seq;
+        snd->cwnd = undo->high_seq - ack_seq + 2 * snd->mss;
+        undo->frto = 2;
+        user_tcp_addto_sendlist(tcp, cur_stream);
+    }
+    else if (undo->frto == 2)
+    {
+        if (advanced)
+        {
+            /* step 3b: the new segments were acked without a dupack */
+            user_tcp_undo_reduction(tcp, cur_stream);
+            return;
+        }
+
+        /* step 3a: the loss was real, go back to snd_una in slow start */
+        cur_stream->snd_nxt = snd->snd_una;
+        snd->cwnd = MIN(snd->cwnd, 3 * (uint32_t) snd->mss);
+        undo->marker = 0;
+        undo->frto = 0;
+        user_tcp_addto_sendlist(tcp, cur_stream);
+    }
+    else
+    {
+        /* no timestamps and no F-RTO, nothing can tell */
+        undo->marker = 0;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void user_tcp_enter_recovery(user_tcp_manager *tcp, user_tcp_stream *cur_stream, uint32_t ack_seq)
+{
+    user_tcp_send *snd = cur_stream->snd;
+
+    user_trace_tcp("Stream %d: entering loss recovery. ack_seq: %u, snd_nxt: %u\n",
+                   cur_stream->id, ack_seq, cur_stream->snd_nxt);
+
+    snd->undo.frto = 0;
+    user_tcp_undo_save(cur_stream);
+
+    if (cur_stream->sack_permit)
+    {
+        snd->sack.in_recovery = 1;
+        snd->sack.recover = cur_stream->snd_nxt;
+
+        snd->prr.recover_fs = cur_stream->snd_nxt - snd->snd_una;
+        snd->prr.delivered = 0;
+        snd->prr.out = 0;
+        /* the first retransmission always goes out */
+        snd->prr.quota = snd->mss;
+    }
+    snd->rack.tlp_out = 0;
+
+    if (TCP_SEQ_LT(ack_seq, cur_stream->snd_nxt))
+    {
+        user_trace_tcp("Reducing snd_nxt from %u to %u\n",
+                       cur_stream->snd_nxt, ack_seq);
+
+        if (ack_seq != snd->snd_una)
+        {
+            user_trace_tcp("ack_seq and snd_una mismatch on tdp ack. "
+                           "ack_seq: %u, snd_una: %u\n",
+                           ack_seq, snd->snd_una);
+        }
+        cur_stream->snd_nxt = ack_seq;
+    }
+
+    user_tcp_cc_on_fast_retransmit(cur_stream);
+
+    if (snd->nrtx < TCP_MAX_RTX)
+    {
+        snd->nrtx++;
+    }
+    else
+    {
+        user_trace_tcp("Exceed MAX_RTX. \n");
+    }
+    user_tcp_addto_sendlist(tcp, cur_stream);
+}
+
+void user_tcp_exit_recovery(user_tcp_stream *cur_stream)
+{
+    user_tcp_rack *rack = &cur_stream->snd->rack;
+
+    cur_stream->snd->sack.in_recovery = 0;
+
+    if (rack->reo_wnd_persist && --rack->reo_wnd_persist == 0)
+    {
+        rack->reo_wnd_steps = 0;
+    }
+
+    user_tcp_cc_on_recovered(cur_stream);
+}
+
+/* per ack of a sack recovery: how much may go out for what was delivered */
+void user_tcp_prr_on_ack(user_tcp_stream *cur_stream, uint32_t delivered)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_prr *prr = &snd->prr;
+    uint32_t high = cur_stream->snd_nxt;
+    uint32_t pipe;
+    int64_t sndcnt, limit;
+
+    if (!snd->sack.in_recovery || USER_TCP_BBR_ACTIVE(snd))
+        return;
+
+    if (TCP_SEQ_LT(high, snd->sack.recover))
+    {
+        high = snd->sack.recover;
+    }
+    pipe = user_tcp_sack_pipe(cur_stream, high);
+
+    prr->delivered += delivered;
+    if (pipe > snd->ssthresh)
+    {
+        /* proportional part, ceil(delivered * ssthresh / recover_fs) */
+        sndcnt = ((uint64_t) prr->delivered * snd->ssthresh + prr->recover_fs - 1) /
+                 MAX(prr->recover_fs, 1);
+        sndcnt -= prr->out;
+    }
+    else
+    {
+        /* slow start reduction bound back up to ssthresh */
+        limit = MAX((int64_t) prr->delivered - prr->out, (int64_t) delivered) + snd->mss;
+        sndcnt = MIN((int64_t) snd->ssthresh - pipe, limit);
+    }
+
+    if (sndcnt < 0)
+    {
+        sndcnt = 0;
+    }
+    if (prr->out == 0 && sndcnt < snd->mss)
+    {
+        sndcnt = snd->mss;
+    }
+
+    prr->quota = (uint32_t) sndcnt;
+    snd->cwnd = pipe + prr->quota;
+
+    user_trace_tcp("Stream %d: prr pipe: %u, delivered: %u, out: %u, sndcnt: %u\n",
+                   cur_stream->id, pipe, prr->delivered, prr->out, prr->quota);
+}
+
+/*----------------------------------------------------------------------------*/
+static int user_tcp_tlp_eligible(user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+
+    if (!TCP_RACK_ENABLE || !cur_stream->sack_permit)
+        return 0;
+    if (snd->rack.tlp_out || snd->sack.in_recovery)
+        return 0;
+    if (cur_stream->state != USER_TCP_ESTABLISHED && cur_stream->state != USER_TCP_CLOSE_WAIT)
+        return 0;
+
+    return TCP_SEQ_GT(cur_stream->snd_nxt, snd->snd_una);
+}
+
+/*
+ * (re)arm the retransmission timer slot with the earliest of the running
+ * rto, the rack reordering timer and the tail loss probe timeout.
+ */
+void user_tcp_recovery_arm_timer(user_tcp_manager *tcp, user_tcp_stream *cur_stream, uint32_t cur_ts)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_rack *rack = &snd->rack;
+    uint8_t kind = USER_TCP_TIMER_RTO;
+    uint32_t expire, ts, pto;
+    uint64_t now_us;
+
+    if (cur_stream->on_rto_idx >= 0 && snd->loss_timer == USER_TCP_TIMER_RTO)
+    {
+        expire = snd->ts_rto;
+    }
+    else
+    {
+        expire = cur_ts + snd->rto;
+    }
+
+    if (rack->reo_deadline_us)
+    {
+        now_us = user_tcp_clock_us();
+        ts = cur_ts + 1;
+        if (rack->reo_deadline_us > now_us)
+        {
+            ts += user_rack_us_to_ts(rack->reo_deadline_us - now_us);
+        }
+        if ((int32_t)(ts - expire) < 0)
+        {
+            expire = ts;
+            kind = USER_TCP_TIMER_REO;
+        }
+    }
+    else if (user_tcp_tlp_eligible(cur_stream))
+    {
+        /* 2 srtt, plus the worst case delayed ack when one segment is out */
+        pto = cur_stream->rcv->srtt ? (cur_stream->rcv->srtt >> 3) * 2 : MSEC_TO_USEC(1000) / TIME_TICK;
+        if (cur_stream->snd_nxt - snd->snd_una <= snd->mss)
+        {
+            pto += MSEC_TO_USEC(USER_TLP_WC_DELACK_MS) / TIME_TICK;
+        }
+        ts = cur_ts + MAX(pto, 1);
+        if ((int32_t)(ts - expire) < 0)
+        {
+            expire = ts;
+            kind = USER_TCP_TIMER_TLP;
+        }
+    }
+
+    RemoveFromRTOList(tcp, cur_stream);
+    snd->ts_rto = expire;
+    snd->loss_timer = kind;
+    AddtoRTOList(tcp, cur_stream);
+}
+
+void user_tcp_recovery_on_send(user_tcp_manager *tcp, user_tcp_stream *cur_stream,
+                               uint32_t cur_ts, uint32_t len)
+{
+    user_tcp_send *snd = cur_stream->snd;
+
+    if (snd->undo.marker && !snd->undo.retrans_ts)
+    {
+        /* the first segment after a reduction is the retransmission */
+        snd->undo.retrans_ts = cur_ts;
+    }
+
+    if (snd->sack.in_recovery)
+    {
+        snd->prr.out += len;
+        snd->prr.quota = snd->prr.quota > len ? snd->prr.quota - len : 0;
+    }
+
+    /* a running rto is left alone, a pending probe moves with new data */
+    if (cur_stream->on_rto_idx < 0 ||
+        snd->loss_timer == USER_TCP_TIMER_TLP ||
+        (snd->loss_timer == USER_TCP_TIMER_RTO && user_tcp_tlp_eligible(cur_stream)))
+    {
+        user_tcp_recovery_arm_timer(tcp, cur_stream, cur_ts);
+    }
+}
+
+/* returns 1 if the expiry was a probe or reordering timer, not an rto */
+int user_tcp_recovery_on_timer(user_tcp_manager *tcp, user_tcp_stream *cur_stream, uint32_t cur_ts)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    uint8_t kind = snd->loss_timer;
+    uint32_t lost_seq = 0;
+
+    snd->loss_timer = USER_TCP_TIMER_RTO;
+    if (kind == USER_TCP_TIMER_RTO)
+        return 0;
+
+    if (kind == USER_TCP_TIMER_REO)
+    {
+        if (user_tcp_rack_detect_loss(cur_stream, snd->snd_una, user_tcp_clock_us(), &lost_seq))
+        {
+            user_tcp_rack_retransmit(tcp, cur_stream, snd->snd_una, lost_seq);
+        }
+    }
+    else
+    {
+        user_trace_timer("Stream %d: tail loss probe. snd_nxt: %u, snd_una: %u\n",
+                         cur_stream->id, cur_stream->snd_nxt, snd->snd_una);
+        user_tcp_send_loss_probe(cur_stream, cur_ts);
+    }
+
+    if (cur_stream->on_rto_idx < 0 && TCP_SEQ_GT(cur_stream->snd_nxt, snd->snd_una))
+    {
+        user_tcp_recovery_arm_timer(tcp, cur_stream, cur_ts);
+    }
+    return 1;
+}
+
+/* before the rto reduces the window and rewinds snd_nxt */
+void user_tcp_recovery_on_rto(user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+
+    snd->loss_timer = USER_TCP_TIMER_RTO;
+    snd->rack.tlp_out = 0;
+    snd->rack.reo_deadline_us = 0;
+
+    if (cur_stream->state != USER_TCP_ESTABLISHED && cur_stream->state != USER_TCP_CLOSE_WAIT)
+    {
+        snd->undo.marker = 0;
+        snd->undo.frto = 0;
+        return;
+    }
+
+    user_tcp_undo_save(cur_stream);
+
+    /* F-RTO on the first timeout outside fast recovery only */
+    snd->undo.frto = (snd->nrtx == 1 && !snd->sack.in_recovery) ? 1 : 0;
+}
@@ -0,0 +1,255 @@
+#include "user_tcp.h"
+#include "user_header.h"
+#include "user_tcp_reqsk.h"
+
+#include <stdlib.h>
+
+/*
+ * request socks. a listener answers a SYN with a syn-ack from a 64 byte
+ * reqsk in its own table, a stream is only allocated for the final ack.
+ * the syn-ack timer is a list sorted by expiry, backoff inserts from the
+ * tail.
+ */
+
+extern uint16_t user_calculate_chksum(uint8_t *buf, uint16_t len, uint32_t saddr, uint32_t daddr);
+
+static unsigned int user_reqsk_seed;
+
+int user_tcp_reqsk_init(user_tcp_manager *tcp)
+{
+    tcp->reqsk_table = (user_tcp_reqsk **) calloc(USER_REQSK_BINS, sizeof(user_tcp_reqsk *));
+    if (!tcp->reqsk_table)
+        return -1;
+
+    tcp->reqsk_pool = user_mempool_create(sizeof(user_tcp_reqsk),
+                                          sizeof(user_tcp_reqsk) * USER_MAX_CONCURRENCY, MEM_DEFAULT);
+    if (!tcp->reqsk_pool)
+    {
+        free(tcp->reqsk_table);
+        tcp->reqsk_table = NULL;
+        return -1;
+    }
+
+    TAILQ_INIT(&tcp->reqsk_list);
+    tcp->reqsk_cnt = 0;
+    user_reqsk_seed = tcp->syncookie_secret[0] ^ tcp->syncookie_secret[1];
+
+    return 0;
+}
+
+static inline unsigned int user_reqsk_hash(uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport)
+{
+    return HashTuple(saddr, sport, daddr, dport) & (USER_REQSK_BINS - 1);
+}
+
+user_tcp_reqsk *user_tcp_reqsk_lookup(user_tcp_manager *tcp, const struct iphdr *iph, const struct tcphdr *tcph)
+{
+    user_tcp_reqsk *rsk;
+
+    if (tcp->reqsk_cnt == 0)
+        return NULL;
+
+    rsk = tcp->reqsk_table[user_reqsk_hash(iph->daddr, tcph->dest, iph->saddr, tcph->source)];
+    for (; rsk != NULL; rsk = rsk->hash_next)
+    {
+        if (rsk->saddr == iph->daddr && rsk->sport == tcph->dest &&
+            rsk->daddr == iph->saddr && rsk->dport == tcph->source)
+        {
+            return rsk;
+        }
+    }
+    return NULL;
+}
+
+static void user_tcp_reqsk_arm(user_tcp_manager *tcp, user_tcp_reqsk *rsk, uint32_t cur_ts)
+{
+    user_tcp_reqsk *walk;
+
+    rsk->ts_rto = cur_ts + (TCP_INITIAL_RTO << MIN(rsk->nrtx, TCP_MAX_BACKOFF));
+
+    TAILQ_FOREACH_REVERSE(walk, &tcp->reqsk_list, reqsk_head, timer_link)
+    {
+        if ((int32_t) (rsk->ts_rto - walk->ts_rto) >= 0)
+        {
+            TAILQ_INSERT_AFTER(&tcp->reqsk_list, walk, rsk, timer_link);
+            return;
+        }
+    }
+    TAILQ_INSERT_HEAD(&tcp->reqsk_list, rsk, timer_link);
+}
+
+user_tcp_reqsk *user_tcp_reqsk_create(user_tcp_manager *tcp, uint32_t cur_ts, const struct iphdr *iph,
+                                      const struct tcphdr *tcph, const user_tcp_synopt *opt)
+{
+    user_tcp_listener *listener;
+    user_tcp_reqsk *rsk;
+    unsigned int idx;
+
+    rsk = (user_tcp_reqsk *) user_mempool_alloc(tcp->reqsk_pool);
+    if (rsk == NULL)
+        return NULL;
+
+    memset(rsk, 0, sizeof(user_tcp_reqsk));
+    rsk->saddr = iph->daddr;
+    rsk->sport = tcph->dest;
+    rsk->daddr = iph->saddr;
+    rsk->dport = tcph->source;
+    rsk->irs = ntohl(tcph->seq);
+    rsk->iss = (uint32_t) rand_r(&user_reqsk_seed);
+    rsk->peer_wnd = ntohs(tcph->window);
+    rsk->opt = *opt;
+
+    idx = user_reqsk_hash(rsk->saddr, rsk->sport, rsk->daddr, rsk->dport);
+    rsk->hash_next = tcp->reqsk_table[idx];
+    tcp->reqsk_table[idx] = rsk;
+    tcp->reqsk_cnt++;
+
+    user_tcp_reqsk_arm(tcp, rsk, cur_ts);
+
+    listener = (user_tcp_listener *) ListenerHTSearch(tcp->listeners, &rsk->sport);
+    if (listener)
+        listener->syn_cnt++;
+
+    return rsk;
+}
+
+void user_tcp_reqsk_destroy(user_tcp_manager *tcp, user_tcp_reqsk *rsk)
+{
+    user_tcp_listener *listener;
+    user_tcp_reqsk **pp;
+
+    pp = &tcp->reqsk_table[user_reqsk_hash(rsk->saddr, rsk->sport, rsk->daddr, rsk->dport)];
+    while (*pp && *pp != rsk)
+        pp = &(*pp)->hash_next;
+    if (*pp)
+        *pp = rsk->hash_next;
+
+    TAILQ_REMOVE(&tcp->reqsk_list, rsk, timer_link);
+    tcp->reqsk_cnt--;
+
+    listener = (user_tcp_listener *) ListenerHTSearch(tcp->listeners, &rsk->sport);
+    if (listener && listener->syn_cnt > 0)
+        listener->syn_cnt--;
+
+    user_mempool_free(tcp->reqsk_pool, rsk);
+}
+
+/*
+ * a syn-ack without a stream. opt is what the peer offered in its SYN,
+ * sack and window scaling are only offered back if it did.
+ */
+int user_tcp_synack_alone(user_tcp_manager *tcp, uint32_t saddr, uint16_t sport,
+                          uint32_t daddr, uint16_t dport, uint32_t seq, uint32_t ack_seq,
+                          uint32_t tsval, const user_tcp_synopt *opt, const uint8_t *tfo_cookie)
+{
+    uint16_t optlen = USER_TCPOPT_MSS_LEN + 2 + USER_TCPOPT_TIMESTAMP_LEN + USER_TCPOPT_WSCALE_LEN + 1;
+
+    if (tfo_cookie)
+        optlen += USER_TCPOPT_FASTOPEN_LEN + 2;
+    uint8_t *tcpopt;
+    int i = 0;
+
+    struct tcphdr *tcph = (struct tcphdr *) IPOutputStandalone(tcp, PROTO_TCP, 0, saddr, daddr,
+                                                               TCP_HEADER_LEN + optlen);
+    if (tcph == NULL)
+        return -1;
+
+    memset(tcph, 0, TCP_HEADER_LEN + optlen);
+    tcph->source = sport;
+    tcph->dest = dport;
+    tcph->seq = htonl(seq);
+    tcph->ack_seq = htonl(ack_seq);
+    tcph->syn = 1;
+    tcph->ack = 1;
+    tcph->ece = opt->ecn_ok;
+    tcph->window = htons(MIN(MIN(TCP_INITIAL_WINDOW, USER_RCVBUF_SIZE), TCP_MAX_WINDOW));
+    tcph->doff = (TCP_HEADER_LEN + optlen) >> 2;
+
+    tcpopt = (uint8_t *) tcph + TCP_HEADER_LEN;
+    tcpopt[i++] = TCP_OPT_MSS;
+    tcpopt[i++] = USER_TCPOPT_MSS_LEN;
+    tcpopt[i++] = TCP_DEFAULT_MSS >> 8;
+    tcpopt[i++] = TCP_DEFAULT_MSS % 256;
+
+    if (opt->sack_ok)
+    {
+        tcpopt[i++] = TCP_OPT_SACK_PERMIT;
+        tcpopt[i++] = USER_TCPOPT_SACK_PERMIT_LEN;
+    }
+    else
+    {
+        tcpopt[i++] = TCP_OPT_NOP;
+        tcpopt[i++] = TCP_OPT_NOP;
+    }
+
+    tcpopt[i++] = TCP_OPT_TIMESTAMP;
+    tcpopt[i++] = USER_TCPOPT_TIMESTAMP_LEN;
+    *(uint32_t *) (tcpopt + i) = htonl(tsval);
+    *(uint32_t *) (tcpopt + i + 4) = htonl(opt->tsval);
+    i += 8;
+
+    tcpopt[i++] = TCP_OPT_NOP;
+    if (opt->wscale_ok)
+    {
+        tcpopt[i++] = TCP_OPT_WSCALE;
+        tcpopt[i++] = USER_TCPOPT_WSCALE_LEN;
+        tcpopt[i++] = TCP_DEFAULT_WSCALE;
+    }
+    else
+    {
+        tcpopt[i++] = TCP_OPT_NOP;
+        tcpopt[i++] = TCP_OPT_NOP;
+        tcpopt[i++] = TCP_OPT_NOP;
+    }
+
+    if (tfo_cookie)
+    {
+        tcpopt[i++] = TCP_OPT_NOP;
+        tcpopt[i++] = TCP_OPT_NOP;
+        tcpopt[i++] = TCP_OPT_FASTOPEN;
+        tcpopt[i++] = USER_TCPOPT_FASTOPEN_LEN;
+        memcpy(tcpopt + i, tfo_cookie, USER_TFO_COOKIE_LEN);
+        i += USER_TFO_COOKIE_LEN;
+    }
+
+    tcph->check = user_calculate_chksum((uint8_t *) tcph, TCP_HEADER_LEN + optlen, saddr, daddr);
+    return 0;
+}
+
+int user_tcp_reqsk_synack(user_tcp_manager *tcp, user_tcp_reqsk *rsk, uint32_t cur_ts)
+{
+    uint8_t cookie[USER_TFO_COOKIE_LEN];
+
+    if (rsk->tfo_req)
+        user_tcp_fastopen_cookie(tcp, rsk->daddr, cookie);
+
+    return user_tcp_synack_alone(tcp, rsk->saddr, rsk->sport, rsk->daddr, rsk->dport,
+                                 rsk->iss, rsk->irs + 1, cur_ts, &rsk->opt,
+                                 rsk->tfo_req ? cookie : NULL);
+}
+
+void user_tcp_reqsk_timer(user_tcp_manager *tcp, uint32_t cur_ts, int thresh)
+{
+    user_tcp_reqsk *rsk;
+    int cnt = 0;
+
+    while ((rsk = TAILQ_FIRST(&tcp->reqsk_list)) != NULL)
+    {
+        if (++cnt > thresh)
+            break;
+        if ((int32_t) (cur_ts - rsk->ts_rto) < 0)
+            break;
+
+        TAILQ_REMOVE(&tcp->reqsk_list, rsk, timer_link);
+        if (++rsk->nrtx > TCP_MAX_SYN_RETRY)
+        {
+            user_trace_timer("reqsk %u: syn-ack retries exhausted\n", ntohs(rsk->dport));
+            TAILQ_INSERT_HEAD(&tcp->reqsk_list, rsk, timer_link);
+            user_tcp_reqsk_destroy(tcp, rsk);
+            continue;
+        }
+
+        user_tcp_reqsk_synack(tcp, rsk, cur_ts);
+        user_tcp_reqsk_arm(tcp, rsk, cur_ts);
+    }
+}
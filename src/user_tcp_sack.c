@@ -0,0 +1,286 @@
+#include "user_tcp.h"
+#include "user_tcp_sack.h"
+
+/*
+ * selective acknowledgement, RFC 2018 / 2883 / 6675.
+ *
+ * the receiver reports the out-of-order fragments of the ring buffer as
+ * sack blocks, the sender merges the reported blocks into snd->sack and
+ * the flush path skips the ranges the peer already holds, so loss
+ * recovery only resends the holes.
+ */
+
+int user_tcp_sack_parse(uint8_t *tcpopt, int len, user_tcp_sack_block *blocks, int max)
+{
+    int i, j, n = 0;
+    unsigned int opt, optlen;
+
+    for (i = 0; i < len;)
+    {
+        opt = *(tcpopt + i++);
+        if (opt == TCP_OPT_END)
+        {
+            break;
+        }
+        else if (opt == TCP_OPT_NOP)
+        {
+            continue;
+        }
+
+        if (i >= len)
+            break;
+
+        optlen = *(tcpopt + i++);
+        if (optlen < 2 || i + optlen - 2 > (unsigned int) len)
+            break;
+
+        if (opt == TCP_OPT_SACK)
+        {
+            for (j = 0; j + 8 <= (int) optlen - 2 && n < max; j += 8)
+            {
+                blocks[n].start = ntohl(*(uint32_t *)(tcpopt + i + j));
+                blocks[n].end = ntohl(*(uint32_t *)(tcpopt + i + j + 4));
+                n++;
+            }
+        }
+        i += optlen - 2;
+    }
+
+    return n;
+}
+
+static void user_tcp_sack_insert(user_tcp_sackboard *board, uint32_t start, uint32_t end)
+{
+    int i, j;
+
+    for (i = 0; i < board->cnt && TCP_SEQ_LT(board->blk[i].end, start); i++);
+
+    /* merge with every block the new range touches */
+    for (j = i; j < board->cnt && TCP_SEQ_LEQ(board->blk[j].start, end); j++)
+    {
+        if (TCP_SEQ_LT(board->blk[j].start, start)) start = board->blk[j].start;
+        if (TCP_SEQ_GT(board->blk[j].end, end)) end = board->blk[j].end;
+    }
+
+    if (j > i)
+    {
+        board->blk[i].start = start;
+        board->blk[i].end = end;
+        memmove(&board->blk[i + 1], &board->blk[j], (board->cnt - j) * sizeof(user_tcp_sack_block));
+        board->cnt -= j - i - 1;
+        return;
+    }
+
+    if (board->cnt == USER_TCP_SACK_SCOREBOARD)
+    {
+        /* full, forget the range farthest from snd_una */
+        if (i == board->cnt)
+            return;
+        board->cnt--;
+    }
+
+    memmove(&board->blk[i + 1], &board->blk[i], (board->cnt - i) * sizeof(user_tcp_sack_block));
+    board->blk[i].start = start;
+    board->blk[i].end = end;
+    board->cnt++;
+}
+
+static void user_tcp_sack_trim(user_tcp_sackboard *board, uint32_t ack_seq)
+{
+    int i;
+
+    for (i = 0; i < board->cnt && TCP_SEQ_LEQ(board->blk[i].end, ack_seq); i++);
+    if (i > 0)
+    {
+        memmove(&board->blk[0], &board->blk[i], (board->cnt - i) * sizeof(user_tcp_sack_block));
+        board->cnt -= i;
+    }
+
+    if (board->cnt > 0 && TCP_SEQ_LT(board->blk[0].start, ack_seq))
+    {
+        board->blk[0].start = ack_seq;
+    }
+
+    board->sacked_bytes = 0;
+    for (i = 0; i < board->cnt; i++)
+    {
+        board->sacked_bytes += board->blk[i].end - board->blk[i].start;
+    }
+}
+
+void user_tcp_sack_update(user_tcp_stream *cur_stream, uint32_t ack_seq,
+                          user_tcp_sack_block *blocks, int nblocks)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_sackboard *board = &snd->sack;
+    uint32_t max_seq = snd->sndbuf->head_seq + snd->sndbuf->len;
+    int i;
+
+    for (i = 0; i < nblocks; i++)
+    {
+        uint32_t start = blocks[i].start;
+        uint32_t end = blocks[i].end;
+
+        if (!TCP_SEQ_LT(start, end))
+            continue;
+
+        /* DSACK: first block below the cumulative ack or inside the second one */
+        if (i == 0 &&
+            (TCP_SEQ_LEQ(end, ack_seq) ||
+             (nblocks > 1 && TCP_SEQ_GEQ(start, blocks[1].start) && TCP_SEQ_LEQ(end, blocks[1].end))))
+        {
+            board->dsack_cnt++;
+            user_trace_tcp("Stream %d: DSACK %u-%u\n", cur_stream->id, start, end);
+            continue;
+        }
+
+        if (TCP_SEQ_LEQ(end, ack_seq) || TCP_SEQ_GT(end, max_seq))
+            continue;
+
+        if (TCP_SEQ_LT(start, ack_seq))
+            start = ack_seq;
+
+        user_tcp_sack_insert(board, start, end);
+    }
+
+    user_tcp_sack_trim(board, ack_seq);
+}
+
+/* more than DupThresh - 1 segments sacked above the first hole */
+int user_tcp_sack_lost(user_tcp_stream *cur_stream)
+{
+    user_tcp_send *snd = cur_stream->snd;
+
+    if (!cur_stream->sack_permit || snd->sack.in_recovery)
+        return 0;
+
+    return snd->sack.sacked_bytes > 2 * (uint32_t) snd->mss;
+}
+
+/*
+ * first sequence at or after seq the peer does not hold yet. *limit is
+ * set to the length of the hole that starts there, or 0 above the
+ * highest sacked range.
+ */
+uint32_t user_tcp_sack_next_seq(user_tcp_stream *cur_stream, uint32_t seq, uint32_t *limit)
+{
+    user_tcp_sackboard *board = &cur_stream->snd->sack;
+    int i;
+
+    for (i = 0; i < board->cnt; i++)
+    {
+        if (TCP_SEQ_LT(seq, board->blk[i].start))
+        {
+            *limit = board->blk[i].start - seq;
+            return seq;
+        }
+        if (TCP_SEQ_LT(seq, board->blk[i].end))
+        {
+            seq = board->blk[i].end;
+        }
+    }
+
+    /* the holes are resent, what was sent above the last block is still in flight */
+    if (board->cnt > 0 && board->in_recovery && TCP_SEQ_LT(seq, board->recover))
+    {
+        seq = board->recover;
+    }
+
+    *limit = 0;
+    return seq;
+}
+
+/* bytes in flight below seq, not counting what the peer sacked */
+uint32_t user_tcp_sack_pipe(user_tcp_stream *cur_stream, uint32_t seq)
+{
+    user_tcp_send *snd = cur_stream->snd;
+    user_tcp_sackboard *board = &snd->sack;
+    uint32_t pipe = seq - snd->snd_una;
+    uint32_t sacked = 0;
+    int i;
+
+    for (i = 0; i < board->cnt; i++)
+    {
+        if (TCP_SEQ_LEQ(board->blk[i].end, seq))
+        {
+            sacked += board->blk[i].end - board->blk[i].start;
+        }
+        else if (TCP_SEQ_LT(board->blk[i].start, seq))
+        {
+            sacked += seq - board->blk[i].start;
+        }
+    }
+
+    return pipe > sacked ? pipe - sacked : 0;
+}
+
+void user_tcp_sack_on_rto(user_tcp_stream *cur_stream)
+{
+    /* everything not sacked is resent from snd_una */
+    cur_stream->snd->sack.in_recovery = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+int user_tcp_sack_generate(user_tcp_stream *cur_stream, user_tcp_sack_block *blocks, int max)
+{
+    user_tcp_recv *rcv = cur_stream->rcv;
+    user_fragment_ctx *frag, *recent = NULL;
+    int n = 0;
+
+    if (rcv->dsack_pending && n < max)
+    {
+        blocks[n].start = rcv->dsack_start;
+        blocks[n].end = rcv->dsack_end;
+        rcv->dsack_pending = 0;
+        n++;
+    }
+
+    if (!rcv->recvbuf)
+        return n;
+
+    /* the app frees ranges in RBRemove and the merge in RBPut unlinks them, both under read_lock */
+    SBUF_LOCK(&rcv->read_lock);
+
+    /* the block holding the most recent segment goes first */
+    for (frag = rcv->recvbuf->fctx; frag != NULL; frag = frag->next)
+    {
+        if (TCP_SEQ_LEQ(frag->seq, cur_stream->rcv_nxt))
+            continue;
+
+        if (TCP_SEQ_GEQ(rcv->sack_recent, frag->seq) &&
+            TCP_SEQ_LT(rcv->sack_recent, frag->seq + frag->len))
+        {
+            recent = frag;
+            break;
+        }
+    }
+
+    if (recent && n < max)
+    {
+        blocks[n].start = recent->seq;
+        blocks[n].end = recent->seq + recent->len;
+        n++;
+    }
+
+    for (frag = rcv->recvbuf->fctx; frag != NULL && n < max; frag = frag->next)
+    {
+        if (frag == recent || TCP_SEQ_LEQ(frag->seq, cur_stream->rcv_nxt))
+            continue;
+
+        blocks[n].start = frag->seq;
+        blocks[n].end = frag->seq + frag->len;
+        n++;
+    }
+
+    SBUF_UNLOCK(&rcv->read_lock);
+    return n;
+}
+
+void user_tcp_sack_dsack(user_tcp_stream *cur_stream, uint32_t start, uint32_t end)
+{
+    user_tcp_recv *rcv = cur_stream->rcv;
+
+    rcv->dsack_start = start;
+    rcv->dsack_end = end;
+    rcv->dsack_pending = 1;
+}
@@ -0,0 +1,194 @@
+#include "user_tcp.h"
+#include "user_header.h"
+#include "user_tcp_syncookie.h"
+#include "user_tcp_reqsk.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+/*
+ * SYN cookies. once a listener's syn queue is full the syn-ack is built
+ * straight from the received SYN and nothing is kept: the iss encodes the
+ * mss, our tsval the wscale and sack options, and a keyed hash ties both
+ * to the tuple. the final ack of the handshake is checked against it and
+ * only then a stream is allocated.
+ */
+
+extern int user_tcp_parse_timestamp(user_tcp_timestamp *ts, uint8_t *tcpopt, int len);
+
+static const uint16_t user_syncookie_mss[] =
+{
+    216, 536, 1024, 1220, 1300, 1400, 1440, 1460
+};
+
+#define USER_SYNCOOKIE_MSS_CNT    (sizeof(user_syncookie_mss) / sizeof(user_syncookie_mss[0]))
+
+void user_tcp_syncookie_init(user_tcp_manager *tcp)
+{
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    if (fd < 0 || read(fd, tcp->syncookie_secret, sizeof(tcp->syncookie_secret)) !=
+                  (ssize_t) sizeof(tcp->syncookie_secret))
+    {
+        tcp->syncookie_secret[0] = (uint32_t) time(NULL) ^ ((uint32_t) getpid() << 16);
+        tcp->syncookie_secret[1] = (uint32_t) rand();
+    }
+
+    if (fd >= 0)
+        close(fd);
+}
+
+static inline uint32_t user_syncookie_mix(uint32_t h, uint32_t w)
+{
+    h ^= w;
+    h *= 0x9e3779b1;
+    h ^= h >> 15;
+    h *= 0x85ebca77;
+    h ^= h >> 13;
+    return h;
+}
+
+static uint32_t user_syncookie_hash(user_tcp_manager *tcp, const struct iphdr *iph, const struct tcphdr *tcph,
+                                    uint32_t count, uint32_t peer_isn)
+{
+    uint32_t h = tcp->syncookie_secret[0];
+
+    h = user_syncookie_mix(h, iph->saddr);
+    h = user_syncookie_mix(h, iph->daddr);
+    h = user_syncookie_mix(h, ((uint32_t) tcph->source << 16) | tcph->dest);
+    h = user_syncookie_mix(h, count);
+    h = user_syncookie_mix(h, peer_isn);
+    return user_syncookie_mix(h, tcp->syncookie_secret[1]);
+}
+
+static inline uint32_t user_syncookie_count(uint32_t cur_ts)
+{
+    return (uint32_t) (TS_TO_MSEC(cur_ts) / USER_SYNCOOKIE_PERIOD_MS);
+}
+
+void user_tcp_parse_synopt(const struct tcphdr *tcph, user_tcp_synopt *opt)
+{
+    const uint8_t *tcpopt = (const uint8_t *) tcph + TCP_HEADER_LEN;
+    int len = (tcph->doff << 2) - TCP_HEADER_LEN;
+    int i;
+    unsigned int kind, optlen;
+
+    memset(opt, 0, sizeof(user_tcp_synopt));
+    opt->mss = 536;
+
+    for (i = 0; i < len;)
+    {
+        kind = tcpopt[i++];
+        if (kind == TCP_OPT_END)
+            break;
+        if (kind == TCP_OPT_NOP)
+            continue;
+
+        if (i >= len)
+            break;
+        optlen = tcpopt[i++];
+        if (optlen < 2 || i + optlen - 2 > (unsigned int) len)
+            break;
+
+        if (kind == TCP_OPT_MSS && optlen == USER_TCPOPT_MSS_LEN)
+        {
+            opt->mss = (tcpopt[i] << 8) | tcpopt[i + 1];
+        }
+        else if (kind == TCP_OPT_WSCALE && optlen == USER_TCPOPT_WSCALE_LEN)
+        {
+            opt->wscale = MIN(tcpopt[i], 14);
+            opt->wscale_ok = 1;
+        }
+        else if (kind == TCP_OPT_SACK_PERMIT)
+        {
+            opt->sack_ok = TCP_SACK_ENABLE;
+        }
+        else if (kind == TCP_OPT_TIMESTAMP && optlen == USER_TCPOPT_TIMESTAMP_LEN)
+        {
+            opt->ts_ok = 1;
+            opt->tsval = ntohl(*(const uint32_t *) (tcpopt + i));
+        }
+        i += optlen - 2;
+    }
+}
+
+int user_tcp_syncookie_synack(user_tcp_manager *tcp, uint32_t cur_ts,
+                              const struct iphdr *iph, const struct tcphdr *tcph)
+{
+    user_tcp_synopt opt;
+    uint32_t peer_isn = ntohl(tcph->seq);
+    uint32_t count = user_syncookie_count(cur_ts);
+    uint32_t cookie, tsval, mssidx = 0;
+
+    user_tcp_parse_synopt(tcph, &opt);
+
+    while (mssidx + 1 < USER_SYNCOOKIE_MSS_CNT &&
+           user_syncookie_mss[mssidx + 1] <= MIN(opt.mss, TCP_DEFAULT_MSS))
+    {
+        mssidx++;
+    }
+
+    cookie = (count << 27) | (mssidx << 24) |
+             (user_syncookie_hash(tcp, iph, tcph, count, peer_isn) & 0xffffff);
+
+    /* just below cur_ts, so our later tsvals never run backwards */
+    tsval = ((cur_ts >> USER_SYNCOOKIE_TS_BITS) - 1) << USER_SYNCOOKIE_TS_BITS;
+    tsval |= opt.wscale_ok ? opt.wscale : USER_SYNCOOKIE_TS_NO_WSCALE;
+    if (opt.sack_ok)
+        tsval |= USER_SYNCOOKIE_TS_SACK;
+
+    /* without timestamps sack and the scale could not be recovered, none is offered */
+    if (!opt.ts_ok)
+    {
+        opt.sack_ok = 0;
+        opt.wscale_ok = 0;
+    }
+    opt.ecn_ok = 0;
+
+    return user_tcp_synack_alone(tcp, iph->daddr, tcph->dest, iph->saddr, tcph->source,
+                                 cookie, peer_isn + 1, tsval, &opt, NULL);
+}
+
+/*
+ * the ack of a cookie syn-ack: 1 and the options of the SYN in opt if
+ * ack_seq - 1 is a cookie we handed out in the last USER_SYNCOOKIE_MAX_AGE
+ * periods, else 0.
+ */
+int user_tcp_syncookie_check(user_tcp_manager *tcp, uint32_t cur_ts,
+                             const struct iphdr *iph, const struct tcphdr *tcph, user_tcp_synopt *opt)
+{
+    uint32_t cookie = ntohl(tcph->ack_seq) - 1;
+    uint32_t peer_isn = ntohl(tcph->seq) - 1;
+    uint32_t now = user_syncookie_count(cur_ts);
+    uint32_t count = cookie >> 27;
+    uint32_t bits;
+    user_tcp_timestamp ts;
+
+    if (((now - count) & 0x1f) > USER_SYNCOOKIE_MAX_AGE)
+        return 0;
+
+    /* the counter is 5 bits on the wire, rebuild the full one */
+    count = now - ((now - count) & 0x1f);
+    if ((cookie & 0xffffff) != (user_syncookie_hash(tcp, iph, tcph, count, peer_isn) & 0xffffff))
+        return 0;
+
+    memset(opt, 0, sizeof(user_tcp_synopt));
+    opt->mss = user_syncookie_mss[(cookie >> 24) & 0x07];
+
+    if (user_tcp_parse_timestamp(&ts, (uint8_t *) tcph + TCP_HEADER_LEN, (tcph->doff << 2) - TCP_HEADER_LEN))
+    {
+        bits = ts.ts_ref & ((1 << USER_SYNCOOKIE_TS_BITS) - 1);
+
+        opt->ts_ok = 1;
+        opt->tsval = ts.ts_val;
+        if ((bits & USER_SYNCOOKIE_TS_NO_WSCALE) != USER_SYNCOOKIE_TS_NO_WSCALE)
+        {
+            opt->wscale = bits & USER_SYNCOOKIE_TS_NO_WSCALE;
+            opt->wscale_ok = 1;
+        }
+        opt->sack_ok = (bits & USER_SYNCOOKIE_TS_SACK) ? TCP_SACK_ENABLE : 0;
+    }
+
+    return 1;
+}
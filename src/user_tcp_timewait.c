@@ -0,0 +1,205 @@
+#include "user_tcp.h"
+#include "user_header.h"
+#include "user_tcp_timewait.h"
+
+#include <stdlib.h>
+
+/*
+ * TIME_WAIT records. a stream in TIME_WAIT gives back its rcv/snd blocks,
+ * buffers and locks as soon as its final ack is sent, the 2MSL is kept by
+ * a 64 byte record. every record lives USER_TCP_TIMEWAIT, so the expiry
+ * list stays sorted by appending at the tail.
+ */
+
+extern int user_tcppkt_alone(user_tcp_manager *tcp,
+                             uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport,
+                             uint32_t seq, uint32_t ack_seq, uint16_t window, uint8_t flags,
+                             uint8_t *payload, uint16_t payloadlen,
+                             uint32_t cur_ts, uint32_t echo_ts);
+extern int user_tcp_parse_timestamp(user_tcp_timestamp *ts, uint8_t *tcpopt, int len);
+
+int user_tcp_tw_init(user_tcp_manager *tcp)
+{
+    tcp->tw_table = (user_tcp_tw **) calloc(USER_TW_BINS, sizeof(user_tcp_tw *));
+    if (!tcp->tw_table)
+        return -1;
+
+    tcp->tw_pool = user_mempool_create(sizeof(user_tcp_tw), sizeof(user_tcp_tw) * USER_MAX_TIMEWAIT, MEM_DEFAULT);
+    if (!tcp->tw_pool)
+    {
+        free(tcp->tw_table);
+        tcp->tw_table = NULL;
+        return -1;
+    }
+
+    TAILQ_INIT(&tcp->tw_list);
+    tcp->tw_cnt = 0;
+    tcp->tw_overflow = 0;
+
+    return 0;
+}
+
+static inline unsigned int user_tw_hash(uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport)
+{
+    return HashTuple(saddr, sport, daddr, dport) & (USER_TW_BINS - 1);
+}
+
+user_tcp_tw *user_tcp_tw_lookup(user_tcp_manager *tcp, uint32_t saddr, uint16_t sport,
+                                uint32_t daddr, uint16_t dport)
+{
+    user_tcp_tw *tw;
+
+    if (tcp->tw_cnt == 0)
+        return NULL;
+
+    for (tw = tcp->tw_table[user_tw_hash(saddr, sport, daddr, dport)]; tw != NULL; tw = tw->hash_next)
+    {
+        if (tw->saddr == saddr && tw->sport == sport &&
+            tw->daddr == daddr && tw->dport == dport)
+        {
+            return tw;
+        }
+    }
+    return NULL;
+}
+
+/* NULL if the table is full, the caller then drops TIME_WAIT for the stream */
+user_tcp_tw *user_tcp_tw_create(user_tcp_manager *tcp, user_tcp_stream *cur_stream)
+{
+    user_tcp_recv *rcv = cur_stream->rcv;
+    uint8_t wscale = cur_stream->wscale_ok ? cur_stream->snd->wscale_mine : 0;
+    user_tcp_tw *tw;
+    unsigned int idx;
+
+    /* the pool grows, the table keeps its limit */
+    if (tcp->tw_cnt >= USER_MAX_TIMEWAIT)
+        return NULL;
+
+    tw = (user_tcp_tw *) user_mempool_alloc(tcp->tw_pool);
+    if (tw == NULL)
+        return NULL;
+
+    memset(tw, 0, sizeof(user_tcp_tw));
+    tw->saddr = cur_stream->saddr;
+    tw->sport = cur_stream->sport;
+    tw->daddr = cur_stream->daddr;
+    tw->dport = cur_stream->dport;
+    tw->snd_nxt = cur_stream->snd_nxt;
+    tw->rcv_nxt = cur_stream->rcv_nxt;
+    tw->ts_recent = rcv->ts_recent;
+    tw->ts_recent_upd = rcv->ts_last_ts_upd;
+    tw->ts_expire = rcv->ts_tw_expire;
+    tw->rcv_wnd = (uint16_t) MIN(rcv->rcv_wnd >> wscale, TCP_MAX_WINDOW);
+    tw->saw_timestamp = cur_stream->saw_timestamp;
+
+    idx = user_tw_hash(tw->saddr, tw->sport, tw->daddr, tw->dport);
+    tw->hash_next = tcp->tw_table[idx];
+    tcp->tw_table[idx] = tw;
+
+    TAILQ_INSERT_TAIL(&tcp->tw_list, tw, timer_link);
+    tcp->tw_cnt++;
+
+    return tw;
+}
+
+void user_tcp_tw_destroy(user_tcp_manager *tcp, user_tcp_tw *tw)
+{
+    user_tcp_tw **pp;
+
+    pp = &tcp->tw_table[user_tw_hash(tw->saddr, tw->sport, tw->daddr, tw->dport)];
+    while (*pp && *pp != tw)
+        pp = &(*pp)->hash_next;
+    if (*pp)
+        *pp = tw->hash_next;
+
+    TAILQ_REMOVE(&tcp->tw_list, tw, timer_link);
+    tcp->tw_cnt--;
+
+    user_mempool_free(tcp->tw_pool, tw);
+}
+
+/*
+ * a segment on a tuple in TIME_WAIT. 1 if it was answered here, 0 if it
+ * is a SYN of a newer incarnation (RFC 6191) and the record is gone.
+ */
+int user_tcp_tw_process(user_tcp_manager *tcp, uint32_t cur_ts, user_tcp_tw *tw,
+                        const struct iphdr *iph, const struct tcphdr *tcph, uint32_t seq)
+{
+    user_tcp_timestamp ts;
+    int has_ts = 0;
+
+    if (tcph->rst)
+    {
+        user_tcp_tw_destroy(tcp, tw);
+        return 1;
+    }
+
+    if (tw->saw_timestamp)
+    {
+        has_ts = user_tcp_parse_timestamp(&ts, (uint8_t *) tcph + TCP_HEADER_LEN,
+                                          (tcph->doff << 2) - TCP_HEADER_LEN);
+    }
+
+    if (tcph->syn && !tcph->ack)
+    {
+        if ((has_ts && (int32_t) (ts.ts_val - tw->ts_recent) > 0) ||
+            (!has_ts && TCP_SEQ_GT(seq, tw->rcv_nxt)))
+        {
+            user_tcp_tw_destroy(tcp, tw);
+            return 0;
+        }
+    }
+
+    if (tcph->fin)
+    {
+        /* our last ack got lost, the 2MSL starts over */
+        tw->ts_expire = cur_ts + USER_TCP_TIMEWAIT;
+        TAILQ_REMOVE(&tcp->tw_list, tw, timer_link);
+        TAILQ_INSERT_TAIL(&tcp->tw_list, tw, timer_link);
+    }
+
+    user_tcppkt_alone(tcp, tw->saddr, tw->sport, tw->daddr, tw->dport,
+                      tw->snd_nxt, tw->rcv_nxt, tw->rcv_wnd, USER_TCPHDR_ACK,
+                      NULL, 0, cur_ts, tw->ts_recent);
+    return 1;
+}
+
+/*
+ * an outbound connect to a tuple still in TIME_WAIT. with timestamps the
+ * peer tells old duplicates apart (PAWS), so the tuple is taken over once
+ * it was idle for a while; the new iss starts past anything still in
+ * flight. 1 if the tuple can be used, 0 if not. it changes tw_table and
+ * tw_list, so it belongs to the stack thread, in the SYN path of the
+ * active open once user_connect sends one.
+ */
+int user_tcp_tw_reuse(user_tcp_manager *tcp, uint32_t cur_ts, uint32_t saddr, uint16_t sport,
+                      uint32_t daddr, uint16_t dport, uint32_t *iss)
+{
+    user_tcp_tw *tw = user_tcp_tw_lookup(tcp, saddr, sport, daddr, dport);
+
+    if (tw == NULL)
+        return 1;
+
+    if (!tw->saw_timestamp || TS_TO_MSEC(cur_ts - tw->ts_recent_upd) <= USER_TW_REUSE_MS)
+        return 0;
+
+    *iss = tw->snd_nxt + TCP_MAX_WINDOW + 2;
+    user_tcp_tw_destroy(tcp, tw);
+    return 1;
+}
+
+void user_tcp_tw_timer(user_tcp_manager *tcp, uint32_t cur_ts, int thresh)
+{
+    user_tcp_tw *tw;
+    int cnt = 0;
+
+    while ((tw = TAILQ_FIRST(&tcp->tw_list)) != NULL)
+    {
+        if (++cnt > thresh)
+            break;
+        if ((int32_t) (cur_ts - tw->ts_expire) < 0)
+            break;
+
+        user_tcp_tw_destroy(tcp, tw);
+    }
+}
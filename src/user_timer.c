@@ -3,6 +3,8 @@
 #include "user_tcp.h"
 
 extern void DestroyTcpStream(user_tcp_manager *tcp, user_tcp_stream *stream);
+extern void user_tcp_enqueue_acklist(user_tcp_manager *tcp, user_tcp_stream *cur_stream, uint32_t cur_ts, uint8_t opt);
+extern void user_tcp_addto_sendlist(user_tcp_manager *tcp, user_tcp_stream *cur_stream);
 
 user_rto_hashstore *InitRTOHashstore(void)
 {
@@ -119,6 +121,10 @@ void AddtoTimeoutList(user_tcp_manager *tcp, user_tcp_stream *cur_stream)
         return;
     }
 
+    /* the app keeps idle streams itself */
+    if (cur_stream->snd->no_idle_kill)
+        return;
+
     cur_stream->on_timeout_list = 1;
     TAILQ_INSERT_TAIL(&tcp->timeout_list, cur_stream, snd->timeout_link);
     tcp->timeout_list_cnt++;
@@ -143,6 +149,85 @@ void UpdateTimeoutList(user_tcp_manager *tcp, user_tcp_stream *cur_stream)
     }
 }
 
+void AddtoDelackList(user_tcp_manager *tcp, user_tcp_stream *cur_stream, uint32_t ts_delack)
+{
+    user_tcp_stream *walk;
+
+    if (cur_stream->rcv->on_delack_list)
+        return;
+
+    cur_stream->rcv->ts_delack = ts_delack;
+    cur_stream->rcv->on_delack_list = 1;
+
+    /* keep the list sorted, the delay is per socket but mostly the same */
+    for (walk = TAILQ_LAST(&tcp->delack_list, delack_head); walk != NULL;
+         walk = TAILQ_PREV(walk, delack_head, rcv->delack_link))
+    {
+        if ((int32_t)(walk->rcv->ts_delack - ts_delack) <= 0)
+            break;
+    }
+
+    if (walk)
+    {
+        TAILQ_INSERT_AFTER(&tcp->delack_list, walk, cur_stream, rcv->delack_link);
+    }
+    else
+    {
+        TAILQ_INSERT_HEAD(&tcp->delack_list, cur_stream, rcv->delack_link);
+    }
+    tcp->delack_list_cnt++;
+}
+
+void RemoveFromDelackList(user_tcp_manager *tcp, user_tcp_stream *cur_stream)
+{
+    if (!cur_stream->rcv->on_delack_list)
+        return;
+
+    TAILQ_REMOVE(&tcp->delack_list, cur_stream, rcv->delack_link);
+    cur_stream->rcv->on_delack_list = 0;
+    tcp->delack_list_cnt--;
+}
+
+/* a held corked tail, the stream is off the send list until ts_cork_due */
+void AddtoCorkList(user_tcp_manager *tcp, user_tcp_stream *cur_stream, uint32_t ts_due)
+{
+    user_tcp_stream *walk;
+
+    if (cur_stream->snd->on_cork_list)
+        return;
+
+    cur_stream->snd->ts_cork_due = ts_due;
+    cur_stream->snd->on_cork_list = 1;
+
+    /* the cork time is the same for all, the list is almost always appended to */
+    for (walk = TAILQ_LAST(&tcp->cork_list, cork_head); walk != NULL;
+         walk = TAILQ_PREV(walk, cork_head, snd->cork_link))
+    {
+        if ((int32_t)(walk->snd->ts_cork_due - ts_due) <= 0)
+            break;
+    }
+
+    if (walk)
+    {
+        TAILQ_INSERT_AFTER(&tcp->cork_list, walk, cur_stream, snd->cork_link);
+    }
+    else
+    {
+        TAILQ_INSERT_HEAD(&tcp->cork_list, cur_stream, snd->cork_link);
+    }
+    tcp->cork_list_cnt++;
+}
+
+void RemoveFromCorkList(user_tcp_manager *tcp, user_tcp_stream *cur_stream)
+{
+    if (!cur_stream->snd->on_cork_list)
+        return;
+
+    TAILQ_REMOVE(&tcp->cork_list, cur_stream, snd->cork_link);
+    cur_stream->snd->on_cork_list = 0;
+    tcp->cork_list_cnt--;
+}
+
 void UpdateRetransmissionTimer(user_tcp_manager *tcp,
                                user_tcp_stream *cur_stream, uint32_t cur_ts)
 {
@@ -157,9 +242,7 @@ void UpdateRetransmissionTimer(user_tcp_manager *tcp,
 
     if (TCP_SEQ_GT(cur_stream->snd_nxt, cur_stream->snd->snd_una))
     {
-        cur_stream->snd->ts_rto = cur_ts + cur_stream->snd->rto;
-        AddtoRTOList(tcp, cur_stream);
-
+        user_tcp_recovery_arm_timer(tcp, cur_stream, cur_ts);
     }
     else
     {
@@ -181,6 +264,12 @@ int HandleRTO(user_tcp_manager *tcp, uint32_t cur_ts, user_tcp_stream *cur_strea
 
     uint8_t backoff;
 
+    /* the slot may have been armed for a loss probe or the rack timer */
+    if (user_tcp_recovery_on_timer(tcp, cur_stream, cur_ts))
+    {
+        return 0;
+    }
+
     if (cur_stream->snd->nrtx < TCP_MAX_RTX)
     {
         cur_stream->snd->nrtx++;
@@ -235,12 +324,8 @@ int HandleRTO(user_tcp_manager *tcp, uint32_t cur_ts, user_tcp_stream *cur_strea
         }
     }
 
-    cur_stream->snd->ssthresh = MIN(cur_stream->snd->cwnd, cur_stream->snd->peer_wnd) / 2;
-    if (cur_stream->snd->ssthresh < (2 * cur_stream->snd->mss))
-    {
-        cur_stream->snd->ssthresh = cur_stream->snd->mss * 2;
-    }
-    cur_stream->snd->cwnd = cur_stream->snd->mss;
+    user_tcp_recovery_on_rto(cur_stream);
+    user_tcp_cc_on_rto(cur_stream);
 
     user_trace_timer("Stream %d Timeout. cwnd: %u, ssthresh: %u\n",
                      cur_stream->id, cur_stream->snd->cwnd, cur_stream->snd->ssthresh);
@@ -315,6 +400,7 @@ int HandleRTO(user_tcp_manager *tcp, uint32_t cur_ts, user_tcp_stream *cur_strea
     }
 
     cur_stream->snd_nxt = cur_stream->snd->snd_una;
+    user_tcp_sack_on_rto(cur_stream);
     if (cur_stream->state == USER_TCP_ESTABLISHED ||
         cur_stream->state == USER_TCP_CLOSE_WAIT)
     {
@@ -457,23 +543,24 @@ void CheckTimewaitExpire(user_tcp_manager *tcp, uint32_t cur_ts, int thresh)
 
         if (walk->on_timewait_list)
         {
-            if ((int32_t)(cur_ts - walk->rcv->ts_tw_expire) >= 0)
+            /* once the final ack is out a compact record keeps the rest of 2MSL */
+            if (!walk->snd->on_control_list && !walk->snd->on_ack_list)
             {
-                if (!walk->snd->on_control_list)
+                TAILQ_REMOVE(&tcp->timewait_list, walk, snd->timer_link);
+                walk->on_timewait_list = 0;
+                tcp->timewait_list_cnt--;
+
+                if ((int32_t)(cur_ts - walk->rcv->ts_tw_expire) < 0 &&
+                    user_tcp_tw_create(tcp, walk) == NULL)
                 {
-                    TAILQ_REMOVE(&tcp->timewait_list, walk, snd->timer_link);
-                    walk->on_timewait_list = 0;
-                    tcp->timewait_list_cnt--;
-
-                    walk->state = USER_TCP_CLOSED;
-                    walk->close_reason = TCP_ACTIVE_CLOSE;
-                    user_trace_timer("Stream %d: TCP_ST_CLOSED\n", walk->id);
-                    DestroyTcpStream(tcp, walk);
+                    user_trace_timer("Stream %d: time wait table full\n", walk->id);
+                    tcp->tw_overflow++;
                 }
-            }
-            else
-            {
-                break;
+
+                walk->state = USER_TCP_CLOSED;
+                walk->close_reason = TCP_ACTIVE_CLOSE;
+                user_trace_timer("Stream %d: TCP_ST_CLOSED\n", walk->id);
+                DestroyTcpStream(tcp, walk);
             }
         }
         else
@@ -483,6 +570,43 @@ void CheckTimewaitExpire(user_tcp_manager *tcp, uint32_t cur_ts, int thresh)
     }
 }
 
+void CheckDelayedAck(user_tcp_manager *tcp, uint32_t cur_ts, int thresh)
+{
+    user_tcp_stream *walk;
+    int cnt = 0;
+
+    while ((walk = TAILQ_FIRST(&tcp->delack_list)) != NULL)
+    {
+        if (++cnt > thresh)
+            break;
+        if ((int32_t)(cur_ts - walk->rcv->ts_delack) < 0)
+            break;
+
+        RemoveFromDelackList(tcp, walk);
+        user_tcp_enqueue_acklist(tcp, walk, cur_ts, ACK_OPT_AGGREGATE);
+    }
+}
+
+void CheckCorkTimeout(user_tcp_manager *tcp, uint32_t cur_ts, int thresh)
+{
+    user_tcp_stream *walk;
+    int cnt = 0;
+
+    while ((walk = TAILQ_FIRST(&tcp->cork_list)) != NULL)
+    {
+        if (++cnt > thresh)
+            break;
+        if ((int32_t)(cur_ts - walk->snd->ts_cork_due) < 0)
+            break;
+
+        RemoveFromCorkList(tcp, walk);
+        if (walk->snd->sndbuf && walk->snd->sndbuf->len > 0)
+        {
+            user_tcp_addto_sendlist(tcp, walk);
+        }
+    }
+}
+
 /*----------------------------------------------------------------------------*/
 void CheckConnectionTimeout(user_tcp_manager *tcp, uint32_t cur_ts, int thresh)
 {
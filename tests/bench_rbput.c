@@ -0,0 +1,249 @@
+#include "../src/user_buffer.c"
+
+#include <time.h>
+
+/*
+ * RBPut with out-of-order segments in bad orders, against the sorted
+ * list walk it used before the ranges went into a red-black tree. both
+ * copy into the same segments, only the lookup of the ranges differs.
+ */
+
+#define BENCH_WINDOW        (1 << 20)
+#define BENCH_MSS           1448
+#define BENCH_NSEGS         (BENCH_WINDOW / BENCH_MSS)
+#define BENCH_ROUNDS        20
+
+typedef int (*rb_put_fn)(user_rb_manager *rbm, user_ring_buffer *buff,
+                         void *data, uint32_t len, uint32_t cur_seq);
+
+/*----------------------------------------------------------------------------*/
+/* the list walk, as RBPut had it */
+static inline int CanMerge(const user_fragment_ctx *a, const user_fragment_ctx *b)
+{
+    uint32_t a_end = a->seq + a->len + 1;
+    uint32_t b_end = b->seq + b->len + 1;
+
+    if (GetMinSeq(a_end, b->seq) == a_end ||
+        GetMinSeq(b_end, a->seq) == b_end)
+        return 0;
+    return (1);
+}
+
+static inline void MergeFragments(user_fragment_ctx *a, user_fragment_ctx *b)
+{
+    /* merge a into b */
+    uint32_t min_seq, max_seq;
+
+    min_seq = GetMinSeq(a->seq, b->seq);
+    max_seq = GetMaxSeq(a->seq + a->len, b->seq + b->len);
+    b->seq = min_seq;
+    b->len = max_seq - min_seq;
+}
+
+static int RBPutList(user_rb_manager *rbm, user_ring_buffer *buff,
+                     void *data, uint32_t len, uint32_t cur_seq)
+{
+    int putx, end_off;
+    user_fragment_ctx *new_ctx;
+    user_fragment_ctx *iter;
+    user_fragment_ctx *prev, *pprev;
+    user_buf_seg *seg;
+    uint32_t seq, off, put, n;
+    int merged = 0;
+
+    if (GetMinSeq(buff->head_seq, cur_seq) != buff->head_seq)
+        return 0;
+
+    putx = cur_seq - buff->head_seq;
+    end_off = putx + len;
+    if (buff->size < end_off)
+        return -2;
+
+    for (put = 0; put < len; put += n)
+    {
+        seq = cur_seq + put;
+        seg = RBSegGet(rbm->seg_mp, buff, seq);
+        if (!seg)
+            return -1;
+
+        off = (seq - buff->seg_seq) & (USER_BUF_SEG_SIZE - 1);
+        n = MIN(len - put, USER_BUF_SEG_SIZE - off);
+        memcpy(seg->data + off, (u_char *) data + put, n);
+    }
+
+    if (buff->last_len < end_off)
+        buff->last_len = end_off;
+
+    new_ctx = AllocateFragmentContext(rbm);
+    new_ctx->seq = cur_seq;
+    new_ctx->len = len;
+    new_ctx->next = NULL;
+
+    for (iter = buff->fctx, prev = NULL, pprev = NULL;
+         iter != NULL;
+         pprev = prev, prev = iter, iter = iter->next)
+    {
+        if (CanMerge(new_ctx, iter))
+        {
+            MergeFragments(new_ctx, iter);
+            if (prev == new_ctx)
+            {
+                if (pprev)
+                    pprev->next = iter;
+                else
+                    buff->fctx = iter;
+                prev = pprev;
+            }
+            FreeFragmentContextSingle(rbm, new_ctx);
+            new_ctx = iter;
+            merged = 1;
+        }
+        else if (merged ||
+                 GetMaxSeq(cur_seq + len, iter->seq) == iter->seq)
+        {
+            break;
+        }
+    }
+
+    if (!merged)
+    {
+        if (buff->fctx == NULL)
+        {
+            buff->fctx = new_ctx;
+        }
+        else if (GetMinSeq(cur_seq, buff->fctx->seq) == cur_seq)
+        {
+            new_ctx->next = buff->fctx;
+            buff->fctx = new_ctx;
+        }
+        else
+        {
+            prev->next = new_ctx;
+            new_ctx->next = iter;
+        }
+    }
+
+    if (buff->head_seq == buff->fctx->seq)
+    {
+        buff->cum_len += buff->fctx->len - buff->merged_len;
+        buff->merged_len = buff->fctx->len;
+    }
+
+    return len;
+}
+
+/*----------------------------------------------------------------------------*/
+/* the order of the segments, 0 always last so everything before is out of order */
+static void order_reversed(uint32_t *idx, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        idx[i] = n - 1 - i;
+    }
+}
+
+/* every other one first, the holes after */
+static void order_strided(uint32_t *idx, int n)
+{
+    int i, k = 0;
+
+    for (i = 2; i < n; i += 2)
+    {
+        idx[k++] = i;
+    }
+    for (i = 1; i < n; i += 2)
+    {
+        idx[k++] = i;
+    }
+    idx[k] = 0;
+}
+
+static void order_random(uint32_t *idx, int n)
+{
+    uint32_t t;
+    int i, j;
+
+    srand(1);
+    for (i = 0; i < n - 1; i++)
+    {
+        idx[i] = i + 1;
+    }
+    for (i = n - 2; i > 0; i--)
+    {
+        j = rand() % (i + 1);
+        t = idx[i];
+        idx[i] = idx[j];
+        idx[j] = t;
+    }
+    idx[n - 1] = 0;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t run(user_rb_manager *rbm, rb_put_fn put, const uint32_t *idx, int n)
+{
+    static u_char data[BENCH_MSS];
+    user_ring_buffer *rb;
+    uint64_t start, total = 0;
+    int r, i;
+
+    for (r = 0; r < BENCH_ROUNDS; r++)
+    {
+        rb = RBInit(rbm, 1000);
+
+        start = now_ns();
+        for (i = 0; i < n; i++)
+        {
+            put(rbm, rb, data, BENCH_MSS, 1000 + idx[i] * BENCH_MSS);
+        }
+        total += now_ns() - start;
+
+        if (rb->merged_len != n * BENCH_MSS || rb->fctx->next != NULL)
+        {
+            printf("bad result, merged %d\n", rb->merged_len);
+            exit(1);
+        }
+        RBFree(rbm, rb);
+    }
+
+    return total / BENCH_ROUNDS / n;
+}
+
+int main(void)
+{
+    static uint32_t idx[BENCH_NSEGS];
+    static const struct
+    {
+        const char *name;
+        void (*order)(uint32_t *idx, int n);
+    } orders[] = {
+        { "reversed", order_reversed },
+        { "strided", order_strided },
+        { "random", order_random },
+    };
+    user_rb_manager *rbm;
+    unsigned i;
+
+    rbm = RBManagerCreate(BENCH_WINDOW, BENCH_WINDOW, 2, BENCH_NSEGS, BENCH_NSEGS);
+    if (!rbm)
+        return 1;
+
+    printf("%d segments of %d bytes, ns per segment\n", BENCH_NSEGS, BENCH_MSS);
+    printf("%-12s %10s %10s\n", "order", "list", "rb-tree");
+    for (i = 0; i < sizeof(orders) / sizeof(orders[0]); i++)
+    {
+        orders[i].order(idx, BENCH_NSEGS);
+        printf("%-12s %10lu %10lu\n", orders[i].name,
+               run(rbm, RBPutList, idx, BENCH_NSEGS), run(rbm, RBPut, idx, BENCH_NSEGS));
+    }
+
+    return 0;
+}
@@ -0,0 +1,268 @@
+#include "../src/user_buffer.c"
+#include "user_test.h"
+
+static void fill(u_char *p, uint32_t len, uint32_t seq)
+{
+    uint32_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        p[i] = (u_char) ((seq + i) * 7);
+    }
+}
+
+static int same(const u_char *p, uint32_t len, uint32_t seq)
+{
+    uint32_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        if (p[i] != (u_char) ((seq + i) * 7))
+            return 0;
+    }
+    return 1;
+}
+
+/*----------------------------------------------------------------------------*/
+static void test_seg_consume(void)
+{
+    user_mempool *mp = user_mempool_create(sizeof(user_buf_seg), sizeof(user_buf_seg) * 8, MEM_NORMAL);
+    user_buf_seg *head = NULL, *tail = NULL, *second, *hint;
+    uint32_t nsegs = 0, hint_off, off;
+    int i;
+
+    USER_CHECK(mp != NULL);
+    for (i = 0; i < 3; i++)
+    {
+        USER_CHECK(BufSegAppend(mp, &head, &tail, &nsegs) == 0);
+    }
+    USER_CHECK(nsegs == 3);
+    second = head->next;
+
+    /* the hint past the dropped segment moves down with the chain */
+    hint = tail;
+    hint_off = 2 * USER_BUF_SEG_SIZE;
+    off = BufSegConsume(mp, &head, &nsegs, &hint, &hint_off, USER_BUF_SEG_SIZE + 10);
+    USER_CHECK(off == 10);
+    USER_CHECK(nsegs == 2);
+    USER_CHECK(head == second);
+    USER_CHECK(hint == tail && hint_off == USER_BUF_SEG_SIZE);
+
+    /* inside the head nothing goes */
+    off = BufSegConsume(mp, &head, &nsegs, &hint, &hint_off, 100);
+    USER_CHECK(off == 100 && nsegs == 2 && head == second);
+
+    /* a hint into a dropped segment is forgotten */
+    hint = head;
+    hint_off = 0;
+    off = BufSegConsume(mp, &head, &nsegs, &hint, &hint_off, USER_BUF_SEG_SIZE);
+    USER_CHECK(off == 0 && nsegs == 1 && head == tail);
+    USER_CHECK(hint == NULL && hint_off == 0);
+
+    /* the last segment is kept, off stays past its end */
+    off = BufSegConsume(mp, &head, &nsegs, &hint, &hint_off, USER_BUF_SEG_SIZE + 5);
+    USER_CHECK(off == USER_BUF_SEG_SIZE + 5 && nsegs == 1 && head == tail);
+
+    BufSegFreeAll(mp, head);
+    user_mempool_destory(mp);
+}
+
+static void test_sb_put_remove(void)
+{
+    user_sb_manager *sbm = user_sbmanager_create(8192, 65536, 4);
+    user_send_buffer *sb;
+    static u_char data[10000], out[10000];
+
+    USER_CHECK(sbm != NULL);
+    sb = SBInit(sbm, 1000);
+    USER_CHECK(sb != NULL);
+
+    fill(data, sizeof(data), 1000);
+    USER_CHECK(SBPut(sbm, sb, data, 5000) == 5000);
+    USER_CHECK(sb->len == 5000 && sb->nsegs == 3);
+
+    /* across a segment boundary */
+    SBCopy(sb, 1000 + USER_BUF_SEG_SIZE - 20, out, 40);
+    USER_CHECK(same(out, 40, 1000 + USER_BUF_SEG_SIZE - 20));
+
+    /* only what fits below the size */
+    USER_CHECK(SBPut(sbm, sb, data + 5000, 5000) == 8192 - 5000);
+    USER_CHECK(sb->len == 8192);
+
+    USER_CHECK(SBRemove(sbm, sb, 2 * USER_BUF_SEG_SIZE + 4) == 2 * USER_BUF_SEG_SIZE + 4);
+    USER_CHECK(sb->head_seq == 1000 + 2 * USER_BUF_SEG_SIZE + 4);
+    USER_CHECK(sb->head_off == 4 && sb->nsegs == 2);
+
+    SBCopy(sb, sb->head_seq, out, sb->len);
+    USER_CHECK(same(out, sb->len, sb->head_seq));
+
+    USER_CHECK(SBRemove(sbm, sb, sb->len) == 8192 - 2 * USER_BUF_SEG_SIZE - 4);
+    USER_CHECK(sb->len == 0 && sb->head_off == 0 && sb->tail_off == 0);
+    USER_CHECK(SBRelease(sbm, sb) == (int) sizeof(user_buf_seg));
+    USER_CHECK(sb->nsegs == 0 && sb->head == NULL);
+
+    SBFree(sbm, sb);
+}
+
+/*----------------------------------------------------------------------------*/
+static uint32_t put(user_rb_manager *rbm, user_ring_buffer *rb, uint32_t seq, uint32_t len)
+{
+    static u_char data[4096];
+
+    fill(data, len, seq);
+    return RBPut(rbm, rb, data, len, seq);
+}
+
+static void test_rb_merge(void)
+{
+    user_rb_manager *rbm = RBManagerCreate(8192, 65536, 4, 64, 256);
+    user_ring_buffer *rb;
+    static u_char out[8192];
+
+    USER_CHECK(rbm != NULL);
+    rb = RBInit(rbm, 0);
+    USER_CHECK(rb != NULL);
+
+    USER_CHECK(put(rbm, rb, 100, 100) == 100);
+    USER_CHECK(put(rbm, rb, 300, 100) == 100);
+    USER_CHECK(rb->nfrags == 2 && rb->merged_len == 0);
+    USER_CHECK(rb->fctx->seq == 100 && rb->fctx->next->seq == 300);
+
+    /* overlapping the front of a range extends it downwards */
+    USER_CHECK(put(rbm, rb, 250, 100) == 100);
+    USER_CHECK(rb->nfrags == 2 && rb->fctx->next->seq == 250 && rb->fctx->next->len == 150);
+
+    /* filling the hole swallows the range above */
+    USER_CHECK(put(rbm, rb, 200, 50) == 50);
+    USER_CHECK(rb->nfrags == 1 && rb->fctx->seq == 100 && rb->fctx->len == 300);
+    USER_CHECK(RB_MIN(_user_frag_tree, &rb->frags) == rb->fctx);
+
+    /* a duplicate changes nothing */
+    USER_CHECK(put(rbm, rb, 150, 50) == 50);
+    USER_CHECK(rb->nfrags == 1 && rb->fctx->len == 300);
+
+    /* the in-order segment makes it readable */
+    USER_CHECK(put(rbm, rb, 0, 100) == 100);
+    USER_CHECK(rb->nfrags == 1 && rb->merged_len == 400 && rb->cum_len == 400);
+    USER_CHECK(RBCopy(rb, out, sizeof(out)) == 400);
+    USER_CHECK(same(out, 400, 0));
+
+    /* below head_seq is dropped, past the size refused */
+    USER_CHECK(RBRemove(rbm, rb, 150, AT_APP) == 150);
+    USER_CHECK(rb->head_seq == 150 && rb->merged_len == 250 && rb->fctx->seq == 150);
+    USER_CHECK(put(rbm, rb, 100, 10) == 0);
+    USER_CHECK((int) put(rbm, rb, 150 + 8192, 10) == -2);
+
+    USER_CHECK(RBRemove(rbm, rb, 250, AT_APP) == 250);
+    USER_CHECK(rb->fctx == NULL && rb->nfrags == 0 && rb->merged_len == 0);
+    USER_CHECK(RBRelease(rbm, rb) > 0);
+
+    RBFree(rbm, rb);
+}
+
+static void test_rb_sparse(void)
+{
+    user_rb_manager *rbm = RBManagerCreate(1 << 20, 1 << 20, 4, 64, 256);
+    user_ring_buffer *rb;
+    static u_char out[3 * USER_BUF_SEG_SIZE];
+    uint32_t edge = (1 << 20) - 1, seq;
+
+    USER_CHECK(rbm != NULL);
+    rb = RBInit(rbm, 5000);
+
+    /* one byte at the edge of the window takes one segment, not the ones before it */
+    USER_CHECK(put(rbm, rb, 5000 + edge, 1) == 1);
+    USER_CHECK(rb->nsegs == 1 && RB_SEG_SLOT(rb, edge >> USER_BUF_SEG_SHIFT) != NULL);
+    USER_CHECK(rb->seg_seq == 5000 && rb->seg_slots == (1 << 20) / USER_BUF_SEG_SIZE);
+
+    /* across a boundary, two; a duplicate none */
+    USER_CHECK(put(rbm, rb, 5000 + 10 * USER_BUF_SEG_SIZE - 10, 20) == 20);
+    USER_CHECK(rb->nsegs == 3);
+    USER_CHECK(put(rbm, rb, 5000 + 10 * USER_BUF_SEG_SIZE - 5, 10) == 10);
+    USER_CHECK(rb->nsegs == 3);
+
+    /* the gap fills in order, from the front */
+    for (seq = 5000; seq < 5000 + 3 * USER_BUF_SEG_SIZE; seq += 1024)
+    {
+        USER_CHECK(put(rbm, rb, seq, 1024) == 1024);
+    }
+    USER_CHECK(rb->nsegs == 6 && rb->merged_len == 3 * USER_BUF_SEG_SIZE);
+    USER_CHECK(RBCopy(rb, out, sizeof(out)) == sizeof(out));
+    USER_CHECK(same(out, sizeof(out), 5000));
+
+    /* reading frees what was read, pruning what only the ranges used */
+    USER_CHECK(RBRemove(rbm, rb, USER_BUF_SEG_SIZE + 1, AT_APP) == USER_BUF_SEG_SIZE + 1);
+    USER_CHECK(rb->nsegs == 5 && rb->seg_seq == 5000 + USER_BUF_SEG_SIZE);
+    USER_CHECK(RBPruneOfo(rbm, rb) == 21);
+    USER_CHECK(rb->nsegs == 2);
+
+    /* read up, one segment stays for the next data at its front */
+    USER_CHECK(RBRemove(rbm, rb, rb->merged_len, AT_APP) > 0);
+    USER_CHECK(rb->nsegs == 1 && rb->seg_seq == rb->head_seq);
+    USER_CHECK(put(rbm, rb, rb->head_seq, 100) == 100 && rb->nsegs == 1);
+
+    RBFree(rbm, rb);
+}
+
+static void test_rb_limit(void)
+{
+    user_rb_manager *rbm = RBManagerCreate(65536, 65536, 4, 4, 6);
+    user_ring_buffer *rb, *rb2;
+    uint32_t seq;
+
+    USER_CHECK(rbm != NULL);
+    rb = RBInit(rbm, 0);
+    rb2 = RBInit(rbm, 0);
+
+    for (seq = 100; seq < 900; seq += 200)
+    {
+        USER_CHECK(put(rbm, rb, seq, 50) == 50);
+    }
+    USER_CHECK(rb->nfrags == 4 && rbm->frag_cnt == 4);
+
+    /* above the highest range, no room: the segment goes */
+    USER_CHECK((int) put(rbm, rb, 900, 50) == -4);
+    USER_CHECK(rb->nfrags == 4 && rbm->frag_dropped == 50);
+
+    /* below it, the highest range goes */
+    USER_CHECK(put(rbm, rb, 200, 50) == 50);
+    USER_CHECK(rb->nfrags == 4 && rbm->frag_dropped == 100);
+    USER_CHECK(RB_MAX(_user_frag_tree, &rb->frags)->seq == 500);
+    USER_CHECK(rb->last_len == 550);
+
+    /* joining a range needs none */
+    USER_CHECK(put(rbm, rb, 150, 50) == 50);
+    USER_CHECK(rb->nfrags == 3 && rb->fctx->seq == 100 && rb->fctx->len == 150);
+
+    /* in-order data is always taken */
+    USER_CHECK(put(rbm, rb, 0, 10) == 10);
+    USER_CHECK(rb->nfrags == 4 && rb->merged_len == 10);
+
+    /* the manager limit holds across buffers */
+    USER_CHECK(put(rbm, rb2, 1000, 10) == 10);
+    USER_CHECK(put(rbm, rb2, 2000, 10) == 10);
+    USER_CHECK(rbm->frag_cnt == 6);
+    USER_CHECK((int) put(rbm, rb2, 3000, 10) == -4);
+    USER_CHECK(put(rbm, rb2, 1500, 10) == 10);
+    USER_CHECK(rb2->nfrags == 2 && RB_MAX(_user_frag_tree, &rb2->frags)->seq == 1500);
+
+    /* pruning keeps the in-order part */
+    USER_CHECK(RBPruneOfo(rbm, rb) == 150 + 50 + 50);
+    USER_CHECK(rb->nfrags == 1 && rb->fctx->seq == 0 && rb->fctx->next == NULL);
+    USER_CHECK(rb->last_len == rb->merged_len);
+
+    RBFree(rbm, rb);
+    RBFree(rbm, rb2);
+    USER_CHECK(rbm->frag_cnt == 0);
+}
+
+int main(void)
+{
+    USER_TEST_RUN(test_seg_consume);
+    USER_TEST_RUN(test_sb_put_remove);
+    USER_TEST_RUN(test_rb_merge);
+    USER_TEST_RUN(test_rb_sparse);
+    USER_TEST_RUN(test_rb_limit);
+
+    return user_test_failed ? 1 : 0;
+}
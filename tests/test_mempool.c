@@ -0,0 +1,188 @@
+#include "user_mempool.h"
+#include "user_slab.h"
+#include "user_test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static int ctor_calls;
+static int dtor_calls;
+
+static int test_ctor(void *obj, void *arg)
+{
+    ((uint32_t *) obj)[4] = *(uint32_t *) arg;
+    ctor_calls++;
+    return 0;
+}
+
+static void test_dtor(void *obj, void *arg)
+{
+    dtor_calls++;
+}
+
+static int cmp_ptr(const void *a, const void *b)
+{
+    uintptr_t x = *(const uintptr_t *) a, y = *(const uintptr_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* all distinct and none overlapping the next */
+static int disjoint(void **p, int n, size_t size)
+{
+    int i;
+
+    qsort(p, n, sizeof(void *), cmp_ptr);
+    for (i = 1; i < n; i++)
+    {
+        if ((u_char *) p[i - 1] + size > (u_char *) p[i])
+            return 0;
+    }
+    return 1;
+}
+
+/*----------------------------------------------------------------------------*/
+static void test_mempool_grow(void)
+{
+    user_mempool *mp = user_mempool_create(64, 64 * 64, MEM_NORMAL);
+    static void *p[4096];
+    int n, i, total, ok = 1;
+
+    USER_CHECK(mp != NULL);
+    total = mp->mp_total_chunks;
+    USER_CHECK(total >= 64 && mp->mp_nslabs == 1);
+
+    /* past the first slab the pool grows */
+    n = total * 3;
+    for (i = 0; i < n; i++)
+    {
+        p[i] = user_mempool_alloc(mp);
+        if (!p[i])
+            break;
+        memset(p[i], i, 64);
+    }
+    USER_CHECK(i == n);
+    USER_CHECK(mp->mp_nslabs > 1 && mp->mp_total_chunks >= n);
+    USER_CHECK(user_mempool_used_chunks(mp) >= n);
+
+    for (i = 0; i < n; i++)
+    {
+        if (((u_char *) p[i])[63] != (u_char) i)
+            ok = 0;
+    }
+    USER_CHECK(ok);
+    USER_CHECK(disjoint(p, n, 64));
+
+    /* freed chunks come back */
+    for (i = 0; i < n; i++)
+    {
+        user_mempool_free(mp, p[i]);
+    }
+    for (i = 0; i < n; i++)
+    {
+        p[i] = user_mempool_alloc(mp);
+    }
+    USER_CHECK(disjoint(p, n, 64));
+    for (i = 0; i < n; i++)
+    {
+        user_mempool_free(mp, p[i]);
+    }
+
+    user_mempool_destory(mp);
+}
+
+static void test_mempool_cache(void)
+{
+    uint32_t magic = 0xfeedbeef;
+    user_mempool *mp;
+    uint32_t *obj;
+
+    ctor_calls = dtor_calls = 0;
+    mp = user_mempool_create_cache(64, 64 * 16, MEM_NORMAL, test_ctor, test_dtor, &magic);
+    USER_CHECK(mp != NULL);
+    USER_CHECK(ctor_calls == mp->mp_total_chunks);
+
+    /* the constructed state lives through free and alloc */
+    obj = user_mempool_alloc(mp);
+    USER_CHECK(obj && obj[4] == magic);
+    obj[5] = 42;
+    user_mempool_free(mp, obj);
+    obj = user_mempool_alloc(mp);
+    USER_CHECK(obj && obj[4] == magic);
+    user_mempool_free(mp, obj);
+
+    user_mempool_destory(mp);
+    USER_CHECK(dtor_calls == ctor_calls);
+}
+
+/*----------------------------------------------------------------------------*/
+static int slab_class(size_t size)
+{
+    user_slab_stat st[USER_SLAB_NCLASS];
+    int i, n = user_slab_stats(st, USER_SLAB_NCLASS);
+
+    for (i = 0; i < n; i++)
+    {
+        if (st[i].size >= size)
+            return i;
+    }
+    return -1;
+}
+
+static void test_slab_classes(void)
+{
+    user_slab_stat before[USER_SLAB_NCLASS], after[USER_SLAB_NCLASS];
+    static const size_t sizes[] = { 1, 16, 17, 100, 129, 1000, 1537, 4096 };
+    void *p[8];
+    int i, cls, ok = 1;
+
+    user_slab_stats(before, USER_SLAB_NCLASS);
+    for (i = 0; i < 8; i++)
+    {
+        p[i] = user_slab_zalloc(sizes[i]);
+        USER_CHECK(p[i] != NULL);
+        memset(p[i], 0xa5, sizes[i]);
+    }
+    user_slab_stats(after, USER_SLAB_NCLASS);
+
+    /* each lands in the smallest class it fits, at most 50% over */
+    for (i = 0; i < 8; i++)
+    {
+        cls = slab_class(sizes[i]);
+        if (cls < 0 || after[cls].used <= before[cls].used)
+            ok = 0;
+        if (after[cls].size > 16 && after[cls].size > sizes[i] * 3 / 2 + 16)
+            ok = 0;
+    }
+    USER_CHECK(ok);
+    cls = slab_class(100);
+    USER_CHECK(after[cls].size == 128 && after[cls].req_bytes - before[cls].req_bytes == 100);
+
+    for (i = 0; i < 8; i++)
+    {
+        user_slab_free(p[i], sizes[i]);
+    }
+    user_slab_stats(after, USER_SLAB_NCLASS);
+    for (i = 0; i < USER_SLAB_NCLASS; i++)
+    {
+        if (after[i].req_bytes != before[i].req_bytes)
+            ok = 0;
+    }
+    USER_CHECK(ok);
+
+    /* above the largest class it is plain malloc */
+    p[0] = user_slab_alloc(USER_SLAB_MAX_SIZE + 1);
+    USER_CHECK(p[0] != NULL);
+    user_slab_stats(after, USER_SLAB_NCLASS);
+    USER_CHECK(after[USER_SLAB_NCLASS - 1].req_bytes == before[USER_SLAB_NCLASS - 1].req_bytes);
+    user_slab_free(p[0], USER_SLAB_MAX_SIZE + 1);
+}
+
+int main(void)
+{
+    USER_TEST_RUN(test_mempool_grow);
+    USER_TEST_RUN(test_mempool_cache);
+    USER_TEST_RUN(test_slab_classes);
+
+    return user_test_failed ? 1 : 0;
+}
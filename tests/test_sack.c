@@ -0,0 +1,151 @@
+#include "../src/user_tcp_sack.c"
+#include "user_test.h"
+
+static void board_reset(user_tcp_sackboard *board)
+{
+    memset(board, 0, sizeof(user_tcp_sackboard));
+}
+
+static int blk_is(user_tcp_sackboard *board, int i, uint32_t start, uint32_t end)
+{
+    return i < board->cnt && board->blk[i].start == start && board->blk[i].end == end;
+}
+
+/*----------------------------------------------------------------------------*/
+static void test_sack_insert(void)
+{
+    user_tcp_sackboard board;
+
+    board_reset(&board);
+    user_tcp_sack_insert(&board, 300, 400);
+    user_tcp_sack_insert(&board, 100, 200);
+    user_tcp_sack_insert(&board, 500, 600);
+    USER_CHECK(board.cnt == 3);
+    USER_CHECK(blk_is(&board, 0, 100, 200) && blk_is(&board, 1, 300, 400) && blk_is(&board, 2, 500, 600));
+
+    /* adjacent ranges join */
+    user_tcp_sack_insert(&board, 200, 250);
+    USER_CHECK(board.cnt == 3 && blk_is(&board, 0, 100, 250));
+
+    /* one range spanning several swallows them */
+    user_tcp_sack_insert(&board, 240, 550);
+    USER_CHECK(board.cnt == 1 && blk_is(&board, 0, 100, 600));
+
+    /* inside an existing one */
+    user_tcp_sack_insert(&board, 150, 160);
+    USER_CHECK(board.cnt == 1 && blk_is(&board, 0, 100, 600));
+
+    /* across the wrap of the sequence space */
+    board_reset(&board);
+    user_tcp_sack_insert(&board, 0xfffffff0, 0x10);
+    user_tcp_sack_insert(&board, 0xffffff00, 0xffffff80);
+    user_tcp_sack_insert(&board, 0x20, 0x30);
+    USER_CHECK(board.cnt == 3);
+    USER_CHECK(blk_is(&board, 0, 0xffffff00, 0xffffff80) && blk_is(&board, 1, 0xfffffff0, 0x10));
+    user_tcp_sack_insert(&board, 0x10, 0x20);
+    USER_CHECK(board.cnt == 2 && blk_is(&board, 1, 0xfffffff0, 0x30));
+}
+
+static void test_sack_full(void)
+{
+    user_tcp_sackboard board;
+    int i;
+
+    board_reset(&board);
+    for (i = 0; i < USER_TCP_SACK_SCOREBOARD; i++)
+    {
+        user_tcp_sack_insert(&board, 1000 + i * 100, 1000 + i * 100 + 10);
+    }
+    USER_CHECK(board.cnt == USER_TCP_SACK_SCOREBOARD);
+
+    /* full: a range above all is not kept */
+    user_tcp_sack_insert(&board, 100000, 100010);
+    USER_CHECK(board.cnt == USER_TCP_SACK_SCOREBOARD);
+    USER_CHECK(board.blk[board.cnt - 1].start == 1000 + (USER_TCP_SACK_SCOREBOARD - 1) * 100);
+
+    /* one below pushes out the range farthest from snd_una */
+    user_tcp_sack_insert(&board, 500, 510);
+    USER_CHECK(board.cnt == USER_TCP_SACK_SCOREBOARD && blk_is(&board, 0, 500, 510));
+    USER_CHECK(board.blk[board.cnt - 1].start == 1000 + (USER_TCP_SACK_SCOREBOARD - 2) * 100);
+
+    /* merging needs no room */
+    user_tcp_sack_insert(&board, 505, 1005);
+    USER_CHECK(board.cnt == USER_TCP_SACK_SCOREBOARD - 1 && blk_is(&board, 0, 500, 1010));
+}
+
+static void test_sack_trim(void)
+{
+    user_tcp_sackboard board;
+
+    board_reset(&board);
+    user_tcp_sack_insert(&board, 100, 200);
+    user_tcp_sack_insert(&board, 300, 400);
+    user_tcp_sack_insert(&board, 500, 600);
+
+    user_tcp_sack_trim(&board, 50);
+    USER_CHECK(board.cnt == 3 && board.sacked_bytes == 300);
+
+    /* the cumulative ack covers the first and cuts into the second */
+    user_tcp_sack_trim(&board, 350);
+    USER_CHECK(board.cnt == 2 && blk_is(&board, 0, 350, 400) && blk_is(&board, 1, 500, 600));
+    USER_CHECK(board.sacked_bytes == 150);
+
+    user_tcp_sack_trim(&board, 600);
+    USER_CHECK(board.cnt == 0 && board.sacked_bytes == 0);
+}
+
+/*----------------------------------------------------------------------------*/
+static void test_sack_update(void)
+{
+    user_tcp_stream stream;
+    user_tcp_send snd;
+    user_send_buffer sb;
+    user_tcp_sack_block blocks[3];
+
+    memset(&stream, 0, sizeof(stream));
+    memset(&snd, 0, sizeof(snd));
+    memset(&sb, 0, sizeof(sb));
+    stream.snd = &snd;
+    snd.sndbuf = &sb;
+    sb.head_seq = 1000;
+    sb.len = 5000;
+
+    /* the first block below the ack is a dsack, beyond what was sent is ignored */
+    blocks[0].start = 900;
+    blocks[0].end = 1000;
+    blocks[1].start = 2000;
+    blocks[1].end = 3000;
+    blocks[2].start = 7000;
+    blocks[2].end = 8000;
+    user_tcp_sack_update(&stream, 1000, blocks, 3);
+    USER_CHECK(snd.sack.dsack_cnt == 1);
+    USER_CHECK(snd.sack.cnt == 1 && blk_is(&snd.sack, 0, 2000, 3000));
+    USER_CHECK(snd.sack.sacked_bytes == 1000);
+
+    /* a dsack inside the second block */
+    blocks[0].start = 2100;
+    blocks[0].end = 2200;
+    blocks[1].start = 2000;
+    blocks[1].end = 3000;
+    user_tcp_sack_update(&stream, 1000, blocks, 2);
+    USER_CHECK(snd.sack.dsack_cnt == 2 && snd.sack.cnt == 1);
+
+    /* a block starting below the ack is clipped to it */
+    blocks[0].start = 3500;
+    blocks[0].end = 4000;
+    blocks[1].start = 1500;
+    blocks[1].end = 2500;
+    user_tcp_sack_update(&stream, 1800, blocks, 2);
+    USER_CHECK(snd.sack.cnt == 2 && blk_is(&snd.sack, 0, 1800, 3000) && blk_is(&snd.sack, 1, 3500, 4000));
+    USER_CHECK(snd.sack.sacked_bytes == 1700);
+}
+
+int main(void)
+{
+    USER_TEST_RUN(test_sack_insert);
+    USER_TEST_RUN(test_sack_full);
+    USER_TEST_RUN(test_sack_trim);
+    USER_TEST_RUN(test_sack_update);
+
+    return user_test_failed ? 1 : 0;
+}
@@ -0,0 +1,229 @@
+#include "../src/user_tcp_syncookie.c"
+#include "user_test.h"
+
+/* what the syn-ack would have carried */
+static uint32_t synack_seq;
+static uint32_t synack_ack;
+static uint32_t synack_tsval;
+static user_tcp_synopt synack_opt;
+
+int user_tcp_synack_alone(user_tcp_manager *tcp, uint32_t saddr, uint16_t sport,
+                          uint32_t daddr, uint16_t dport, uint32_t seq, uint32_t ack_seq,
+                          uint32_t tsval, const user_tcp_synopt *opt, const uint8_t *tfo_cookie)
+{
+    synack_seq = seq;
+    synack_ack = ack_seq;
+    synack_tsval = tsval;
+    synack_opt = *opt;
+    return 0;
+}
+
+int user_tcp_parse_timestamp(user_tcp_timestamp *ts, uint8_t *tcpopt, int len)
+{
+    int i = 0;
+
+    while (i < len && tcpopt[i] != TCP_OPT_END)
+    {
+        if (tcpopt[i] == TCP_OPT_NOP)
+        {
+            i++;
+            continue;
+        }
+        if (i + 1 >= len || tcpopt[i + 1] < 2)
+            break;
+        if (tcpopt[i] == TCP_OPT_TIMESTAMP && i + USER_TCPOPT_TIMESTAMP_LEN <= len)
+        {
+            ts->ts_val = ntohl(*(uint32_t *) (tcpopt + i + 2));
+            ts->ts_ref = ntohl(*(uint32_t *) (tcpopt + i + 6));
+            return 1;
+        }
+        i += tcpopt[i + 1];
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+static user_tcp_manager tcp;
+static struct iphdr iph;
+static uint8_t syn_pkt[60];
+static uint8_t ack_pkt[60];
+
+#define PERIOD_TS    (MSEC_TO_USEC(USER_SYNCOOKIE_PERIOD_MS) / TIME_TICK)
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    v = htonl(v);
+    memcpy(p, &v, 4);
+}
+
+static struct tcphdr *build_syn(uint16_t mss, int wscale, int sack, int ts)
+{
+    struct tcphdr *tcph = (struct tcphdr *) syn_pkt;
+    uint8_t *opt = syn_pkt + TCP_HEADER_LEN;
+    int len = 0;
+
+    memset(syn_pkt, 0, sizeof(syn_pkt));
+    tcph->source = htons(40000);
+    tcph->dest = htons(80);
+    tcph->seq = htonl(123456789);
+    tcph->syn = 1;
+
+    opt[len++] = TCP_OPT_MSS;
+    opt[len++] = USER_TCPOPT_MSS_LEN;
+    opt[len++] = mss >> 8;
+    opt[len++] = mss & 0xff;
+    if (sack)
+    {
+        opt[len++] = TCP_OPT_SACK_PERMIT;
+        opt[len++] = 2;
+    }
+    if (ts)
+    {
+        opt[len++] = TCP_OPT_TIMESTAMP;
+        opt[len++] = USER_TCPOPT_TIMESTAMP_LEN;
+        put32(opt + len, 1111);
+        put32(opt + len + 4, 0);
+        len += 8;
+    }
+    if (wscale >= 0)
+    {
+        opt[len++] = TCP_OPT_WSCALE;
+        opt[len++] = USER_TCPOPT_WSCALE_LEN;
+        opt[len++] = wscale;
+    }
+    while (len % 4)
+    {
+        opt[len++] = TCP_OPT_NOP;
+    }
+    tcph->doff = (TCP_HEADER_LEN + len) >> 2;
+
+    return tcph;
+}
+
+/* the final ack of the handshake, echoing the syn-ack */
+static struct tcphdr *build_ack(uint32_t ack_seq, int ts)
+{
+    struct tcphdr *tcph = (struct tcphdr *) ack_pkt;
+    uint8_t *opt = ack_pkt + TCP_HEADER_LEN;
+    int len = 0;
+
+    memset(ack_pkt, 0, sizeof(ack_pkt));
+    tcph->source = htons(40000);
+    tcph->dest = htons(80);
+    tcph->seq = htonl(123456789 + 1);
+    tcph->ack_seq = htonl(ack_seq);
+    tcph->ack = 1;
+
+    if (ts)
+    {
+        opt[len++] = TCP_OPT_NOP;
+        opt[len++] = TCP_OPT_NOP;
+        opt[len++] = TCP_OPT_TIMESTAMP;
+        opt[len++] = USER_TCPOPT_TIMESTAMP_LEN;
+        put32(opt + len, 1112);
+        put32(opt + len + 4, synack_tsval);
+        len += 8;
+    }
+    tcph->doff = (TCP_HEADER_LEN + len) >> 2;
+
+    return tcph;
+}
+
+static void setup(void)
+{
+    memset(&tcp, 0, sizeof(tcp));
+    tcp.syncookie_secret[0] = 0x12345678;
+    tcp.syncookie_secret[1] = 0x9abcdef0;
+
+    memset(&iph, 0, sizeof(iph));
+    iph.saddr = htonl(0x0a000001);
+    iph.daddr = htonl(0x0a000002);
+}
+
+/*----------------------------------------------------------------------------*/
+static void test_syncookie_roundtrip(void)
+{
+    uint32_t cur_ts = 10 * PERIOD_TS + 1234;
+    user_tcp_synopt opt;
+
+    setup();
+    USER_CHECK(user_tcp_syncookie_synack(&tcp, cur_ts, &iph, build_syn(1460, 7, 1, 1)) == 0);
+    USER_CHECK(synack_ack == 123456789 + 1);
+    USER_CHECK(synack_opt.ts_ok && synack_opt.sack_ok && synack_opt.wscale_ok);
+    USER_CHECK(synack_opt.ecn_ok == 0);
+    USER_CHECK(TCP_SEQ_LT(synack_tsval, cur_ts));
+
+    USER_CHECK(user_tcp_syncookie_check(&tcp, cur_ts, &iph, build_ack(synack_seq + 1, 1), &opt) == 1);
+    USER_CHECK(opt.mss == 1460);
+    USER_CHECK(opt.wscale_ok && opt.wscale == 7);
+    USER_CHECK(opt.sack_ok == TCP_SACK_ENABLE);
+    USER_CHECK(opt.ts_ok && opt.tsval == 1112);
+}
+
+static void test_syncookie_options(void)
+{
+    uint32_t cur_ts = 3 * PERIOD_TS;
+    user_tcp_synopt opt;
+
+    setup();
+
+    /* the mss rounds down to the table, without wscale nor sack */
+    user_tcp_syncookie_synack(&tcp, cur_ts, &iph, build_syn(1000, -1, 0, 1));
+    USER_CHECK(user_tcp_syncookie_check(&tcp, cur_ts, &iph, build_ack(synack_seq + 1, 1), &opt) == 1);
+    USER_CHECK(opt.mss == 536);
+    USER_CHECK(!opt.wscale_ok && !opt.sack_ok && opt.ts_ok);
+
+    /* above the default it is capped */
+    user_tcp_syncookie_synack(&tcp, cur_ts, &iph, build_syn(9000, 14, 1, 1));
+    USER_CHECK(user_tcp_syncookie_check(&tcp, cur_ts, &iph, build_ack(synack_seq + 1, 1), &opt) == 1);
+    USER_CHECK(opt.mss == TCP_DEFAULT_MSS && opt.wscale == 14);
+
+    /* without timestamps only the mss survives, none of the others was offered */
+    user_tcp_syncookie_synack(&tcp, cur_ts, &iph, build_syn(1460, 7, 1, 0));
+    USER_CHECK(!synack_opt.sack_ok && !synack_opt.wscale_ok);
+    USER_CHECK(user_tcp_syncookie_check(&tcp, cur_ts, &iph, build_ack(synack_seq + 1, 0), &opt) == 1);
+    USER_CHECK(opt.mss == 1460 && !opt.ts_ok && !opt.sack_ok && !opt.wscale_ok);
+}
+
+static void test_syncookie_reject(void)
+{
+    uint32_t cur_ts = 40 * PERIOD_TS + 5;
+    user_tcp_synopt opt;
+    struct tcphdr *ack;
+
+    setup();
+    user_tcp_syncookie_synack(&tcp, cur_ts, &iph, build_syn(1460, 7, 1, 1));
+
+    /* valid for USER_SYNCOOKIE_MAX_AGE periods, the 5 bit counter wraps on the way */
+    USER_CHECK(user_tcp_syncookie_check(&tcp, cur_ts + USER_SYNCOOKIE_MAX_AGE * PERIOD_TS,
+                                        &iph, build_ack(synack_seq + 1, 1), &opt) == 1);
+    USER_CHECK(user_tcp_syncookie_check(&tcp, cur_ts + (USER_SYNCOOKIE_MAX_AGE + 1) * PERIOD_TS,
+                                        &iph, build_ack(synack_seq + 1, 1), &opt) == 0);
+
+    /* any other ack number, tuple, peer isn or secret */
+    USER_CHECK(user_tcp_syncookie_check(&tcp, cur_ts, &iph, build_ack(synack_seq + 2, 1), &opt) == 0);
+
+    ack = build_ack(synack_seq + 1, 1);
+    ack->source = htons(40001);
+    USER_CHECK(user_tcp_syncookie_check(&tcp, cur_ts, &iph, ack, &opt) == 0);
+
+    ack = build_ack(synack_seq + 1, 1);
+    ack->seq = htonl(123456789 + 2);
+    USER_CHECK(user_tcp_syncookie_check(&tcp, cur_ts, &iph, ack, &opt) == 0);
+
+    iph.saddr = htonl(0x0a000003);
+    USER_CHECK(user_tcp_syncookie_check(&tcp, cur_ts, &iph, build_ack(synack_seq + 1, 1), &opt) == 0);
+
+    setup();
+    tcp.syncookie_secret[1]++;
+    USER_CHECK(user_tcp_syncookie_check(&tcp, cur_ts, &iph, build_ack(synack_seq + 1, 1), &opt) == 0);
+}
+
+int main(void)
+{
+    USER_TEST_RUN(test_syncookie_roundtrip);
+    USER_TEST_RUN(test_syncookie_options);
+    USER_TEST_RUN(test_syncookie_reject);
+
+    return user_test_failed ? 1 : 0;
+}
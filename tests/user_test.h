@@ -0,0 +1,30 @@
+#ifndef __USER_TEST_H__
+#define __USER_TEST_H__
+
+#include <stdio.h>
+
+/*
+ * the unit tests build the pure pieces of the stack on their own, without
+ * netmap. a test file includes the .c it tests, for its static functions.
+ */
+static int user_test_failed;
+
+#define USER_CHECK(cond)                                                        \
+    do                                                                          \
+    {                                                                           \
+        if (!(cond))                                                            \
+        {                                                                       \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            user_test_failed++;                                                 \
+        }                                                                       \
+    } while (0)
+
+#define USER_TEST_RUN(fn)                                                       \
+    do                                                                          \
+    {                                                                           \
+        int before = user_test_failed;                                          \
+        fn();                                                                   \
+        printf("%-32s %s\n", #fn, user_test_failed == before ? "ok" : "FAILED"); \
+    } while (0)
+
+#endif